@@ -5,10 +5,10 @@ set -ex
 if hash apt-get 2> /dev/null;
 then
     $SUDO apt-get update
-    $SUDO apt-get install -y git cmake g++ doxygen
+    $SUDO apt-get install -y git cmake g++ doxygen libbenchmark-dev
 else
     $SUDO yum update -y
-    $SUDO yum install -y git cmake gcc-c++ doxygen
+    $SUDO yum install -y git cmake gcc-c++ doxygen google-benchmark-devel
 fi
 git submodule sync
 git submodule update --force --init --recursive
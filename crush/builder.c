@@ -27,42 +27,804 @@ struct crush_map *crush_create()
 	return m;
 }
 
+#define CRUSH_ARENA_ALIGN 16
+/* the size of the first chunk allocated by the arena */
+#define CRUSH_ARENA_CHUNK_SIZE (64 * 1024)
+
+static size_t crush_arena_align(size_t size)
+{
+	return (size + CRUSH_ARENA_ALIGN - 1) & ~(size_t)(CRUSH_ARENA_ALIGN - 1);
+}
+
+static void crush_arena_add_chunk(struct crush_arena *arena,
+				  struct crush_arena_chunk *chunk,
+				  size_t size, int owned)
+{
+	chunk->next = arena->chunks;
+	chunk->end = (char *)chunk + size;
+	chunk->owned = owned;
+	arena->chunks = chunk;
+	arena->point = (char *)chunk + crush_arena_align(sizeof(*chunk));
+}
+
 /*
- * finalize should be called _after_ all buckets are added to the map.
+ * malloc(3) if @arena is NULL. Otherwise the memory is taken from the
+ * first chunk or from a new one, twice as large as the previous, and
+ * is only freed with the arena.
  */
-void crush_finalize(struct crush_map *map)
+static void *crush_arena_alloc(struct crush_arena *arena, size_t size)
+{
+	void *p;
+
+	if (!arena)
+		return malloc(size);
+	size = crush_arena_align(size);
+	if (size > (size_t)(arena->chunks->end - arena->point)) {
+		size_t chunk_size = arena->chunk_size;
+		struct crush_arena_chunk *chunk;
+
+		while (chunk_size < crush_arena_align(sizeof(*chunk)) + size)
+			chunk_size *= 2;
+		chunk = malloc(chunk_size);
+		if (!chunk)
+			return NULL;
+		crush_arena_add_chunk(arena, chunk, chunk_size, 1);
+		arena->chunk_size = chunk_size * 2;
+	}
+	p = arena->point;
+	arena->point += size;
+	arena->size += size;
+	return p;
+}
+
+static void crush_arena_free(struct crush_arena *arena, void *p)
+{
+	if (!arena)
+		free(p);
+}
+
+/*
+ * the elements allocated in an arena for an array of @count, so that
+ * adding items one at a time only copies the array log(count) times
+ */
+static __u32 crush_arena_capacity(__u32 count)
+{
+	__u32 capacity = 4;
+
+	while (capacity < count)
+		capacity *= 2;
+	return capacity;
+}
+
+static void *crush_arena_array(struct crush_arena *arena, size_t elem,
+			       __u32 count)
+{
+	if (!arena)
+		return malloc(elem * count);
+	return crush_arena_alloc(arena, elem * crush_arena_capacity(count));
+}
+
+/*
+ * realloc(3) @p from @count to @new_count elements of @elem bytes, in
+ * place if its capacity in @arena allows it. The elements added are
+ * zeroed: the tree buckets sum weights into the nodes they add.
+ */
+static void *crush_arena_realloc(struct crush_arena *arena, void *p,
+				 size_t elem, __u32 count, __u32 new_count)
+{
+	void *grown;
+
+	if (!arena) {
+		grown = realloc(p, elem * new_count);
+		if (!grown)
+			return NULL;
+		if (!p)
+			count = 0;
+	} else if (p && crush_arena_capacity(new_count) <= crush_arena_capacity(count)) {
+		grown = p;
+	} else {
+		grown = crush_arena_array(arena, elem, new_count);
+		if (!grown)
+			return NULL;
+		if (p)
+			memcpy(grown, p, elem * (count < new_count ? count : new_count));
+		else
+			count = 0;
+	}
+	if (new_count > count)
+		memset((char *)grown + elem * count, 0,
+		       elem * (new_count - count));
+	return grown;
+}
+
+/* the arena of the buckets crush_make_bucket() makes for @map */
+static struct crush_arena *crush_map_arena(const struct crush_map *map)
+{
+	return map ? map->builder_arena : NULL;
+}
+
+/* the arena @bucket and its arrays are in, if any */
+static struct crush_arena *crush_bucket_arena(const struct crush_map *map,
+					      const struct crush_bucket *bucket)
+{
+	struct crush_arena *arena = crush_map_arena(map);
+
+	if (arena && crush_arena_owns(arena, bucket))
+		return arena;
+	return NULL;
+}
+
+struct crush_map *crush_create_arena(void *memory, size_t size)
+{
+	size_t header = crush_arena_align(sizeof(struct crush_arena_chunk)) +
+		crush_arena_align(sizeof(struct crush_arena));
+	struct crush_arena_chunk *chunk;
+	struct crush_arena *arena;
+	struct crush_map *m;
+	int owned = memory == NULL;
+
+	if (owned) {
+		if (size < CRUSH_ARENA_CHUNK_SIZE)
+			size = CRUSH_ARENA_CHUNK_SIZE;
+		memory = malloc(size);
+		if (!memory)
+			return NULL;
+	} else if (size < header + crush_arena_align(sizeof(*m)) ||
+		   (uintptr_t)memory % CRUSH_ARENA_ALIGN) {
+		errno = EINVAL;
+		return NULL;
+	}
+	chunk = memory;
+	arena = (struct crush_arena *)((char *)chunk +
+				       crush_arena_align(sizeof(*chunk)));
+	memset(arena, 0, sizeof(*arena));
+	crush_arena_add_chunk(arena, chunk, size, owned);
+	arena->point = (char *)chunk + header;
+	arena->chunk_size = 2 * (size < CRUSH_ARENA_CHUNK_SIZE ?
+				 CRUSH_ARENA_CHUNK_SIZE : size);
+
+	m = crush_arena_alloc(arena, sizeof(*m));
+	memset(m, 0, sizeof(*m));
+	set_optimal_crush_map(m);
+	m->builder_arena = arena;
+	return m;
+}
+
+size_t crush_arena_size(const struct crush_map *map)
+{
+	return map->builder_arena ? map->builder_arena->size : 0;
+}
+
+/*
+ * the reciprocal of @weight: for all n < 2^CRUSH_STRAW2_RECIP_BITS,
+ * n / weight == (n * magic) >> shift with
+ *
+ *    shift = CRUSH_STRAW2_RECIP_BITS + l, where 2^(l-1) <= weight < 2^l
+ *    magic = ceil(2^shift / weight) < 2^(CRUSH_STRAW2_RECIP_BITS + 1)
+ *
+ * because magic * weight - 2^shift < weight < 2^l.
+ */
+static void crush_straw2_recip_init(struct crush_straw2_recip *recip,
+				    __u32 weight)
+{
+	__u64 t, q, r;
+
+	recip->weight = weight;
+	if (!weight) {
+		recip->magic = 0;
+		recip->shift = 0;
+		return;
+	}
+	recip->shift = CRUSH_STRAW2_RECIP_BITS + 32 - __builtin_clz(weight);
+	/* 2^shift does not fit in 64 bits, divide it in two steps */
+	t = 1ull << (recip->shift - 32);
+	q = (t / weight) << 32;
+	r = (t % weight) << 32;
+	q += r / weight;
+	recip->magic = q + (r % weight != 0);
+}
+
+void crush_update_straw2_recips(struct crush_straw2_recip *recips,
+				const __u32 *weights, __u32 size)
 {
-	int b;
 	__u32 i;
 
-	/* Calculate the needed working space while we do other
-	   finalization tasks. */
+	for (i = 0; i < size; i++)
+		crush_straw2_recip_init(&recips[i], weights[i]);
+}
+
+/*
+ * the reciprocals are an optimization, the bucket is left without
+ * them if they cannot be allocated.
+ */
+static void crush_make_straw2_recips(struct crush_arena *arena,
+				     struct crush_bucket_straw2 *bucket)
+{
+	/* in an arena, they are updated in place until the size of the
+	   bucket changes and resets them */
+	if (!arena || !bucket->item_recips) {
+		crush_arena_free(arena, bucket->item_recips);
+		bucket->item_recips = NULL;
+		if (bucket->h.size == 0)
+			return;
+		bucket->item_recips = crush_arena_array(
+			arena, sizeof(struct crush_straw2_recip),
+			bucket->h.size);
+	}
+	if (bucket->item_recips)
+		crush_update_straw2_recips(bucket->item_recips,
+					   bucket->item_weights,
+					   bucket->h.size);
+}
+
+/*
+ * the part of the working space of a bucket of @alg with @size items,
+ * see crush_init_workspace(): only the uniform buckets, which always
+ * choose from a permutation of their items, have their own.
+ */
+static size_t crush_bucket_working_size(int alg, __u32 size)
+{
+	if (alg != CRUSH_BUCKET_UNIFORM)
+		return 0;
+	return CRUSH_WORK_UNIFORM_SIZE(size);
+}
+
+/*
+ * the size of the largest bucket that is not a uniform bucket, other
+ * than @except, for the permutation they share
+ */
+static __u32 crush_shared_perm_size(const struct crush_map *map,
+				    const struct crush_bucket *except)
+{
+	__u32 size = 0;
+	int b;
+
+	for (b = 0; b < map->max_buckets; b++) {
+		const struct crush_bucket *bucket = map->buckets[b];
+
+		if (bucket == NULL || bucket == except ||
+		    bucket->alg == CRUSH_BUCKET_UNIFORM)
+			continue;
+		if (bucket->size > size)
+			size = bucket->size;
+	}
+	return size;
+}
+
+static void crush_sum_working_size(struct crush_map *map)
+{
 	map->working_size = sizeof(struct crush_work);
 	/* Space for the array of pointers to per-bucket workspace */
 	map->working_size += map->max_buckets *
 		sizeof(struct crush_work_bucket *);
+	map->working_size += CRUSH_WORK_BUCKET_SIZE(map->shared_perm_size);
+	map->working_size += map->buckets_working_size;
+	/* The histogram of the retries, at the end of the working space. */
+	map->working_size += (map->choose_total_tries + 1) * sizeof(__u32);
+}
+
+void crush_calc_working_size(struct crush_map *map)
+{
+	int b;
+
+	map->buckets_working_size = 0;
+	for (b=0; b<map->max_buckets; b++) {
+		if (map->buckets[b] == 0)
+			continue;
+		map->buckets_working_size +=
+			crush_bucket_working_size(map->buckets[b]->alg,
+						  map->buckets[b]->size);
+	}
+	map->shared_perm_size = crush_shared_perm_size(map, NULL);
+	crush_sum_working_size(map);
+}
+
+/*
+ * changes tracking: when one of the tracking functions fails to
+ * allocate memory, it stops tracking and the next crush_finalize()
+ * goes over the whole map.
+ */
+
+static int crush_bucket_is_tracked(const struct crush_map *map,
+				   const struct crush_bucket *b)
+{
+	return map->changes_tracked && b->id < 0 &&
+		-1-b->id < map->max_buckets && map->buckets[-1-b->id] == b;
+}
+
+/* the parent of item or NULL if the item was never in a bucket */
+static struct crush_item_parent *crush_item_parent(const struct crush_map *map,
+						   int item)
+{
+	if (item >= 0)
+		return item < map->device_parents_size ?
+			&map->device_parents[item] : NULL;
+	return -1-item < map->bucket_parents_size ?
+		&map->bucket_parents[-1-item] : NULL;
+}
+
+static struct crush_item_parent *crush_track_parent(struct crush_map *map,
+						    int item)
+{
+	struct crush_item_parent **parents = &map->device_parents;
+	int *parents_size = &map->device_parents_size;
+	int index = item;
+	struct crush_item_parent *grown;
+	int size;
+
+	if (item < 0) {
+		parents = &map->bucket_parents;
+		parents_size = &map->bucket_parents_size;
+		index = -1-item;
+	}
+	if (index < *parents_size)
+		return &(*parents)[index];
+	size = *parents_size ? *parents_size : 64;
+	while (size <= index && size < INT_MAX / 2)
+		size *= 2;
+	if (size <= index)
+		size = INT_MAX;
+	grown = realloc(*parents, size * sizeof(**parents));
+	if (!grown) {
+		map->changes_tracked = 0;
+		return NULL;
+	}
+	memset(grown + *parents_size, 0,
+	       (size - *parents_size) * sizeof(**parents));
+	*parents = grown;
+	*parents_size = size;
+	return &grown[index];
+}
+
+static void crush_track_item_added(struct crush_map *map, int item,
+				   int bucket, __u32 pos)
+{
+	struct crush_item_parent *parent;
+
+	if (!map->changes_tracked)
+		return;
+	parent = crush_track_parent(map, item);
+	if (!parent)
+		return;
+	if (parent->refs++ == 0) {
+		parent->bucket = bucket;
+		parent->pos = pos;
+	} else {
+		parent->bucket = 0;
+	}
+	if (item >= map->max_devices)
+		map->max_devices = item + 1;
+}
+
+static void crush_track_item_removed(struct crush_map *map, int item)
+{
+	struct crush_item_parent *parent;
+
+	if (!map->changes_tracked)
+		return;
+	parent = crush_item_parent(map, item);
+	if (!parent || parent->refs == 0) {
+		/* the map was modified by other means */
+		map->changes_tracked = 0;
+		return;
+	}
+	parent->bucket = 0;
+	if (--parent->refs > 0 || item != map->max_devices - 1)
+		return;
+	while (map->max_devices > 0 &&
+	       map->device_parents[map->max_devices - 1].refs == 0)
+		map->max_devices--;
+}
+
+/* the items of b that moved or that are left in b only */
+static void crush_track_positions(struct crush_map *map,
+				  const struct crush_bucket *b)
+{
+	__u32 i;
+
+	if (!map->changes_tracked)
+		return;
+	for (i = 0; i < b->size; i++) {
+		struct crush_item_parent *parent =
+			crush_item_parent(map, b->items[i]);
+
+		if (parent && parent->refs == 1) {
+			parent->bucket = b->id;
+			parent->pos = i;
+		}
+	}
+}
+
+static void crush_track_dirty_bucket(struct crush_map *map,
+				     const struct crush_bucket *b)
+{
+	if (b->alg != CRUSH_BUCKET_STRAW2 || !map->changes_tracked)
+		return;
+	if (map->dirty_buckets_count == map->dirty_buckets_size) {
+		int size = map->dirty_buckets_size ?
+			map->dirty_buckets_size * 2 : 16;
+		int *dirty = realloc(map->dirty_buckets, size * sizeof(int));
+
+		if (!dirty) {
+			map->changes_tracked = 0;
+			return;
+		}
+		map->dirty_buckets = dirty;
+		map->dirty_buckets_size = size;
+	}
+	map->dirty_buckets[map->dirty_buckets_count++] = b->id;
+}
+
+/*
+ * the items of a bucket before crush_bucket_add_item() or
+ * crush_bucket_remove_item() modify it. A tree bucket replaces the
+ * item it removes with 0 and then drops the trailing items with no
+ * weight: its items are compared one by one. The other buckets only
+ * add or remove the given item.
+ */
+struct crush_track_snapshot {
+	int tracked;
+	__u32 size;
+	int *items;
+};
+
+static void crush_track_begin(struct crush_map *map,
+			      const struct crush_bucket *b,
+			      struct crush_track_snapshot *snapshot)
+{
+	snapshot->tracked = crush_bucket_is_tracked(map, b);
+	snapshot->size = b->size;
+	snapshot->items = NULL;
+	if (!snapshot->tracked || b->alg != CRUSH_BUCKET_TREE || b->size == 0)
+		return;
+	snapshot->items = malloc(sizeof(int) * b->size);
+	if (!snapshot->items) {
+		map->changes_tracked = 0;
+		snapshot->tracked = 0;
+		return;
+	}
+	memcpy(snapshot->items, b->items, sizeof(int) * b->size);
+}
+
+static void crush_track_end(struct crush_map *map,
+			    const struct crush_bucket *b,
+			    struct crush_track_snapshot *snapshot, int item)
+{
+	__u32 i;
+
+	if (!snapshot->tracked)
+		return;
+	if (b->alg == CRUSH_BUCKET_TREE) {
+		/* add before removing so that max_devices only
+		   goes down when it has to */
+		for (i = 0; i < b->size; i++)
+			crush_track_item_added(map, b->items[i], b->id, i);
+		for (i = 0; i < snapshot->size; i++)
+			crush_track_item_removed(map, snapshot->items[i]);
+		free(snapshot->items);
+		crush_track_positions(map, b);
+	} else if (b->size > snapshot->size) {
+		crush_track_item_added(map, item, b->id, b->size - 1);
+	} else if (b->size < snapshot->size) {
+		crush_track_item_removed(map, item);
+		crush_track_positions(map, b);
+	}
+	if (b->size == snapshot->size)
+		return;
+	map->buckets_working_size +=
+		crush_bucket_working_size(b->alg, b->size);
+	map->buckets_working_size -=
+		crush_bucket_working_size(b->alg, snapshot->size);
+	if (b->alg != CRUSH_BUCKET_UNIFORM) {
+		if (b->size > map->shared_perm_size)
+			map->shared_perm_size = b->size;
+		else if (snapshot->size == map->shared_perm_size)
+			map->shared_perm_size = crush_shared_perm_size(map, NULL);
+	}
+	crush_track_dirty_bucket(map, b);
+	crush_sum_working_size(map);
+}
+
+/* go over the whole map and start tracking changes */
+static void crush_finalize_all(struct crush_map *map)
+{
+	int b;
+	__u32 i;
+
+	map->changes_tracked = 1;
+	map->dirty_buckets_count = 0;
+	if (map->device_parents)
+		memset(map->device_parents, 0,
+		       map->device_parents_size * sizeof(struct crush_item_parent));
+	if (map->bucket_parents)
+		memset(map->bucket_parents, 0,
+		       map->bucket_parents_size * sizeof(struct crush_item_parent));
 
 	/* calc max_devices */
 	map->max_devices = 0;
 	for (b=0; b<map->max_buckets; b++) {
 		if (map->buckets[b] == 0)
 			continue;
-		for (i=0; i<map->buckets[b]->size; i++)
+		for (i=0; i<map->buckets[b]->size; i++) {
+			crush_track_item_added(map, map->buckets[b]->items[i],
+					       -1-b, i);
 			if (map->buckets[b]->items[i] >= map->max_devices)
 				map->max_devices = map->buckets[b]->items[i] + 1;
+		}
 
-		switch (map->buckets[b]->alg) {
-		default:
-			/* The base case, permutation variables and
-			   the pointer to the permutation array. */
-			map->working_size += sizeof(struct crush_work_bucket);
-			break;
+		if (map->buckets[b]->alg == CRUSH_BUCKET_STRAW2)
+			crush_make_straw2_recips(
+				crush_bucket_arena(map, map->buckets[b]),
+				(struct crush_bucket_straw2 *)map->buckets[b]);
+	}
+
+	crush_calc_working_size(map);
+}
+
+/*
+ * finalize should be called _after_ all buckets are added to the map.
+ */
+void crush_finalize(struct crush_map *map)
+{
+	int i;
+
+	if (!map->changes_tracked) {
+		crush_finalize_all(map);
+		return;
+	}
+
+	/* max_devices and working_size are up to date, only the
+	   tunables may have changed */
+	for (i = 0; i < map->dirty_buckets_count; i++) {
+		int pos = -1 - map->dirty_buckets[i];
+		struct crush_bucket_straw2 *bucket;
+
+		if (pos >= map->max_buckets || map->buckets[pos] == NULL ||
+		    map->buckets[pos]->alg != CRUSH_BUCKET_STRAW2)
+			continue;
+		bucket = (struct crush_bucket_straw2 *)map->buckets[pos];
+		/* a bucket may be listed more than once */
+		if (bucket->item_recips == NULL)
+			crush_make_straw2_recips(
+				crush_bucket_arena(map, &bucket->h), bucket);
+	}
+	map->dirty_buckets_count = 0;
+	crush_sum_working_size(map);
+}
+
+
+
+/** flattened maps **/
+
+#define CRUSH_FLAT_ALIGN 8
+
+static size_t crush_flat_size(size_t size)
+{
+	return (size + CRUSH_FLAT_ALIGN - 1) & ~(size_t)(CRUSH_FLAT_ALIGN - 1);
+}
+
+/* reserve @size bytes at @point and copy @src in them, if not NULL */
+static void *crush_flat_allot(char **point, const void *src, size_t size)
+{
+	void *dst = *point;
+
+	if (src && size)
+		memcpy(dst, src, size);
+	*point += crush_flat_size(size);
+	return dst;
+}
+
+static size_t crush_flat_bucket_size(const struct crush_bucket *b)
+{
+	size_t size = crush_flat_size(sizeof(__s32) * b->size);
+
+	switch (b->alg) {
+	case CRUSH_BUCKET_UNIFORM:
+		return size + crush_flat_size(sizeof(struct crush_bucket_uniform));
+	case CRUSH_BUCKET_LIST:
+		return size + crush_flat_size(sizeof(struct crush_bucket_list)) +
+			2 * crush_flat_size(sizeof(__u32) * b->size);
+	case CRUSH_BUCKET_TREE:
+		return size + crush_flat_size(sizeof(struct crush_bucket_tree)) +
+			crush_flat_size(sizeof(__u32) *
+					((struct crush_bucket_tree *)b)->num_nodes);
+	case CRUSH_BUCKET_STRAW:
+		return size + crush_flat_size(sizeof(struct crush_bucket_straw)) +
+			2 * crush_flat_size(sizeof(__u32) * b->size);
+	case CRUSH_BUCKET_STRAW2:
+		size += crush_flat_size(sizeof(struct crush_bucket_straw2)) +
+			crush_flat_size(sizeof(__u32) * b->size);
+		if (((struct crush_bucket_straw2 *)b)->item_recips)
+			size += crush_flat_size(sizeof(struct crush_straw2_recip) *
+						b->size);
+		return size;
+	default:
+		return 0;
+	}
+}
+
+/* copy @b at @point, its header followed by its arrays */
+static struct crush_bucket *crush_flat_bucket(const struct crush_bucket *b,
+					      char **point)
+{
+	struct crush_bucket *flat;
+
+	switch (b->alg) {
+	case CRUSH_BUCKET_UNIFORM:
+		flat = crush_flat_allot(point, b, sizeof(struct crush_bucket_uniform));
+		break;
+	case CRUSH_BUCKET_LIST: {
+		const struct crush_bucket_list *from = (const struct crush_bucket_list *)b;
+		struct crush_bucket_list *to = crush_flat_allot(point, b, sizeof(*to));
+		to->item_weights = crush_flat_allot(point, from->item_weights,
+						    sizeof(__u32) * b->size);
+		to->sum_weights = crush_flat_allot(point, from->sum_weights,
+						   sizeof(__u32) * b->size);
+		flat = &to->h;
+		break;
+	}
+	case CRUSH_BUCKET_TREE: {
+		const struct crush_bucket_tree *from = (const struct crush_bucket_tree *)b;
+		struct crush_bucket_tree *to = crush_flat_allot(point, b, sizeof(*to));
+		to->node_weights = crush_flat_allot(point, from->node_weights,
+						    sizeof(__u32) * from->num_nodes);
+		flat = &to->h;
+		break;
+	}
+	case CRUSH_BUCKET_STRAW: {
+		const struct crush_bucket_straw *from = (const struct crush_bucket_straw *)b;
+		struct crush_bucket_straw *to = crush_flat_allot(point, b, sizeof(*to));
+		to->item_weights = crush_flat_allot(point, from->item_weights,
+						    sizeof(__u32) * b->size);
+		to->straws = crush_flat_allot(point, from->straws,
+					      sizeof(__u32) * b->size);
+		flat = &to->h;
+		break;
+	}
+	case CRUSH_BUCKET_STRAW2: {
+		const struct crush_bucket_straw2 *from = (const struct crush_bucket_straw2 *)b;
+		struct crush_bucket_straw2 *to = crush_flat_allot(point, b, sizeof(*to));
+		to->item_weights = crush_flat_allot(point, from->item_weights,
+						    sizeof(__u32) * b->size);
+		if (from->item_recips)
+			to->item_recips = crush_flat_allot(
+				point, from->item_recips,
+				sizeof(struct crush_straw2_recip) * b->size);
+		flat = &to->h;
+		break;
+	}
+	default:
+		return NULL;
+	}
+	flat->items = crush_flat_allot(point, b->items, sizeof(__s32) * b->size);
+	return flat;
+}
+
+/*
+ * the order in which crush_flatten() lays out the buckets: breadth
+ * first from the roots, then the buckets that are not reachable from
+ * a root, if any.
+ */
+static int crush_flat_order(const struct crush_map *map, int *order)
+{
+	char *seen = calloc(map->max_buckets, 1);
+	int b, i, head, count = 0;
+
+	if (!seen)
+		return -ENOMEM;
+	for (b = 0; b < map->max_buckets; b++) {
+		if (map->buckets[b] == NULL)
+			continue;
+		for (i = 0; i < map->buckets[b]->size; i++) {
+			int item = map->buckets[b]->items[i];
+			if (item < 0 && -1-item < map->max_buckets)
+				seen[-1-item] = 1;
+		}
+	}
+	for (b = 0; b < map->max_buckets; b++) {
+		if (map->buckets[b] != NULL && !seen[b])
+			order[count++] = b;
+		seen[b] = 0;
+	}
+	for (head = 0; ; head++) {
+		if (head == count) {
+			/* cycles have no root */
+			for (b = 0; b < map->max_buckets; b++)
+				if (map->buckets[b] != NULL && !seen[b])
+					break;
+			if (b == map->max_buckets)
+				break;
+			order[count++] = b;
+		}
+		seen[order[head]] = 1;
+		for (i = 0; i < map->buckets[order[head]]->size; i++) {
+			int item = map->buckets[order[head]]->items[i];
+			if (item >= 0 || -1-item >= map->max_buckets ||
+			    map->buckets[-1-item] == NULL || seen[-1-item])
+				continue;
+			seen[-1-item] = 1;
+			order[count++] = -1-item;
 		}
-		/* Every bucket has a permutation array. */
-		map->working_size += map->buckets[b]->size * sizeof(__u32);
 	}
+	free(seen);
+	return count;
 }
 
+struct crush_map *crush_flatten(const struct crush_map *map)
+{
+	struct crush_map *flat;
+	size_t size;
+	char *point;
+	int *order;
+	int b, count;
+	__u32 r;
+
+	order = malloc(sizeof(int) * (map->max_buckets + 1));
+	if (!order)
+		return NULL;
+	count = crush_flat_order(map, order);
+	if (count < 0) {
+		free(order);
+		return NULL;
+	}
+
+	size = crush_flat_size(sizeof(*map)) +
+		crush_flat_size(sizeof(struct crush_bucket *) * map->max_buckets) +
+		crush_flat_size(sizeof(struct crush_rule *) * map->max_rules);
+	for (b = 0; b < count; b++) {
+		size_t bucket_size = crush_flat_bucket_size(map->buckets[order[b]]);
+		if (bucket_size == 0) {
+			free(order);
+			return NULL;
+		}
+		size += bucket_size;
+	}
+	for (r = 0; r < map->max_rules; r++)
+		if (map->rules[r])
+			size += crush_flat_size(crush_rule_size(map->rules[r]->len));
+
+	point = malloc(size);
+	if (!point) {
+		free(order);
+		return NULL;
+	}
+	memset(point, 0, size);
+	flat = crush_flat_allot(&point, map, sizeof(*map));
+	flat->arena = flat;
+	flat->choose_tries = NULL;
+	flat->mapping = NULL;
+	flat->mapping_size = 0;
+	flat->builder_arena = NULL;
+	flat->changes_tracked = 0;
+	flat->device_parents = NULL;
+	flat->device_parents_size = 0;
+	flat->bucket_parents = NULL;
+	flat->bucket_parents_size = 0;
+	flat->dirty_buckets = NULL;
+	flat->dirty_buckets_count = 0;
+	flat->dirty_buckets_size = 0;
+	flat->straw_order_bucket = NULL;
+	flat->straw_order = NULL;
+	flat->straw_reverse = NULL;
+	flat->straw_order_count = 0;
+	flat->straw_order_size = 0;
+	flat->buckets = crush_flat_allot(&point, NULL,
+					 sizeof(struct crush_bucket *) * map->max_buckets);
+	flat->rules = crush_flat_allot(&point, NULL,
+				       sizeof(struct crush_rule *) * map->max_rules);
+	for (b = 0; b < count; b++)
+		flat->buckets[order[b]] = crush_flat_bucket(map->buckets[order[b]],
+							    &point);
+	for (r = 0; r < map->max_rules; r++)
+		if (map->rules[r])
+			flat->rules[r] = crush_flat_allot(
+				&point, map->rules[r],
+				crush_rule_size(map->rules[r]->len));
+	BUG_ON(point != (char *)flat + size);
+
+	free(order);
+	return flat;
+}
 
 
 /** rules **/
@@ -174,6 +936,20 @@ int crush_add_bucket(struct crush_map *map,
 	bucket->id = id;
 	map->buckets[pos] = bucket;
 
+	if (map->changes_tracked) {
+		__u32 i;
+
+		for (i = 0; i < bucket->size; i++)
+			crush_track_item_added(map, bucket->items[i], id, i);
+		map->buckets_working_size +=
+			crush_bucket_working_size(bucket->alg, bucket->size);
+		if (bucket->alg != CRUSH_BUCKET_UNIFORM &&
+		    bucket->size > map->shared_perm_size)
+			map->shared_perm_size = bucket->size;
+		crush_track_dirty_bucket(map, bucket);
+		crush_sum_working_size(map);
+	}
+
 	if (idout) *idout = id;
 	return 0;
 }
@@ -182,23 +958,38 @@ int crush_remove_bucket(struct crush_map *map, struct crush_bucket *bucket)
 {
 	int pos = -1 - bucket->id;
        assert(pos < map->max_buckets);
+	if (crush_bucket_is_tracked(map, bucket)) {
+		__u32 i;
+
+		for (i = 0; i < bucket->size; i++)
+			crush_track_item_removed(map, bucket->items[i]);
+		map->buckets_working_size -=
+			crush_bucket_working_size(bucket->alg, bucket->size);
+		if (bucket->alg != CRUSH_BUCKET_UNIFORM &&
+		    bucket->size == map->shared_perm_size)
+			map->shared_perm_size =
+				crush_shared_perm_size(map, bucket);
+		crush_sum_working_size(map);
+	}
 	map->buckets[pos] = NULL;
-	crush_destroy_bucket(bucket);
+	/* the memory of a bucket in an arena is freed with it */
+	if (!crush_bucket_arena(map, bucket))
+		crush_destroy_bucket(bucket);
 	return 0;
 }
 
 
 /* uniform bucket */
 
-struct crush_bucket_uniform *
-crush_make_uniform_bucket(int hash, int type, int size,
-			  int *items,
-			  int item_weight)
+static struct crush_bucket_uniform *
+crush_arena_make_uniform_bucket(struct crush_arena *arena,
+				int hash, int type, int size,
+				int *items, int item_weight)
 {
 	int i;
 	struct crush_bucket_uniform *bucket;
 
-	bucket = malloc(sizeof(*bucket));
+	bucket = crush_arena_alloc(arena, sizeof(*bucket));
         if (!bucket)
                 return NULL;
 	memset(bucket, 0, sizeof(*bucket));
@@ -212,7 +1003,7 @@ crush_make_uniform_bucket(int hash, int type, int size,
 
 	bucket->h.weight = size * item_weight;
 	bucket->item_weight = item_weight;
-	bucket->h.items = malloc(sizeof(__s32)*size);
+	bucket->h.items = crush_arena_array(arena, sizeof(__s32), size);
 
         if (!bucket->h.items)
                 goto err;
@@ -222,24 +1013,32 @@ crush_make_uniform_bucket(int hash, int type, int size,
 
 	return bucket;
 err:
-        free(bucket->h.items);
-        free(bucket);
+        crush_arena_free(arena, bucket->h.items);
+        crush_arena_free(arena, bucket);
         return NULL;
 }
 
+struct crush_bucket_uniform *
+crush_make_uniform_bucket(int hash, int type, int size,
+			  int *items,
+			  int item_weight)
+{
+	return crush_arena_make_uniform_bucket(NULL, hash, type, size, items, item_weight);
+}
+
 
 /* list bucket */
 
-struct crush_bucket_list*
-crush_make_list_bucket(int hash, int type, int size,
-		       int *items,
-		       int *weights)
+static struct crush_bucket_list *
+crush_arena_make_list_bucket(struct crush_arena *arena,
+			     int hash, int type, int size,
+			     int *items, int *weights)
 {
 	int i;
 	int w;
 	struct crush_bucket_list *bucket;
 
-	bucket = malloc(sizeof(*bucket));
+	bucket = crush_arena_alloc(arena, sizeof(*bucket));
         if (!bucket)
                 return NULL;
 	memset(bucket, 0, sizeof(*bucket));
@@ -248,15 +1047,15 @@ crush_make_list_bucket(int hash, int type, int size,
 	bucket->h.type = type;
 	bucket->h.size = size;
 
-	bucket->h.items = malloc(sizeof(__s32)*size);
+	bucket->h.items = crush_arena_array(arena, sizeof(__s32), size);
         if (!bucket->h.items)
                 goto err;
 
 
-        bucket->item_weights = malloc(sizeof(__u32)*size);
+        bucket->item_weights = crush_arena_array(arena, sizeof(__u32), size);
         if (!bucket->item_weights)
                 goto err;
-	bucket->sum_weights = malloc(sizeof(__u32)*size);
+	bucket->sum_weights = crush_arena_array(arena, sizeof(__u32), size);
         if (!bucket->sum_weights)
                 goto err;
 	w = 0;
@@ -277,13 +1076,21 @@ crush_make_list_bucket(int hash, int type, int size,
 
 	return bucket;
 err:
-        free(bucket->sum_weights);
-        free(bucket->item_weights);
-        free(bucket->h.items);
-        free(bucket);
+        crush_arena_free(arena, bucket->sum_weights);
+        crush_arena_free(arena, bucket->item_weights);
+        crush_arena_free(arena, bucket->h.items);
+        crush_arena_free(arena, bucket);
         return NULL;
 }
 
+struct crush_bucket_list*
+crush_make_list_bucket(int hash, int type, int size,
+		       int *items,
+		       int *weights)
+{
+	return crush_arena_make_list_bucket(NULL, hash, type, size, items, weights);
+}
+
 
 /* tree bucket */
 
@@ -322,17 +1129,18 @@ static int calc_depth(int size)
 	return depth;
 }
 
-struct crush_bucket_tree*
-crush_make_tree_bucket(int hash, int type, int size,
-		       int *items,    /* in leaf order */
-		       int *weights)
+static struct crush_bucket_tree *
+crush_arena_make_tree_bucket(struct crush_arena *arena,
+			     int hash, int type, int size,
+			     int *items,    /* in leaf order */
+			     int *weights)
 {
 	struct crush_bucket_tree *bucket;
 	int depth;
 	int node;
 	int i, j;
 
-	bucket = malloc(sizeof(*bucket));
+	bucket = crush_arena_alloc(arena, sizeof(*bucket));
         if (!bucket)
                 return NULL;
 	memset(bucket, 0, sizeof(*bucket));
@@ -350,7 +1158,7 @@ crush_make_tree_bucket(int hash, int type, int size,
 		return bucket;
 	}
 
-	bucket->h.items = malloc(sizeof(__s32)*size);
+	bucket->h.items = crush_arena_array(arena, sizeof(__s32), size);
         if (!bucket->h.items)
                 goto err;
 
@@ -359,47 +1167,169 @@ crush_make_tree_bucket(int hash, int type, int size,
 	bucket->num_nodes = 1 << depth;
 	dprintk("size %d depth %d nodes %d\n", size, depth, bucket->num_nodes);
 
-        bucket->node_weights = malloc(sizeof(__u32)*bucket->num_nodes);
+        bucket->node_weights = crush_arena_array(arena, sizeof(__u32), bucket->num_nodes);
         if (!bucket->node_weights)
                 goto err;
 
-	memset(bucket->h.items, 0, sizeof(__s32)*bucket->h.size);
-	memset(bucket->node_weights, 0, sizeof(__u32)*bucket->num_nodes);
+	memset(bucket->h.items, 0, sizeof(__s32)*bucket->h.size);
+	memset(bucket->node_weights, 0, sizeof(__u32)*bucket->num_nodes);
+
+	for (i=0; i<size; i++) {
+		bucket->h.items[i] = items[i];
+		node = crush_calc_tree_node(i);
+		dprintk("item %d node %d weight %d\n", i, node, weights[i]);
+		bucket->node_weights[node] = weights[i];
+
+		if (crush_addition_is_unsafe(bucket->h.weight, weights[i]))
+                        goto err;
+
+		bucket->h.weight += weights[i];
+		for (j=1; j<depth; j++) {
+			node = parent(node);
+
+                        if (crush_addition_is_unsafe(bucket->node_weights[node], weights[i]))
+                                goto err;
+
+			bucket->node_weights[node] += weights[i];
+			dprintk(" node %d weight %d\n", node, bucket->node_weights[node]);
+		}
+	}
+	BUG_ON(bucket->node_weights[bucket->num_nodes/2] != bucket->h.weight);
+
+	return bucket;
+err:
+        crush_arena_free(arena, bucket->node_weights);
+        crush_arena_free(arena, bucket->h.items);
+        crush_arena_free(arena, bucket);
+        return NULL;
+}
+
+struct crush_bucket_tree*
+crush_make_tree_bucket(int hash, int type, int size,
+		       int *items,    /* in leaf order */
+		       int *weights)
+{
+	return crush_arena_make_tree_bucket(NULL, hash, type, size, items, weights);
+}
+
+
+
+/* straw bucket */
+
+#define CRUSH_STRAW_INSERTION_SORT_MAX 64
+
+static int crush_straw_key_cmp(const void *a, const void *b)
+{
+	__u64 ka = *(const __u64 *)a;
+	__u64 kb = *(const __u64 *)b;
+
+	return ka < kb ? -1 : ka > kb;
+}
+
+static inline __u64 crush_straw_key(const struct crush_bucket_straw *bucket,
+				    int i)
+{
+	return (__u64)bucket->item_weights[i] << 32 | (__u32)i;
+}
+
+/*
+ * check that map->straw_order holds the order of @bucket before the
+ * item at @changed was reweighted or appended, and remove @changed
+ * from it
+ */
+static int crush_straw_order_is_valid(struct crush_map *map,
+				      const struct crush_bucket_straw *bucket,
+				      int changed)
+{
+	int size = bucket->h.size;
+	int count = map->straw_order_count;
+	__u64 *order = map->straw_order;
+	int i, j;
+
+	if (map->straw_order_bucket != bucket ||
+	    !(count == size || (count == size - 1 && changed == size - 1)))
+		return 0;
+	for (i = 0, j = 0; i < count; i++) {
+		int index = (__u32)order[i];
+
+		if (index == changed)
+			continue;
+		if (index >= size || order[i] != crush_straw_key(bucket, index) ||
+		    (j > 0 && order[j - 1] >= order[i]))
+			return 0;
+		order[j++] = order[i];
+	}
+	map->straw_order_count = j;
+	return j == size - 1;
+}
 
-	for (i=0; i<size; i++) {
-		bucket->h.items[i] = items[i];
-		node = crush_calc_tree_node(i);
-		dprintk("item %d node %d weight %d\n", i, node, weights[i]);
-		bucket->node_weights[node] = weights[i];
+/*
+ * sort in map->straw_order the items of @bucket by increasing weight
+ * and, for equal weights, by increasing index, as the insertion sort
+ * of the original implementation did. If @changed >= 0, only the
+ * weight of the item at @changed differs since the order was last
+ * sorted for @bucket, or it was appended, and it is moved to its
+ * place in linear time.
+ */
+static int crush_straw_order(struct crush_map *map,
+			     const struct crush_bucket_straw *bucket,
+			     int changed)
+{
+	int size = bucket->h.size;
+	int i;
 
-		if (crush_addition_is_unsafe(bucket->h.weight, weights[i]))
-                        goto err;
+	if (size > map->straw_order_size) {
+		__u64 *order = realloc(map->straw_order, sizeof(__u64) * size);
+		int *reverse;
 
-		bucket->h.weight += weights[i];
-		for (j=1; j<depth; j++) {
-			node = parent(node);
+		map->straw_order_bucket = NULL;
+		if (!order)
+			return -ENOMEM;
+		map->straw_order = order;
+		reverse = realloc(map->straw_reverse, sizeof(int) * size);
+		if (!reverse)
+			return -ENOMEM;
+		map->straw_reverse = reverse;
+		map->straw_order_size = size;
+	}
+	if (changed >= 0 && crush_straw_order_is_valid(map, bucket, changed)) {
+		__u64 key = crush_straw_key(bucket, changed);
+		int low = 0, high = size - 1;
 
-                        if (crush_addition_is_unsafe(bucket->node_weights[node], weights[i]))
-                                goto err;
+		while (low < high) {
+			int middle = low + (high - low) / 2;
 
-			bucket->node_weights[node] += weights[i];
-			dprintk(" node %d weight %d\n", node, bucket->node_weights[node]);
+			if (map->straw_order[middle] < key)
+				low = middle + 1;
+			else
+				high = middle;
+		}
+		memmove(map->straw_order + low + 1, map->straw_order + low,
+			sizeof(__u64) * (size - 1 - low));
+		map->straw_order[low] = key;
+	} else {
+		for (i = 0; i < size; i++)
+			map->straw_order[i] = crush_straw_key(bucket, i);
+		if (size > CRUSH_STRAW_INSERTION_SORT_MAX) {
+			qsort(map->straw_order, size, sizeof(__u64),
+			      crush_straw_key_cmp);
+		} else {
+			/* cheaper than qsort() for small buckets */
+			for (i = 1; i < size; i++) {
+				__u64 key = map->straw_order[i];
+				int j = i;
+
+				for (; j > 0 && map->straw_order[j - 1] > key; j--)
+					map->straw_order[j] = map->straw_order[j - 1];
+				map->straw_order[j] = key;
+			}
 		}
 	}
-	BUG_ON(bucket->node_weights[bucket->num_nodes/2] != bucket->h.weight);
-
-	return bucket;
-err:
-        free(bucket->node_weights);
-        free(bucket->h.items);
-        free(bucket);
-        return NULL;
+	map->straw_order_count = size;
+	map->straw_order_bucket = bucket;
+	return 0;
 }
 
-
-
-/* straw bucket */
-
 /*
  * this code was written 8 years ago.  i have a vague recollection of
  * drawing boxes underneath bars of different lengths, where the bar
@@ -427,34 +1357,25 @@ err:
  * moral of the story: if you do something clever, write down why it
  * works.
  */
-int crush_calc_straw(struct crush_map *map, struct crush_bucket_straw *bucket)
+static int crush_calc_straw_changed(struct crush_map *map,
+				    struct crush_bucket_straw *bucket,
+				    int changed)
 {
-	int *reverse;
-	int i, j, k;
+	int i, j;
 	double straw, wbelow, lastw, wnext, pbelow;
 	int numleft;
 	int size = bucket->h.size;
 	__u32 *weights = bucket->item_weights;
+	int *reverse;
+	int r;
 
-	/* reverse sort by weight (simple insertion sort) */
-	reverse = malloc(sizeof(int) * size);
-        if (!reverse)
-                return -ENOMEM;
-	if (size)
-		reverse[0] = 0;
-	for (i=1; i<size; i++) {
-		for (j=0; j<i; j++) {
-			if (weights[i] < weights[reverse[j]]) {
-				/* insert here */
-				for (k=i; k>j; k--)
-					reverse[k] = reverse[k-1];
-				reverse[j] = i;
-				break;
-			}
-		}
-		if (j == i)
-			reverse[i] = i;
-	}
+	r = crush_straw_order(map, bucket, changed);
+	if (r < 0)
+		return r;
+	/* the indexes are in the low bits of the keys */
+	reverse = map->straw_reverse;
+	for (i = 0; i < size; i++)
+		reverse[i] = (__u32)map->straw_order[i];
 
 	numleft = size;
 	straw = 1.0;
@@ -540,11 +1461,22 @@ int crush_calc_straw(struct crush_map *map, struct crush_bucket_straw *bucket)
 			lastw = weights[reverse[i-1]];
 		}
 	}
-
-	free(reverse);
 	return 0;
 }
 
+int crush_calc_straw(struct crush_map *map, struct crush_bucket_straw *bucket)
+{
+	return crush_calc_straw_changed(map, bucket, -1);
+}
+
+int crush_calc_straw_item(struct crush_map *map,
+			  struct crush_bucket_straw *bucket, int idx)
+{
+	if (idx < 0 || idx >= (int)bucket->h.size)
+		return -EINVAL;
+	return crush_calc_straw_changed(map, bucket, idx);
+}
+
 struct crush_bucket_straw *
 crush_make_straw_bucket(struct crush_map *map,
 			int hash,
@@ -553,10 +1485,11 @@ crush_make_straw_bucket(struct crush_map *map,
 			int *items,
 			int *weights)
 {
+	struct crush_arena *arena = crush_map_arena(map);
 	struct crush_bucket_straw *bucket;
 	int i;
 
-	bucket = malloc(sizeof(*bucket));
+	bucket = crush_arena_alloc(arena, sizeof(*bucket));
         if (!bucket)
                 return NULL;
 	memset(bucket, 0, sizeof(*bucket));
@@ -565,13 +1498,13 @@ crush_make_straw_bucket(struct crush_map *map,
 	bucket->h.type = type;
 	bucket->h.size = size;
 
-        bucket->h.items = malloc(sizeof(__s32)*size);
+        bucket->h.items = crush_arena_array(arena, sizeof(__s32), size);
         if (!bucket->h.items)
                 goto err;
-	bucket->item_weights = malloc(sizeof(__u32)*size);
+	bucket->item_weights = crush_arena_array(arena, sizeof(__u32), size);
         if (!bucket->item_weights)
                 goto err;
-        bucket->straws = malloc(sizeof(__u32)*size);
+        bucket->straws = crush_arena_array(arena, sizeof(__u32), size);
         if (!bucket->straws)
                 goto err;
 
@@ -587,10 +1520,10 @@ crush_make_straw_bucket(struct crush_map *map,
 
 	return bucket;
 err:
-        free(bucket->straws);
-        free(bucket->item_weights);
-        free(bucket->h.items);
-        free(bucket);
+        crush_arena_free(arena, bucket->straws);
+        crush_arena_free(arena, bucket->item_weights);
+        crush_arena_free(arena, bucket->h.items);
+        crush_arena_free(arena, bucket);
         return NULL;
 }
 
@@ -602,10 +1535,11 @@ crush_make_straw2_bucket(struct crush_map *map,
 			 int *items,
 			 int *weights)
 {
+	struct crush_arena *arena = crush_map_arena(map);
 	struct crush_bucket_straw2 *bucket;
 	int i;
 
-	bucket = malloc(sizeof(*bucket));
+	bucket = crush_arena_alloc(arena, sizeof(*bucket));
         if (!bucket)
                 return NULL;
 	memset(bucket, 0, sizeof(*bucket));
@@ -614,10 +1548,10 @@ crush_make_straw2_bucket(struct crush_map *map,
 	bucket->h.type = type;
 	bucket->h.size = size;
 
-        bucket->h.items = malloc(sizeof(__s32)*size);
+        bucket->h.items = crush_arena_array(arena, sizeof(__s32), size);
         if (!bucket->h.items)
                 goto err;
-	bucket->item_weights = malloc(sizeof(__u32)*size);
+	bucket->item_weights = crush_arena_array(arena, sizeof(__u32), size);
         if (!bucket->item_weights)
                 goto err;
 
@@ -630,9 +1564,9 @@ crush_make_straw2_bucket(struct crush_map *map,
 
 	return bucket;
 err:
-        free(bucket->item_weights);
-        free(bucket->h.items);
-        free(bucket);
+        crush_arena_free(arena, bucket->item_weights);
+        crush_arena_free(arena, bucket->h.items);
+        crush_arena_free(arena, bucket);
         return NULL;
 }
 
@@ -652,13 +1586,13 @@ crush_make_bucket(struct crush_map *map,
 			item_weight = weights[0];
 		else
 			item_weight = 0;
-		return (struct crush_bucket *)crush_make_uniform_bucket(hash, type, size, items, item_weight);
+		return (struct crush_bucket *)crush_arena_make_uniform_bucket(crush_map_arena(map), hash, type, size, items, item_weight);
 
 	case CRUSH_BUCKET_LIST:
-		return (struct crush_bucket *)crush_make_list_bucket(hash, type, size, items, weights);
+		return (struct crush_bucket *)crush_arena_make_list_bucket(crush_map_arena(map), hash, type, size, items, weights);
 
 	case CRUSH_BUCKET_TREE:
-		return (struct crush_bucket *)crush_make_tree_bucket(hash, type, size, items, weights);
+		return (struct crush_bucket *)crush_arena_make_tree_bucket(crush_map_arena(map), hash, type, size, items, weights);
 
 	case CRUSH_BUCKET_STRAW:
 		return (struct crush_bucket *)crush_make_straw_bucket(map, hash, type, size, items, weights);
@@ -671,7 +1605,9 @@ crush_make_bucket(struct crush_map *map,
 
 /************************************************/
 
-int crush_add_uniform_bucket_item(struct crush_bucket_uniform *bucket, int item, int weight)
+int crush_add_uniform_bucket_item(struct crush_arena *arena,
+				  struct crush_bucket_uniform *bucket, int item,
+				  int weight)
 {
         int newsize = bucket->h.size + 1;
 	void *_realloc = NULL;
@@ -685,7 +1621,8 @@ int crush_add_uniform_bucket_item(struct crush_bucket_uniform *bucket, int item,
 	  return -EINVAL;
 	}
 
-	if ((_realloc = realloc(bucket->h.items, sizeof(__s32)*newsize)) == NULL) {
+	if ((_realloc = crush_arena_realloc(arena, bucket->h.items, sizeof(__s32),
+					     newsize - 1, newsize)) == NULL) {
 		return -ENOMEM;
 	} else {
 		bucket->h.items = _realloc;
@@ -702,22 +1639,27 @@ int crush_add_uniform_bucket_item(struct crush_bucket_uniform *bucket, int item,
         return 0;
 }
 
-int crush_add_list_bucket_item(struct crush_bucket_list *bucket, int item, int weight)
+int crush_add_list_bucket_item(struct crush_arena *arena,
+			       struct crush_bucket_list *bucket, int item,
+			       int weight)
 {
         int newsize = bucket->h.size + 1;
 	void *_realloc = NULL;
 
-	if ((_realloc = realloc(bucket->h.items, sizeof(__s32)*newsize)) == NULL) {
+	if ((_realloc = crush_arena_realloc(arena, bucket->h.items, sizeof(__s32),
+					     newsize - 1, newsize)) == NULL) {
 		return -ENOMEM;
 	} else {
 		bucket->h.items = _realloc;
 	}
-	if ((_realloc = realloc(bucket->item_weights, sizeof(__u32)*newsize)) == NULL) {
+	if ((_realloc = crush_arena_realloc(arena, bucket->item_weights, sizeof(__u32),
+					     newsize - 1, newsize)) == NULL) {
 		return -ENOMEM;
 	} else {
 		bucket->item_weights = _realloc;
 	}
-	if ((_realloc = realloc(bucket->sum_weights, sizeof(__u32)*newsize)) == NULL) {
+	if ((_realloc = crush_arena_realloc(arena, bucket->sum_weights, sizeof(__u32),
+					     newsize - 1, newsize)) == NULL) {
 		return -ENOMEM;
 	} else {
 		bucket->sum_weights = _realloc;
@@ -742,22 +1684,27 @@ int crush_add_list_bucket_item(struct crush_bucket_list *bucket, int item, int w
 	return 0;
 }
 
-int crush_add_tree_bucket_item(struct crush_bucket_tree *bucket, int item, int weight)
+int crush_add_tree_bucket_item(struct crush_arena *arena,
+			       struct crush_bucket_tree *bucket, int item,
+			       int weight)
 {
 	int newsize = bucket->h.size + 1;
 	int depth = calc_depth(newsize);;
 	int node;
 	int j;
+	int old_nodes = bucket->num_nodes;
 	void *_realloc = NULL;
 
 	bucket->num_nodes = 1 << depth;
 
-	if ((_realloc = realloc(bucket->h.items, sizeof(__s32)*newsize)) == NULL) {
+	if ((_realloc = crush_arena_realloc(arena, bucket->h.items, sizeof(__s32),
+					     newsize - 1, newsize)) == NULL) {
 		return -ENOMEM;
 	} else {
 		bucket->h.items = _realloc;
 	}
-	if ((_realloc = realloc(bucket->node_weights, sizeof(__u32)*bucket->num_nodes)) == NULL) {
+	if ((_realloc = crush_arena_realloc(arena, bucket->node_weights, sizeof(__u32),
+					     old_nodes, bucket->num_nodes)) == NULL) {
 		return -ENOMEM;
 	} else {
 		bucket->node_weights = _realloc;
@@ -796,25 +1743,29 @@ int crush_add_tree_bucket_item(struct crush_bucket_tree *bucket, int item, int w
 	return 0;
 }
 
-int crush_add_straw_bucket_item(struct crush_map *map,
-				struct crush_bucket_straw *bucket,
-				int item, int weight)
+int crush_add_straw_bucket_item(struct crush_arena *arena,
+				struct crush_map *map,
+				struct crush_bucket_straw *bucket, int item,
+				int weight)
 {
 	int newsize = bucket->h.size + 1;
 
 	void *_realloc = NULL;
 
-	if ((_realloc = realloc(bucket->h.items, sizeof(__s32)*newsize)) == NULL) {
+	if ((_realloc = crush_arena_realloc(arena, bucket->h.items, sizeof(__s32),
+					     newsize - 1, newsize)) == NULL) {
 		return -ENOMEM;
 	} else {
 		bucket->h.items = _realloc;
 	}
-	if ((_realloc = realloc(bucket->item_weights, sizeof(__u32)*newsize)) == NULL) {
+	if ((_realloc = crush_arena_realloc(arena, bucket->item_weights, sizeof(__u32),
+					     newsize - 1, newsize)) == NULL) {
 		return -ENOMEM;
 	} else {
 		bucket->item_weights = _realloc;
 	}
-	if ((_realloc = realloc(bucket->straws, sizeof(__u32)*newsize)) == NULL) {
+	if ((_realloc = crush_arena_realloc(arena, bucket->straws, sizeof(__u32),
+					     newsize - 1, newsize)) == NULL) {
 		return -ENOMEM;
 	} else {
 		bucket->straws = _realloc;
@@ -829,23 +1780,26 @@ int crush_add_straw_bucket_item(struct crush_map *map,
 	bucket->h.weight += weight;
 	bucket->h.size++;
 	
-	return crush_calc_straw(map, bucket);
+	return crush_calc_straw_item(map, bucket, newsize - 1);
 }
 
-int crush_add_straw2_bucket_item(struct crush_map *map,
-				 struct crush_bucket_straw2 *bucket,
-				 int item, int weight)
+int crush_add_straw2_bucket_item(struct crush_arena *arena,
+				 struct crush_map *map,
+				 struct crush_bucket_straw2 *bucket, int item,
+				 int weight)
 {
 	int newsize = bucket->h.size + 1;
 
 	void *_realloc = NULL;
 
-	if ((_realloc = realloc(bucket->h.items, sizeof(__s32)*newsize)) == NULL) {
+	if ((_realloc = crush_arena_realloc(arena, bucket->h.items, sizeof(__s32),
+					     newsize - 1, newsize)) == NULL) {
 		return -ENOMEM;
 	} else {
 		bucket->h.items = _realloc;
 	}
-	if ((_realloc = realloc(bucket->item_weights, sizeof(__u32)*newsize)) == NULL) {
+	if ((_realloc = crush_arena_realloc(arena, bucket->item_weights, sizeof(__u32),
+					     newsize - 1, newsize)) == NULL) {
 		return -ENOMEM;
 	} else {
 		bucket->item_weights = _realloc;
@@ -860,31 +1814,50 @@ int crush_add_straw2_bucket_item(struct crush_map *map,
 	bucket->h.weight += weight;
 	bucket->h.size++;
 
+	/* the reciprocals are rebuilt by crush_finalize() */
+	crush_arena_free(arena, bucket->item_recips);
+	bucket->item_recips = NULL;
+
 	return 0;
 }
 
 int crush_bucket_add_item(struct crush_map *map,
 			  struct crush_bucket *b, int item, int weight)
 {
+	struct crush_arena *arena = crush_bucket_arena(map, b);
+	struct crush_track_snapshot snapshot;
+	int r;
+
+	crush_track_begin(map, b, &snapshot);
 	switch (b->alg) {
 	case CRUSH_BUCKET_UNIFORM:
-		return crush_add_uniform_bucket_item((struct crush_bucket_uniform *)b, item, weight);
+		r = crush_add_uniform_bucket_item(arena, (struct crush_bucket_uniform *)b, item, weight);
+		break;
 	case CRUSH_BUCKET_LIST:
-		return crush_add_list_bucket_item((struct crush_bucket_list *)b, item, weight);
+		r = crush_add_list_bucket_item(arena, (struct crush_bucket_list *)b, item, weight);
+		break;
 	case CRUSH_BUCKET_TREE:
-		return crush_add_tree_bucket_item((struct crush_bucket_tree *)b, item, weight);
+		r = crush_add_tree_bucket_item(arena, (struct crush_bucket_tree *)b, item, weight);
+		break;
 	case CRUSH_BUCKET_STRAW:
-		return crush_add_straw_bucket_item(map, (struct crush_bucket_straw *)b, item, weight);
+		r = crush_add_straw_bucket_item(arena, map, (struct crush_bucket_straw *)b, item, weight);
+		break;
 	case CRUSH_BUCKET_STRAW2:
-		return crush_add_straw2_bucket_item(map, (struct crush_bucket_straw2 *)b, item, weight);
+		r = crush_add_straw2_bucket_item(arena, map, (struct crush_bucket_straw2 *)b, item, weight);
+		break;
 	default:
-		return -1;
+		r = -1;
+		break;
 	}
+	crush_track_end(map, b, &snapshot, item);
+	return r;
 }
 
 /************************************************/
 
-int crush_remove_uniform_bucket_item(struct crush_bucket_uniform *bucket, int item)
+int crush_remove_uniform_bucket_item(struct crush_arena *arena,
+				     struct crush_bucket_uniform *bucket,
+				     int item)
 {
 	unsigned i, j;
 	int newsize;
@@ -896,7 +1869,7 @@ int crush_remove_uniform_bucket_item(struct crush_bucket_uniform *bucket, int it
 	if (i == bucket->h.size)
 		return -ENOENT;
 
-	for (j = i; j < bucket->h.size; j++)
+	for (j = i; j + 1 < bucket->h.size; j++)
 		bucket->h.items[j] = bucket->h.items[j+1];
 	newsize = --bucket->h.size;
 	if (bucket->item_weight < bucket->h.weight)
@@ -904,7 +1877,8 @@ int crush_remove_uniform_bucket_item(struct crush_bucket_uniform *bucket, int it
 	else
 		bucket->h.weight = 0;
 
-	if ((_realloc = realloc(bucket->h.items, sizeof(__s32)*newsize)) == NULL) {
+	if ((_realloc = crush_arena_realloc(arena, bucket->h.items, sizeof(__s32),
+					     newsize + 1, newsize)) == NULL) {
 		return -ENOMEM;
 	} else {
 		bucket->h.items = _realloc;
@@ -912,7 +1886,8 @@ int crush_remove_uniform_bucket_item(struct crush_bucket_uniform *bucket, int it
 	return 0;
 }
 
-int crush_remove_list_bucket_item(struct crush_bucket_list *bucket, int item)
+int crush_remove_list_bucket_item(struct crush_arena *arena,
+				  struct crush_bucket_list *bucket, int item)
 {
 	unsigned i, j;
 	int newsize;
@@ -925,7 +1900,7 @@ int crush_remove_list_bucket_item(struct crush_bucket_list *bucket, int item)
 		return -ENOENT;
 
 	weight = bucket->item_weights[i];
-	for (j = i; j < bucket->h.size; j++) {
+	for (j = i; j + 1 < bucket->h.size; j++) {
 		bucket->h.items[j] = bucket->h.items[j+1];
 		bucket->item_weights[j] = bucket->item_weights[j+1];
 		bucket->sum_weights[j] = bucket->sum_weights[j+1] - weight;
@@ -938,17 +1913,20 @@ int crush_remove_list_bucket_item(struct crush_bucket_list *bucket, int item)
 	
 	void *_realloc = NULL;
 
-	if ((_realloc = realloc(bucket->h.items, sizeof(__s32)*newsize)) == NULL) {
+	if ((_realloc = crush_arena_realloc(arena, bucket->h.items, sizeof(__s32),
+					     newsize + 1, newsize)) == NULL) {
 		return -ENOMEM;
 	} else {
 		bucket->h.items = _realloc;
 	}
-	if ((_realloc = realloc(bucket->item_weights, sizeof(__u32)*newsize)) == NULL) {
+	if ((_realloc = crush_arena_realloc(arena, bucket->item_weights, sizeof(__u32),
+					     newsize + 1, newsize)) == NULL) {
 		return -ENOMEM;
 	} else {
 		bucket->item_weights = _realloc;
 	}
-	if ((_realloc = realloc(bucket->sum_weights, sizeof(__u32)*newsize)) == NULL) {
+	if ((_realloc = crush_arena_realloc(arena, bucket->sum_weights, sizeof(__u32),
+					     newsize + 1, newsize)) == NULL) {
 		return -ENOMEM;
 	} else {
 		bucket->sum_weights = _realloc;
@@ -956,7 +1934,8 @@ int crush_remove_list_bucket_item(struct crush_bucket_list *bucket, int item)
 	return 0;
 }
 
-int crush_remove_tree_bucket_item(struct crush_bucket_tree *bucket, int item)
+int crush_remove_tree_bucket_item(struct crush_arena *arena,
+				  struct crush_bucket_tree *bucket, int item)
 {
 	unsigned i;
 	unsigned newsize;
@@ -1002,7 +1981,8 @@ int crush_remove_tree_bucket_item(struct crush_bucket_tree *bucket, int item)
 
 		void *_realloc = NULL;
 
-		if ((_realloc = realloc(bucket->h.items, sizeof(__s32)*newsize)) == NULL) {
+		if ((_realloc = crush_arena_realloc(arena, bucket->h.items, sizeof(__s32),
+					     bucket->h.size, newsize)) == NULL) {
 			return -ENOMEM;
 		} else {
 			bucket->h.items = _realloc;
@@ -1011,9 +1991,11 @@ int crush_remove_tree_bucket_item(struct crush_bucket_tree *bucket, int item)
 		olddepth = calc_depth(bucket->h.size);
 		newdepth = calc_depth(newsize);
 		if (olddepth != newdepth) {
+			int old_nodes = bucket->num_nodes;
+
 			bucket->num_nodes = 1 << newdepth;
-			if ((_realloc = realloc(bucket->node_weights, 
-						sizeof(__u32)*bucket->num_nodes)) == NULL) {
+			if ((_realloc = crush_arena_realloc(arena, bucket->node_weights, sizeof(__u32),
+							     old_nodes, bucket->num_nodes)) == NULL) {
 				return -ENOMEM;
 			} else {
 				bucket->node_weights = _realloc;
@@ -1025,7 +2007,8 @@ int crush_remove_tree_bucket_item(struct crush_bucket_tree *bucket, int item)
 	return 0;
 }
 
-int crush_remove_straw_bucket_item(struct crush_map *map,
+int crush_remove_straw_bucket_item(struct crush_arena *arena,
+				   struct crush_map *map,
 				   struct crush_bucket_straw *bucket, int item)
 {
 	int newsize = bucket->h.size - 1;
@@ -1050,17 +2033,20 @@ int crush_remove_straw_bucket_item(struct crush_map *map,
 	
 	void *_realloc = NULL;
 
-	if ((_realloc = realloc(bucket->h.items, sizeof(__s32)*newsize)) == NULL) {
+	if ((_realloc = crush_arena_realloc(arena, bucket->h.items, sizeof(__s32),
+					     newsize + 1, newsize)) == NULL) {
 		return -ENOMEM;
 	} else {
 		bucket->h.items = _realloc;
 	}
-	if ((_realloc = realloc(bucket->item_weights, sizeof(__u32)*newsize)) == NULL) {
+	if ((_realloc = crush_arena_realloc(arena, bucket->item_weights, sizeof(__u32),
+					     newsize + 1, newsize)) == NULL) {
 		return -ENOMEM;
 	} else {
 		bucket->item_weights = _realloc;
 	}
-	if ((_realloc = realloc(bucket->straws, sizeof(__u32)*newsize)) == NULL) {
+	if ((_realloc = crush_arena_realloc(arena, bucket->straws, sizeof(__u32),
+					     newsize + 1, newsize)) == NULL) {
 		return -ENOMEM;
 	} else {
 		bucket->straws = _realloc;
@@ -1069,8 +2055,10 @@ int crush_remove_straw_bucket_item(struct crush_map *map,
 	return crush_calc_straw(map, bucket);
 }
 
-int crush_remove_straw2_bucket_item(struct crush_map *map,
-				    struct crush_bucket_straw2 *bucket, int item)
+int crush_remove_straw2_bucket_item(struct crush_arena *arena,
+				    struct crush_map *map,
+				    struct crush_bucket_straw2 *bucket,
+				    int item)
 {
 	int newsize = bucket->h.size - 1;
 	unsigned i, j;
@@ -1092,14 +2080,20 @@ int crush_remove_straw2_bucket_item(struct crush_map *map,
 	if (i == bucket->h.size)
 		return -ENOENT;
 
+	/* the reciprocals are rebuilt by crush_finalize() */
+	crush_arena_free(arena, bucket->item_recips);
+	bucket->item_recips = NULL;
+
 	void *_realloc = NULL;
 
-	if ((_realloc = realloc(bucket->h.items, sizeof(__s32)*newsize)) == NULL) {
+	if ((_realloc = crush_arena_realloc(arena, bucket->h.items, sizeof(__s32),
+					     newsize + 1, newsize)) == NULL) {
 		return -ENOMEM;
 	} else {
 		bucket->h.items = _realloc;
 	}
-	if ((_realloc = realloc(bucket->item_weights, sizeof(__u32)*newsize)) == NULL) {
+	if ((_realloc = crush_arena_realloc(arena, bucket->item_weights, sizeof(__u32),
+					     newsize + 1, newsize)) == NULL) {
 		return -ENOMEM;
 	} else {
 		bucket->item_weights = _realloc;
@@ -1110,20 +2104,33 @@ int crush_remove_straw2_bucket_item(struct crush_map *map,
 
 int crush_bucket_remove_item(struct crush_map *map, struct crush_bucket *b, int item)
 {
+	struct crush_arena *arena = crush_bucket_arena(map, b);
+	struct crush_track_snapshot snapshot;
+	int r;
+
+	crush_track_begin(map, b, &snapshot);
 	switch (b->alg) {
 	case CRUSH_BUCKET_UNIFORM:
-		return crush_remove_uniform_bucket_item((struct crush_bucket_uniform *)b, item);
+		r = crush_remove_uniform_bucket_item(arena, (struct crush_bucket_uniform *)b, item);
+		break;
 	case CRUSH_BUCKET_LIST:
-		return crush_remove_list_bucket_item((struct crush_bucket_list *)b, item);
+		r = crush_remove_list_bucket_item(arena, (struct crush_bucket_list *)b, item);
+		break;
 	case CRUSH_BUCKET_TREE:
-		return crush_remove_tree_bucket_item((struct crush_bucket_tree *)b, item);
+		r = crush_remove_tree_bucket_item(arena, (struct crush_bucket_tree *)b, item);
+		break;
 	case CRUSH_BUCKET_STRAW:
-		return crush_remove_straw_bucket_item(map, (struct crush_bucket_straw *)b, item);
+		r = crush_remove_straw_bucket_item(arena, map, (struct crush_bucket_straw *)b, item);
+		break;
 	case CRUSH_BUCKET_STRAW2:
-		return crush_remove_straw2_bucket_item(map, (struct crush_bucket_straw2 *)b, item);
+		r = crush_remove_straw2_bucket_item(arena, map, (struct crush_bucket_straw2 *)b, item);
+		break;
 	default:
-		return -1;
+		r = -1;
+		break;
 	}
+	crush_track_end(map, b, &snapshot, item);
+	return r;
 }
 
 
@@ -1139,17 +2146,11 @@ int crush_adjust_uniform_bucket_item_weight(struct crush_bucket_uniform *bucket,
 	return diff;
 }
 
-int crush_adjust_list_bucket_item_weight(struct crush_bucket_list *bucket, int item, int weight)
+static int crush_adjust_list_bucket_item_weight_at(struct crush_bucket_list *bucket,
+						   unsigned i, int weight)
 {
 	int diff;
-	unsigned i, j;
-
-	for (i = 0; i < bucket->h.size; i++) {
-		if (bucket->h.items[i] == item)
-			break;
-	}
-	if (i == bucket->h.size)
-		return 0;
+	unsigned j;
 
 	diff = weight - bucket->item_weights[i];
 	bucket->item_weights[i] = weight;
@@ -1161,12 +2162,9 @@ int crush_adjust_list_bucket_item_weight(struct crush_bucket_list *bucket, int i
 	return diff;
 }
 
-int crush_adjust_tree_bucket_item_weight(struct crush_bucket_tree *bucket, int item, int weight)
+int crush_adjust_list_bucket_item_weight(struct crush_bucket_list *bucket, int item, int weight)
 {
-	int diff;
-	int node;
-	unsigned i, j;
-	unsigned depth = calc_depth(bucket->h.size);
+	unsigned i;
 
 	for (i = 0; i < bucket->h.size; i++) {
 		if (bucket->h.items[i] == item)
@@ -1174,7 +2172,18 @@ int crush_adjust_tree_bucket_item_weight(struct crush_bucket_tree *bucket, int i
 	}
 	if (i == bucket->h.size)
 		return 0;
-	
+
+	return crush_adjust_list_bucket_item_weight_at(bucket, i, weight);
+}
+
+static int crush_adjust_tree_bucket_item_weight_at(struct crush_bucket_tree *bucket,
+						   unsigned i, int weight)
+{
+	int diff;
+	int node;
+	unsigned j;
+	unsigned depth = calc_depth(bucket->h.size);
+
 	node = crush_calc_tree_node(i);
 	diff = weight - bucket->node_weights[node];
 	bucket->node_weights[node] = weight;
@@ -1188,13 +2197,43 @@ int crush_adjust_tree_bucket_item_weight(struct crush_bucket_tree *bucket, int i
 	return diff;
 }
 
+int crush_adjust_tree_bucket_item_weight(struct crush_bucket_tree *bucket, int item, int weight)
+{
+	unsigned i;
+
+	for (i = 0; i < bucket->h.size; i++) {
+		if (bucket->h.items[i] == item)
+			break;
+	}
+	if (i == bucket->h.size)
+		return 0;
+
+	return crush_adjust_tree_bucket_item_weight_at(bucket, i, weight);
+}
+
+static int crush_adjust_straw_bucket_item_weight_at(struct crush_map *map,
+						    struct crush_bucket_straw *bucket,
+						    unsigned idx, int weight)
+{
+	int diff;
+        int r;
+
+	diff = weight - bucket->item_weights[idx];
+	bucket->item_weights[idx] = weight;
+	bucket->h.weight += diff;
+
+	r = crush_calc_straw_item(map, bucket, idx);
+        if (r < 0)
+                return r;
+
+	return diff;
+}
+
 int crush_adjust_straw_bucket_item_weight(struct crush_map *map,
 					  struct crush_bucket_straw *bucket,
 					  int item, int weight)
 {
 	unsigned idx;
-	int diff;
-        int r;
 
 	for (idx = 0; idx < bucket->h.size; idx++)
 		if (bucket->h.items[idx] == item)
@@ -1202,13 +2241,19 @@ int crush_adjust_straw_bucket_item_weight(struct crush_map *map,
 	if (idx == bucket->h.size)
 		return 0;
 
+	return crush_adjust_straw_bucket_item_weight_at(map, bucket, idx, weight);
+}
+
+static int crush_adjust_straw2_bucket_item_weight_at(struct crush_bucket_straw2 *bucket,
+						     unsigned idx, int weight)
+{
+	int diff;
+
 	diff = weight - bucket->item_weights[idx];
 	bucket->item_weights[idx] = weight;
 	bucket->h.weight += diff;
-
-	r = crush_calc_straw(map, bucket);
-        if (r < 0)
-                return r;
+	if (bucket->item_recips)
+		crush_straw2_recip_init(&bucket->item_recips[idx], weight);
 
 	return diff;
 }
@@ -1218,7 +2263,6 @@ int crush_adjust_straw2_bucket_item_weight(struct crush_map *map,
 					   int item, int weight)
 {
 	unsigned idx;
-	int diff;
 
 	for (idx = 0; idx < bucket->h.size; idx++)
 		if (bucket->h.items[idx] == item)
@@ -1226,11 +2270,7 @@ int crush_adjust_straw2_bucket_item_weight(struct crush_map *map,
 	if (idx == bucket->h.size)
 		return 0;
 
-	diff = weight - bucket->item_weights[idx];
-	bucket->item_weights[idx] = weight;
-	bucket->h.weight += diff;
-
-	return diff;
+	return crush_adjust_straw2_bucket_item_weight_at(bucket, idx, weight);
 }
 
 int crush_bucket_adjust_item_weight(struct crush_map *map,
@@ -1260,6 +2300,142 @@ int crush_bucket_adjust_item_weight(struct crush_map *map,
 	}
 }
 
+/* set the weight of the item at pos in b, which must be a valid position */
+static int crush_bucket_adjust_item_weight_at(struct crush_map *map,
+					      struct crush_bucket *b,
+					      unsigned pos, int weight)
+{
+	switch (b->alg) {
+	case CRUSH_BUCKET_UNIFORM:
+		return crush_adjust_uniform_bucket_item_weight((struct crush_bucket_uniform *)b,
+							     b->items[pos], weight);
+	case CRUSH_BUCKET_LIST:
+		return crush_adjust_list_bucket_item_weight_at((struct crush_bucket_list *)b,
+							       pos, weight);
+	case CRUSH_BUCKET_TREE:
+		return crush_adjust_tree_bucket_item_weight_at((struct crush_bucket_tree *)b,
+							       pos, weight);
+	case CRUSH_BUCKET_STRAW:
+		return crush_adjust_straw_bucket_item_weight_at(map,
+								(struct crush_bucket_straw *)b,
+								pos, weight);
+	case CRUSH_BUCKET_STRAW2:
+		return crush_adjust_straw2_bucket_item_weight_at((struct crush_bucket_straw2 *)b,
+								 pos, weight);
+	default:
+		return -1;
+	}
+}
+
+/************************************************/
+
+/* the first bucket holding item, from pos on in map->buckets */
+static int crush_scan_parent(const struct crush_map *map, int item,
+			     int pos, int *item_pos)
+{
+	__u32 i;
+
+	for (; pos < map->max_buckets; pos++) {
+		const struct crush_bucket *b = map->buckets[pos];
+
+		if (b == NULL)
+			continue;
+		for (i = 0; i < b->size; i++) {
+			if (b->items[i] == item) {
+				*item_pos = i;
+				return pos;
+			}
+		}
+	}
+	return -1;
+}
+
+int crush_get_parent(struct crush_map *map, int item, int *pos)
+{
+	struct crush_item_parent *parent = NULL;
+	int item_pos = 0;
+	int found;
+
+	if (map->changes_tracked) {
+		parent = crush_item_parent(map, item);
+		if (parent == NULL || parent->refs == 0)
+			return 0;
+		if (parent->bucket != 0) {
+			if (pos)
+				*pos = parent->pos;
+			return parent->bucket;
+		}
+	}
+	found = crush_scan_parent(map, item, 0, &item_pos);
+	if (found < 0)
+		return 0;
+	if (parent && parent->refs == 1) {
+		parent->bucket = -1-found;
+		parent->pos = item_pos;
+	}
+	if (pos)
+		*pos = item_pos;
+	return -1-found;
+}
+
+static int crush_set_weight_at(struct crush_map *map, struct crush_bucket *b,
+			       int pos, int weight)
+{
+	__u32 former = crush_get_bucket_item_weight(b, pos);
+
+	if (b->alg == CRUSH_BUCKET_UNIFORM ?
+	    crush_multiplication_is_unsafe(weight, b->size) :
+	    crush_addition_is_unsafe(b->weight - former, weight))
+		return -ERANGE;
+	crush_bucket_adjust_item_weight_at(map, b, pos, weight);
+	return 0;
+}
+
+/* set the weight of item in all its parents and so on up to the roots */
+static int crush_propagate_weight(struct crush_map *map, int item, int weight)
+{
+	struct crush_bucket *b;
+	int bucket, pos, r;
+
+	if (map->changes_tracked) {
+		struct crush_item_parent *parent = crush_item_parent(map, item);
+
+		if (parent == NULL || parent->refs == 0)
+			return 0;
+		if (parent->refs == 1) {
+			bucket = crush_get_parent(map, item, &pos);
+			b = map->buckets[-1-bucket];
+			r = crush_set_weight_at(map, b, pos, weight);
+			if (r < 0)
+				return r;
+			return crush_propagate_weight(map, b->id, b->weight);
+		}
+	}
+
+	bucket = crush_scan_parent(map, item, 0, &pos);
+	while (bucket >= 0) {
+		b = map->buckets[bucket];
+		r = crush_set_weight_at(map, b, pos, weight);
+		if (r < 0)
+			return r;
+		r = crush_propagate_weight(map, b->id, b->weight);
+		if (r < 0)
+			return r;
+		/* an item is not expected to be twice in a bucket */
+		bucket = crush_scan_parent(map, item, bucket + 1, &pos);
+	}
+	return 0;
+}
+
+int crush_set_device_weight(struct crush_map *map, int device, int weight)
+{
+	if (device < 0 || weight < 0)
+		return -EINVAL;
+	if (crush_get_parent(map, device, NULL) == 0)
+		return -ENOENT;
+	return crush_propagate_weight(map, device, weight);
+}
+
 /************************************************/
 
 static int crush_reweight_uniform_bucket(struct crush_map *map, struct crush_bucket_uniform *bucket)
@@ -1379,6 +2555,11 @@ static int crush_reweight_straw2_bucket(struct crush_map *map, struct crush_buck
                 bucket->h.weight += bucket->item_weights[i];
 	}
 
+	if (bucket->item_recips)
+		crush_update_straw2_recips(bucket->item_recips,
+					   bucket->item_weights,
+					   bucket->h.size);
+
 	return 0;
 }
 
@@ -1400,28 +2581,55 @@ int crush_reweight_bucket(struct crush_map *map, struct crush_bucket *b)
 	}
 }
 
-struct crush_choose_arg *crush_make_choose_args(struct crush_map *map, int num_positions)
+size_t crush_choose_args_size(const struct crush_map *map, int num_positions)
+{
+  int b;
+  size_t sum_bucket_size = 0;
+  size_t bucket_count = 0;
+  for (b = 0; b < map->max_buckets; b++) {
+    if (map->buckets[b] == 0)
+      continue;
+    sum_bucket_size += map->buckets[b]->size;
+    bucket_count++;
+  }
+  dprintk("sum_bucket_size %d max_buckets %d bucket_count %d\n",
+          (int)sum_bucket_size, map->max_buckets, (int)bucket_count);
+  return (sizeof(struct crush_choose_arg) * map->max_buckets +
+          sizeof(struct crush_weight_set) * bucket_count * num_positions +
+          sizeof(struct crush_straw2_recip) * sum_bucket_size * num_positions + // recips
+          sizeof(__u32) * sum_bucket_size * num_positions + // weights
+          sizeof(__u32) * sum_bucket_size); // ids
+}
+
+struct crush_choose_arg *crush_init_choose_args(const struct crush_map *map,
+                                                int num_positions,
+                                                void *arena, size_t arena_size)
 {
   int b;
   int sum_bucket_size = 0;
   int bucket_count = 0;
+  if (num_positions < 0) {
+    errno = EINVAL;
+    return NULL;
+  }
+  size_t size = crush_choose_args_size(map, num_positions);
+  if (arena_size < size) {
+    errno = ENOSPC;
+    return NULL;
+  }
   for (b = 0; b < map->max_buckets; b++) {
     if (map->buckets[b] == 0)
       continue;
     sum_bucket_size += map->buckets[b]->size;
     bucket_count++;
   }
-  dprintk("sum_bucket_size %d max_buckets %d bucket_count %d\n",
-          sum_bucket_size, map->max_buckets, bucket_count);
-  int size = (sizeof(struct crush_choose_arg) * map->max_buckets +
-              sizeof(struct crush_weight_set) * bucket_count * num_positions +
-              sizeof(__u32) * sum_bucket_size * num_positions + // weights
-              sizeof(__u32) * sum_bucket_size); // ids
-  char *space = malloc(size);
+  char *space = arena;
   struct crush_choose_arg *arg = (struct crush_choose_arg *)space;
   struct crush_weight_set *weight_set = (struct crush_weight_set *)(arg + map->max_buckets);
-  __u32 *weights = (__u32 *)(weight_set + bucket_count * num_positions);
-  char *weight_set_ends = (char*)weights;
+  struct crush_straw2_recip *recips = (struct crush_straw2_recip *)(weight_set + bucket_count * num_positions);
+  char *weight_set_ends = (char*)recips;
+  __u32 *weights = (__u32 *)(recips + sum_bucket_size * num_positions);
+  char *recips_end = (char*)weights;
   int *ids = (int *)(weights + sum_bucket_size * num_positions);
   char *weights_end = (char *)ids;
   char *ids_end = (char *)(ids + sum_bucket_size);
@@ -1438,8 +2646,11 @@ struct crush_choose_arg *crush_make_choose_args(struct crush_map *map, int num_p
       memcpy(weights, bucket->item_weights, sizeof(__u32) * bucket->h.size);
       weight_set[position].weights = weights;
       weight_set[position].size = bucket->h.size;
+      crush_update_straw2_recips(recips, weights, bucket->h.size);
+      weight_set[position].recips = recips;
       dprintk("moving weight %d bytes forward\n", (int)((weights + bucket->h.size) - weights));
       weights += bucket->h.size;
+      recips += bucket->h.size;
     }
     arg[b].weight_set = weight_set;
     arg[b].weight_set_size = num_positions;
@@ -1451,11 +2662,162 @@ struct crush_choose_arg *crush_make_choose_args(struct crush_map *map, int num_p
     ids += bucket->h.size;
   }
   BUG_ON((char*)weight_set_ends != (char*)weight_set);
+  BUG_ON((char*)recips_end != (char*)recips);
   BUG_ON((char*)weights_end != (char*)weights);
   BUG_ON((char*)ids != (char*)ids_end);
   return arg;
 }
 
+struct crush_choose_arg *crush_make_choose_args(struct crush_map *map, int num_positions)
+{
+  size_t size = crush_choose_args_size(map, num_positions);
+  char *space = malloc(size);
+  if (!space)
+    return NULL;
+  struct crush_choose_arg *arg = crush_init_choose_args(map, num_positions,
+                                                        space, size);
+  if (!arg)
+    free(space);
+  return arg;
+}
+
+/* the weight set @position of the bucket @bucket_id or NULL */
+static struct crush_weight_set *
+crush_choose_args_weight_set(const struct crush_map *map,
+			     struct crush_choose_arg *args,
+			     int bucket_id, int position)
+{
+	int b = -1-bucket_id;
+
+	if (b < 0 || b >= map->max_buckets || map->buckets[b] == NULL ||
+	    position < 0 || (__u32)position >= args[b].weight_set_size)
+		return NULL;
+	return &args[b].weight_set[position];
+}
+
+int crush_choose_args_set_weights(const struct crush_map *map,
+				  struct crush_choose_arg *args,
+				  int bucket_id, int position,
+				  const __u32 *weights)
+{
+	struct crush_weight_set *ws =
+		crush_choose_args_weight_set(map, args, bucket_id, position);
+
+	if (ws == NULL)
+		return -EINVAL;
+	memcpy(ws->weights, weights, ws->size * sizeof(__u32));
+	if (ws->recips)
+		crush_update_straw2_recips(ws->recips, ws->weights, ws->size);
+	return 0;
+}
+
+int crush_choose_args_set_weight(const struct crush_map *map,
+				 struct crush_choose_arg *args,
+				 int bucket_id, int position,
+				 int index, __u32 weight)
+{
+	struct crush_weight_set *ws =
+		crush_choose_args_weight_set(map, args, bucket_id, position);
+
+	if (ws == NULL || index < 0 || (__u32)index >= ws->size)
+		return -EINVAL;
+	ws->weights[index] = weight;
+	if (ws->recips)
+		crush_update_straw2_recips(&ws->recips[index],
+					   &ws->weights[index], 1);
+	return 0;
+}
+
+/* true if the choose_arg @a and @b have the same sizes */
+static int crush_choose_arg_same_shape(const struct crush_choose_arg *a,
+				       const struct crush_choose_arg *b)
+{
+	__u32 position;
+
+	if (a->weight_set_size != b->weight_set_size ||
+	    a->ids_size != b->ids_size ||
+	    (a->ids == NULL) != (b->ids == NULL))
+		return 0;
+	for (position = 0; position < a->weight_set_size; position++)
+		if (a->weight_set[position].size !=
+		    b->weight_set[position].size)
+			return 0;
+	return 1;
+}
+
+int crush_copy_choose_args(const struct crush_map *map,
+			   struct crush_choose_arg *dst,
+			   const struct crush_choose_arg *src)
+{
+	__s32 b;
+	__u32 position;
+
+	for (b = 0; b < map->max_buckets; b++)
+		if (map->buckets[b] &&
+		    !crush_choose_arg_same_shape(&dst[b], &src[b]))
+			return -EINVAL;
+	for (b = 0; b < map->max_buckets; b++) {
+		if (map->buckets[b] == NULL)
+			continue;
+		if (dst[b].ids && dst[b].ids != src[b].ids)
+			memcpy(dst[b].ids, src[b].ids,
+			       dst[b].ids_size * sizeof(int));
+		for (position = 0; position < dst[b].weight_set_size; position++) {
+			struct crush_weight_set *to = &dst[b].weight_set[position];
+			const struct crush_weight_set *from =
+				&src[b].weight_set[position];
+
+			if (to->weights == from->weights)
+				continue;
+			memcpy(to->weights, from->weights,
+			       to->size * sizeof(__u32));
+			if (to->recips == NULL)
+				continue;
+			if (from->recips)
+				memcpy(to->recips, from->recips,
+				       to->size * sizeof(*to->recips));
+			else
+				crush_update_straw2_recips(to->recips,
+							   to->weights,
+							   to->size);
+		}
+	}
+	return 0;
+}
+
+int crush_diff_choose_args(const struct crush_map *map,
+			   const struct crush_choose_arg *a,
+			   const struct crush_choose_arg *b,
+			   int *ids, int ids_max)
+{
+	__s32 i;
+	__u32 position;
+	int count = 0;
+
+	for (i = 0; i < map->max_buckets; i++) {
+		int differ;
+
+		if (map->buckets[i] == NULL)
+			continue;
+		differ = !crush_choose_arg_same_shape(&a[i], &b[i]) ||
+			(a[i].ids && memcmp(a[i].ids, b[i].ids,
+					    a[i].ids_size * sizeof(int)));
+		for (position = 0;
+		     !differ && position < a[i].weight_set_size;
+		     position++)
+			differ = memcmp(a[i].weight_set[position].weights,
+					b[i].weight_set[position].weights,
+					a[i].weight_set[position].size *
+					sizeof(__u32)) != 0;
+		if (!differ)
+			continue;
+		if (count < ids_max)
+			ids[count] = -1-i;
+		count++;
+	}
+	return count;
+}
+
 void crush_destroy_choose_args(struct crush_choose_arg *args)
 {
   free(args);
@@ -17,6 +17,48 @@
  * @returns a pointer to the newly created crush_map or NULL
  */
 extern struct crush_map *crush_create();
+/** @ingroup API
+ *
+ * Allocate a crush_map as crush_create() does, in an arena that also
+ * holds the buckets crush_make_bucket() makes for it. The arrays of
+ * these buckets grow geometrically in the arena when
+ * crush_bucket_add_item() adds items: building a map of __n__ items
+ * takes O(log(__n__)) allocations instead of several for each item.
+ * Nothing is freed from the arena before crush_destroy(), which frees
+ * it at once, and the memory of the buckets removed or given new
+ * arrays is not reused.
+ *
+ * The arena starts with __memory__, which the caller owns and must
+ * keep until crush_destroy(), and continues with chunks allocated with
+ * __malloc(3)__, each twice as large as the previous. If __memory__ is
+ * NULL, the first chunk of __size__ bytes, or 64KB if __size__ is
+ * smaller, is allocated with the arena.
+ *
+ * The buckets made for the map must be deallocated with it: not with
+ * crush_destroy_bucket(), and the __map__ must be given to
+ * crush_bucket_add_item() and crush_bucket_remove_item() for them.
+ * Buckets made for another map can still be added to it.
+ *
+ * - __errno__ is EINVAL if __memory__ is not aligned on 16 bytes or
+ *   __size__ is too small to hold the crush_map
+ * - __errno__ is ENOMEM if __malloc(3)__ fails
+ *
+ * @param memory the first chunk of the arena or NULL
+ * @param size the size of __memory__ in bytes
+ *
+ * @returns a pointer to the newly created crush_map or NULL
+ */
+extern struct crush_map *crush_create_arena(void *memory, size_t size);
+/** @ingroup API
+ *
+ * The number of bytes allocated in the arena of a crush_map created
+ * with crush_create_arena(), the crush_map included.
+ *
+ * @param map the crush_map
+ *
+ * @returns the bytes allocated in the arena of __map__, 0 if it has none
+ */
+extern size_t crush_arena_size(const struct crush_map *map);
 /** @ingroup API
  *
  * Analyze the content of __map__ and set the internal values required
@@ -24,9 +66,53 @@ extern struct crush_map *crush_create();
  * must make sure it is run before crush_do_rule() and after any
  * function that modifies the __map__ (crush_add_bucket(), etc.).
  *
+ * The first call goes over the whole __map__, so that the buckets
+ * may be filled by crush_add_bucket() or by setting
+ * __map->buckets__ directly. After that, crush_add_bucket(),
+ * crush_remove_bucket(), crush_bucket_add_item() and
+ * crush_bucket_remove_item() keep __map->max_devices__ and
+ * __map->working_size__ up to date as they go and
+ * crush_bucket_adjust_item_weight() and crush_reweight_bucket() update
+ * what depends on the weights in place: crush_finalize() only
+ * revisits the buckets that were given new items since it last ran.
+ * They also keep track of the bucket holding each item, see
+ * crush_get_parent().
+ *
  * @param map the crush_map
  */
 extern void crush_finalize(struct crush_map *map);
+/** @ingroup API
+ *
+ * Set __map->working_size__ to the size of the working space needed
+ * by crush_do_rule(), as crush_finalize() does, without modifying
+ * anything else in the __map__. It is enough to call it after
+ * modifying a tunable of a finalized __map__ or when its buckets are
+ * not to be modified, for instance to load a map that was encoded.
+ *
+ * @param map the crush_map
+ */
+extern void crush_calc_working_size(struct crush_map *map);
+/** @ingroup API
+ *
+ * Return a read only copy of a finalized __map__ that gives the same
+ * mappings with crush_do_rule() but is faster to descend. The copy
+ * is a single __malloc(3)__ allocation: the crush_map is followed by
+ * the buckets, laid out breadth first from the roots of the
+ * hierarchy, each bucket immediately followed by its arrays, and the
+ * rules.
+ *
+ * The copy must not be modified (crush_add_bucket(),
+ * crush_bucket_add_item(), crush_finalize(), etc.) and the __map__
+ * can be destroyed without affecting it. The caller is responsible
+ * for deallocating the copy with crush_destroy().
+ *
+ * If __malloc(3)__ fails or a bucket has an unknown algorithm, return NULL.
+ *
+ * @param map a finalized crush_map
+ *
+ * @returns a pointer to the copy or NULL
+ */
+extern struct crush_map *crush_flatten(const struct crush_map *map);
 
 /* rules */
 /** @ingroup API
@@ -183,11 +269,13 @@ extern int crush_add_bucket(struct crush_map *map,
  * __items[x]__ is set to be the value of __weights[x]__.
  *
  * The caller is responsible for deallocating the returned pointer via
- * crush_destroy_bucket().
+ * crush_destroy_bucket(), unless __map__ was created with
+ * crush_create_arena(): the bucket is then allocated in its arena and
+ * deallocated with the __map__.
  *
- * @param map __unused__
+ * @param map the crush_map the bucket is made for or NULL
  * @param alg algorithm for item selection
- * @param hash always set to CRUSH_HASH_RJENKINS1
+ * @param hash CRUSH_HASH_RJENKINS1 or CRUSH_HASH_XXHASH32
  * @param type user defined bucket type
  * @param size of the __items__ array
  * @param items array of __size__ items
@@ -196,8 +284,173 @@ extern int crush_add_bucket(struct crush_map *map,
  * @returns a pointer to the newly created bucket or NULL
  */
 struct crush_bucket *crush_make_bucket(struct crush_map *map, int alg, int hash, int type, int size, int *items, int *weights);
+/** @ingroup API
+ *
+ * Allocate an array of crush_choose_arg for each bucket in __map__,
+ * with __num_positions__ weight sets initialized with the item
+ * weights of the buckets and the reciprocals of these weights. All
+ * the buckets in __map__ must be ::CRUSH_BUCKET_STRAW2 buckets.
+ *
+ * If the caller modifies the weights of a weight set, it should call
+ * crush_update_straw2_recips() so that crush_do_rule() does not fall
+ * back to dividing by the modified weights.
+ *
+ * The caller is responsible for deallocating the returned pointer via
+ * crush_destroy_choose_args().
+ *
+ * @param map the crush_map
+ * @param num_positions the number of weight sets for each bucket
+ *
+ * @returns an array of __map->max_buckets__ crush_choose_arg or NULL
+ */
 extern struct crush_choose_arg *crush_make_choose_args(struct crush_map *map, int num_positions);
 extern void crush_destroy_choose_args(struct crush_choose_arg *args);
+
+/** @ingroup API
+ *
+ * Return the number of bytes crush_init_choose_args() needs to lay
+ * out choose_args for __map__ with __num_positions__ weight sets for
+ * each bucket. It is the size of the block that
+ * crush_make_choose_args() allocates.
+ *
+ * @param map the crush_map
+ * @param num_positions the number of weight sets for each bucket
+ *
+ * @returns the size of the choose_args in bytes
+ */
+extern size_t crush_choose_args_size(const struct crush_map *map,
+				     int num_positions);
+/** @ingroup API
+ *
+ * Lay out in __arena__ the choose_args crush_make_choose_args() would
+ * allocate, without allocating anything. The caller owns __arena__,
+ * which must be aligned as a __malloc(3)__ block and hold at least
+ * crush_choose_args_size() bytes, and must not give the returned
+ * array to crush_destroy_choose_args(). An arena can be laid out
+ * again, for instance to reset the weights of all the weight sets.
+ *
+ * - __errno__ is EINVAL if __num_positions__ is negative
+ * - __errno__ is ENOSPC if __arena_size__ is too small
+ *
+ * @param map the crush_map
+ * @param num_positions the number of weight sets for each bucket
+ * @param arena where to lay out the choose_args
+ * @param arena_size the size of __arena__ in bytes
+ *
+ * @returns an array of __map->max_buckets__ crush_choose_arg at the
+ *          beginning of __arena__ or NULL with __errno__ set on error
+ */
+extern struct crush_choose_arg *crush_init_choose_args(const struct crush_map *map,
+						       int num_positions,
+						       void *arena,
+						       size_t arena_size);
+/** @ingroup API
+ *
+ * Set the weights of the weight set __position__ of the bucket
+ * __bucket_id__ in __args__ to the __weights__ array, which has as
+ * many weights as the weight set, and update their reciprocals. The
+ * other weight sets are not modified.
+ *
+ * - return -EINVAL if __bucket_id__ or __position__ do not exist
+ *
+ * @param map the crush_map of __args__
+ * @param args an array of __map->max_buckets__ crush_choose_arg
+ * @param bucket_id the id of the bucket (negative)
+ * @param position the weight set of the bucket
+ * @param weights the 16.16 fixed point weights
+ *
+ * @returns 0 on success, < 0 on error
+ */
+extern int crush_choose_args_set_weights(const struct crush_map *map,
+					 struct crush_choose_arg *args,
+					 int bucket_id, int position,
+					 const __u32 *weights);
+/** @ingroup API
+ *
+ * Set the weight __index__ of the weight set __position__ of the
+ * bucket __bucket_id__ in __args__ to __weight__ and update its
+ * reciprocal, in constant time.
+ *
+ * - return -EINVAL if __bucket_id__, __position__ or __index__ do not
+ *   exist
+ *
+ * @param map the crush_map of __args__
+ * @param args an array of __map->max_buckets__ crush_choose_arg
+ * @param bucket_id the id of the bucket (negative)
+ * @param position the weight set of the bucket
+ * @param index the index of the weight in the weight set
+ * @param weight the 16.16 fixed point weight
+ *
+ * @returns 0 on success, < 0 on error
+ */
+extern int crush_choose_args_set_weight(const struct crush_map *map,
+					struct crush_choose_arg *args,
+					int bucket_id, int position,
+					int index, __u32 weight);
+/** @ingroup API
+ *
+ * Copy the ids, the weights and the reciprocals of the weights of
+ * __src__ into the arrays of __dst__, without allocating anything.
+ * Both must have the same number of weight sets of the same sizes
+ * for each bucket of __map__, for instance because they were made by
+ * crush_make_choose_args() or crush_init_choose_args() with the same
+ * arguments. Cloning choose_args into an arena is:
+ *
+ *         clone = crush_init_choose_args(map, num_positions, arena, size);
+ *         crush_copy_choose_args(map, clone, args);
+ *
+ * - return -EINVAL if __dst__ and __src__ do not have the same sizes,
+ *   __dst__ is then left unmodified
+ *
+ * @param map the crush_map of __dst__ and __src__
+ * @param dst an array of __map->max_buckets__ crush_choose_arg
+ * @param src an array of __map->max_buckets__ crush_choose_arg
+ *
+ * @returns 0 on success, < 0 on error
+ */
+extern int crush_copy_choose_args(const struct crush_map *map,
+				  struct crush_choose_arg *dst,
+				  const struct crush_choose_arg *src);
+/** @ingroup API
+ *
+ * Store in __ids__ the ids of the buckets of __map__ whose ids or
+ * weights differ between the choose_args __a__ and __b__, up to
+ * __ids_max__ of them, and return how many there are. The values
+ * mapped by crush_do_rule() with __a__ and with __b__ may only differ
+ * if they go through one of these buckets, see crush_map_delta().
+ *
+ * @param map the crush_map of __a__ and __b__
+ * @param a an array of __map->max_buckets__ crush_choose_arg
+ * @param b an array of __map->max_buckets__ crush_choose_arg
+ * @param ids an array of __ids_max__ bucket ids
+ * @param ids_max the size of the __ids__ array
+ *
+ * @returns the number of buckets that differ
+ */
+extern int crush_diff_choose_args(const struct crush_map *map,
+				  const struct crush_choose_arg *a,
+				  const struct crush_choose_arg *b,
+				  int *ids, int ids_max);
+
+/** @ingroup API
+ *
+ * Set __recips[i]__ to the reciprocal of __weights[i]__ for i in
+ * [0,__size__[. It must be called after modifying the weights of a
+ * crush_weight_set that has reciprocals, for instance:
+ *
+ *         ws->weights[3] = 0x20000;
+ *         crush_update_straw2_recips(ws->recips, ws->weights, ws->size);
+ *
+ * The reciprocals of the item weights of ::CRUSH_BUCKET_STRAW2
+ * buckets are updated by crush_finalize(),
+ * crush_bucket_adjust_item_weight() and crush_reweight_bucket().
+ *
+ * @param recips the reciprocals to update
+ * @param weights the 16.16 fixed point weights
+ * @param size the size of the __recips__ and __weights__ arrays
+ */
+extern void crush_update_straw2_recips(struct crush_straw2_recip *recips,
+				       const __u32 *weights, __u32 size);
 /** @ingroup API
  *
  * Add __item__ to __bucket__ with __weight__. The weight of the new
@@ -249,7 +502,49 @@ extern int crush_bucket_adjust_item_weight(struct crush_map *map, struct crush_b
 extern int crush_reweight_bucket(struct crush_map *map, struct crush_bucket *bucket);
 /** @ingroup API
  *
- * Remove __bucket__ from __map__ and deallocate it via crush_destroy_bucket().
+ * Return the id of the bucket that holds __item__ and set __pos__, if
+ * not NULL, to the position of __item__ in the bucket. If __item__ is
+ * in more than one bucket, return the first one found in
+ * __map->buckets__.
+ *
+ * If the changes of __map__ are tracked (see crush_finalize()) and
+ * __item__ is in a single bucket, the bucket is known without going
+ * over the buckets of __map__.
+ *
+ * @param map the crush_map
+ * @param item the device or bucket to look for
+ * @param[out] pos the position of __item__ in the returned bucket or NULL
+ *
+ * @returns the id of the bucket (< 0) or 0 if __item__ is in no bucket
+ */
+extern int crush_get_parent(struct crush_map *map, int item, int *pos);
+/** @ingroup API
+ *
+ * Set the weight of __device__ to __weight__ with
+ * crush_bucket_adjust_item_weight() in every bucket that holds it and
+ * do the same for the weight of these buckets in their own parents,
+ * up to the roots of the hierarchy. If each of these items is in a
+ * single bucket and the changes of __map__ are tracked, the cost is
+ * proportional to the depth of __device__ in the hierarchy, as
+ * opposed to crush_reweight_bucket() which goes over all the items
+ * under a bucket.
+ *
+ * - return -EINVAL if __device__ or __weight__ is negative
+ * - return -ENOENT if __device__ is in no bucket
+ * - return -ERANGE if the weight of a bucket overflows, in which case
+ *   the buckets below it are already updated
+ *
+ * @param map the crush_map
+ * @param device the device to reweight
+ * @param weight the 16.16 fixed point weight of __device__
+ *
+ * @returns 0 on success, < 0 on error
+ */
+extern int crush_set_device_weight(struct crush_map *map, int device, int weight);
+/** @ingroup API
+ *
+ * Remove __bucket__ from __map__ and deallocate it via crush_destroy_bucket(),
+ * unless it is in the arena of __map__, see crush_create_arena().
  * __assert(3)__ that __bucket__ is in __map__. The caller is responsible for
  * making sure the bucket is not the child of any other bucket in the __map__.
  *
@@ -267,7 +562,7 @@ extern int crush_remove_bucket(struct crush_map *map, struct crush_bucket *bucke
  * - return -ENOMEM if the __bucket__ cannot be sized down with __realloc(3)__.
  * - return -1 if the value of __bucket->alg__ is unknown.
  *
- * @param map __unused__
+ * @param map the crush_map of __bucket__
  * @param bucket the bucket from which __item__ is removed
  * @param item the item to remove from __bucket__
  * @returns 0 on success, < 0 on error
@@ -291,6 +586,26 @@ crush_make_straw_bucket(struct crush_map *map,
 			int hash, int type, int size,
 			int *items,
 			int *weights);
+extern int crush_calc_straw(struct crush_map *map, struct crush_bucket_straw *bucket);
+/** @ingroup API
+ *
+ * Compute the straws of __bucket__ after the weight of the item at
+ * __idx__ was modified, or after it was appended, as
+ * crush_calc_straw() would. If the previous crush_calc_straw() or
+ * crush_calc_straw_item() of __map__ was for __bucket__, the items
+ * are not sorted again and the straws are computed in linear time.
+ *
+ * - return -EINVAL if __idx__ is not in the bucket
+ * - return -ENOMEM if __malloc(3)__ fails
+ *
+ * @param map the crush_map of __bucket__
+ * @param bucket a straw bucket
+ * @param idx the index of the modified item
+ *
+ * @returns 0 on success, < 0 on error
+ */
+extern int crush_calc_straw_item(struct crush_map *map,
+				 struct crush_bucket_straw *bucket, int idx);
 
 extern int crush_addition_is_unsafe(__u32 a, __u32 b);
 extern int crush_multiplication_is_unsafe(__u32  a, __u32 b);
@@ -0,0 +1,172 @@
+#include <errno.h>
+#include <stdlib.h>
+
+#include "cache.h"
+#include "hash.h"
+#include "mapper.h"
+
+/*
+ * Each entry is a sequence lock: its writer makes __seq__ odd, stores
+ * the key and the result and makes it even again. A reader copies
+ * the key and the result between two reads of __seq__ and retries
+ * nothing: if __seq__ changed, the entry is ignored. All the fields
+ * are accessed atomically so that a reader racing with a writer only
+ * sees a torn entry, which it does not use.
+ */
+struct crush_cache_entry {
+	__u32 seq;
+	__s32 ruleno;
+	__s32 x;
+	__s32 result_max;
+	__s32 len;
+	__u32 pad;
+	__u64 epoch;
+	__u64 generation;
+	__s32 result[];
+};
+
+struct crush_cache {
+	__u64 epoch;
+	int result_max;
+	size_t entry_size;
+	__u32 mask;	/* the number of entries minus one */
+	char *entries;
+};
+
+#define crush_cache_load(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#define crush_cache_store(p, v) __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+
+struct crush_cache *crush_cache_create(int result_max, size_t size)
+{
+	struct crush_cache *cache;
+	size_t entry_size, count;
+
+	if (result_max <= 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	entry_size = sizeof(struct crush_cache_entry) +
+		result_max * sizeof(__s32);
+	entry_size = (entry_size + 7) & ~(size_t)7;
+	if (size < sizeof(*cache) + entry_size) {
+		errno = EINVAL;
+		return NULL;
+	}
+	/* the largest power of two that fits */
+	count = 1;
+	while (count < 0x80000000UL &&
+	       sizeof(*cache) + count * 2 * entry_size <= size)
+		count *= 2;
+
+	cache = malloc(sizeof(*cache));
+	if (!cache) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	cache->entries = calloc(count, entry_size);
+	if (!cache->entries) {
+		free(cache);
+		errno = ENOMEM;
+		return NULL;
+	}
+	/* the entries that were never written are from epoch 0 */
+	cache->epoch = 1;
+	cache->result_max = result_max;
+	cache->entry_size = entry_size;
+	cache->mask = count - 1;
+	return cache;
+}
+
+void crush_cache_destroy(struct crush_cache *cache)
+{
+	free(cache->entries);
+	free(cache);
+}
+
+void crush_cache_invalidate(struct crush_cache *cache)
+{
+	__atomic_add_fetch(&cache->epoch, 1, __ATOMIC_RELEASE);
+}
+
+/* copy the result from e if it is there, return its length or -1 */
+static int crush_cache_get(struct crush_cache_entry *e, __u64 epoch,
+			   int ruleno, int x, int result_max,
+			   __u64 generation, int *result)
+{
+	__u32 seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+	int i, len;
+
+	if (seq & 1)
+		return -1;
+	if (crush_cache_load(&e->epoch) != epoch ||
+	    crush_cache_load(&e->x) != x ||
+	    crush_cache_load(&e->ruleno) != ruleno ||
+	    crush_cache_load(&e->result_max) != result_max ||
+	    crush_cache_load(&e->generation) != generation)
+		return -1;
+	len = crush_cache_load(&e->len);
+	if (len < 0 || len > result_max)
+		return -1;
+	for (i = 0; i < len; i++)
+		result[i] = crush_cache_load(&e->result[i]);
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (crush_cache_load(&e->seq) != seq)
+		return -1;
+	return len;
+}
+
+/* store the result in e unless another thread is writing it */
+static void crush_cache_put(struct crush_cache_entry *e, __u64 epoch,
+			    int ruleno, int x, int result_max,
+			    __u64 generation, const int *result, int len)
+{
+	__u32 seq = crush_cache_load(&e->seq);
+	int i;
+
+	if ((seq & 1) ||
+	    !__atomic_compare_exchange_n(&e->seq, &seq, seq + 1, 0,
+					 __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		return;
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	crush_cache_store(&e->epoch, epoch);
+	crush_cache_store(&e->ruleno, ruleno);
+	crush_cache_store(&e->x, x);
+	crush_cache_store(&e->result_max, result_max);
+	crush_cache_store(&e->generation, generation);
+	crush_cache_store(&e->len, len);
+	for (i = 0; i < len; i++)
+		crush_cache_store(&e->result[i], result[i]);
+	__atomic_store_n(&e->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+int crush_cache_do_rule(struct crush_cache *cache,
+			const struct crush_map *map,
+			int ruleno, int x, int *result, int result_max,
+			__u64 generation,
+			const __u32 *weights, int weight_max,
+			void *cwin,
+			const struct crush_choose_arg *choose_args)
+{
+	__u64 epoch = __atomic_load_n(&cache->epoch, __ATOMIC_ACQUIRE);
+	struct crush_cache_entry *e;
+	__u32 hash;
+	int len;
+
+	if (result_max <= 0 || result_max > cache->result_max)
+		return crush_do_rule(map, ruleno, x, result, result_max,
+				     weights, weight_max, cwin, choose_args);
+
+	hash = crush_hash32_4(CRUSH_HASH_RJENKINS1, x, ruleno,
+			      (__u32)generation, (__u32)(generation >> 32));
+	e = (struct crush_cache_entry *)(cache->entries +
+					 (hash & cache->mask) * cache->entry_size);
+	len = crush_cache_get(e, epoch, ruleno, x, result_max, generation,
+			      result);
+	if (len >= 0)
+		return len;
+	len = crush_do_rule(map, ruleno, x, result, result_max,
+			    weights, weight_max, cwin, choose_args);
+	crush_cache_put(e, epoch, ruleno, x, result_max, generation,
+			result, len);
+	return len;
+}
@@ -0,0 +1,90 @@
+#ifndef CEPH_CRUSH_CACHE_H
+#define CEPH_CRUSH_CACHE_H
+
+/*
+ * A cache of the results of crush_do_rule() shared by threads.
+ *
+ * LGPL2
+ */
+
+#include "crush.h"
+
+struct crush_cache;
+
+/** @ingroup API
+ *
+ * Allocate a cache of the results of crush_do_rule() that uses at
+ * most __size__ bytes, for results of at most __result_max__ items.
+ * The cache is direct mapped: an entry holds the result of one value
+ * and is replaced by the next value that hashes to it.
+ *
+ * The cache must be deallocated with crush_cache_destroy().
+ *
+ * - __errno__ is EINVAL if __result_max__ <= 0 or __size__ is too
+ *   small to hold a single entry
+ * - __errno__ is ENOMEM if __malloc(3)__ fails
+ *
+ * @param result_max the maximum number of items of a result
+ * @param size the size of the cache in bytes
+ *
+ * @returns the cache or NULL with __errno__ set on error
+ */
+extern struct crush_cache *crush_cache_create(int result_max, size_t size);
+
+/** @ingroup API
+ *
+ * Deallocate a cache returned by crush_cache_create().
+ *
+ * @param cache the cache to deallocate
+ */
+extern void crush_cache_destroy(struct crush_cache *cache);
+
+/** @ingroup API
+ *
+ * Forget all the results in __cache__ in constant time, for instance
+ * when a new epoch of the map is used. It can be called while other
+ * threads use the cache: they stop finding the results stored before
+ * the call once it returns.
+ *
+ * @param cache the cache
+ */
+extern void crush_cache_invalidate(struct crush_cache *cache);
+
+/** @ingroup API
+ *
+ * Map __x__ as crush_do_rule() would, unless the result for
+ * __ruleno__, __x__, __result_max__ and __generation__ is in __cache__
+ * since its last crush_cache_invalidate(). The __generation__ is
+ * chosen by the caller and must be different for each combination of
+ * __weights__ and __choose_args__ the values are mapped with.
+ *
+ * Any number of threads may call crush_cache_do_rule() at the same
+ * time with the same __cache__, each with its own __cwin__. It does not
+ * take any lock: a thread that finds an entry being written by
+ * another one maps __x__ with crush_do_rule() and does not wait.
+ *
+ * @param cache the cache
+ * @param map the crush_map
+ * @param ruleno a positive integer < __CRUSH_MAX_RULES__
+ * @param x the value to map to __result_max__ items
+ * @param result an array of items of size __result_max__
+ * @param result_max the size of the __result__ array, which is not
+ *        cached if larger than the __result_max__ given to
+ *        crush_cache_create()
+ * @param generation the generation of __weights__ and __choose_args__
+ * @param weights an array of weights of size __weight_max__
+ * @param weight_max the size of the __weights__ array
+ * @param cwin must be an char array initialized by crush_init_workspace
+ * @param choose_args weights and ids for each known bucket
+ *
+ * @return 0 on error or the size of __result__ on success
+ */
+extern int crush_cache_do_rule(struct crush_cache *cache,
+			       const struct crush_map *map,
+			       int ruleno, int x, int *result, int result_max,
+			       __u64 generation,
+			       const __u32 *weights, int weight_max,
+			       void *cwin,
+			       const struct crush_choose_arg *choose_args);
+
+#endif
@@ -0,0 +1,1294 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "builder.h"
+#include "compiler.h"
+#include "hash.h"
+
+/* device and bucket ids are bounded to keep the arrays indexed by them small */
+#define CRUSH_TEXT_MAX_ID (1 << 24)
+#define CRUSH_TEXT_MAX_TYPE 0xffff
+
+/* the mask.type of the rules */
+#define CRUSH_TEXT_RULE_REPLICATED 1
+#define CRUSH_TEXT_RULE_ERASURE 3
+
+struct crush_token {
+	const char *s;
+	int len;
+};
+
+/* open addressing hash table of the names found in the text */
+struct crush_name {
+	const char *s;
+	int len;
+	int value;
+};
+
+struct crush_names {
+	struct crush_name *table;
+	unsigned int size;		/* zero or a power of two */
+	unsigned int count;
+};
+
+struct crush_compiler {
+	const char *p;
+	const char *end;
+	int line;
+	struct crush_token tok;		/* the current token, empty at the end */
+	int tok_line;
+	char *error;
+	size_t error_len;
+
+	struct crush_map *map;
+	int has_buckets;
+
+	struct crush_names item_ids;	/* devices and buckets to their id */
+	struct crush_names type_ids;	/* types to their id */
+	struct crush_names rule_ids;	/* rules to their id */
+
+	/* the names and weights for the crush_text, indexed by id */
+	struct crush_token *device_names;
+	int device_names_size;
+	__u32 *device_weights;
+	int device_weights_size;
+	int max_devices;
+	struct crush_token *bucket_names;
+	int bucket_names_size;
+	struct crush_token *rule_names;
+	int rule_names_size;
+	struct crush_token *type_names;
+	int type_names_size;
+	int max_types;
+
+	/* the bucket and the rule being parsed */
+	int *items;
+	int items_size;
+	int *weights;
+	int weights_size;
+	int *positions;
+	int positions_size;
+	int *slots;
+	int slots_size;
+	struct crush_rule_step *steps;
+	int steps_size;
+};
+
+static const char *crush_algs[] = {
+	[CRUSH_BUCKET_UNIFORM] = "uniform",
+	[CRUSH_BUCKET_LIST] = "list",
+	[CRUSH_BUCKET_TREE] = "tree",
+	[CRUSH_BUCKET_STRAW] = "straw",
+	[CRUSH_BUCKET_STRAW2] = "straw2",
+};
+
+static const char *crush_tunables[] = {
+	"choose_local_tries",
+	"choose_local_fallback_tries",
+	"choose_total_tries",
+	"chooseleaf_descend_once",
+	"chooseleaf_vary_r",
+	"chooseleaf_stable",
+	"straw_calc_version",
+	"allowed_bucket_algs",
+};
+
+static const char *crush_set_steps[] = {
+	[CRUSH_RULE_SET_CHOOSE_TRIES] = "set_choose_tries",
+	[CRUSH_RULE_SET_CHOOSELEAF_TRIES] = "set_chooseleaf_tries",
+	[CRUSH_RULE_SET_CHOOSE_LOCAL_TRIES] = "set_choose_local_tries",
+	[CRUSH_RULE_SET_CHOOSE_LOCAL_FALLBACK_TRIES] = "set_choose_local_fallback_tries",
+	[CRUSH_RULE_SET_CHOOSELEAF_VARY_R] = "set_chooseleaf_vary_r",
+	[CRUSH_RULE_SET_CHOOSELEAF_STABLE] = "set_chooseleaf_stable",
+};
+
+#define CRUSH_ARRAY_SIZE(a) ((int)(sizeof(a) / sizeof((a)[0])))
+
+/** names **/
+
+static __u32 crush_name_hash(const char *s, int len)
+{
+	__u32 h = 2166136261u;		/* FNV-1a */
+
+	while (len-- > 0) {
+		h ^= (unsigned char)*s++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/* the slot of @s or the empty slot where it belongs */
+static struct crush_name *crush_names_slot(const struct crush_names *names,
+					   const char *s, int len)
+{
+	unsigned int mask = names->size - 1;
+	unsigned int i;
+
+	for (i = crush_name_hash(s, len) & mask; ; i = (i + 1) & mask) {
+		struct crush_name *n = &names->table[i];
+		if (n->s == NULL || (n->len == len && !memcmp(n->s, s, len)))
+			return n;
+	}
+}
+
+static int crush_names_find(const struct crush_names *names,
+			    const struct crush_token *t, int *value)
+{
+	struct crush_name *n;
+
+	if (names->count == 0)
+		return 0;
+	n = crush_names_slot(names, t->s, t->len);
+	if (n->s == NULL)
+		return 0;
+	if (value)
+		*value = n->value;
+	return 1;
+}
+
+static int crush_names_add(struct crush_names *names,
+			   const struct crush_token *t, int value)
+{
+	struct crush_name *n;
+
+	if (2 * (names->count + 1) > names->size) {
+		struct crush_names grown;
+		unsigned int i;
+
+		grown.size = names->size ? names->size * 2 : 64;
+		grown.count = names->count;
+		grown.table = calloc(grown.size, sizeof(struct crush_name));
+		if (!grown.table)
+			return -ENOMEM;
+		for (i = 0; i < names->size; i++) {
+			n = &names->table[i];
+			if (n->s)
+				*crush_names_slot(&grown, n->s, n->len) = *n;
+		}
+		free(names->table);
+		*names = grown;
+	}
+	n = crush_names_slot(names, t->s, t->len);
+	if (n->s)
+		return -EEXIST;
+	n->s = t->s;
+	n->len = t->len;
+	n->value = value;
+	names->count++;
+	return 0;
+}
+
+/*
+ * grow the array @*array of @*size elements of @elem bytes to at
+ * least @needed elements, the new elements being zero.
+ */
+static int crush_grow(void *array, int *size, int needed, size_t elem)
+{
+	void **a = (void **)array;
+	void *grown;
+	int new_size;
+
+	if (needed <= *size)
+		return 0;
+	new_size = *size ? *size : 16;
+	while (new_size < needed)
+		new_size *= 2;
+	grown = realloc(*a, new_size * elem);
+	if (!grown)
+		return -ENOMEM;
+	memset((char *)grown + *size * elem, 0, (new_size - *size) * elem);
+	*a = grown;
+	*size = new_size;
+	return 0;
+}
+
+/** tokens **/
+
+static int crush_is_blank(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+static int crush_is_delimiter(char c)
+{
+	return crush_is_blank(c) || c == '#' || c == '{' || c == '}';
+}
+
+static void crush_next(struct crush_compiler *c)
+{
+	const char *p = c->p;
+
+	for (;;) {
+		while (p < c->end && crush_is_blank(*p)) {
+			if (*p == '\n')
+				c->line++;
+			p++;
+		}
+		if (p < c->end && *p == '#') {
+			while (p < c->end && *p != '\n')
+				p++;
+			continue;
+		}
+		break;
+	}
+	c->tok.s = p;
+	c->tok_line = c->line;
+	if (p < c->end && (*p == '{' || *p == '}'))
+		p++;
+	else
+		while (p < c->end && !crush_is_delimiter(*p))
+			p++;
+	c->tok.len = p - c->tok.s;
+	c->p = p;
+}
+
+static int crush_is(const struct crush_token *t, const char *word)
+{
+	return (size_t)t->len == strlen(word) && !memcmp(t->s, word, t->len);
+}
+
+/* the index of @t in @words or -1 */
+static int crush_lookup(const struct crush_token *t,
+			const char **words, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		if (words[i] && crush_is(t, words[i]))
+			return i;
+	return -1;
+}
+
+static int crush_error(struct crush_compiler *c, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+static int crush_error(struct crush_compiler *c, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	if (c->error_len == 0)
+		return -EINVAL;
+	n = snprintf(c->error, c->error_len, "line %d: ", c->tok_line);
+	if (n >= 0 && (size_t)n < c->error_len) {
+		va_start(ap, fmt);
+		vsnprintf(c->error + n, c->error_len - n, fmt, ap);
+		va_end(ap);
+	}
+	return -EINVAL;
+}
+
+static int crush_unexpected(struct crush_compiler *c, const char *expected)
+{
+	if (c->tok.len == 0)
+		return crush_error(c, "expected %s, got the end of the text",
+				   expected);
+	return crush_error(c, "expected %s, got '%.*s'", expected,
+			   c->tok.len, c->tok.s);
+}
+
+static int crush_expect(struct crush_compiler *c, const char *word)
+{
+	char quoted[16];
+
+	if (!crush_is(&c->tok, word)) {
+		snprintf(quoted, sizeof(quoted), "'%s'", word);
+		return crush_unexpected(c, quoted);
+	}
+	crush_next(c);
+	return 0;
+}
+
+/* a name is a token that is not a brace */
+static int crush_name(struct crush_compiler *c, const char *what,
+		      struct crush_token *name)
+{
+	if (c->tok.len == 0 || crush_is(&c->tok, "{") || crush_is(&c->tok, "}"))
+		return crush_unexpected(c, what);
+	*name = c->tok;
+	crush_next(c);
+	return 0;
+}
+
+static int crush_parse_int(struct crush_compiler *c, const char *what,
+			   int min, int max, int *value)
+{
+	const char *s = c->tok.s;
+	long long v = 0;
+	int i = 0, negative = 0;
+
+	if (c->tok.len > 0 && s[0] == '-') {
+		negative = 1;
+		i = 1;
+	}
+	if (i == c->tok.len)
+		return crush_unexpected(c, what);
+	for (; i < c->tok.len; i++) {
+		if (s[i] < '0' || s[i] > '9')
+			return crush_unexpected(c, what);
+		v = v * 10 + s[i] - '0';
+		if (v > (long long)INT_MAX + 1)
+			break;
+	}
+	if (negative)
+		v = -v;
+	if (v < min || v > max)
+		return crush_error(c, "%s %.*s is not in [%d,%d]", what,
+				   c->tok.len, s, min, max);
+	*value = v;
+	crush_next(c);
+	return 0;
+}
+
+/* a decimal number rounded to the nearest 16.16 fixed point number */
+static int crush_parse_fixed(struct crush_compiler *c, const char *what,
+			     __u32 max, __u32 *value)
+{
+	const char *s = c->tok.s;
+	unsigned long long integer = 0, numerator = 0, denominator = 1, v;
+	int i = 0, digits = 0;
+
+	for (; i < c->tok.len && s[i] >= '0' && s[i] <= '9'; i++, digits++) {
+		integer = integer * 10 + s[i] - '0';
+		if (integer > 0x10000ull)
+			integer = 0x10000ull;	/* too large anyway */
+	}
+	if (i < c->tok.len && s[i] == '.') {
+		for (i++; i < c->tok.len && s[i] >= '0' && s[i] <= '9';
+		     i++, digits++) {
+			/* more digits do not change the rounding */
+			if (denominator < 1000000000000ull) {
+				numerator = numerator * 10 + s[i] - '0';
+				denominator *= 10;
+			}
+		}
+	}
+	if (digits == 0 || i != c->tok.len)
+		return crush_unexpected(c, what);
+	v = integer * 0x10000 + (numerator * 0x10000 + denominator / 2) / denominator;
+	if (v > max)
+		return crush_error(c, "%s %.*s is too large", what,
+				   c->tok.len, s);
+	*value = v;
+	crush_next(c);
+	return 0;
+}
+
+/** statements **/
+
+static int crush_parse_tunable(struct crush_compiler *c)
+{
+	struct crush_map *map = c->map;
+	int tunable, value, r;
+
+	crush_next(c);
+	tunable = crush_lookup(&c->tok, crush_tunables,
+			       CRUSH_ARRAY_SIZE(crush_tunables));
+	if (tunable < 0)
+		return crush_unexpected(c, "a tunable");
+	if (c->has_buckets)
+		return crush_error(c, "tunable %s must be set before the buckets",
+				   crush_tunables[tunable]);
+	crush_next(c);
+	r = crush_parse_int(c, crush_tunables[tunable], 0,
+			    tunable < 3 || tunable == 7 ? INT_MAX : 0xff,
+			    &value);
+	if (r)
+		return r;
+	switch (tunable) {
+	case 0: map->choose_local_tries = value; break;
+	case 1: map->choose_local_fallback_tries = value; break;
+	case 2: map->choose_total_tries = value; break;
+	case 3: map->chooseleaf_descend_once = value; break;
+	case 4: map->chooseleaf_vary_r = value; break;
+	case 5: map->chooseleaf_stable = value; break;
+	case 6: map->straw_calc_version = value; break;
+	case 7: map->allowed_bucket_algs = value; break;
+	}
+	return 0;
+}
+
+static int crush_parse_device(struct crush_compiler *c)
+{
+	struct crush_token name;
+	__u32 weight = 0x10000, offload;
+	int id, r;
+
+	crush_next(c);
+	r = crush_parse_int(c, "a device id", 0, CRUSH_TEXT_MAX_ID - 1, &id);
+	if (r)
+		return r;
+	if (id < c->device_names_size && c->device_names[id].s)
+		return crush_error(c, "device %d is already defined", id);
+	r = crush_name(c, "a device name", &name);
+	if (r)
+		return r;
+	if (crush_is(&c->tok, "down")) {
+		crush_next(c);
+		weight = 0;
+	} else if (crush_is(&c->tok, "offload")) {
+		crush_next(c);
+		r = crush_parse_fixed(c, "an offload", 0x10000, &offload);
+		if (r)
+			return r;
+		weight = 0x10000 - offload;
+	}
+
+	r = crush_names_add(&c->item_ids, &name, id);
+	if (r == -EEXIST)
+		return crush_error(c, "item %.*s is already defined",
+				   name.len, name.s);
+	if (r)
+		return r;
+	if (crush_grow(&c->device_names, &c->device_names_size, id + 1,
+		       sizeof(struct crush_token)) ||
+	    crush_grow(&c->device_weights, &c->device_weights_size, id + 1,
+		       sizeof(__u32)))
+		return -ENOMEM;
+	c->device_names[id] = name;
+	c->device_weights[id] = weight;
+	if (id >= c->max_devices)
+		c->max_devices = id + 1;
+	return 0;
+}
+
+static int crush_parse_type(struct crush_compiler *c)
+{
+	struct crush_token name;
+	int id, r;
+
+	crush_next(c);
+	r = crush_parse_int(c, "a type id", 0, CRUSH_TEXT_MAX_TYPE, &id);
+	if (r)
+		return r;
+	if (id < c->type_names_size && c->type_names[id].s)
+		return crush_error(c, "type %d is already defined", id);
+	r = crush_name(c, "a type name", &name);
+	if (r)
+		return r;
+	r = crush_names_add(&c->type_ids, &name, id);
+	if (r == -EEXIST)
+		return crush_error(c, "type %.*s is already defined",
+				   name.len, name.s);
+	if (r)
+		return r;
+	if (crush_grow(&c->type_names, &c->type_names_size, id + 1,
+		       sizeof(struct crush_token)))
+		return -ENOMEM;
+	c->type_names[id] = name;
+	if (id >= c->max_types)
+		c->max_types = id + 1;
+	return 0;
+}
+
+static int crush_parse_type_name(struct crush_compiler *c, int *type)
+{
+	if (c->tok.len == 0)
+		return crush_unexpected(c, "a type");
+	if (!crush_names_find(&c->type_ids, &c->tok, type)) {
+		if (!crush_is(&c->tok, "device") ||
+		    (c->type_names_size > 0 && c->type_names[0].s))
+			return crush_error(c, "type %.*s is not defined",
+					   c->tok.len, c->tok.s);
+		*type = 0;
+	}
+	crush_next(c);
+	return 0;
+}
+
+static int crush_parse_item_name(struct crush_compiler *c, int *item)
+{
+	if (c->tok.len == 0)
+		return crush_unexpected(c, "an item");
+	if (!crush_names_find(&c->item_ids, &c->tok, item))
+		return crush_error(c, "item %.*s is not defined",
+				   c->tok.len, c->tok.s);
+	crush_next(c);
+	return 0;
+}
+
+/* parse the item line at @index of the bucket being parsed */
+static int crush_parse_item(struct crush_compiler *c, int index)
+{
+	__u32 weight;
+	int item, pos = -1, r;
+
+	crush_next(c);
+	r = crush_parse_item_name(c, &item);
+	if (r)
+		return r;
+	weight = item >= 0 ? 0x10000 : c->map->buckets[-1-item]->weight;
+	for (;;) {
+		if (crush_is(&c->tok, "weight")) {
+			crush_next(c);
+			r = crush_parse_fixed(c, "a weight", UINT_MAX, &weight);
+		} else if (crush_is(&c->tok, "pos")) {
+			crush_next(c);
+			r = crush_parse_int(c, "a position", 0,
+					    CRUSH_TEXT_MAX_ID - 1, &pos);
+		} else {
+			break;
+		}
+		if (r)
+			return r;
+	}
+
+	if (crush_grow(&c->items, &c->items_size, index + 1, sizeof(int)) ||
+	    crush_grow(&c->weights, &c->weights_size, index + 1, sizeof(int)) ||
+	    crush_grow(&c->positions, &c->positions_size, index + 1, sizeof(int)) ||
+	    crush_grow(&c->slots, &c->slots_size, index + 1, sizeof(int)))
+		return -ENOMEM;
+	c->items[index] = item;
+	c->weights[index] = weight;
+	c->positions[index] = pos;
+	return 0;
+}
+
+/*
+ * move the items of the bucket being parsed to their position, the
+ * items without a position filling the others in order.
+ */
+static int crush_place_items(struct crush_compiler *c,
+			     const struct crush_token *name, int size)
+{
+	int i, j, placed = 0;
+
+	for (i = 0; i < size; i++)
+		c->slots[i] = -1;
+	for (i = 0; i < size; i++) {
+		int pos = c->positions[i];
+		if (pos < 0)
+			continue;
+		if (pos >= size)
+			return crush_error(c, "pos %d is not lower than the size %d of bucket %.*s",
+					   pos, size, name->len, name->s);
+		if (c->slots[pos] >= 0)
+			return crush_error(c, "pos %d is used twice in bucket %.*s",
+					   pos, name->len, name->s);
+		c->slots[pos] = i;
+		placed++;
+	}
+	if (placed == 0)
+		return 0;
+	for (i = 0, j = 0; i < size; i++) {
+		if (c->positions[i] >= 0)
+			continue;
+		while (c->slots[j] >= 0)
+			j++;
+		c->slots[j] = i;
+	}
+	/* the positions are no longer needed: reuse them for the weights */
+	for (i = 0; i < size; i++)
+		c->positions[i] = c->weights[c->slots[i]];
+	memcpy(c->weights, c->positions, sizeof(int) * size);
+	for (i = 0; i < size; i++)
+		c->positions[i] = c->items[c->slots[i]];
+	memcpy(c->items, c->positions, sizeof(int) * size);
+	return 0;
+}
+
+static int crush_parse_bucket(struct crush_compiler *c, int type)
+{
+	struct crush_token name;
+	struct crush_bucket *b;
+	unsigned long long weight = 0;
+	int id = 0, alg = 0, hash = CRUSH_HASH_DEFAULT, size = 0, i, r;
+
+	crush_next(c);
+	r = crush_name(c, "a bucket name", &name);
+	if (r)
+		return r;
+	if (crush_names_find(&c->item_ids, &name, NULL))
+		return crush_error(c, "item %.*s is already defined",
+				   name.len, name.s);
+	r = crush_expect(c, "{");
+	if (r)
+		return r;
+	while (!crush_is(&c->tok, "}")) {
+		if (crush_is(&c->tok, "id")) {
+			crush_next(c);
+			r = crush_parse_int(c, "a bucket id", -CRUSH_TEXT_MAX_ID,
+					    -1, &id);
+		} else if (crush_is(&c->tok, "alg")) {
+			crush_next(c);
+			alg = crush_lookup(&c->tok, crush_algs,
+					   CRUSH_ARRAY_SIZE(crush_algs));
+			if (alg < 0)
+				return crush_unexpected(c, "a bucket alg");
+			crush_next(c);
+		} else if (crush_is(&c->tok, "hash")) {
+			crush_next(c);
+			if (crush_is(&c->tok, "rjenkins1")) {
+				hash = CRUSH_HASH_RJENKINS1;
+				crush_next(c);
+			} else if (crush_is(&c->tok, "xxhash32")) {
+				hash = CRUSH_HASH_XXHASH32;
+				crush_next(c);
+			} else {
+				r = crush_parse_int(c, "a hash",
+						    CRUSH_HASH_RJENKINS1,
+						    CRUSH_HASH_XXHASH32,
+						    &hash);
+			}
+		} else if (crush_is(&c->tok, "item")) {
+			r = crush_parse_item(c, size++);
+		} else {
+			return crush_unexpected(c, "id, alg, hash, item or '}'");
+		}
+		if (r)
+			return r;
+	}
+
+	if (alg == 0)
+		return crush_error(c, "bucket %.*s has no alg",
+				   name.len, name.s);
+	r = crush_place_items(c, &name, size);
+	if (r)
+		return r;
+	for (i = 0; i < size; i++) {
+		if (alg == CRUSH_BUCKET_UNIFORM && c->weights[i] != c->weights[0])
+			return crush_error(c, "the items of uniform bucket %.*s do not have the same weight",
+					   name.len, name.s);
+		weight += (__u32)c->weights[i];
+	}
+	if (weight > UINT_MAX)
+		return crush_error(c, "the weight of bucket %.*s is too large",
+				   name.len, name.s);
+
+	b = crush_make_bucket(c->map, alg, hash, type, size,
+			      c->items, c->weights);
+	if (!b)
+		return -ENOMEM;
+	r = crush_add_bucket(c->map, id, b, &id);
+	if (r) {
+		crush_destroy_bucket(b);
+		if (r == -EEXIST)
+			return crush_error(c, "bucket id %d is already used", id);
+		return r;
+	}
+	c->has_buckets = 1;
+	r = crush_names_add(&c->item_ids, &name, id);
+	if (r)
+		return r;
+	if (crush_grow(&c->bucket_names, &c->bucket_names_size, -id,
+		       sizeof(struct crush_token)))
+		return -ENOMEM;
+	c->bucket_names[-1-id] = name;
+	crush_next(c);
+	return 0;
+}
+
+/* parse the step at @index of the rule being parsed */
+static int crush_parse_step(struct crush_compiler *c, int index)
+{
+	struct crush_rule_step step = { 0, 0, 0 };
+	int op, r;
+
+	if (crush_grow(&c->steps, &c->steps_size, index + 1,
+		       sizeof(struct crush_rule_step)))
+		return -ENOMEM;
+	crush_next(c);
+	if (crush_is(&c->tok, "take")) {
+		crush_next(c);
+		step.op = CRUSH_RULE_TAKE;
+		r = crush_parse_item_name(c, &step.arg1);
+	} else if (crush_is(&c->tok, "emit")) {
+		crush_next(c);
+		step.op = CRUSH_RULE_EMIT;
+		r = 0;
+	} else if (crush_is(&c->tok, "noop")) {
+		crush_next(c);
+		step.op = CRUSH_RULE_NOOP;
+		r = 0;
+	} else if (crush_is(&c->tok, "choose") ||
+		   crush_is(&c->tok, "chooseleaf")) {
+		int leaf = crush_is(&c->tok, "chooseleaf");
+		crush_next(c);
+		if (crush_is(&c->tok, "firstn"))
+			step.op = leaf ? CRUSH_RULE_CHOOSELEAF_FIRSTN :
+				CRUSH_RULE_CHOOSE_FIRSTN;
+		else if (crush_is(&c->tok, "indep"))
+			step.op = leaf ? CRUSH_RULE_CHOOSELEAF_INDEP :
+				CRUSH_RULE_CHOOSE_INDEP;
+		else
+			return crush_unexpected(c, "firstn or indep");
+		crush_next(c);
+		r = crush_parse_int(c, "a number of items", -INT_MAX, INT_MAX,
+				    &step.arg1);
+		if (!r)
+			r = crush_expect(c, "type");
+		if (!r)
+			r = crush_parse_type_name(c, &step.arg2);
+	} else {
+		op = crush_lookup(&c->tok, crush_set_steps,
+				  CRUSH_ARRAY_SIZE(crush_set_steps));
+		if (op < 0)
+			return crush_unexpected(c, "a step");
+		crush_next(c);
+		step.op = op;
+		r = crush_parse_int(c, crush_set_steps[op], 0, INT_MAX,
+				    &step.arg1);
+	}
+	c->steps[index] = step;
+	return r;
+}
+
+static int crush_parse_rule(struct crush_compiler *c)
+{
+	struct crush_map *map = c->map;
+	struct crush_token name = { NULL, 0 };
+	struct crush_rule *rule;
+	int id = -1, ruleset = -1, type = -1, min_size = -1, max_size = -1;
+	int len = 0, r = 0;
+
+	crush_next(c);
+	if (!crush_is(&c->tok, "{")) {
+		r = crush_name(c, "a rule name", &name);
+		if (r)
+			return r;
+		if (crush_names_find(&c->rule_ids, &name, NULL))
+			return crush_error(c, "rule %.*s is already defined",
+					   name.len, name.s);
+	}
+	r = crush_expect(c, "{");
+	if (r)
+		return r;
+	while (!crush_is(&c->tok, "}")) {
+		if (crush_is(&c->tok, "id")) {
+			crush_next(c);
+			r = crush_parse_int(c, "a rule id", 0,
+					    CRUSH_MAX_RULES - 1, &id);
+		} else if (crush_is(&c->tok, "ruleset") ||
+			   crush_is(&c->tok, "pool")) {
+			crush_next(c);
+			r = crush_parse_int(c, "a ruleset", 0, 0xff, &ruleset);
+		} else if (crush_is(&c->tok, "type")) {
+			crush_next(c);
+			if (crush_is(&c->tok, "replicated")) {
+				crush_next(c);
+				type = CRUSH_TEXT_RULE_REPLICATED;
+			} else if (crush_is(&c->tok, "erasure")) {
+				crush_next(c);
+				type = CRUSH_TEXT_RULE_ERASURE;
+			} else {
+				r = crush_parse_int(c, "a rule type", 0, 0xff,
+						    &type);
+			}
+		} else if (crush_is(&c->tok, "min_size")) {
+			crush_next(c);
+			r = crush_parse_int(c, "a min_size", 0, 0xff, &min_size);
+		} else if (crush_is(&c->tok, "max_size")) {
+			crush_next(c);
+			r = crush_parse_int(c, "a max_size", 0, 0xff, &max_size);
+		} else if (crush_is(&c->tok, "step")) {
+			r = crush_parse_step(c, len++);
+		} else {
+			return crush_unexpected(c, "id, ruleset, type, min_size, max_size, step or '}'");
+		}
+		if (r)
+			return r;
+	}
+
+	if (ruleset < 0)
+		return crush_error(c, "rule has no ruleset");
+	if (type < 0)
+		return crush_error(c, "rule has no type");
+	if (min_size < 0)
+		return crush_error(c, "rule has no min_size");
+	if (max_size < 0)
+		return crush_error(c, "rule has no max_size");
+	if (id < 0) {
+		for (id = 0; id < (int)map->max_rules; id++)
+			if (map->rules[id] == NULL)
+				break;
+		if (id >= CRUSH_MAX_RULES)
+			return crush_error(c, "there are more than %d rules",
+					   CRUSH_MAX_RULES);
+	} else if (id < (int)map->max_rules && map->rules[id]) {
+		return crush_error(c, "rule id %d is already used", id);
+	}
+
+	rule = crush_make_rule(len, ruleset, type, min_size, max_size);
+	if (!rule)
+		return -ENOMEM;
+	if (len)
+		memcpy(rule->steps, c->steps,
+		       sizeof(struct crush_rule_step) * len);
+	r = crush_add_rule(map, rule, id);
+	if (r < 0) {
+		crush_destroy_rule(rule);
+		return r;
+	}
+	if (name.s) {
+		r = crush_names_add(&c->rule_ids, &name, id);
+		if (r)
+			return r;
+		if (crush_grow(&c->rule_names, &c->rule_names_size, id + 1,
+			       sizeof(struct crush_token)))
+			return -ENOMEM;
+		c->rule_names[id] = name;
+	}
+	crush_next(c);
+	return 0;
+}
+
+static int crush_parse_statement(struct crush_compiler *c)
+{
+	int type;
+
+	if (crush_is(&c->tok, "tunable"))
+		return crush_parse_tunable(c);
+	if (crush_is(&c->tok, "device"))
+		return crush_parse_device(c);
+	if (crush_is(&c->tok, "type"))
+		return crush_parse_type(c);
+	if (crush_is(&c->tok, "rule"))
+		return crush_parse_rule(c);
+	if (crush_names_find(&c->type_ids, &c->tok, &type))
+		return crush_parse_bucket(c, type);
+	return crush_unexpected(c, "tunable, device, type, rule or a bucket type");
+}
+
+/** crush_text **/
+
+static size_t crush_names_size(const struct crush_token *names, int count)
+{
+	size_t size = 0;
+	int i;
+
+	for (i = 0; i < count; i++)
+		if (names[i].s)
+			size += names[i].len + 1;
+	return size;
+}
+
+static char *crush_names_copy(char **dst, const struct crush_token *names,
+			      int count, char *strings)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (!names[i].s)
+			continue;
+		dst[i] = strings;
+		memcpy(strings, names[i].s, names[i].len);
+		strings[names[i].len] = '\0';
+		strings += names[i].len + 1;
+	}
+	return strings;
+}
+
+/* a crush_text in a single allocation, pointer arrays first */
+static struct crush_text *crush_make_text(struct crush_compiler *c)
+{
+	struct crush_map *map = c->map;
+	struct crush_text *t;
+	int max_devices = c->max_devices;
+	int bucket_names = c->bucket_names_size < map->max_buckets ?
+		c->bucket_names_size : map->max_buckets;
+	int rule_names = c->rule_names_size < (int)map->max_rules ?
+		c->rule_names_size : (int)map->max_rules;
+	size_t pointers, size;
+	char *strings;
+
+	if (map->max_devices > max_devices)
+		max_devices = map->max_devices;
+	pointers = max_devices + map->max_buckets + map->max_rules + c->max_types;
+	size = sizeof(*t) + sizeof(char *) * pointers +
+		sizeof(__u32) * max_devices +
+		crush_names_size(c->device_names, c->max_devices) +
+		crush_names_size(c->bucket_names, bucket_names) +
+		crush_names_size(c->rule_names, rule_names) +
+		crush_names_size(c->type_names, c->max_types);
+	t = calloc(1, size);
+	if (!t)
+		return NULL;
+
+	t->map = map;
+	t->max_devices = max_devices;
+	t->max_types = c->max_types;
+	t->device_names = (char **)(t + 1);
+	t->bucket_names = t->device_names + max_devices;
+	t->rule_names = t->bucket_names + map->max_buckets;
+	t->type_names = t->rule_names + map->max_rules;
+	t->device_weights = (__u32 *)(t->type_names + c->max_types);
+	if (c->max_devices)
+		memcpy(t->device_weights, c->device_weights,
+		       sizeof(__u32) * c->max_devices);
+	strings = (char *)(t->device_weights + max_devices);
+	strings = crush_names_copy(t->device_names, c->device_names,
+				   c->max_devices, strings);
+	strings = crush_names_copy(t->bucket_names, c->bucket_names,
+				   bucket_names, strings);
+	strings = crush_names_copy(t->rule_names, c->rule_names,
+				   rule_names, strings);
+	strings = crush_names_copy(t->type_names, c->type_names,
+				   c->max_types, strings);
+	return t;
+}
+
+struct crush_text *crush_compile(const char *text, size_t len,
+				 char *error, size_t error_len)
+{
+	struct crush_compiler c;
+	struct crush_text *t = NULL;
+	int r = 0;
+
+	memset(&c, 0, sizeof(c));
+	c.p = text;
+	c.end = text + len;
+	c.line = 1;
+	c.error = error;
+	c.error_len = error ? error_len : 0;
+	if (c.error_len)
+		error[0] = '\0';
+
+	c.map = crush_create();
+	if (!c.map)
+		r = -ENOMEM;
+	if (!r)
+		crush_next(&c);
+	while (!r && c.tok.len > 0)
+		r = crush_parse_statement(&c);
+	if (!r) {
+		crush_finalize(c.map);
+		t = crush_make_text(&c);
+		if (!t)
+			r = -ENOMEM;
+	}
+
+	free(c.item_ids.table);
+	free(c.type_ids.table);
+	free(c.rule_ids.table);
+	free(c.device_names);
+	free(c.device_weights);
+	free(c.bucket_names);
+	free(c.rule_names);
+	free(c.type_names);
+	free(c.items);
+	free(c.weights);
+	free(c.positions);
+	free(c.slots);
+	free(c.steps);
+	if (r) {
+		if (c.map)
+			crush_destroy(c.map);
+		errno = -r;
+	}
+	return t;
+}
+
+void crush_destroy_text(struct crush_text *text)
+{
+	if (text->map)
+		crush_destroy(text->map);
+	free(text);
+}
+
+/** decompiler **/
+
+struct crush_printer {
+	char *buf;
+	size_t len;
+	size_t size;
+	int error;
+};
+
+static void crush_print(struct crush_printer *p, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+static void crush_print(struct crush_printer *p, const char *fmt, ...)
+{
+	va_list ap;
+	size_t size;
+	char *grown;
+	int n;
+
+	while (!p->error) {
+		va_start(ap, fmt);
+		n = vsnprintf(p->buf + p->len, p->size - p->len, fmt, ap);
+		va_end(ap);
+		if (n < 0) {
+			p->error = -EINVAL;
+		} else if (p->len + n < p->size) {
+			p->len += n;
+			return;
+		} else {
+			size = p->size * 2;
+			if (size <= p->len + n)
+				size = p->len + n + 1;
+			grown = realloc(p->buf, size);
+			if (grown) {
+				p->buf = grown;
+				p->size = size;
+			} else {
+				p->error = -ENOMEM;
+			}
+		}
+	}
+}
+
+static void crush_print_item(struct crush_printer *p,
+			     const struct crush_text *t, int item)
+{
+	if (item >= 0) {
+		if (t->device_names && item < t->max_devices &&
+		    t->device_names[item])
+			crush_print(p, "%s", t->device_names[item]);
+		else
+			crush_print(p, "device%d", item);
+	} else {
+		if (t->bucket_names && -1-item < t->map->max_buckets &&
+		    t->bucket_names[-1-item])
+			crush_print(p, "%s", t->bucket_names[-1-item]);
+		else
+			crush_print(p, "bucket%d", -1-item);
+	}
+}
+
+static void crush_print_type(struct crush_printer *p,
+			     const struct crush_text *t, int type)
+{
+	if (t->type_names && type >= 0 && type < t->max_types &&
+	    t->type_names[type])
+		crush_print(p, "%s", t->type_names[type]);
+	else
+		crush_print(p, "type%d", type);
+}
+
+static void crush_print_fixed(struct crush_printer *p, __u32 value)
+{
+	/* five decimals tell apart all 16.16 fixed point numbers */
+	crush_print(p, "%.5f", (double)value / 0x10000);
+}
+
+/* print the children of bucket @b before @b, once */
+static int crush_print_bucket(struct crush_printer *p,
+			      const struct crush_text *t, int b, char *done)
+{
+	const struct crush_map *map = t->map;
+	const struct crush_bucket *bucket = map->buckets[b];
+	__u32 i;
+	int r;
+
+	if (bucket == NULL || done[b])
+		return 0;
+	done[b] = 1;
+	for (i = 0; i < bucket->size; i++) {
+		int item = bucket->items[i];
+		if (item < 0 && -1-item < map->max_buckets) {
+			r = crush_print_bucket(p, t, -1-item, done);
+			if (r)
+				return r;
+		}
+	}
+	if (bucket->alg >= CRUSH_ARRAY_SIZE(crush_algs) ||
+	    crush_algs[bucket->alg] == NULL)
+		return -EINVAL;
+
+	crush_print_type(p, t, bucket->type);
+	crush_print(p, " ");
+	crush_print_item(p, t, bucket->id);
+	crush_print(p, " {\n\tid %d\n\talg %s\n\thash %d\t# %s\n",
+		    bucket->id, crush_algs[bucket->alg], bucket->hash,
+		    crush_hash_name(bucket->hash));
+	for (i = 0; i < bucket->size; i++) {
+		crush_print(p, "\titem ");
+		crush_print_item(p, t, bucket->items[i]);
+		crush_print(p, " weight ");
+		crush_print_fixed(p, crush_get_bucket_item_weight(bucket, i));
+		crush_print(p, "\n");
+	}
+	crush_print(p, "}\n");
+	return 0;
+}
+
+static int crush_step_has_type(__u32 op)
+{
+	return op == CRUSH_RULE_CHOOSE_FIRSTN ||
+		op == CRUSH_RULE_CHOOSE_INDEP ||
+		op == CRUSH_RULE_CHOOSELEAF_FIRSTN ||
+		op == CRUSH_RULE_CHOOSELEAF_INDEP;
+}
+
+static int crush_print_rule(struct crush_printer *p,
+			    const struct crush_text *t, int ruleno)
+{
+	const struct crush_rule *rule = t->map->rules[ruleno];
+	__u32 i;
+
+	if (t->rule_names && t->rule_names[ruleno])
+		crush_print(p, "rule %s {\n", t->rule_names[ruleno]);
+	else
+		crush_print(p, "rule {\n");
+	crush_print(p, "\tid %d\n\truleset %d\n", ruleno, rule->mask.ruleset);
+	if (rule->mask.type == CRUSH_TEXT_RULE_REPLICATED)
+		crush_print(p, "\ttype replicated\n");
+	else if (rule->mask.type == CRUSH_TEXT_RULE_ERASURE)
+		crush_print(p, "\ttype erasure\n");
+	else
+		crush_print(p, "\ttype %d\n", rule->mask.type);
+	crush_print(p, "\tmin_size %d\n\tmax_size %d\n",
+		    rule->mask.min_size, rule->mask.max_size);
+	for (i = 0; i < rule->len; i++) {
+		const struct crush_rule_step *s = &rule->steps[i];
+		switch (s->op) {
+		case CRUSH_RULE_NOOP:
+			crush_print(p, "\tstep noop\n");
+			break;
+		case CRUSH_RULE_TAKE:
+			crush_print(p, "\tstep take ");
+			crush_print_item(p, t, s->arg1);
+			crush_print(p, "\n");
+			break;
+		case CRUSH_RULE_EMIT:
+			crush_print(p, "\tstep emit\n");
+			break;
+		case CRUSH_RULE_CHOOSE_FIRSTN:
+		case CRUSH_RULE_CHOOSE_INDEP:
+		case CRUSH_RULE_CHOOSELEAF_FIRSTN:
+		case CRUSH_RULE_CHOOSELEAF_INDEP:
+			/* keep in sync with crush_step_has_type() */
+			crush_print(p, "\tstep %s %s %d type ",
+				    s->op == CRUSH_RULE_CHOOSE_FIRSTN ||
+				    s->op == CRUSH_RULE_CHOOSE_INDEP ?
+				    "choose" : "chooseleaf",
+				    s->op == CRUSH_RULE_CHOOSE_FIRSTN ||
+				    s->op == CRUSH_RULE_CHOOSELEAF_FIRSTN ?
+				    "firstn" : "indep", s->arg1);
+			crush_print_type(p, t, s->arg2);
+			crush_print(p, "\n");
+			break;
+		default:
+			if (s->op >= (__u32)CRUSH_ARRAY_SIZE(crush_set_steps) ||
+			    crush_set_steps[s->op] == NULL)
+				return -EINVAL;
+			crush_print(p, "\tstep %s %d\n", crush_set_steps[s->op],
+				    s->arg1);
+			break;
+		}
+	}
+	crush_print(p, "}\n");
+	return 0;
+}
+
+int crush_decompile(const struct crush_text *t, char **buf, size_t *len)
+{
+	const struct crush_map *map = t->map;
+	struct crush_printer p;
+	char *done = NULL, *devices = NULL, *types = NULL;
+	int max_devices = t->max_devices > map->max_devices ?
+		t->max_devices : map->max_devices;
+	int b, i, r = 0;
+	__u32 j;
+
+	memset(&p, 0, sizeof(p));
+	p.size = 4096;
+	p.buf = malloc(p.size);
+	done = calloc(map->max_buckets + 1, 1);
+	devices = calloc(max_devices + 1, 1);
+	types = calloc(CRUSH_TEXT_MAX_TYPE + 1, 1);
+	if (!p.buf || !done || !devices || !types) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	/* the devices and the types that need to be defined */
+	for (i = 0; i < max_devices; i++)
+		devices[i] = t->device_names && i < t->max_devices &&
+			t->device_names[i];
+	for (i = 0; i < t->max_types; i++)
+		types[i] = t->type_names && t->type_names[i];
+	for (b = 0; b < map->max_buckets; b++) {
+		const struct crush_bucket *bucket = map->buckets[b];
+		if (bucket == NULL)
+			continue;
+		types[bucket->type] = 1;
+		for (j = 0; j < bucket->size; j++)
+			if (bucket->items[j] >= 0 &&
+			    bucket->items[j] < max_devices)
+				devices[bucket->items[j]] = 1;
+	}
+	for (b = 0; b < (int)map->max_rules; b++) {
+		const struct crush_rule *rule = map->rules[b];
+		if (rule == NULL)
+			continue;
+		for (j = 0; j < rule->len; j++)
+			if (crush_step_has_type(rule->steps[j].op) &&
+			    (__u32)rule->steps[j].arg2 <= CRUSH_TEXT_MAX_TYPE)
+				types[rule->steps[j].arg2] = 1;
+	}
+
+	crush_print(&p, "# begin crush map\n");
+	crush_print(&p, "tunable choose_local_tries %u\n",
+		    map->choose_local_tries);
+	crush_print(&p, "tunable choose_local_fallback_tries %u\n",
+		    map->choose_local_fallback_tries);
+	crush_print(&p, "tunable choose_total_tries %u\n",
+		    map->choose_total_tries);
+	crush_print(&p, "tunable chooseleaf_descend_once %u\n",
+		    map->chooseleaf_descend_once);
+	crush_print(&p, "tunable chooseleaf_vary_r %u\n",
+		    map->chooseleaf_vary_r);
+	crush_print(&p, "tunable chooseleaf_stable %u\n",
+		    map->chooseleaf_stable);
+	crush_print(&p, "tunable straw_calc_version %u\n",
+		    map->straw_calc_version);
+	crush_print(&p, "tunable allowed_bucket_algs %u\n",
+		    map->allowed_bucket_algs);
+
+	crush_print(&p, "\n# devices\n");
+	for (i = 0; i < max_devices; i++) {
+		__u32 weight = 0x10000;
+		if (!devices[i])
+			continue;
+		if (t->device_weights && i < t->max_devices)
+			weight = t->device_weights[i];
+		crush_print(&p, "device %d ", i);
+		crush_print_item(&p, t, i);
+		if (weight == 0) {
+			crush_print(&p, " down");
+		} else if (weight < 0x10000) {
+			crush_print(&p, " offload ");
+			crush_print_fixed(&p, 0x10000 - weight);
+		}
+		crush_print(&p, "\n");
+	}
+
+	crush_print(&p, "\n# types\n");
+	for (i = 0; i <= CRUSH_TEXT_MAX_TYPE; i++) {
+		if (!types[i])
+			continue;
+		crush_print(&p, "type %d ", i);
+		crush_print_type(&p, t, i);
+		crush_print(&p, "\n");
+	}
+
+	crush_print(&p, "\n# buckets\n");
+	for (b = 0; b < map->max_buckets && !r; b++)
+		r = crush_print_bucket(&p, t, b, done);
+
+	crush_print(&p, "\n# rules\n");
+	for (b = 0; b < (int)map->max_rules && !r; b++)
+		if (map->rules[b])
+			r = crush_print_rule(&p, t, b);
+	crush_print(&p, "\n# end crush map\n");
+	if (!r)
+		r = p.error;
+
+out:
+	free(done);
+	free(devices);
+	free(types);
+	if (r) {
+		free(p.buf);
+		return r;
+	}
+	*buf = p.buf;
+	*len = p.len;
+	return 0;
+}
@@ -0,0 +1,129 @@
+#ifndef CEPH_CRUSH_COMPILER_H
+#define CEPH_CRUSH_COMPILER_H
+
+/*
+ * Text representation of a crush_map, as documented in sample.txt.
+ *
+ * LGPL2
+ */
+
+#include "crush.h"
+
+/*
+ * The text is a sequence of statements separated by blanks, a #
+ * starting a comment that ends with the line:
+ *
+ *     tunable <name> <value>
+ *     device <id> <name> [down | offload <fraction>]
+ *     type <id> <name>
+ *     <type> <name> {
+ *             [id <negative id>]
+ *             alg uniform | list | tree | straw | straw2
+ *             [hash 0 | rjenkins1 | 1 | xxhash32]
+ *             item <name> [weight <weight>] [pos <position>]
+ *             ...
+ *     }
+ *     rule [<name>] {
+ *             [id <rule id>]
+ *             ruleset | pool <ruleset>
+ *             type replicated | erasure | <type>
+ *             min_size <size>
+ *             max_size <size>
+ *             step take <name>
+ *             step choose | chooseleaf firstn | indep <n> type <type>
+ *             step emit
+ *             step noop
+ *             step set_choose_tries | set_chooseleaf_tries |
+ *                  set_choose_local_tries | set_choose_local_fallback_tries |
+ *                  set_chooseleaf_vary_r | set_chooseleaf_stable <value>
+ *             ...
+ *     }
+ *
+ * The tunables must come before the buckets, a bucket must be defined
+ * before it is used as an item and the type 0 is named "device" unless
+ * it is given another name. The weights are decimal numbers converted
+ * to 16.16 fixed point, an item weighs 1.0 if it is a device and the
+ * weight of the bucket otherwise. The items given a position are
+ * stored at this position in the bucket and the others fill the
+ * remaining positions in order. A bucket without an id is given the
+ * lowest id that is not used when it is defined.
+ */
+
+/** @ingroup API
+ *
+ * A crush_map and what its text representation holds that the map
+ * does not: the names of the items, types and rules and the weights
+ * of the devices to be given to crush_do_rule(). A NULL name is not
+ * defined.
+ */
+struct crush_text {
+	struct crush_map *map;
+	/*! the size of __device_weights__ and __device_names__ */
+	int max_devices;
+	/*! 16.16 fixed point weight of each device, 0 if not defined */
+	__u32 *device_weights;
+	char **device_names;
+	/*! __map->max_buckets__ names, the bucket __id__ is at __-1-id__ */
+	char **bucket_names;
+	/*! __map->max_rules__ names */
+	char **rule_names;
+	/*! the size of __type_names__ */
+	int max_types;
+	char **type_names;
+};
+
+/** @ingroup API
+ *
+ * Compile the __len__ characters of __text__ into a finalized
+ * crush_map in a single pass. The items of each bucket are collected
+ * before the bucket is created, with all its arrays allocated at once.
+ *
+ * The returned crush_text must be deallocated with crush_destroy_text().
+ *
+ * - __errno__ is ENOMEM if __malloc(3)__ fails
+ * - __errno__ is EINVAL if __text__ is not valid and __error__ is set to
+ *   a message saying why, starting with the number of the line
+ *
+ * @param[in] text the text representation of the map
+ * @param[in] len the number of characters in __text__
+ * @param[out] error a buffer for the error message or NULL
+ * @param[in] error_len the size of __error__
+ *
+ * @returns the compiled map or NULL with __errno__ set on error
+ */
+extern struct crush_text *crush_compile(const char *text, size_t len,
+					char *error, size_t error_len);
+
+/** @ingroup API
+ *
+ * Write the text representation of __text->map__ in the __buf__
+ * __malloc(3)__ buffer, which is NUL terminated. All the members of
+ * __text__ other than __map__ may be zero: items, types and rules
+ * that have no name are given one made of their kind and their
+ * number (device2, bucket1, type3) and the devices without a weight
+ * are not down. Compiling the text gives the same map.
+ *
+ * The caller is responsible for deallocating __buf__ via __free(3)__.
+ *
+ * - return -ENOMEM if __malloc(3)__ fails
+ * - return -EINVAL if the map has an unknown bucket algorithm or rule step
+ *
+ * @param[in] text the map and its names
+ * @param[out] buf the text representation
+ * @param[out] len the number of characters in __buf__ without the NUL
+ *
+ * @returns 0 on success, < 0 on error
+ */
+extern int crush_decompile(const struct crush_text *text,
+			   char **buf, size_t *len);
+
+/** @ingroup API
+ *
+ * Deallocate a crush_text returned by crush_compile() and its map,
+ * unless __text->map__ was set to NULL to keep it.
+ *
+ * @param text the crush_text to deallocate
+ */
+extern void crush_destroy_text(struct crush_text *text);
+
+#endif
@@ -57,6 +57,10 @@
 /* Define to 1 if you have the <linux/types.h> header file. */
 #cmakedefine HAVE_LINUX_TYPES_H 1
 
+/* Define to 1 to count and report the decisions of the mapper, see
+   crush_set_trace(). */
+#cmakedefine CRUSH_TRACE 1
+
 /* Version number of package */
 #cmakedefine VERSION "@VERSION@"
 
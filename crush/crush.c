@@ -2,6 +2,7 @@
 # include <linux/slab.h>
 # include <linux/crush/crush.h>
 #else
+# include <sys/mman.h>
 # include "crush_compat.h"
 # include "crush.h"
 #endif
@@ -74,6 +75,7 @@ void crush_destroy_bucket_straw(struct crush_bucket_straw *b)
 
 void crush_destroy_bucket_straw2(struct crush_bucket_straw2 *b)
 {
+	kfree(b->item_recips);
 	kfree(b->item_weights);
 	kfree(b->h.items);
 	kfree(b);
@@ -100,12 +102,78 @@ void crush_destroy_bucket(struct crush_bucket *b)
 	}
 }
 
+#ifndef __KERNEL__
+int crush_arena_owns(const struct crush_arena *arena, const void *p)
+{
+	const struct crush_arena_chunk *chunk;
+
+	for (chunk = arena->chunks; chunk; chunk = chunk->next)
+		if ((const char *)p > (const char *)chunk &&
+		    (const char *)p < chunk->end)
+			return 1;
+	return 0;
+}
+
+/*
+ * the buckets in the arena are not deallocated one by one: only
+ * those made elsewhere and added to the map are
+ */
+static void crush_destroy_arena(struct crush_map *map)
+{
+	struct crush_arena *arena = map->builder_arena;
+	struct crush_arena_chunk *chunk, *next;
+	__s32 b;
+
+	for (b = 0; b < map->max_buckets; b++)
+		if (map->buckets[b] &&
+		    !crush_arena_owns(arena, map->buckets[b]))
+			crush_destroy_bucket(map->buckets[b]);
+	kfree(map->buckets);
+	/* the map is in the first chunk, the last of the list */
+	for (chunk = arena->chunks; chunk; chunk = next) {
+		next = chunk->next;
+		if (chunk->owned)
+			kfree(chunk);
+	}
+}
+#endif
+
 /**
  * crush_destroy - Destroy a crush_map
  * @map: crush_map pointer
  */
 void crush_destroy(struct crush_map *map)
 {
+#ifndef __KERNEL__
+	if (map->arena) {
+		void *mapping = map->mapping;
+		size_t mapping_size = map->mapping_size;
+
+		kfree(map->arena);
+		if (mapping)
+			munmap(mapping, mapping_size);
+		return;
+	}
+#endif
+
+#ifndef __KERNEL__
+	if (map->builder_arena) {
+		__u32 r;
+
+		for (r = 0; r < map->max_rules; r++)
+			crush_destroy_rule(map->rules[r]);
+		kfree(map->rules);
+		kfree(map->choose_tries);
+		kfree(map->device_parents);
+		kfree(map->bucket_parents);
+		kfree(map->dirty_buckets);
+		kfree(map->straw_order);
+		kfree(map->straw_reverse);
+		crush_destroy_arena(map);
+		return;
+	}
+#endif
+
 	/* buckets */
 	if (map->buckets) {
 		__s32 b;
@@ -127,6 +195,11 @@ void crush_destroy(struct crush_map *map)
 
 #ifndef __KERNEL__
 	kfree(map->choose_tries);
+	kfree(map->device_parents);
+	kfree(map->bucket_parents);
+	kfree(map->dirty_buckets);
+	kfree(map->straw_order);
+	kfree(map->straw_reverse);
 #endif
 	kfree(map);
 }
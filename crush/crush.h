@@ -238,6 +238,32 @@ struct crush_bucket {
         __s32 *items;    /*!< array of children: < 0 are buckets, >= 0 items */
 };
 
+/*
+ * The straw2 draws divided by the item weights are in [-2^48, 0],
+ * the reciprocals are exact for dividends lower than 2^49.
+ */
+#define CRUSH_STRAW2_RECIP_BITS 49
+
+/** @ingroup API
+ *
+ * The reciprocal of a 16.16 fixed point straw2 __weight__. When
+ * choosing an item from a straw2 bucket, the draw of each item is
+ * divided by its weight. If the reciprocal of the weight is known,
+ * the division is replaced by a multiplication and a shift, which is
+ * much faster and gives the same result.
+ *
+ * The reciprocal is only used if its __weight__ is the weight of the
+ * item: it is ignored, and the division is done, if the weight of the
+ * item was modified and crush_update_straw2_recips() was not called.
+ *
+ * See crush_update_straw2_recips() for more information.
+ */
+struct crush_straw2_recip {
+	__u64 magic;  /*!< multiplier, 0 if __weight__ is 0 */
+	__u32 weight; /*!< 16.16 fixed point weight of the item */
+	__u32 shift;  /*!< shift of the product by __magic__ */
+};
+
 /** @ingroup API
  *
  * Replacement weights for each item in a bucket. The size of the
@@ -248,6 +274,7 @@ struct crush_bucket {
 struct crush_weight_set {
   __u32 *weights; /*!< 16.16 fixed point weights in the same order as items */
   __u32 size;     /*!< size of the __weights__ array */
+  struct crush_straw2_recip *recips; /*!< reciprocals of the __weights__ or NULL */
 };
 
 /** @ingroup API
@@ -340,9 +367,44 @@ struct crush_bucket_straw {
 struct crush_bucket_straw2 {
         struct crush_bucket h; /*!< generic bucket information */
 	__u32 *item_weights;   /*!< 16.16 fixed point weight for each item */
+	struct crush_straw2_recip *item_recips; /*!< reciprocals of the __item_weights__ or NULL */
+};
+
+
+
+#ifndef __KERNEL__
+/*
+ * where an item of a map that tracks its changes is found, see
+ * crush_get_parent(). The bucket and the position are known if the
+ * item is in a single bucket, otherwise __bucket__ is 0. It is also 0
+ * when the item is found in a single bucket after being removed from
+ * another one, until the bucket is looked up.
+ */
+struct crush_item_parent {
+	__u32 refs;	/* how many times the item is in a bucket */
+	__s32 bucket;	/* the id of the bucket or 0 */
+	__u32 pos;	/* the position of the item in the bucket */
 };
 
+/*
+ * the memory of a map created by crush_create_arena(), in chunks of
+ * increasing size. The first chunk holds the arena and the crush_map
+ * and is the caller's memory or allocated with the arena, as the
+ * others. Nothing allocated in the arena is freed before the arena.
+ */
+struct crush_arena_chunk {
+	struct crush_arena_chunk *next;
+	char *end;
+	int owned;	/* freed by crush_destroy() */
+};
 
+struct crush_arena {
+	struct crush_arena_chunk *chunks;	/* the last allocated first */
+	char *point;	/* the free memory of the first chunk */
+	size_t chunk_size;	/* the size of the next chunk */
+	size_t size;	/* the bytes allocated in the chunks */
+};
+#endif
 
 /** @ingroup API
  *
@@ -435,6 +497,11 @@ struct crush_map {
 	size_t working_size;
 
 #ifndef __KERNEL__
+	/* the size of the largest bucket that is not a uniform
+	   bucket, for the permutation they share in the working
+	   space, see crush_init_workspace() */
+	__u32 shared_perm_size;
+
 	/*! @endcond */
 	/*! Backward compatibility tunable. It is a fix for the straw
          *  scaler values for the straw algorithm which is deprecated
@@ -455,7 +522,62 @@ struct crush_map {
 	 */
 	__u32 allowed_bucket_algs;
 
+	/*
+	 * no longer updated by the mapper, which does not modify the
+	 * map: the histogram of the retries is in the working space,
+	 * see crush_merge_choose_tries().
+	 */
 	__u32 *choose_tries;
+
+	/*
+	 * if not NULL, the map is read only and all its memory is in
+	 * this single allocation, see crush_flatten().
+	 */
+	void *arena;
+
+	/*
+	 * if not NULL, the file mapped by crush_map_file() and its
+	 * size, unmapped by crush_destroy().
+	 */
+	void *mapping;
+	size_t mapping_size;
+
+	/*
+	 * if not NULL, the map and the buckets crush_make_bucket() makes
+	 * for it are in this arena, see crush_create_arena().
+	 */
+	struct crush_arena *builder_arena;
+
+	/*
+	 * if changes_tracked is set, the builder functions that modify
+	 * the map keep max_devices and working_size up to date and
+	 * record what crush_finalize() needs to revisit. It is set by
+	 * crush_finalize() after it went over the whole map, which it
+	 * does the first time, however the buckets were filled. It
+	 * must be cleared by whoever then modifies the buckets of the
+	 * map by other means.
+	 */
+	__u8 changes_tracked;
+	struct crush_item_parent *device_parents; /* indexed by device */
+	int device_parents_size;
+	struct crush_item_parent *bucket_parents; /* indexed by -1-id */
+	int bucket_parents_size;
+	size_t buckets_working_size;	/* the part of working_size
+					   that depends on the buckets */
+	int *dirty_buckets;		/* the ids of the straw2 buckets
+					   with new items */
+	int dirty_buckets_count;
+	int dirty_buckets_size;
+	/*
+	 * the scratch of crush_calc_straw(): the items of the last
+	 * straw bucket it computed, (weight << 32 | index) in
+	 * increasing order, and their indexes
+	 */
+	const struct crush_bucket_straw *straw_order_bucket;
+	__u64 *straw_order;
+	int *straw_reverse;
+	int straw_order_count;
+	int straw_order_size;
 #endif
 	/*! @endcond */
 };
@@ -501,6 +623,11 @@ extern void crush_destroy_rule(struct crush_rule *r);
  */
 extern void crush_destroy(struct crush_map *map);
 
+#ifndef __KERNEL__
+/* true if @p was allocated in @arena */
+extern int crush_arena_owns(const struct crush_arena *arena, const void *p);
+#endif
+
 static inline int crush_calc_tree_node(int i)
 {
 	return ((i+1) << 1)-1;
@@ -518,14 +645,62 @@ static inline int crush_calc_tree_node(int i)
    immutable within the mapper and removes the requirement for a CRUSH
    map lock. */
 
+/* bucket_perm_choose() reduces the hashes with a multiplication
+   instead of a division, see bucket_perm_mod() */
+#if !defined(__KERNEL__) && defined(__SIZEOF_INT128__)
+# define CRUSH_FASTMOD 1
+#endif
+
 struct crush_work_bucket {
 	__u32 perm_x; /* @x for which *perm is defined */
 	__u32 perm_n; /* num elements of *perm that are permuted/defined */
-	__u32 *perm;  /* Permutation of the bucket's items */
+	__u32 *perm;  /* Permutation of the bucket's items, the identity
+			 beyond what the first perm_n steps swapped */
+	__u64 *perm_magic; /* the reciprocal of size - p at p, or NULL */
 };
 
+/* A crush_work_bucket followed by the permutation of @size items,
+   rounded up so that the next one is aligned. */
+#define CRUSH_WORK_BUCKET_SIZE(size)					\
+	(sizeof(struct crush_work_bucket) +				\
+	 (((size) * sizeof(__u32) + sizeof(void *) - 1) &		\
+	  ~(sizeof(void *) - 1)))
+
+/* The same for a uniform bucket, followed by its perm_magic. */
+#ifdef CRUSH_FASTMOD
+#define CRUSH_WORK_UNIFORM_SIZE(size)					\
+	(CRUSH_WORK_BUCKET_SIZE(size) + (size) * sizeof(__u64))
+#else
+#define CRUSH_WORK_UNIFORM_SIZE(size) CRUSH_WORK_BUCKET_SIZE(size)
+#endif
+
 struct crush_work {
-	struct crush_work_bucket **work; /* Per-bucket working store */
+	/* Per-bucket working store. The kernel lays it out for each
+	   bucket, as its decoder sizes the working space, and
+	   otherwise it is only for the uniform buckets and set up the
+	   first time they are used */
+	struct crush_work_bucket **work;
+#ifndef __KERNEL__
+	char *work_point; /* where the next one is laid out */
+	/* The permutation the other buckets share for the local
+	   fallback retries and the bucket it is for */
+	struct crush_work_bucket *shared;
+	__s32 shared_id;
+	__u32 shared_identity; /* first entries of shared->perm set up */
+	/* choose_tries[n] is the number of items found after n
+	   retries, see crush_merge_choose_tries() */
+	__u32 *choose_tries;
+	__u32 choose_tries_size;
+	/* the buckets visited by the last crush_do_rule(), recorded
+	   only when track_visited is set, see crush_track_visited() */
+	__u64 visited;
+	__u32 track_visited;
+#ifdef CRUSH_TRACE
+	/* see crush_set_trace() */
+	struct crush_trace *trace;
+	__u32 trace_step;
+#endif
+#endif
 };
 
 #endif
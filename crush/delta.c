@@ -0,0 +1,497 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "delta.h"
+#include "mapper.h"
+#include "parallel.h"
+
+/* the number of values mapped by each chunk of crush_map_movement() */
+#define CRUSH_MOVEMENT_CHUNK 1024
+
+static int crush_rules_differ(const struct crush_map *a,
+			      const struct crush_map *b, int ruleno)
+{
+	const struct crush_rule *ra, *rb;
+
+	if (a->choose_local_tries != b->choose_local_tries ||
+	    a->choose_local_fallback_tries != b->choose_local_fallback_tries ||
+	    a->choose_total_tries != b->choose_total_tries ||
+	    a->chooseleaf_descend_once != b->chooseleaf_descend_once ||
+	    a->chooseleaf_vary_r != b->chooseleaf_vary_r ||
+	    a->chooseleaf_stable != b->chooseleaf_stable ||
+	    a->straw_calc_version != b->straw_calc_version)
+		return 1;
+	ra = (__u32)ruleno < a->max_rules ? a->rules[ruleno] : NULL;
+	rb = (__u32)ruleno < b->max_rules ? b->rules[ruleno] : NULL;
+	if (ra == NULL || rb == NULL)
+		return ra != rb;
+	return ra->len != rb->len ||
+		memcmp(ra->steps, rb->steps, ra->len * sizeof(ra->steps[0])) != 0;
+}
+
+/*
+ * The mask of the buckets an input must have visited with bucket a
+ * to be mapped differently with bucket b. Lowering the weight of an
+ * item of a straw2 bucket lowers its draw and leaves the others
+ * unchanged: the item can only lose, which moves nothing but the
+ * inputs that chose it. They visited the item if it is a bucket and
+ * the bucket holding it otherwise.
+ */
+static __u64 crush_bucket_changes(const struct crush_bucket *a,
+				  const struct crush_bucket *b, int id)
+{
+	__u64 changes = 0;
+	__u32 i;
+
+	if (a == NULL || b == NULL)
+		return a != b ? CRUSH_VISITED_BIT(id) : 0;
+	if (a->id != b->id || a->type != b->type || a->alg != b->alg ||
+	    a->hash != b->hash || a->size != b->size)
+		return CRUSH_VISITED_BIT(id);
+	for (i = 0; i < a->size; i++) {
+		__u32 wa, wb;
+
+		if (a->items[i] != b->items[i])
+			return CRUSH_VISITED_BIT(id);
+		wa = crush_get_bucket_item_weight(a, i);
+		wb = crush_get_bucket_item_weight(b, i);
+		if (wa == wb)
+			continue;
+		if (a->alg != CRUSH_BUCKET_STRAW2 || wb > wa)
+			return CRUSH_VISITED_BIT(id);
+		changes |= CRUSH_VISITED_BIT(a->items[i] < 0 ? a->items[i] : id);
+	}
+	return changes;
+}
+
+__u64 crush_changed_buckets(const struct crush_map *old_map,
+			    const struct crush_map *new_map,
+			    int ruleno)
+{
+	int max_buckets = old_map->max_buckets > new_map->max_buckets ?
+		old_map->max_buckets : new_map->max_buckets;
+	__u64 changed = 0;
+	int b;
+
+	if (crush_rules_differ(old_map, new_map, ruleno))
+		return ~0ULL;
+	for (b = 0; b < max_buckets; b++) {
+		const struct crush_bucket *o = b < old_map->max_buckets ?
+			old_map->buckets[b] : NULL;
+		const struct crush_bucket *n = b < new_map->max_buckets ?
+			new_map->buckets[b] : NULL;
+
+		changed |= crush_bucket_changes(o, n, -1-b);
+	}
+	return changed;
+}
+
+static const struct crush_choose_arg *
+crush_bucket_choose_arg(const struct crush_map *map,
+			const struct crush_choose_arg *choose_args, int b)
+{
+	if (choose_args == NULL || b >= map->max_buckets)
+		return NULL;
+	if (choose_args[b].ids_size == 0 && choose_args[b].weight_set_size == 0)
+		return NULL;
+	return &choose_args[b];
+}
+
+static int crush_choose_arg_differs(const struct crush_choose_arg *a,
+				    const struct crush_choose_arg *b)
+{
+	__u32 p;
+
+	if (a == NULL || b == NULL)
+		return a != b;
+	if (a->ids_size != b->ids_size ||
+	    a->weight_set_size != b->weight_set_size)
+		return 1;
+	if (a->ids_size &&
+	    memcmp(a->ids, b->ids, a->ids_size * sizeof(a->ids[0])) != 0)
+		return 1;
+	for (p = 0; p < a->weight_set_size; p++) {
+		const struct crush_weight_set *wa = &a->weight_set[p];
+		const struct crush_weight_set *wb = &b->weight_set[p];
+
+		if (wa->size != wb->size ||
+		    (wa->size && memcmp(wa->weights, wb->weights,
+					wa->size * sizeof(wa->weights[0]))))
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * The mask of the buckets whose choose_args differ, each map having
+ * its own array of __max_buckets__ choose_args.
+ */
+static __u64 crush_changed_choose_args(const struct crush_map *old_map,
+				       const struct crush_map *new_map,
+				       const struct crush_choose_arg *old_args,
+				       const struct crush_choose_arg *new_args)
+{
+	int max_buckets = old_map->max_buckets > new_map->max_buckets ?
+		old_map->max_buckets : new_map->max_buckets;
+	__u64 changed = 0;
+	int b;
+
+	if (old_args == NULL && new_args == NULL)
+		return 0;
+	for (b = 0; b < max_buckets; b++)
+		if (crush_choose_arg_differs(
+			    crush_bucket_choose_arg(old_map, old_args, b),
+			    crush_bucket_choose_arg(new_map, new_args, b)))
+			changed |= CRUSH_VISITED_BIT(-1-b);
+	return changed;
+}
+
+static void *crush_delta_workspace(const struct crush_map *map, int ruleno,
+				   int result_max)
+{
+	void *cwin;
+
+	if ((__u32)ruleno >= map->max_rules || map->rules[ruleno] == NULL ||
+	    result_max <= 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	/* with room for one more result after those of crush_do_rule() */
+	cwin = malloc(crush_work_size(map, result_max) +
+		      result_max * sizeof(int));
+	if (!cwin) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	crush_init_workspace(map, cwin);
+	crush_track_visited(cwin, 1);
+	return cwin;
+}
+
+int crush_map_visited(const struct crush_map *map, int ruleno,
+		      const int *xs, int n,
+		      int *results, int result_max, int *result_lens,
+		      __u64 *visited,
+		      const __u32 *weights, int weight_max,
+		      const struct crush_choose_arg *choose_args)
+{
+	void *cwin = crush_delta_workspace(map, ruleno, result_max);
+	int i;
+
+	if (!cwin)
+		return -errno;
+	for (i = 0; i < n; i++) {
+		result_lens[i] = crush_do_rule(map, ruleno, xs[i],
+					       results + (size_t)i * result_max,
+					       result_max, weights, weight_max,
+					       cwin, choose_args);
+		visited[i] = crush_get_visited(cwin);
+	}
+	free(cwin);
+	return n;
+}
+
+int crush_map_delta(const struct crush_map *map, int ruleno,
+		    __u64 changed,
+		    const int *xs, int n,
+		    int *results, int result_max, int *result_lens,
+		    __u64 *visited,
+		    const __u32 *weights, int weight_max,
+		    const struct crush_choose_arg *choose_args,
+		    int *moved)
+{
+	void *cwin = crush_delta_workspace(map, ruleno, result_max);
+	int *result;
+	int i, len, moved_count = 0;
+
+	if (!cwin)
+		return -errno;
+	result = (int *)((char *)cwin + crush_work_size(map, result_max));
+	for (i = 0; i < n; i++) {
+		int *former = results + (size_t)i * result_max;
+
+		if ((visited[i] & changed) == 0)
+			continue;
+		len = crush_do_rule(map, ruleno, xs[i], result, result_max,
+				    weights, weight_max, cwin, choose_args);
+		visited[i] = crush_get_visited(cwin);
+		if (len == result_lens[i] &&
+		    memcmp(result, former, len * sizeof(int)) == 0)
+			continue;
+		memcpy(former, result, len * sizeof(int));
+		result_lens[i] = len;
+		moved[moved_count++] = i;
+	}
+	free(cwin);
+	return moved_count;
+}
+
+/*
+ * The working spaces and counts of a thread of crush_map_movement().
+ * The counts are laid out as the arrays of crush_movement followed
+ * by the remapped, moved and replicas counters.
+ */
+struct crush_mover_worker {
+	void *old_cwin;
+	void *new_cwin;
+	int *old_result;
+	int *new_result;
+	__u64 *counts;
+};
+
+struct crush_mover {
+	const struct crush_map *old_map;
+	const struct crush_map *new_map;
+	int ruleno;
+	__u64 changed;
+	int indep;
+	const int *xs;
+	int result_max;
+	const __u32 *weights;
+	int weight_max;
+	const struct crush_choose_arg *old_choose_args;
+	const struct crush_choose_arg *new_choose_args;
+	int max_buckets;
+	/* the parent of each item, devices first, 0 for none */
+	int *old_parents;
+	int *new_parents;
+	size_t size;
+	struct crush_mover_worker *workers;
+};
+
+static int *crush_movement_parents(const struct crush_map *map)
+{
+	int *parents = calloc((size_t)map->max_devices + map->max_buckets + 1,
+			      sizeof(int));
+	int b;
+	__u32 i;
+
+	if (!parents)
+		return NULL;
+	for (b = 0; b < map->max_buckets; b++) {
+		const struct crush_bucket *bucket = map->buckets[b];
+
+		if (!bucket)
+			continue;
+		for (i = 0; i < bucket->size; i++) {
+			int item = bucket->items[i];
+			int index = item >= 0 ? item : map->max_devices - 1 - item;
+
+			if (item < map->max_devices &&
+			    -1-item < map->max_buckets && parents[index] == 0)
+				parents[index] = bucket->id;
+		}
+	}
+	return parents;
+}
+
+/* count a replica of @device and of the buckets above it */
+static void crush_movement_count(const struct crush_mover *m,
+				 const struct crush_map *map,
+				 const int *parents,
+				 __u64 *devices, __u64 *buckets, int device)
+{
+	int item;
+
+	if (device < 0 || device >= m->weight_max)
+		return;
+	devices[device]++;
+	if (device >= map->max_devices)
+		return;
+	item = parents[device];
+	while (item < 0) {
+		if (-1-item < m->max_buckets)
+			buckets[-1-item]++;
+		item = parents[map->max_devices - 1 - item];
+	}
+}
+
+static int crush_movement_holds(const int *result, int len, int device)
+{
+	int i;
+
+	for (i = 0; i < len; i++)
+		if (result[i] == device)
+			return 1;
+	return 0;
+}
+
+static void crush_map_movement_chunk(void *arg, int worker,
+				     int begin, int end)
+{
+	struct crush_mover *m = (struct crush_mover *)arg;
+	struct crush_mover_worker *w = &m->workers[worker];
+	__u64 *device_out = w->counts;
+	__u64 *device_in = device_out + m->weight_max;
+	__u64 *bucket_out = device_in + m->weight_max;
+	__u64 *bucket_in = bucket_out + m->max_buckets;
+	__u64 *counters = bucket_in + m->max_buckets;
+	int i, j;
+
+	for (i = begin; i < end; i++) {
+		int old_len, new_len, replicas = 0;
+
+		old_len = crush_do_rule(m->old_map, m->ruleno, m->xs[i],
+					w->old_result, m->result_max,
+					m->weights, m->weight_max,
+					w->old_cwin, m->old_choose_args);
+		if ((crush_get_visited(w->old_cwin) & m->changed) == 0)
+			continue;
+		counters[0]++;
+		new_len = crush_do_rule(m->new_map, m->ruleno, m->xs[i],
+					w->new_result, m->result_max,
+					m->weights, m->weight_max,
+					w->new_cwin, m->new_choose_args);
+		for (j = 0; j < old_len || j < new_len; j++) {
+			int former = j < old_len ?
+				w->old_result[j] : CRUSH_ITEM_NONE;
+			int device = j < new_len ?
+				w->new_result[j] : CRUSH_ITEM_NONE;
+
+			if (m->indep) {
+				if (former == device)
+					continue;
+			} else {
+				if (j < old_len &&
+				    crush_movement_holds(w->new_result,
+							 new_len, former))
+					former = CRUSH_ITEM_NONE;
+				if (j < new_len &&
+				    crush_movement_holds(w->old_result,
+							 old_len, device))
+					device = CRUSH_ITEM_NONE;
+			}
+			crush_movement_count(m, m->old_map, m->old_parents,
+					     device_out, bucket_out, former);
+			if (device >= 0 && device < m->weight_max)
+				replicas++;
+			crush_movement_count(m, m->new_map, m->new_parents,
+					     device_in, bucket_in, device);
+		}
+		if (old_len != new_len ||
+		    memcmp(w->old_result, w->new_result,
+			   old_len * sizeof(int)) != 0)
+			counters[1]++;
+		counters[2] += replicas;
+	}
+}
+
+static int crush_rule_is_indep(const struct crush_rule *rule)
+{
+	__u32 step;
+
+	for (step = 0; step < rule->len; step++)
+		if (rule->steps[step].op == CRUSH_RULE_CHOOSE_INDEP ||
+		    rule->steps[step].op == CRUSH_RULE_CHOOSELEAF_INDEP)
+			return 1;
+	return 0;
+}
+
+int crush_map_movement(const struct crush_map *old_map,
+		       const struct crush_map *new_map, int ruleno,
+		       const int *xs, int n, int result_max,
+		       const __u32 *weights, int weight_max,
+		       const struct crush_choose_arg *old_choose_args,
+		       const struct crush_choose_arg *new_choose_args,
+		       int nthreads,
+		       struct crush_movement *movement)
+{
+	struct crush_mover m;
+	struct crush_mover_worker *total;
+	__u64 *counts;
+	size_t i;
+	int t, ret = 0;
+
+	if ((__u32)ruleno >= old_map->max_rules ||
+	    old_map->rules[ruleno] == NULL ||
+	    (__u32)ruleno >= new_map->max_rules ||
+	    new_map->rules[ruleno] == NULL ||
+	    n < 0 || result_max <= 0 || weight_max < 0)
+		return -EINVAL;
+
+	memset(&m, 0, sizeof(m));
+	m.old_map = old_map;
+	m.new_map = new_map;
+	m.ruleno = ruleno;
+	m.changed = crush_changed_buckets(old_map, new_map, ruleno) |
+		crush_changed_choose_args(old_map, new_map,
+					  old_choose_args, new_choose_args);
+	m.indep = crush_rule_is_indep(old_map->rules[ruleno]);
+	m.xs = xs;
+	m.result_max = result_max;
+	m.weights = weights;
+	m.weight_max = weight_max;
+	m.old_choose_args = old_choose_args;
+	m.new_choose_args = new_choose_args;
+	m.max_buckets = movement->max_buckets > 0 ? movement->max_buckets : 0;
+	m.size = 2 * ((size_t)weight_max + m.max_buckets) + 3;
+
+	nthreads = crush_parallel_nthreads(nthreads);
+	m.old_parents = crush_movement_parents(old_map);
+	m.new_parents = crush_movement_parents(new_map);
+	m.workers = calloc(nthreads, sizeof(*m.workers));
+	if (!m.old_parents || !m.new_parents || !m.workers) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	for (t = 0; t < nthreads; t++) {
+		struct crush_mover_worker *w = &m.workers[t];
+
+		w->old_cwin = crush_delta_workspace(old_map, ruleno, result_max);
+		w->new_cwin = crush_delta_workspace(new_map, ruleno, result_max);
+		w->counts = calloc(m.size, sizeof(__u64));
+		if (!w->old_cwin || !w->new_cwin || !w->counts) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		w->old_result = (int *)((char *)w->old_cwin +
+					crush_work_size(old_map, result_max));
+		w->new_result = (int *)((char *)w->new_cwin +
+					crush_work_size(new_map, result_max));
+	}
+
+	ret = crush_parallel_run(0, n, CRUSH_MOVEMENT_CHUNK, nthreads,
+				 crush_map_movement_chunk, &m);
+	if (ret < 0)
+		goto out;
+
+	total = &m.workers[0];
+	for (t = 1; t < nthreads; t++)
+		for (i = 0; i < m.size; i++)
+			total->counts[i] += m.workers[t].counts[i];
+	counts = total->counts;
+	if (movement->device_out)
+		memcpy(movement->device_out, counts,
+		       weight_max * sizeof(__u64));
+	counts += weight_max;
+	if (movement->device_in)
+		memcpy(movement->device_in, counts,
+		       weight_max * sizeof(__u64));
+	counts += weight_max;
+	if (movement->bucket_out)
+		memcpy(movement->bucket_out, counts,
+		       m.max_buckets * sizeof(__u64));
+	counts += m.max_buckets;
+	if (movement->bucket_in)
+		memcpy(movement->bucket_in, counts,
+		       m.max_buckets * sizeof(__u64));
+	counts += m.max_buckets;
+	movement->values = n;
+	movement->remapped = counts[0];
+	movement->moved = counts[1];
+	movement->replicas = counts[2];
+	ret = movement->moved;
+out:
+	if (m.workers) {
+		for (t = 0; t < nthreads; t++) {
+			free(m.workers[t].old_cwin);
+			free(m.workers[t].new_cwin);
+			free(m.workers[t].counts);
+		}
+	}
+	free(m.workers);
+	free(m.old_parents);
+	free(m.new_parents);
+	return ret;
+}
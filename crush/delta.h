@@ -0,0 +1,200 @@
+#ifndef CEPH_CRUSH_DELTA_H
+#define CEPH_CRUSH_DELTA_H
+
+/*
+ * Find the values that are mapped differently after a map is edited,
+ * without mapping them all again.
+ *
+ * LGPL2
+ */
+
+#include "crush.h"
+
+/** @ingroup API
+ *
+ * Return the mask of the buckets a value must have visited (see
+ * crush_get_visited()) with __old_map__ to be mapped differently with
+ * __new_map__. It is made of the CRUSH_VISITED_BIT() of each bucket
+ * that exists in only one of the maps or differs by its type,
+ * algorithm, hash, items or item weights, except for the
+ * ::CRUSH_BUCKET_STRAW2 buckets whose item weights were only
+ * lowered: since an item with a lower weight can only lose the draws
+ * it won, the bits are those of the items whose weight was lowered,
+ * or of the bucket for the devices. If a tunable or the rule
+ * __ruleno__ differ, any value may be mapped differently and all the
+ * bits are set.
+ *
+ * The mask of a recorded edit can also be made by the caller, for
+ * instance the CRUSH_VISITED_BIT() of a device's ancestors (see
+ * crush_get_parent()) after crush_set_device_weight().
+ *
+ * @param old_map a finalized crush_map
+ * @param new_map __old_map__ after an edit, finalized
+ * @param ruleno the rule used to map the values
+ *
+ * @returns the mask of the buckets that differ
+ */
+extern __u64 crush_changed_buckets(const struct crush_map *old_map,
+				   const struct crush_map *new_map,
+				   int ruleno);
+
+/** @ingroup API
+ *
+ * Map each of the __n__ values of __xs__ to __result_max__ items, as
+ * crush_do_rule() would, and store them in __results__ and their
+ * number in __result_lens__ as crush_do_rule_batch() does. The mask of
+ * the buckets visited to map __xs[i]__ (see crush_get_visited()) is
+ * stored in __visited[i]__, to be given to crush_map_delta() after
+ * the map is edited.
+ *
+ * - return -EINVAL if __ruleno__ does not exist or __result_max__ <= 0
+ * - return -ENOMEM if __malloc(3)__ fails
+ *
+ * @param map the crush_map
+ * @param ruleno a positive integer < __CRUSH_MAX_RULES__
+ * @param xs the __n__ values to map
+ * @param n the size of the __xs__ array
+ * @param results an array of items of size __n__ * __result_max__
+ * @param result_max the maximum number of items for each value
+ * @param result_lens an array of size __n__
+ * @param visited an array of size __n__
+ * @param weights an array of weights of size __weight_max__
+ * @param weight_max the size of the __weights__ array
+ * @param choose_args weights and ids for each known bucket
+ *
+ * @returns __n__ on success, < 0 on error
+ */
+extern int crush_map_visited(const struct crush_map *map, int ruleno,
+			     const int *xs, int n,
+			     int *results, int result_max, int *result_lens,
+			     __u64 *visited,
+			     const __u32 *weights, int weight_max,
+			     const struct crush_choose_arg *choose_args);
+
+/** @ingroup API
+ *
+ * Update the __results__, __result_lens__ and __visited__ of the __n__
+ * values of __xs__, which were mapped with crush_map_visited() (or
+ * crush_map_delta()) before the buckets of the __changed__ mask were
+ * edited, so that they are what crush_map_visited() would return for
+ * __map__. Only the values that visited a bucket of the __changed__
+ * mask are mapped again: the others are known to be mapped to the
+ * same items.
+ *
+ * The indexes in __xs__ of the values that are mapped to different
+ * items are stored in increasing order in __moved__, an array of size
+ * __n__, and their number is returned. The __weights__ and
+ * __choose_args__ must be those the values were mapped with.
+ *
+ * - return -EINVAL if __ruleno__ does not exist or __result_max__ <= 0
+ * - return -ENOMEM if __malloc(3)__ fails
+ *
+ * @param map the edited crush_map, finalized
+ * @param ruleno the rule the values were mapped with
+ * @param changed the mask of the edited buckets, see crush_changed_buckets()
+ * @param xs the __n__ values to map
+ * @param n the size of the __xs__ array
+ * @param results an array of items of size __n__ * __result_max__
+ * @param result_max the maximum number of items for each value
+ * @param result_lens an array of size __n__
+ * @param visited an array of size __n__
+ * @param weights an array of weights of size __weight_max__
+ * @param weight_max the size of the __weights__ array
+ * @param choose_args weights and ids for each known bucket
+ * @param moved an array of size __n__
+ *
+ * @returns the number of values in __moved__ on success, < 0 on error
+ */
+extern int crush_map_delta(const struct crush_map *map, int ruleno,
+			   __u64 changed,
+			   const int *xs, int n,
+			   int *results, int result_max, int *result_lens,
+			   __u64 *visited,
+			   const __u32 *weights, int weight_max,
+			   const struct crush_choose_arg *choose_args,
+			   int *moved);
+
+
+/** @ingroup API
+ *
+ * Where crush_map_movement() stores the replicas that move. The arrays
+ * are owned by the caller and each may be NULL. The other members are
+ * set by crush_map_movement().
+ *
+ * A replica leaves a device if the device is no longer in the result
+ * of a value and is written to a device that was not in it. When the
+ * rule has a CRUSH_RULE_CHOOSE_INDEP or CRUSH_RULE_CHOOSELEAF_INDEP
+ * step, the position of a device in the result matters: a replica
+ * moves when the device at its position differs. A bucket is counted
+ * for the replicas of the devices below it, the first bucket holding
+ * an item being its parent.
+ */
+struct crush_movement {
+	/*! arrays of __weight_max__ counts of replicas for each device */
+	__u64 *device_out;
+	__u64 *device_in;
+	/*! arrays of __max_buckets__ counts of replicas for each bucket,
+	  the bucket __id__ being at __-1-id__, in the old map for
+	  __bucket_out__ and in the new map for __bucket_in__ */
+	__u64 *bucket_out;
+	__u64 *bucket_in;
+	int max_buckets;
+	/*! the number of values mapped */
+	__u64 values;
+	/*! the number of values mapped again with the new map */
+	__u64 remapped;
+	/*! the number of values whose result differs, as found by
+	  crush_map_delta() */
+	__u64 moved;
+	/*! the number of replicas written to another device */
+	__u64 replicas;
+};
+
+/** @ingroup API
+ *
+ * Store in __movement__ the replicas that move when the __n__ values
+ * of __xs__, mapped to __result_max__ items with the rule __ruleno__,
+ * are mapped with __new_map__ instead of __old_map__. A map and edits
+ * made with the builder are compared by copying the map with
+ * crush_flatten() before the edits.
+ *
+ * Each value is mapped with __old_map__ and only those that visited
+ * a bucket of crush_changed_buckets() are mapped again with
+ * __new_map__, as crush_map_delta() does. The values are mapped by
+ * __nthreads__ threads, as explained in crush_parallel_run(), and the
+ * counts do not depend on __nthreads__.
+ *
+ * Each map is used with its own choose_args, for instance those of
+ * crush_make_choose_args() for __new_map__ after a bucket is added.
+ * The buckets whose choose_args differ are added to the mask of
+ * crush_changed_buckets(). Either may be NULL.
+ *
+ * - return -EINVAL if __ruleno__ does not exist in one of the maps,
+ *   __n__ < 0, __result_max__ <= 0 or __weight_max__ < 0
+ * - return -ENOMEM if __malloc(3)__ fails
+ *
+ * @param old_map a finalized crush_map
+ * @param new_map __old_map__ after an edit, finalized
+ * @param ruleno the rule used to map the values
+ * @param xs the __n__ values to map
+ * @param n the size of the __xs__ array
+ * @param result_max the maximum number of items for each value
+ * @param weights an array of weights of size __weight_max__
+ * @param weight_max the size of the __weights__ array
+ * @param old_choose_args weights and ids for each bucket of __old_map__
+ * @param new_choose_args weights and ids for each bucket of __new_map__
+ * @param nthreads the number of threads
+ * @param movement where to store the replicas that move
+ *
+ * @returns the __moved__ count on success, < 0 on error
+ */
+extern int crush_map_movement(const struct crush_map *old_map,
+			      const struct crush_map *new_map, int ruleno,
+			      const int *xs, int n, int result_max,
+			      const __u32 *weights, int weight_max,
+			      const struct crush_choose_arg *old_choose_args,
+			      const struct crush_choose_arg *new_choose_args,
+			      int nthreads,
+			      struct crush_movement *movement);
+
+#endif
@@ -0,0 +1,887 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "builder.h"
+#include "encoding.h"
+
+/*
+ * The records of the encoding. All offsets are relative to the
+ * beginning of the encoding, a multiple of CRUSH_ENCODING_ALIGN, and
+ * 0 when there is nothing to point to.
+ */
+#define CRUSH_ENCODING_ALIGN 8
+
+struct crush_disk_header {
+	__u32 magic;
+	__u32 version;
+	__u64 size;			/* of the encoding, header included */
+	__u32 choose_local_tries;
+	__u32 choose_local_fallback_tries;
+	__u32 choose_total_tries;
+	__u32 chooseleaf_descend_once;
+	__u32 chooseleaf_vary_r;
+	__u32 chooseleaf_stable;
+	__u32 straw_calc_version;
+	__u32 allowed_bucket_algs;
+	__s32 max_buckets;
+	__u32 max_rules;
+	__s32 max_devices;
+	__u32 reserved;
+	__u64 buckets;			/* max_buckets offsets of crush_disk_bucket */
+	__u64 rules;			/* max_rules offsets of crush_rule */
+	__u64 choose_args;		/* max_buckets offsets of crush_disk_choose_arg */
+};
+
+struct crush_disk_bucket {
+	__s32 id;
+	__u16 type;
+	__u8 alg;
+	__u8 hash;
+	__u32 weight;
+	__u32 size;
+	__u32 arg;			/* uniform item_weight, tree num_nodes */
+	__u32 reserved;
+	__u64 items;			/* size __s32 */
+	__u64 weights;			/* item_weights, tree node_weights */
+	__u64 extra;			/* list sum_weights, straw straws,
+					   straw2 item_recips */
+};
+
+struct crush_disk_weight_set {
+	__u32 size;
+	__u32 reserved;
+	__u64 weights;			/* size __u32 */
+	__u64 recips;			/* size crush_straw2_recip */
+};
+
+/* followed by weight_set_size crush_disk_weight_set */
+struct crush_disk_choose_arg {
+	__u32 ids_size;
+	__u32 weight_set_size;
+	__u64 ids;			/* ids_size __s32 */
+};
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define CRUSH_ENCODING_SWAP 1
+static inline __u16 crush_le16(__u16 v) { return __builtin_bswap16(v); }
+static inline __u32 crush_le32(__u32 v) { return __builtin_bswap32(v); }
+static inline __u64 crush_le64(__u64 v) { return __builtin_bswap64(v); }
+#else
+#define CRUSH_ENCODING_SWAP 0
+static inline __u16 crush_le16(__u16 v) { return v; }
+static inline __u32 crush_le32(__u32 v) { return v; }
+static inline __u64 crush_le64(__u64 v) { return v; }
+#endif
+
+static inline size_t crush_encoding_size(size_t size)
+{
+	return (size + CRUSH_ENCODING_ALIGN - 1) &
+		~(size_t)(CRUSH_ENCODING_ALIGN - 1);
+}
+
+/** encode **/
+
+/*
+ * The encoding is done twice: the first time with a NULL @buf to
+ * calculate its size, the second time to write it.
+ */
+struct crush_encoder {
+	char *buf;
+	size_t len;
+};
+
+static __u64 crush_enc_reserve(struct crush_encoder *e, size_t size)
+{
+	__u64 offset = e->len;
+
+	e->len += crush_encoding_size(size);
+	return offset;
+}
+
+static void crush_enc_put(struct crush_encoder *e, __u64 offset,
+			  const void *src, size_t size)
+{
+	if (e->buf)
+		memcpy(e->buf + offset, src, size);
+}
+
+static __u64 crush_enc_u32s(struct crush_encoder *e, const void *v, __u32 n)
+{
+	__u64 offset = crush_enc_reserve(e, sizeof(__u32) * n);
+	__u32 i, le;
+
+	if (e->buf)
+		for (i = 0; i < n; i++) {
+			le = crush_le32(((const __u32 *)v)[i]);
+			crush_enc_put(e, offset + i * sizeof(__u32), &le, sizeof(le));
+		}
+	return offset;
+}
+
+static __u64 crush_enc_recips(struct crush_encoder *e, const __u32 *weights,
+			      __u32 n)
+{
+	__u64 offset = crush_enc_reserve(e, sizeof(struct crush_straw2_recip) * n);
+	struct crush_straw2_recip recip;
+	__u32 i;
+
+	if (e->buf)
+		for (i = 0; i < n; i++) {
+			crush_update_straw2_recips(&recip, &weights[i], 1);
+			recip.magic = crush_le64(recip.magic);
+			recip.weight = crush_le32(recip.weight);
+			recip.shift = crush_le32(recip.shift);
+			crush_enc_put(e, offset + i * sizeof(recip), &recip,
+				      sizeof(recip));
+		}
+	return offset;
+}
+
+static int crush_enc_bucket(struct crush_encoder *e,
+			    const struct crush_bucket *b, __u64 *offset)
+{
+	struct crush_disk_bucket d;
+
+	memset(&d, 0, sizeof(d));
+	*offset = crush_enc_reserve(e, sizeof(d));
+	d.id = crush_le32(b->id);
+	d.type = crush_le16(b->type);
+	d.alg = b->alg;
+	d.hash = b->hash;
+	d.weight = crush_le32(b->weight);
+	d.size = crush_le32(b->size);
+	d.items = crush_le64(crush_enc_u32s(e, b->items, b->size));
+	switch (b->alg) {
+	case CRUSH_BUCKET_UNIFORM:
+		d.arg = crush_le32(((const struct crush_bucket_uniform *)b)->item_weight);
+		break;
+	case CRUSH_BUCKET_LIST: {
+		const struct crush_bucket_list *list = (const struct crush_bucket_list *)b;
+		d.weights = crush_le64(crush_enc_u32s(e, list->item_weights, b->size));
+		d.extra = crush_le64(crush_enc_u32s(e, list->sum_weights, b->size));
+		break;
+	}
+	case CRUSH_BUCKET_TREE: {
+		const struct crush_bucket_tree *tree = (const struct crush_bucket_tree *)b;
+		d.arg = crush_le32(tree->num_nodes);
+		d.weights = crush_le64(crush_enc_u32s(e, tree->node_weights,
+						      tree->num_nodes));
+		break;
+	}
+	case CRUSH_BUCKET_STRAW: {
+		const struct crush_bucket_straw *straw = (const struct crush_bucket_straw *)b;
+		d.weights = crush_le64(crush_enc_u32s(e, straw->item_weights, b->size));
+		d.extra = crush_le64(crush_enc_u32s(e, straw->straws, b->size));
+		break;
+	}
+	case CRUSH_BUCKET_STRAW2: {
+		const struct crush_bucket_straw2 *straw2 = (const struct crush_bucket_straw2 *)b;
+		d.weights = crush_le64(crush_enc_u32s(e, straw2->item_weights, b->size));
+		d.extra = crush_le64(crush_enc_recips(e, straw2->item_weights, b->size));
+		break;
+	}
+	default:
+		return -EINVAL;
+	}
+	crush_enc_put(e, *offset, &d, sizeof(d));
+	return 0;
+}
+
+static __u64 crush_enc_rule(struct crush_encoder *e, const struct crush_rule *r)
+{
+	__u64 offset = crush_enc_reserve(e, crush_rule_size(r->len));
+	__u32 i, v[3];
+
+	v[0] = crush_le32(r->len);
+	crush_enc_put(e, offset, v, sizeof(__u32));
+	crush_enc_put(e, offset + sizeof(__u32), &r->mask, sizeof(r->mask));
+	for (i = 0; i < r->len; i++) {
+		v[0] = crush_le32(r->steps[i].op);
+		v[1] = crush_le32(r->steps[i].arg1);
+		v[2] = crush_le32(r->steps[i].arg2);
+		crush_enc_put(e, offset + crush_rule_size(i), v, sizeof(v));
+	}
+	return offset;
+}
+
+static __u64 crush_enc_choose_arg(struct crush_encoder *e,
+				  const struct crush_choose_arg *arg)
+{
+	struct crush_disk_choose_arg d;
+	struct crush_disk_weight_set ws;
+	__u64 offset;
+	__u32 position, weight_set_size;
+
+	if (arg->ids == NULL && arg->weight_set == NULL)
+		return 0;
+	weight_set_size = arg->weight_set ? arg->weight_set_size : 0;
+	offset = crush_enc_reserve(e, sizeof(d) + sizeof(ws) * weight_set_size);
+	memset(&d, 0, sizeof(d));
+	if (arg->ids) {
+		d.ids_size = crush_le32(arg->ids_size);
+		d.ids = crush_le64(crush_enc_u32s(e, arg->ids, arg->ids_size));
+	}
+	d.weight_set_size = crush_le32(weight_set_size);
+	crush_enc_put(e, offset, &d, sizeof(d));
+	for (position = 0; position < weight_set_size; position++) {
+		const struct crush_weight_set *from = &arg->weight_set[position];
+		memset(&ws, 0, sizeof(ws));
+		ws.size = crush_le32(from->size);
+		ws.weights = crush_le64(crush_enc_u32s(e, from->weights, from->size));
+		ws.recips = crush_le64(crush_enc_recips(e, from->weights, from->size));
+		crush_enc_put(e, offset + sizeof(d) + sizeof(ws) * position,
+			      &ws, sizeof(ws));
+	}
+	return offset;
+}
+
+static int crush_enc_map(struct crush_encoder *e, const struct crush_map *map,
+			 const struct crush_choose_arg *choose_args)
+{
+	struct crush_disk_header h;
+	__u64 offset, table;
+	__u32 r;
+	int b, err;
+
+	memset(&h, 0, sizeof(h));
+	crush_enc_reserve(e, sizeof(h));
+	h.magic = crush_le32(CRUSH_ENCODING_MAGIC);
+	h.version = crush_le32(CRUSH_ENCODING_VERSION);
+	h.choose_local_tries = crush_le32(map->choose_local_tries);
+	h.choose_local_fallback_tries = crush_le32(map->choose_local_fallback_tries);
+	h.choose_total_tries = crush_le32(map->choose_total_tries);
+	h.chooseleaf_descend_once = crush_le32(map->chooseleaf_descend_once);
+	h.chooseleaf_vary_r = crush_le32(map->chooseleaf_vary_r);
+	h.chooseleaf_stable = crush_le32(map->chooseleaf_stable);
+	h.straw_calc_version = crush_le32(map->straw_calc_version);
+	h.allowed_bucket_algs = crush_le32(map->allowed_bucket_algs);
+	h.max_buckets = crush_le32(map->max_buckets);
+	h.max_rules = crush_le32(map->max_rules);
+	h.max_devices = crush_le32(map->max_devices);
+
+	table = crush_enc_reserve(e, sizeof(__u64) * map->max_buckets);
+	h.buckets = crush_le64(table);
+	for (b = 0; b < map->max_buckets; b++) {
+		offset = 0;
+		if (map->buckets[b]) {
+			err = crush_enc_bucket(e, map->buckets[b], &offset);
+			if (err < 0)
+				return err;
+		}
+		offset = crush_le64(offset);
+		crush_enc_put(e, table + b * sizeof(__u64), &offset, sizeof(offset));
+	}
+
+	table = crush_enc_reserve(e, sizeof(__u64) * map->max_rules);
+	h.rules = crush_le64(table);
+	for (r = 0; r < map->max_rules; r++) {
+		offset = map->rules[r] ? crush_le64(crush_enc_rule(e, map->rules[r])) : 0;
+		crush_enc_put(e, table + r * sizeof(__u64), &offset, sizeof(offset));
+	}
+
+	if (choose_args) {
+		table = crush_enc_reserve(e, sizeof(__u64) * map->max_buckets);
+		h.choose_args = crush_le64(table);
+		for (b = 0; b < map->max_buckets; b++) {
+			offset = crush_le64(crush_enc_choose_arg(e, &choose_args[b]));
+			crush_enc_put(e, table + b * sizeof(__u64), &offset,
+				      sizeof(offset));
+		}
+	}
+
+	h.size = crush_le64(e->len);
+	crush_enc_put(e, 0, &h, sizeof(h));
+	return 0;
+}
+
+int crush_encode(const struct crush_map *map,
+		 const struct crush_choose_arg *choose_args,
+		 void **buf, size_t *len)
+{
+	struct crush_encoder e = { NULL, 0 };
+	int err;
+
+	err = crush_enc_map(&e, map, choose_args);
+	if (err < 0)
+		return err;
+	e.buf = calloc(1, e.len);
+	if (!e.buf)
+		return -ENOMEM;
+	*len = e.len;
+	e.len = 0;
+	crush_enc_map(&e, map, choose_args);
+	*buf = e.buf;
+	return 0;
+}
+
+/** decode **/
+
+/*
+ * The decoded map is a single allocation, as for crush_flatten(),
+ * whose size is calculated while checking the encoding. The arrays
+ * are either copied in it or used where they are in the encoding,
+ * when @in_place is set.
+ */
+struct crush_decoder {
+	const char *buf;
+	size_t len;
+	int in_place;
+	struct crush_disk_header h;
+	const char *buckets;	/* tables of offsets */
+	const char *rules;
+	const char *choose_args;
+};
+
+static __u64 crush_dec_u64(const char *p)
+{
+	__u64 v;
+
+	memcpy(&v, p, sizeof(v));
+	return crush_le64(v);
+}
+
+static __u32 crush_dec_u32(const char *p)
+{
+	__u32 v;
+
+	memcpy(&v, p, sizeof(v));
+	return crush_le32(v);
+}
+
+/* the @count elements of @size bytes at @offset, NULL if out of bounds */
+static const char *crush_dec_at(const struct crush_decoder *d, __u64 offset,
+				__u64 count, size_t size)
+{
+	if (offset == 0 || offset % CRUSH_ENCODING_ALIGN ||
+	    offset > d->len || count > (d->len - offset) / size)
+		return NULL;
+	return d->buf + offset;
+}
+
+/* the offset at index @i of the @table of offsets */
+static __u64 crush_dec_table(const char *table, __u32 i)
+{
+	return table ? crush_dec_u64(table + i * sizeof(__u64)) : 0;
+}
+
+static void crush_dec_bucket_header(const char *p, struct crush_disk_bucket *b)
+{
+	memcpy(b, p, sizeof(*b));
+	b->id = crush_le32(b->id);
+	b->type = crush_le16(b->type);
+	b->weight = crush_le32(b->weight);
+	b->size = crush_le32(b->size);
+	b->arg = crush_le32(b->arg);
+	b->items = crush_le64(b->items);
+	b->weights = crush_le64(b->weights);
+	b->extra = crush_le64(b->extra);
+}
+
+static void crush_dec_weight_set(const char *p, struct crush_disk_weight_set *ws)
+{
+	memcpy(ws, p, sizeof(*ws));
+	ws->size = crush_le32(ws->size);
+	ws->weights = crush_le64(ws->weights);
+	ws->recips = crush_le64(ws->recips);
+}
+
+/* the space taken in the decoded map by an array */
+static size_t crush_dec_array_size(const struct crush_decoder *d,
+				   __u64 count, size_t size)
+{
+	return d->in_place ? 0 : crush_encoding_size(count * size);
+}
+
+static size_t crush_dec_bucket_struct_size(int alg)
+{
+	switch (alg) {
+	case CRUSH_BUCKET_UNIFORM:
+		return sizeof(struct crush_bucket_uniform);
+	case CRUSH_BUCKET_LIST:
+		return sizeof(struct crush_bucket_list);
+	case CRUSH_BUCKET_TREE:
+		return sizeof(struct crush_bucket_tree);
+	case CRUSH_BUCKET_STRAW:
+		return sizeof(struct crush_bucket_straw);
+	case CRUSH_BUCKET_STRAW2:
+		return sizeof(struct crush_bucket_straw2);
+	default:
+		return 0;
+	}
+}
+
+/* check the bucket @b and add the size it takes to @size */
+static int crush_dec_check_bucket(const struct crush_decoder *d, int b,
+				  __u64 offset, size_t *size)
+{
+	struct crush_disk_bucket db;
+	const char *p, *items;
+	__u32 i, weights;
+
+	p = crush_dec_at(d, offset, 1, sizeof(db));
+	if (!p)
+		return -EINVAL;
+	crush_dec_bucket_header(p, &db);
+	if (db.id != -1-b || crush_dec_bucket_struct_size(db.alg) == 0)
+		return -EINVAL;
+	items = crush_dec_at(d, db.items, db.size, sizeof(__s32));
+	if (!items)
+		return -EINVAL;
+	for (i = 0; i < db.size; i++) {
+		__s32 item = crush_dec_u32(items + i * sizeof(__s32));
+		if (item < 0 && (-1-item >= d->h.max_buckets ||
+				 !crush_dec_table(d->buckets, -1-item)))
+			return -EINVAL;
+	}
+	*size += crush_encoding_size(crush_dec_bucket_struct_size(db.alg)) +
+		crush_dec_array_size(d, db.size, sizeof(__s32));
+
+	weights = db.alg == CRUSH_BUCKET_TREE ? db.arg : db.size;
+	if (db.alg != CRUSH_BUCKET_UNIFORM) {
+		/* the nodes are a power of two from the root,
+		   num_nodes / 2, and hold a leaf for each item */
+		if (db.alg == CRUSH_BUCKET_TREE && db.size > 0 &&
+		    (db.arg > 255 || db.arg == 0 || (db.arg & (db.arg - 1)) ||
+		     db.arg < (__u32)crush_calc_tree_node(db.size - 1) + 1))
+			return -EINVAL;
+		if (!crush_dec_at(d, db.weights, weights, sizeof(__u32)))
+			return -EINVAL;
+		*size += crush_dec_array_size(d, weights, sizeof(__u32));
+	}
+	if (db.alg == CRUSH_BUCKET_LIST || db.alg == CRUSH_BUCKET_STRAW) {
+		if (!crush_dec_at(d, db.extra, db.size, sizeof(__u32)))
+			return -EINVAL;
+		*size += crush_dec_array_size(d, db.size, sizeof(__u32));
+	}
+	if (db.alg == CRUSH_BUCKET_STRAW2 && db.extra) {
+		if (!crush_dec_at(d, db.extra, db.size,
+				  sizeof(struct crush_straw2_recip)))
+			return -EINVAL;
+		*size += crush_dec_array_size(d, db.size,
+					      sizeof(struct crush_straw2_recip));
+	}
+	return 0;
+}
+
+static int crush_dec_check_rule(const struct crush_decoder *d, __u64 offset,
+				size_t *size)
+{
+	const char *p;
+	__u32 len;
+
+	p = crush_dec_at(d, offset, 1, sizeof(struct crush_rule));
+	if (!p)
+		return -EINVAL;
+	len = crush_dec_u32(p);
+	if (!crush_dec_at(d, offset + sizeof(struct crush_rule), len,
+			  sizeof(struct crush_rule_step)))
+		return -EINVAL;
+	*size += d->in_place ? 0 : crush_encoding_size(crush_rule_size(len));
+	return 0;
+}
+
+static int crush_dec_check_choose_arg(const struct crush_decoder *d, int b,
+				      __u64 offset, size_t *size)
+{
+	struct crush_disk_weight_set ws;
+	__u64 bucket = crush_dec_table(d->buckets, b);
+	__u32 bucket_size, ids_size, weight_set_size, position;
+	const char *p;
+
+	/* the bucket was checked before */
+	p = crush_dec_at(d, offset, 1, sizeof(struct crush_disk_choose_arg));
+	if (!bucket || !p)
+		return -EINVAL;
+	bucket_size = crush_dec_u32(d->buf + bucket +
+				    offsetof(struct crush_disk_bucket, size));
+	ids_size = crush_dec_u32(p + offsetof(struct crush_disk_choose_arg, ids_size));
+	weight_set_size = crush_dec_u32(p + offsetof(struct crush_disk_choose_arg,
+						     weight_set_size));
+	if (ids_size) {
+		if (ids_size != bucket_size ||
+		    !crush_dec_at(d, crush_dec_u64(p + offsetof(struct crush_disk_choose_arg, ids)),
+				  ids_size, sizeof(__s32)))
+			return -EINVAL;
+		*size += crush_dec_array_size(d, ids_size, sizeof(__s32));
+	}
+	if (!crush_dec_at(d, offset + sizeof(struct crush_disk_choose_arg),
+			  weight_set_size, sizeof(ws)))
+		return -EINVAL;
+	*size += crush_encoding_size(sizeof(struct crush_weight_set) * weight_set_size);
+	for (position = 0; position < weight_set_size; position++) {
+		crush_dec_weight_set(p + sizeof(struct crush_disk_choose_arg) +
+				     position * sizeof(ws), &ws);
+		if (ws.size != bucket_size ||
+		    !crush_dec_at(d, ws.weights, ws.size, sizeof(__u32)))
+			return -EINVAL;
+		*size += crush_dec_array_size(d, ws.size, sizeof(__u32));
+		if (ws.recips) {
+			if (!crush_dec_at(d, ws.recips, ws.size,
+					  sizeof(struct crush_straw2_recip)))
+				return -EINVAL;
+			*size += crush_dec_array_size(d, ws.size,
+						      sizeof(struct crush_straw2_recip));
+		}
+	}
+	return 0;
+}
+
+/* check the encoding and calculate the size of the decoded map and choose_args */
+static int crush_dec_check(struct crush_decoder *d, size_t *map_size,
+			   size_t *args_size)
+{
+	__u64 offset;
+	__u32 r;
+	int b, err;
+
+	if (d->len < sizeof(d->h))
+		return -EINVAL;
+	memcpy(&d->h, d->buf, sizeof(d->h));
+	d->h.magic = crush_le32(d->h.magic);
+	d->h.version = crush_le32(d->h.version);
+	d->h.size = crush_le64(d->h.size);
+	d->h.choose_local_tries = crush_le32(d->h.choose_local_tries);
+	d->h.choose_local_fallback_tries = crush_le32(d->h.choose_local_fallback_tries);
+	d->h.choose_total_tries = crush_le32(d->h.choose_total_tries);
+	d->h.chooseleaf_descend_once = crush_le32(d->h.chooseleaf_descend_once);
+	d->h.chooseleaf_vary_r = crush_le32(d->h.chooseleaf_vary_r);
+	d->h.chooseleaf_stable = crush_le32(d->h.chooseleaf_stable);
+	d->h.straw_calc_version = crush_le32(d->h.straw_calc_version);
+	d->h.allowed_bucket_algs = crush_le32(d->h.allowed_bucket_algs);
+	d->h.max_buckets = crush_le32(d->h.max_buckets);
+	d->h.max_rules = crush_le32(d->h.max_rules);
+	d->h.max_devices = crush_le32(d->h.max_devices);
+	d->h.buckets = crush_le64(d->h.buckets);
+	d->h.rules = crush_le64(d->h.rules);
+	d->h.choose_args = crush_le64(d->h.choose_args);
+	if (d->h.magic != CRUSH_ENCODING_MAGIC ||
+	    d->h.version != CRUSH_ENCODING_VERSION ||
+	    d->h.size > d->len || d->h.max_buckets < 0)
+		return -EINVAL;
+	d->len = d->h.size;
+
+	d->buckets = crush_dec_at(d, d->h.buckets, d->h.max_buckets, sizeof(__u64));
+	d->rules = crush_dec_at(d, d->h.rules, d->h.max_rules, sizeof(__u64));
+	if (!d->buckets || !d->rules)
+		return -EINVAL;
+	if (d->h.choose_args) {
+		d->choose_args = crush_dec_at(d, d->h.choose_args,
+					      d->h.max_buckets, sizeof(__u64));
+		if (!d->choose_args)
+			return -EINVAL;
+	}
+
+	*map_size = crush_encoding_size(sizeof(struct crush_map)) +
+		crush_encoding_size(sizeof(struct crush_bucket *) * d->h.max_buckets) +
+		crush_encoding_size(sizeof(struct crush_rule *) * d->h.max_rules);
+	for (b = 0; b < d->h.max_buckets; b++) {
+		offset = crush_dec_table(d->buckets, b);
+		if (offset && (err = crush_dec_check_bucket(d, b, offset, map_size)) < 0)
+			return err;
+	}
+	for (r = 0; r < d->h.max_rules; r++) {
+		offset = crush_dec_table(d->rules, r);
+		if (offset && (err = crush_dec_check_rule(d, offset, map_size)) < 0)
+			return err;
+	}
+	*args_size = 0;
+	if (d->choose_args) {
+		/* the choose_args are always copied, see crush_dec_map() */
+		int in_place = d->in_place;
+
+		d->in_place = 0;
+		err = 0;
+		*args_size = crush_encoding_size(sizeof(struct crush_choose_arg) *
+						 d->h.max_buckets);
+		for (b = 0; b < d->h.max_buckets; b++) {
+			offset = crush_dec_table(d->choose_args, b);
+			if (offset &&
+			    (err = crush_dec_check_choose_arg(d, b, offset, args_size)) < 0)
+				break;
+		}
+		d->in_place = in_place;
+		if (err < 0)
+			return err;
+	}
+	return 0;
+}
+
+/* the array of @count 32 bits values at @offset, at @point if copied */
+static void *crush_dec_u32s(const struct crush_decoder *d, char **point,
+			    __u64 offset, __u32 count)
+{
+	__u32 *dst = (__u32 *)*point;
+	__u32 i;
+
+	if (d->in_place)
+		return (void *)(d->buf + offset);
+	for (i = 0; i < count; i++)
+		dst[i] = crush_dec_u32(d->buf + offset + i * sizeof(__u32));
+	*point += crush_encoding_size(sizeof(__u32) * count);
+	return dst;
+}
+
+static struct crush_straw2_recip *crush_dec_recips(const struct crush_decoder *d,
+						   char **point,
+						   __u64 offset, __u32 count)
+{
+	struct crush_straw2_recip *dst = (struct crush_straw2_recip *)*point;
+	__u32 i;
+
+	if (offset == 0)
+		return NULL;
+	if (d->in_place)
+		return (struct crush_straw2_recip *)(d->buf + offset);
+	memcpy(dst, d->buf + offset, sizeof(*dst) * count);
+	for (i = 0; i < count; i++) {
+		dst[i].magic = crush_le64(dst[i].magic);
+		dst[i].weight = crush_le32(dst[i].weight);
+		dst[i].shift = crush_le32(dst[i].shift);
+	}
+	*point += crush_encoding_size(sizeof(*dst) * count);
+	return dst;
+}
+
+static struct crush_bucket *crush_dec_bucket(const struct crush_decoder *d,
+					     const char *p, char **point)
+{
+	struct crush_disk_bucket db;
+	struct crush_bucket *b = (struct crush_bucket *)*point;
+
+	crush_dec_bucket_header(p, &db);
+	*point += crush_encoding_size(crush_dec_bucket_struct_size(db.alg));
+	b->id = db.id;
+	b->type = db.type;
+	b->alg = db.alg;
+	b->hash = db.hash;
+	b->weight = db.weight;
+	b->size = db.size;
+	b->items = crush_dec_u32s(d, point, db.items, db.size);
+	switch (db.alg) {
+	case CRUSH_BUCKET_UNIFORM:
+		((struct crush_bucket_uniform *)b)->item_weight = db.arg;
+		break;
+	case CRUSH_BUCKET_LIST: {
+		struct crush_bucket_list *list = (struct crush_bucket_list *)b;
+		list->item_weights = crush_dec_u32s(d, point, db.weights, db.size);
+		list->sum_weights = crush_dec_u32s(d, point, db.extra, db.size);
+		break;
+	}
+	case CRUSH_BUCKET_TREE: {
+		struct crush_bucket_tree *tree = (struct crush_bucket_tree *)b;
+		tree->num_nodes = db.arg;
+		tree->node_weights = crush_dec_u32s(d, point, db.weights, db.arg);
+		break;
+	}
+	case CRUSH_BUCKET_STRAW: {
+		struct crush_bucket_straw *straw = (struct crush_bucket_straw *)b;
+		straw->item_weights = crush_dec_u32s(d, point, db.weights, db.size);
+		straw->straws = crush_dec_u32s(d, point, db.extra, db.size);
+		break;
+	}
+	case CRUSH_BUCKET_STRAW2: {
+		struct crush_bucket_straw2 *straw2 = (struct crush_bucket_straw2 *)b;
+		straw2->item_weights = crush_dec_u32s(d, point, db.weights, db.size);
+		straw2->item_recips = crush_dec_recips(d, point, db.extra, db.size);
+		break;
+	}
+	}
+	return b;
+}
+
+static struct crush_rule *crush_dec_rule(const struct crush_decoder *d,
+					 const char *p, char **point)
+{
+	struct crush_rule *r = (struct crush_rule *)*point;
+	__u32 i, len = crush_dec_u32(p);
+
+	if (d->in_place)
+		return (struct crush_rule *)p;
+	r->len = len;
+	memcpy(&r->mask, p + sizeof(__u32), sizeof(r->mask));
+	for (i = 0; i < len; i++) {
+		const char *step = p + crush_rule_size(i);
+		r->steps[i].op = crush_dec_u32(step);
+		r->steps[i].arg1 = crush_dec_u32(step + sizeof(__u32));
+		r->steps[i].arg2 = crush_dec_u32(step + 2 * sizeof(__u32));
+	}
+	*point += crush_encoding_size(crush_rule_size(len));
+	return r;
+}
+
+static void crush_dec_choose_arg(const struct crush_decoder *d, const char *p,
+				 struct crush_choose_arg *arg, char **point)
+{
+	struct crush_disk_weight_set ws;
+	__u32 position;
+
+	arg->ids_size = crush_dec_u32(p + offsetof(struct crush_disk_choose_arg, ids_size));
+	if (arg->ids_size)
+		arg->ids = crush_dec_u32s(d, point,
+					  crush_dec_u64(p + offsetof(struct crush_disk_choose_arg, ids)),
+					  arg->ids_size);
+	arg->weight_set_size = crush_dec_u32(p + offsetof(struct crush_disk_choose_arg,
+							  weight_set_size));
+	arg->weight_set = (struct crush_weight_set *)*point;
+	*point += crush_encoding_size(sizeof(struct crush_weight_set) *
+				      arg->weight_set_size);
+	for (position = 0; position < arg->weight_set_size; position++) {
+		struct crush_weight_set *to = &arg->weight_set[position];
+		crush_dec_weight_set(p + sizeof(struct crush_disk_choose_arg) +
+				     position * sizeof(ws), &ws);
+		to->size = ws.size;
+		to->weights = crush_dec_u32s(d, point, ws.weights, ws.size);
+		to->recips = crush_dec_recips(d, point, ws.recips, ws.size);
+	}
+	if (arg->weight_set_size == 0)
+		arg->weight_set = NULL;
+}
+
+static struct crush_map *crush_dec_map(struct crush_decoder *d,
+				       struct crush_choose_arg **choose_args)
+{
+	struct crush_map *map;
+	struct crush_choose_arg *args = NULL;
+	size_t map_size, args_size;
+	__u64 offset;
+	char *point;
+	__u32 r;
+	int b, err;
+
+	if (choose_args)
+		*choose_args = NULL;
+	err = crush_dec_check(d, &map_size, &args_size);
+	if (err < 0) {
+		errno = -err;
+		return NULL;
+	}
+	map = calloc(1, map_size);
+	if (!map)
+		return NULL;
+	if (choose_args && d->choose_args) {
+		args = calloc(1, args_size);
+		if (!args) {
+			free(map);
+			return NULL;
+		}
+	}
+
+	point = (char *)map + crush_encoding_size(sizeof(*map));
+	map->arena = map;
+	map->choose_local_tries = d->h.choose_local_tries;
+	map->choose_local_fallback_tries = d->h.choose_local_fallback_tries;
+	map->choose_total_tries = d->h.choose_total_tries;
+	map->chooseleaf_descend_once = d->h.chooseleaf_descend_once;
+	map->chooseleaf_vary_r = d->h.chooseleaf_vary_r;
+	map->chooseleaf_stable = d->h.chooseleaf_stable;
+	map->straw_calc_version = d->h.straw_calc_version;
+	map->allowed_bucket_algs = d->h.allowed_bucket_algs;
+	map->max_buckets = d->h.max_buckets;
+	map->max_rules = d->h.max_rules;
+	map->max_devices = d->h.max_devices;
+	map->buckets = (struct crush_bucket **)point;
+	point += crush_encoding_size(sizeof(struct crush_bucket *) * map->max_buckets);
+	map->rules = (struct crush_rule **)point;
+	point += crush_encoding_size(sizeof(struct crush_rule *) * map->max_rules);
+	for (b = 0; b < map->max_buckets; b++) {
+		offset = crush_dec_table(d->buckets, b);
+		if (offset)
+			map->buckets[b] = crush_dec_bucket(d, d->buf + offset, &point);
+	}
+	for (r = 0; r < map->max_rules; r++) {
+		offset = crush_dec_table(d->rules, r);
+		if (offset)
+			map->rules[r] = crush_dec_rule(d, d->buf + offset, &point);
+	}
+	BUG_ON(point != (char *)map + map_size);
+	crush_calc_working_size(map);
+
+	if (args) {
+		/*
+		 * The weight sets and ids are updated in place, for instance
+		 * by crush_choose_args_set_weights() or
+		 * crush_optimize_choose_args(): they are copied instead of
+		 * pointing to a read only mapping.
+		 */
+		int in_place = d->in_place;
+
+		d->in_place = 0;
+		point = (char *)args + crush_encoding_size(sizeof(*args) *
+							   map->max_buckets);
+		for (b = 0; b < map->max_buckets; b++) {
+			offset = crush_dec_table(d->choose_args, b);
+			if (offset)
+				crush_dec_choose_arg(d, d->buf + offset, &args[b],
+						     &point);
+		}
+		d->in_place = in_place;
+		BUG_ON(point != (char *)args + args_size);
+		*choose_args = args;
+	}
+	return map;
+}
+
+struct crush_map *crush_decode(const void *buf, size_t len,
+			       struct crush_choose_arg **choose_args)
+{
+	struct crush_decoder d;
+
+	memset(&d, 0, sizeof(d));
+	d.buf = buf;
+	d.len = len;
+	d.in_place = 0;
+	return crush_dec_map(&d, choose_args);
+}
+
+struct crush_map *crush_map_file(const char *path,
+				 struct crush_choose_arg **choose_args)
+{
+	struct crush_decoder d;
+	struct crush_map *map;
+	struct stat st;
+	void *mapping;
+	int fd, err;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0) {
+		err = errno;
+		close(fd);
+		errno = err;
+		return NULL;
+	}
+	if (st.st_size < (off_t)sizeof(struct crush_disk_header)) {
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+	mapping = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	err = errno;
+	close(fd);
+	if (mapping == MAP_FAILED) {
+		errno = err;
+		return NULL;
+	}
+
+	memset(&d, 0, sizeof(d));
+	d.buf = mapping;
+	d.len = st.st_size;
+	d.in_place = !CRUSH_ENCODING_SWAP;
+	map = crush_dec_map(&d, choose_args);
+	if (!map || !d.in_place) {
+		err = errno;
+		munmap(mapping, st.st_size);
+		errno = err;
+		return map;
+	}
+	map->mapping = mapping;
+	map->mapping_size = st.st_size;
+	return map;
+}
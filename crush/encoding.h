@@ -0,0 +1,100 @@
+#ifndef CEPH_CRUSH_ENCODING_H
+#define CEPH_CRUSH_ENCODING_H
+
+/*
+ * Binary encoding of a crush_map.
+ *
+ * LGPL2
+ */
+
+#include "crush.h"
+
+/*
+ * The encoding is little endian and made of 8 bytes aligned records.
+ * It starts with a header holding the tunables and the offsets,
+ * relative to the beginning of the encoding, of the tables of
+ * offsets of the buckets, the rules and the choose_args. Each array
+ * of a bucket has its own offset so that it can be used where it is
+ * found, without being copied.
+ */
+#define CRUSH_ENCODING_MAGIC 0x48535243 /* "CRSH" */
+#define CRUSH_ENCODING_VERSION 1
+
+/** @ingroup API
+ *
+ * Encode __map__ and, if not NULL, the __choose_args__ array of
+ * size __map->max_buckets__, as returned by crush_make_choose_args().
+ * The reciprocals of the straw2 weights are encoded as well, whether
+ * or not __map__ has them, so that the decoded map does not need to
+ * compute them.
+ *
+ * The caller is responsible for deallocating the __buf__ via __free(3)__.
+ *
+ * - return -ENOMEM if __malloc(3)__ fails
+ * - return -EINVAL if a bucket has an unknown algorithm
+ *
+ * @param[in] map a finalized crush_map
+ * @param[in] choose_args weights and ids for each bucket or NULL
+ * @param[out] buf the __malloc(3)__ buffer holding the encoding
+ * @param[out] len the size of __buf__
+ *
+ * @returns 0 on success, < 0 on error
+ */
+extern int crush_encode(const struct crush_map *map,
+			const struct crush_choose_arg *choose_args,
+			void **buf, size_t *len);
+
+/** @ingroup API
+ *
+ * Decode a map encoded with crush_encode(). The decoded map is a
+ * copy, as returned by crush_flatten(): it is read only, does not
+ * depend on __buf__ and must be deallocated with crush_destroy(). It
+ * is ready to be used by crush_do_rule(), crush_finalize() must not be
+ * called.
+ *
+ * If the encoding has choose_args and __choose_args__ is not NULL,
+ * it is set to an array of __map->max_buckets__ crush_choose_arg that
+ * must be deallocated with crush_destroy_choose_args(). Otherwise it is
+ * set to NULL.
+ *
+ * - __errno__ is ENOMEM if __malloc(3)__ fails
+ * - __errno__ is EINVAL if __buf__ is not a valid encoding
+ *
+ * @param[in] buf the encoding
+ * @param[in] len the size of __buf__
+ * @param[out] choose_args the decoded choose_args or NULL
+ *
+ * @returns the decoded map or NULL with __errno__ set on error
+ */
+extern struct crush_map *crush_decode(const void *buf, size_t len,
+				      struct crush_choose_arg **choose_args);
+
+/** @ingroup API
+ *
+ * Load the map encoded with crush_encode() in the file __path__ by
+ * mapping it in memory with __mmap(3)__. On a little endian host, the
+ * arrays of the buckets (items, weights, etc.) and the rules are used
+ * where they are found in the file instead of being copied, which is
+ * to say that loading the map only costs a small allocation for each
+ * bucket and that the processes that load the same file share the
+ * same pages. On a big endian host, the map is decoded as with
+ * crush_decode().
+ *
+ * The file must not be modified while the map is loaded. The map is
+ * read only and must be deallocated with crush_destroy(), which
+ * unmaps the file. The __choose_args__ are copied as by
+ * crush_decode(), so that their weight sets can be updated in place.
+ *
+ * - __errno__ is set by __open(2)__, __fstat(2)__ or __mmap(2)__ on failure
+ * - __errno__ is ENOMEM if __malloc(3)__ fails
+ * - __errno__ is EINVAL if the file is not a valid encoding
+ *
+ * @param[in] path the file holding the encoding
+ * @param[out] choose_args the decoded choose_args or NULL
+ *
+ * @returns the loaded map or NULL with __errno__ set on error
+ */
+extern struct crush_map *crush_map_file(const char *path,
+					struct crush_choose_arg **choose_args);
+
+#endif
@@ -0,0 +1,308 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "epoch.h"
+#include "builder.h"
+#include "mapper.h"
+
+#define CRUSH_CACHE_LINE 64
+
+/*
+ * A map published by crush_handle_publish(). It is current while the
+ * epoch of the handle is __epoch__ and is deallocated once no reader
+ * entered at __epoch__ or before is left.
+ */
+struct crush_version {
+	struct crush_map *map;
+	struct crush_choose_arg *choose_args;
+	__u64 epoch;
+	struct crush_version *next;	/* in the retired list */
+};
+
+/*
+ * The readers are the only ones writing there, each in its own cache
+ * line. The __epoch__ of a reader is that of the handle when it
+ * entered or zero when it is not between crush_reader_enter() and
+ * crush_reader_leave(): it is read by the writers and the rest is
+ * private to the thread using the reader.
+ */
+struct crush_reader {
+	__u64 epoch;
+	int depth;
+	int in_use;
+	struct crush_version *version;
+	struct crush_handle *handle;
+	struct crush_reader *next;
+	char *cwin;
+	size_t cwin_size;
+	__u64 cwin_epoch;
+	int cwin_result_max;
+} __attribute__((aligned(CRUSH_CACHE_LINE)));
+
+/*
+ * The readers load __epoch__ and __current__, which only change when
+ * a map is published. The rest belongs to the writers, serialized by
+ * __lock__, and is in another cache line.
+ */
+struct crush_handle {
+	struct crush_version *current;
+	__u64 epoch;
+	pthread_mutex_t lock __attribute__((aligned(CRUSH_CACHE_LINE)));
+	struct crush_reader *readers;
+	struct crush_version *retired;
+} __attribute__((aligned(CRUSH_CACHE_LINE)));
+
+static struct crush_version *crush_version_create(struct crush_map *map,
+						  struct crush_choose_arg *choose_args,
+						  __u64 epoch)
+{
+	struct crush_version *version = malloc(sizeof(*version));
+
+	if (!version)
+		return NULL;
+	version->map = map;
+	version->choose_args = choose_args;
+	version->epoch = epoch;
+	version->next = NULL;
+	return version;
+}
+
+static void crush_version_destroy(struct crush_version *version)
+{
+	if (version->choose_args)
+		crush_destroy_choose_args(version->choose_args);
+	crush_destroy(version->map);
+	free(version);
+}
+
+struct crush_handle *crush_handle_create(struct crush_map *map,
+					 struct crush_choose_arg *choose_args)
+{
+	struct crush_handle *handle;
+	void *p;
+
+	if (!map) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (posix_memalign(&p, CRUSH_CACHE_LINE, sizeof(*handle))) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	handle = (struct crush_handle *)p;
+	handle->epoch = 1;
+	handle->current = crush_version_create(map, choose_args, handle->epoch);
+	if (!handle->current) {
+		free(handle);
+		errno = ENOMEM;
+		return NULL;
+	}
+	pthread_mutex_init(&handle->lock, NULL);
+	handle->readers = NULL;
+	handle->retired = NULL;
+	return handle;
+}
+
+void crush_handle_destroy(struct crush_handle *handle)
+{
+	struct crush_version *version, *next;
+	struct crush_reader *reader, *next_reader;
+
+	for (version = handle->retired; version; version = next) {
+		next = version->next;
+		crush_version_destroy(version);
+	}
+	crush_version_destroy(handle->current);
+	for (reader = handle->readers; reader; reader = next_reader) {
+		next_reader = reader->next;
+		free(reader->cwin);
+		free(reader);
+	}
+	pthread_mutex_destroy(&handle->lock);
+	free(handle);
+}
+
+/* with handle->lock held */
+static int crush_handle_reclaim_locked(struct crush_handle *handle)
+{
+	struct crush_version **link, *version;
+	struct crush_reader *reader;
+	__u64 oldest = 0;
+	int left = 0;
+
+	/*
+	 * A reader that read an epoch lower or equal to that of a retired
+	 * map may have loaded it as current after that: it is kept until
+	 * the reader leaves. The readers entering now load a later epoch
+	 * or a later map.
+	 */
+	for (reader = handle->readers; reader; reader = reader->next) {
+		__u64 epoch = __atomic_load_n(&reader->epoch, __ATOMIC_SEQ_CST);
+
+		if (epoch && (oldest == 0 || epoch < oldest))
+			oldest = epoch;
+	}
+	link = &handle->retired;
+	while ((version = *link)) {
+		if (oldest == 0 || version->epoch < oldest) {
+			*link = version->next;
+			crush_version_destroy(version);
+		} else {
+			link = &version->next;
+			left++;
+		}
+	}
+	return left;
+}
+
+long long crush_handle_publish(struct crush_handle *handle,
+			       struct crush_map *map,
+			       struct crush_choose_arg *choose_args)
+{
+	struct crush_version *version, *former;
+	long long epoch;
+
+	if (!map)
+		return -EINVAL;
+	pthread_mutex_lock(&handle->lock);
+	epoch = handle->epoch + 1;
+	version = crush_version_create(map, choose_args, epoch);
+	if (!version) {
+		pthread_mutex_unlock(&handle->lock);
+		return -ENOMEM;
+	}
+	former = __atomic_exchange_n(&handle->current, version,
+				     __ATOMIC_SEQ_CST);
+	__atomic_store_n(&handle->epoch, epoch, __ATOMIC_SEQ_CST);
+	former->next = handle->retired;
+	handle->retired = former;
+	crush_handle_reclaim_locked(handle);
+	pthread_mutex_unlock(&handle->lock);
+	return epoch;
+}
+
+int crush_handle_reclaim(struct crush_handle *handle)
+{
+	int left;
+
+	pthread_mutex_lock(&handle->lock);
+	left = crush_handle_reclaim_locked(handle);
+	pthread_mutex_unlock(&handle->lock);
+	return left;
+}
+
+long long crush_handle_epoch(const struct crush_handle *handle)
+{
+	return __atomic_load_n(&handle->epoch, __ATOMIC_ACQUIRE);
+}
+
+struct crush_reader *crush_reader_create(struct crush_handle *handle)
+{
+	struct crush_reader *reader;
+	void *p;
+
+	pthread_mutex_lock(&handle->lock);
+	/* reuse a reader deallocated by crush_reader_destroy() */
+	for (reader = handle->readers; reader; reader = reader->next)
+		if (!reader->in_use)
+			break;
+	if (!reader) {
+		if (posix_memalign(&p, CRUSH_CACHE_LINE, sizeof(*reader))) {
+			pthread_mutex_unlock(&handle->lock);
+			errno = ENOMEM;
+			return NULL;
+		}
+		reader = (struct crush_reader *)p;
+		reader->cwin = NULL;
+		reader->next = handle->readers;
+		handle->readers = reader;
+	}
+	reader->epoch = 0;
+	reader->depth = 0;
+	reader->in_use = 1;
+	reader->version = NULL;
+	reader->handle = handle;
+	reader->cwin_size = 0;
+	reader->cwin_epoch = 0;
+	reader->cwin_result_max = 0;
+	pthread_mutex_unlock(&handle->lock);
+	return reader;
+}
+
+void crush_reader_destroy(struct crush_reader *reader)
+{
+	struct crush_handle *handle = reader->handle;
+
+	/* the writers keep walking the list of readers: it is kept, as
+	   the reader, until crush_handle_destroy() */
+	pthread_mutex_lock(&handle->lock);
+	free(reader->cwin);
+	reader->cwin = NULL;
+	reader->in_use = 0;
+	pthread_mutex_unlock(&handle->lock);
+}
+
+const struct crush_map *crush_reader_enter(struct crush_reader *reader,
+					   const struct crush_choose_arg **choose_args)
+{
+	struct crush_handle *handle = reader->handle;
+
+	if (reader->depth++ == 0) {
+		/*
+		 * The epoch is stored before the current map is loaded, in
+		 * the same total order as the exchange and the loads of
+		 * crush_handle_publish(): a writer that does not see it
+		 * published the map before it is loaded.
+		 */
+		__atomic_store_n(&reader->epoch,
+				 __atomic_load_n(&handle->epoch,
+						 __ATOMIC_ACQUIRE),
+				 __ATOMIC_SEQ_CST);
+		reader->version = __atomic_load_n(&handle->current,
+						  __ATOMIC_SEQ_CST);
+	}
+	if (choose_args)
+		*choose_args = reader->version->choose_args;
+	return reader->version->map;
+}
+
+void crush_reader_leave(struct crush_reader *reader)
+{
+	if (--reader->depth == 0) {
+		reader->version = NULL;
+		__atomic_store_n(&reader->epoch, 0, __ATOMIC_RELEASE);
+	}
+}
+
+int crush_reader_do_rule(struct crush_reader *reader, int ruleno, int x,
+			 int *result, int result_max,
+			 const __u32 *weights, int weight_max)
+{
+	const struct crush_choose_arg *choose_args;
+	const struct crush_map *map = crush_reader_enter(reader, &choose_args);
+	int len;
+
+	if (reader->cwin_epoch != reader->version->epoch ||
+	    reader->cwin_result_max != result_max) {
+		size_t size = crush_work_size(map, result_max);
+
+		if (size > reader->cwin_size) {
+			char *cwin = realloc(reader->cwin, size);
+
+			if (!cwin) {
+				crush_reader_leave(reader);
+				return -ENOMEM;
+			}
+			reader->cwin = cwin;
+			reader->cwin_size = size;
+		}
+		crush_init_workspace(map, reader->cwin);
+		reader->cwin_epoch = reader->version->epoch;
+		reader->cwin_result_max = result_max;
+	}
+	len = crush_do_rule(map, ruleno, x, result, result_max,
+			    weights, weight_max, reader->cwin, choose_args);
+	crush_reader_leave(reader);
+	return len;
+}
@@ -0,0 +1,179 @@
+#ifndef CEPH_CRUSH_EPOCH_H
+#define CEPH_CRUSH_EPOCH_H
+
+/*
+ * A handle on the current crush_map, replaced while other threads map
+ * values with it and deallocated once they no longer use it.
+ *
+ * LGPL2
+ */
+
+#include "crush.h"
+
+struct crush_handle;
+struct crush_reader;
+
+/** @ingroup API
+ *
+ * Allocate a handle publishing __map__ and __choose_args__, which may
+ * be NULL, to the threads reading it with the crush_reader of
+ * crush_reader_create(). The handle owns them from now on: they are
+ * deallocated with crush_destroy() and crush_destroy_choose_args()
+ * when another map is published and no reader uses them anymore, or
+ * by crush_handle_destroy().
+ *
+ * The maps published must be finalized and are not modified while
+ * published: the readers use them without locking.
+ *
+ * The handle must be deallocated with crush_handle_destroy().
+ *
+ * - __errno__ is EINVAL if __map__ is NULL
+ * - __errno__ is ENOMEM if __malloc(3)__ fails
+ *
+ * @param map the crush_map, finalized
+ * @param choose_args weights and ids for each known bucket or NULL
+ *
+ * @returns the handle or NULL with __errno__ set on error
+ */
+extern struct crush_handle *crush_handle_create(struct crush_map *map,
+						struct crush_choose_arg *choose_args);
+
+/** @ingroup API
+ *
+ * Deallocate a handle returned by crush_handle_create(), the maps it
+ * owns and its readers. No reader must be between crush_reader_enter()
+ * and crush_reader_leave() or be used afterwards.
+ *
+ * @param handle the handle to deallocate
+ */
+extern void crush_handle_destroy(struct crush_handle *handle);
+
+/** @ingroup API
+ *
+ * Replace the map and choose_args of __handle__ with __map__ and
+ * __choose_args__, with the same ownership as crush_handle_create().
+ * The readers entering after crush_handle_publish() returns use the
+ * new map, those that entered before keep using the former one until
+ * they leave. The maps no reader uses anymore are then deallocated, as
+ * crush_handle_reclaim() does.
+ *
+ * The epoch of the handle, which is 1 after crush_handle_create(), is
+ * incremented for each map published. Writers are serialized by a
+ * mutex and can publish from any thread.
+ *
+ * - return -EINVAL if __map__ is NULL
+ * - return -ENOMEM if __malloc(3)__ fails, the map is not published
+ *   and is still owned by the caller
+ *
+ * @param handle the handle
+ * @param map the crush_map, finalized
+ * @param choose_args weights and ids for each known bucket or NULL
+ *
+ * @returns the epoch of __map__ on success, < 0 on error
+ */
+extern long long crush_handle_publish(struct crush_handle *handle,
+				      struct crush_map *map,
+				      struct crush_choose_arg *choose_args);
+
+/** @ingroup API
+ *
+ * Deallocate the maps replaced by crush_handle_publish() that no
+ * reader uses anymore. It is called by crush_handle_publish() and
+ * only needs to be called to deallocate the maps a reader was using
+ * at the time, for instance periodically.
+ *
+ * @param handle the handle
+ *
+ * @returns the number of maps replaced that are still in use
+ */
+extern int crush_handle_reclaim(struct crush_handle *handle);
+
+/** @ingroup API
+ *
+ * Allocate a reader of __handle__ for the calling thread. A reader
+ * must be used by a single thread at a time: between
+ * crush_reader_enter() and crush_reader_leave(), it only writes to
+ * its own cache line and reads the epoch of the handle, so that the
+ * readers of different threads do not slow each other down.
+ *
+ * The reader can be deallocated with crush_reader_destroy() or is
+ * deallocated by crush_handle_destroy().
+ *
+ * - __errno__ is ENOMEM if __malloc(3)__ fails
+ *
+ * @param handle the handle
+ *
+ * @returns the reader or NULL with __errno__ set on error
+ */
+extern struct crush_reader *crush_reader_create(struct crush_handle *handle);
+
+/** @ingroup API
+ *
+ * Deallocate a reader returned by crush_reader_create(), which must
+ * not be between crush_reader_enter() and crush_reader_leave().
+ *
+ * @param reader the reader to deallocate
+ */
+extern void crush_reader_destroy(struct crush_reader *reader);
+
+/** @ingroup API
+ *
+ * Pin the map currently published by the handle of __reader__ and
+ * return it, with its choose_args in __choose_args__ unless it is
+ * NULL. The map and choose_args are not deallocated until
+ * crush_reader_leave() is called as many times as
+ * crush_reader_enter(): the calls can be nested and the innermost
+ * return the map pinned by the outermost.
+ *
+ * @param reader the reader of the calling thread
+ * @param choose_args set to the choose_args of the map or NULL
+ *
+ * @returns the crush_map pinned
+ */
+extern const struct crush_map *crush_reader_enter(struct crush_reader *reader,
+						  const struct crush_choose_arg **choose_args);
+
+/** @ingroup API
+ *
+ * Unpin the map returned by the matching crush_reader_enter(). The
+ * map and its choose_args must not be used afterwards.
+ *
+ * @param reader the reader of the calling thread
+ */
+extern void crush_reader_leave(struct crush_reader *reader);
+
+/** @ingroup API
+ *
+ * Map __x__ as crush_do_rule() would with the map and choose_args
+ * currently published by the handle of __reader__, between
+ * crush_reader_enter() and crush_reader_leave(). The working space is
+ * kept in __reader__ and initialized again when the map or
+ * __result_max__ differ from the previous call.
+ *
+ * - return -ENOMEM if __malloc(3)__ fails
+ *
+ * @param reader the reader of the calling thread
+ * @param ruleno a positive integer < __CRUSH_MAX_RULES__
+ * @param x the value to map to __result_max__ items
+ * @param result an array of items of size __result_max__
+ * @param result_max the size of the __result__ array
+ * @param weights an array of weights of size __weight_max__
+ * @param weight_max the size of the __weights__ array
+ *
+ * @returns the size of __result__ on success, < 0 on error
+ */
+extern int crush_reader_do_rule(struct crush_reader *reader, int ruleno, int x,
+				int *result, int result_max,
+				const __u32 *weights, int weight_max);
+
+/** @ingroup API
+ *
+ * The epoch of the map currently published by __handle__.
+ *
+ * @param handle the handle
+ *
+ * @returns the epoch, >= 1
+ */
+extern long long crush_handle_epoch(const struct crush_handle *handle);
+
+#endif
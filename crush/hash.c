@@ -5,96 +5,28 @@
 #endif
 
 /*
- * Robert Jenkins' function for mixing 32-bit values
- * http://burtleburtle.net/bob/hash/evahash.html
- * a, b = random bits, c = input and output
+ * The lane functions use the GCC vector extensions when available. On
+ * x86_64 an AVX2 clone is also built and chosen when the library is
+ * loaded if the CPU supports it.
  */
-#define crush_hashmix(a, b, c) do {			\
-		a = a-b;  a = a-c;  a = a^(c>>13);	\
-		b = b-c;  b = b-a;  b = b^(a<<8);	\
-		c = c-a;  c = c-b;  c = c^(b>>13);	\
-		a = a-b;  a = a-c;  a = a^(c>>12);	\
-		b = b-c;  b = b-a;  b = b^(a<<16);	\
-		c = c-a;  c = c-b;  c = c^(b>>5);	\
-		a = a-b;  a = a-c;  a = a^(c>>3);	\
-		b = b-c;  b = b-a;  b = b^(a<<10);	\
-		c = c-a;  c = c-b;  c = c^(b>>15);	\
-	} while (0)
-
-#define crush_hash_seed 1315423911
-
-static __u32 crush_hash32_rjenkins1(__u32 a)
-{
-	__u32 hash = crush_hash_seed ^ a;
-	__u32 b = a;
-	__u32 x = 231232;
-	__u32 y = 1232;
-	crush_hashmix(b, x, hash);
-	crush_hashmix(y, a, hash);
-	return hash;
-}
-
-static __u32 crush_hash32_rjenkins1_2(__u32 a, __u32 b)
-{
-	__u32 hash = crush_hash_seed ^ a ^ b;
-	__u32 x = 231232;
-	__u32 y = 1232;
-	crush_hashmix(a, b, hash);
-	crush_hashmix(x, a, hash);
-	crush_hashmix(b, y, hash);
-	return hash;
-}
-
-static __u32 crush_hash32_rjenkins1_3(__u32 a, __u32 b, __u32 c)
-{
-	__u32 hash = crush_hash_seed ^ a ^ b ^ c;
-	__u32 x = 231232;
-	__u32 y = 1232;
-	crush_hashmix(a, b, hash);
-	crush_hashmix(c, x, hash);
-	crush_hashmix(y, a, hash);
-	crush_hashmix(b, x, hash);
-	crush_hashmix(y, c, hash);
-	return hash;
-}
-
-static __u32 crush_hash32_rjenkins1_4(__u32 a, __u32 b, __u32 c, __u32 d)
-{
-	__u32 hash = crush_hash_seed ^ a ^ b ^ c ^ d;
-	__u32 x = 231232;
-	__u32 y = 1232;
-	crush_hashmix(a, b, hash);
-	crush_hashmix(c, d, hash);
-	crush_hashmix(a, x, hash);
-	crush_hashmix(y, b, hash);
-	crush_hashmix(c, x, hash);
-	crush_hashmix(y, d, hash);
-	return hash;
-}
-
-static __u32 crush_hash32_rjenkins1_5(__u32 a, __u32 b, __u32 c, __u32 d,
-				      __u32 e)
-{
-	__u32 hash = crush_hash_seed ^ a ^ b ^ c ^ d ^ e;
-	__u32 x = 231232;
-	__u32 y = 1232;
-	crush_hashmix(a, b, hash);
-	crush_hashmix(c, d, hash);
-	crush_hashmix(e, x, hash);
-	crush_hashmix(y, a, hash);
-	crush_hashmix(b, x, hash);
-	crush_hashmix(y, c, hash);
-	crush_hashmix(d, x, hash);
-	crush_hashmix(y, e, hash);
-	return hash;
-}
-
+#if !defined(__KERNEL__) && defined(__GNUC__) && defined(__x86_64__) && \
+	defined(__has_attribute)
+# if __has_attribute(target_clones)
+#  define crush_hash_lanes_clones \
+	__attribute__((target_clones("avx2", "default")))
+# endif
+#endif
+#ifndef crush_hash_lanes_clones
+# define crush_hash_lanes_clones
+#endif
 
 __u32 crush_hash32(int type, __u32 a)
 {
 	switch (type) {
 	case CRUSH_HASH_RJENKINS1:
 		return crush_hash32_rjenkins1(a);
+	case CRUSH_HASH_XXHASH32:
+		return crush_hash32_xxhash32(a);
 	default:
 		return 0;
 	}
@@ -105,6 +37,8 @@ __u32 crush_hash32_2(int type, __u32 a, __u32 b)
 	switch (type) {
 	case CRUSH_HASH_RJENKINS1:
 		return crush_hash32_rjenkins1_2(a, b);
+	case CRUSH_HASH_XXHASH32:
+		return crush_hash32_xxhash32_2(a, b);
 	default:
 		return 0;
 	}
@@ -115,6 +49,8 @@ __u32 crush_hash32_3(int type, __u32 a, __u32 b, __u32 c)
 	switch (type) {
 	case CRUSH_HASH_RJENKINS1:
 		return crush_hash32_rjenkins1_3(a, b, c);
+	case CRUSH_HASH_XXHASH32:
+		return crush_hash32_xxhash32_3(a, b, c);
 	default:
 		return 0;
 	}
@@ -125,6 +61,8 @@ __u32 crush_hash32_4(int type, __u32 a, __u32 b, __u32 c, __u32 d)
 	switch (type) {
 	case CRUSH_HASH_RJENKINS1:
 		return crush_hash32_rjenkins1_4(a, b, c, d);
+	case CRUSH_HASH_XXHASH32:
+		return crush_hash32_xxhash32_4(a, b, c, d);
 	default:
 		return 0;
 	}
@@ -135,16 +73,266 @@ __u32 crush_hash32_5(int type, __u32 a, __u32 b, __u32 c, __u32 d, __u32 e)
 	switch (type) {
 	case CRUSH_HASH_RJENKINS1:
 		return crush_hash32_rjenkins1_5(a, b, c, d, e);
+	case CRUSH_HASH_XXHASH32:
+		return crush_hash32_xxhash32_5(a, b, c, d, e);
 	default:
 		return 0;
 	}
 }
 
+#ifdef __GNUC__
+/*
+ * GCC vector extensions: the operators used by crush_hashmix() apply
+ * lane wise to this type.
+ */
+typedef __u32 crush_hash_vec __attribute__((vector_size(4 * CRUSH_HASH_LANES)));
+
+crush_hash_lanes_clones
+static void crush_hash32_rjenkins1_2_x8(__u32 a, const __u32 *b, __u32 *out)
+{
+	crush_hash_vec va, vb, hash, x, y;
+	int i;
+
+	for (i = 0; i < CRUSH_HASH_LANES; i++) {
+		va[i] = a;
+		vb[i] = b[i];
+		x[i] = 231232;
+		y[i] = 1232;
+	}
+	hash = crush_hash_seed ^ va ^ vb;
+	crush_hashmix(va, vb, hash);
+	crush_hashmix(x, va, hash);
+	crush_hashmix(vb, y, hash);
+	for (i = 0; i < CRUSH_HASH_LANES; i++)
+		out[i] = hash[i];
+}
+
+crush_hash_lanes_clones
+static void crush_hash32_rjenkins1_3_x8(__u32 a, const __u32 *b, __u32 c,
+					__u32 *out)
+{
+	crush_hash_vec va, vb, vc, hash, x, y;
+	int i;
+
+	for (i = 0; i < CRUSH_HASH_LANES; i++) {
+		va[i] = a;
+		vb[i] = b[i];
+		vc[i] = c;
+		x[i] = 231232;
+		y[i] = 1232;
+	}
+	hash = crush_hash_seed ^ va ^ vb ^ vc;
+	crush_hashmix(va, vb, hash);
+	crush_hashmix(vc, x, hash);
+	crush_hashmix(y, va, hash);
+	crush_hashmix(vb, x, hash);
+	crush_hashmix(y, vc, hash);
+	for (i = 0; i < CRUSH_HASH_LANES; i++)
+		out[i] = hash[i];
+}
+
+crush_hash_lanes_clones
+static void crush_hash32_rjenkins1_4_x8(__u32 a, const __u32 *b, __u32 c,
+					__u32 d, __u32 *out)
+{
+	crush_hash_vec va, vb, vc, vd, hash, x, y;
+	int i;
+
+	for (i = 0; i < CRUSH_HASH_LANES; i++) {
+		va[i] = a;
+		vb[i] = b[i];
+		vc[i] = c;
+		vd[i] = d;
+		x[i] = 231232;
+		y[i] = 1232;
+	}
+	hash = crush_hash_seed ^ va ^ vb ^ vc ^ vd;
+	crush_hashmix(va, vb, hash);
+	crush_hashmix(vc, vd, hash);
+	crush_hashmix(va, x, hash);
+	crush_hashmix(y, vb, hash);
+	crush_hashmix(vc, x, hash);
+	crush_hashmix(y, vd, hash);
+	for (i = 0; i < CRUSH_HASH_LANES; i++)
+		out[i] = hash[i];
+}
+
+crush_hash_lanes_clones
+static void crush_hash32_xxhash32_2_x8(__u32 a, const __u32 *b, __u32 *out)
+{
+	crush_hash_vec vb, hash;
+	int i;
+
+	for (i = 0; i < CRUSH_HASH_LANES; i++) {
+		vb[i] = b[i];
+		hash[i] = crush_xxh_short_init(8);
+	}
+	crush_xxh_tail(hash, a);
+	crush_xxh_tail(hash, vb);
+	crush_xxh_avalanche(hash);
+	for (i = 0; i < CRUSH_HASH_LANES; i++)
+		out[i] = hash[i];
+}
+
+crush_hash_lanes_clones
+static void crush_hash32_xxhash32_3_x8(__u32 a, const __u32 *b, __u32 c,
+				       __u32 *out)
+{
+	crush_hash_vec vb, hash;
+	int i;
+
+	for (i = 0; i < CRUSH_HASH_LANES; i++) {
+		vb[i] = b[i];
+		hash[i] = crush_xxh_short_init(12);
+	}
+	crush_xxh_tail(hash, a);
+	crush_xxh_tail(hash, vb);
+	crush_xxh_tail(hash, c);
+	crush_xxh_avalanche(hash);
+	for (i = 0; i < CRUSH_HASH_LANES; i++)
+		out[i] = hash[i];
+}
+
+crush_hash_lanes_clones
+static void crush_hash32_xxhash32_4_x8(__u32 a, const __u32 *b, __u32 c,
+				       __u32 d, __u32 *out)
+{
+	crush_hash_vec vb, v2, hash;
+	__u32 v1 = (__u32)crush_hash_seed + CRUSH_XXH_PRIME32_1 +
+		CRUSH_XXH_PRIME32_2;
+	__u32 v3 = (__u32)crush_hash_seed;
+	__u32 v4 = (__u32)crush_hash_seed - CRUSH_XXH_PRIME32_1;
+	int i;
+
+	for (i = 0; i < CRUSH_HASH_LANES; i++) {
+		vb[i] = b[i];
+		v2[i] = (__u32)crush_hash_seed + CRUSH_XXH_PRIME32_2;
+	}
+	/* only the second accumulator depends on the lane */
+	crush_xxh_round(v1, a);
+	crush_xxh_round(v2, vb);
+	crush_xxh_round(v3, c);
+	crush_xxh_round(v4, d);
+	hash = crush_xxh_rotl(v2, 7) + (crush_xxh_rotl(v1, 1) +
+		crush_xxh_rotl(v3, 12) + crush_xxh_rotl(v4, 18) + 16);
+	crush_xxh_avalanche(hash);
+	for (i = 0; i < CRUSH_HASH_LANES; i++)
+		out[i] = hash[i];
+}
+#else
+static void crush_hash32_rjenkins1_2_x8(__u32 a, const __u32 *b, __u32 *out)
+{
+	int i;
+
+	for (i = 0; i < CRUSH_HASH_LANES; i++)
+		out[i] = crush_hash32_rjenkins1_2(a, b[i]);
+}
+
+static void crush_hash32_rjenkins1_3_x8(__u32 a, const __u32 *b, __u32 c,
+					__u32 *out)
+{
+	int i;
+
+	for (i = 0; i < CRUSH_HASH_LANES; i++)
+		out[i] = crush_hash32_rjenkins1_3(a, b[i], c);
+}
+
+static void crush_hash32_rjenkins1_4_x8(__u32 a, const __u32 *b, __u32 c,
+					__u32 d, __u32 *out)
+{
+	int i;
+
+	for (i = 0; i < CRUSH_HASH_LANES; i++)
+		out[i] = crush_hash32_rjenkins1_4(a, b[i], c, d);
+}
+
+static void crush_hash32_xxhash32_2_x8(__u32 a, const __u32 *b, __u32 *out)
+{
+	int i;
+
+	for (i = 0; i < CRUSH_HASH_LANES; i++)
+		out[i] = crush_hash32_xxhash32_2(a, b[i]);
+}
+
+static void crush_hash32_xxhash32_3_x8(__u32 a, const __u32 *b, __u32 c,
+				       __u32 *out)
+{
+	int i;
+
+	for (i = 0; i < CRUSH_HASH_LANES; i++)
+		out[i] = crush_hash32_xxhash32_3(a, b[i], c);
+}
+
+static void crush_hash32_xxhash32_4_x8(__u32 a, const __u32 *b, __u32 c,
+				       __u32 d, __u32 *out)
+{
+	int i;
+
+	for (i = 0; i < CRUSH_HASH_LANES; i++)
+		out[i] = crush_hash32_xxhash32_4(a, b[i], c, d);
+}
+#endif
+
+void crush_hash32_2_x8(int type, __u32 a, const __u32 *b, __u32 *out)
+{
+	int i;
+
+	switch (type) {
+	case CRUSH_HASH_RJENKINS1:
+		crush_hash32_rjenkins1_2_x8(a, b, out);
+		break;
+	case CRUSH_HASH_XXHASH32:
+		crush_hash32_xxhash32_2_x8(a, b, out);
+		break;
+	default:
+		for (i = 0; i < CRUSH_HASH_LANES; i++)
+			out[i] = 0;
+	}
+}
+
+void crush_hash32_3_x8(int type, __u32 a, const __u32 *b, __u32 c,
+		       __u32 *out)
+{
+	int i;
+
+	switch (type) {
+	case CRUSH_HASH_RJENKINS1:
+		crush_hash32_rjenkins1_3_x8(a, b, c, out);
+		break;
+	case CRUSH_HASH_XXHASH32:
+		crush_hash32_xxhash32_3_x8(a, b, c, out);
+		break;
+	default:
+		for (i = 0; i < CRUSH_HASH_LANES; i++)
+			out[i] = 0;
+	}
+}
+
+void crush_hash32_4_x8(int type, __u32 a, const __u32 *b, __u32 c, __u32 d,
+		       __u32 *out)
+{
+	int i;
+
+	switch (type) {
+	case CRUSH_HASH_RJENKINS1:
+		crush_hash32_rjenkins1_4_x8(a, b, c, d, out);
+		break;
+	case CRUSH_HASH_XXHASH32:
+		crush_hash32_xxhash32_4_x8(a, b, c, d, out);
+		break;
+	default:
+		for (i = 0; i < CRUSH_HASH_LANES; i++)
+			out[i] = 0;
+	}
+}
+
 const char *crush_hash_name(int type)
 {
 	switch (type) {
 	case CRUSH_HASH_RJENKINS1:
 		return "rjenkins1";
+	case CRUSH_HASH_XXHASH32:
+		return "xxhash32";
 	default:
 		return "unknown";
 	}
@@ -8,6 +8,12 @@
 #endif
 
 #define CRUSH_HASH_RJENKINS1   0
+/*
+ * XXH32 of the values as little endian 32-bit words: multiplications
+ * and rotations instead of the long Jenkins mix, cheaper and lane
+ * friendly but mapping the values to other items.
+ */
+#define CRUSH_HASH_XXHASH32    1
 
 #define CRUSH_HASH_DEFAULT CRUSH_HASH_RJENKINS1
 
@@ -20,4 +26,226 @@ extern __u32 crush_hash32_4(int type, __u32 a, __u32 b, __u32 c, __u32 d);
 extern __u32 crush_hash32_5(int type, __u32 a, __u32 b, __u32 c, __u32 d,
 			    __u32 e);
 
+/*
+ * Hash 8 values at once: out[i] is the same as the corresponding
+ * crush_hash32_N() with b[i] as its second argument.
+ */
+#define CRUSH_HASH_LANES 8
+
+extern void crush_hash32_2_x8(int type, __u32 a, const __u32 *b,
+			      __u32 *out);
+extern void crush_hash32_3_x8(int type, __u32 a, const __u32 *b, __u32 c,
+			      __u32 *out);
+extern void crush_hash32_4_x8(int type, __u32 a, const __u32 *b, __u32 c,
+			      __u32 d, __u32 *out);
+
+/*
+ * Robert Jenkins' function for mixing 32-bit values
+ * http://burtleburtle.net/bob/hash/evahash.html
+ * a, b = random bits, c = input and output
+ */
+#define crush_hashmix(a, b, c) do {			\
+		a = a-b;  a = a-c;  a = a^(c>>13);	\
+		b = b-c;  b = b-a;  b = b^(a<<8);	\
+		c = c-a;  c = c-b;  c = c^(b>>13);	\
+		a = a-b;  a = a-c;  a = a^(c>>12);	\
+		b = b-c;  b = b-a;  b = b^(a<<16);	\
+		c = c-a;  c = c-b;  c = c^(b>>5);	\
+		a = a-b;  a = a-c;  a = a^(c>>3);	\
+		b = b-c;  b = b-a;  b = b^(a<<10);	\
+		c = c-a;  c = c-b;  c = c^(b>>15);	\
+	} while (0)
+
+/*
+ * The same mix for vector types, SUB, XOR, SRL and SLL being the
+ * functions implementing the lane wise -, ^, >> and <<
+ */
+#define crush_hashmix_vec(a, b, c, SUB, XOR, SRL, SLL) do {	\
+		a = SUB(SUB(a, b), c); a = XOR(a, SRL(c, 13));	\
+		b = SUB(SUB(b, c), a); b = XOR(b, SLL(a, 8));	\
+		c = SUB(SUB(c, a), b); c = XOR(c, SRL(b, 13));	\
+		a = SUB(SUB(a, b), c); a = XOR(a, SRL(c, 12));	\
+		b = SUB(SUB(b, c), a); b = XOR(b, SLL(a, 16));	\
+		c = SUB(SUB(c, a), b); c = XOR(c, SRL(b, 5));	\
+		a = SUB(SUB(a, b), c); a = XOR(a, SRL(c, 3));	\
+		b = SUB(SUB(b, c), a); b = XOR(b, SLL(a, 10));	\
+		c = SUB(SUB(c, a), b); c = XOR(c, SRL(b, 15));	\
+	} while (0)
+
+#define crush_hash_seed 1315423911
+
+/*
+ * Yann Collet's XXH32, http://cyan4973.github.io/xxHash/. The round
+ * and tail macros apply to scalars as well as to vector types whose
+ * +, *, <<, >> and | operators are lane wise.
+ */
+#define CRUSH_XXH_PRIME32_1 0x9E3779B1U
+#define CRUSH_XXH_PRIME32_2 0x85EBCA77U
+#define CRUSH_XXH_PRIME32_3 0xC2B2AE3DU
+#define CRUSH_XXH_PRIME32_4 0x27D4EB2FU
+#define CRUSH_XXH_PRIME32_5 0x165667B1U
+
+#define crush_xxh_rotl(x, r) (((x) << (r)) | ((x) >> (32 - (r))))
+
+/* a 16-byte stripe input @v into the accumulator @acc */
+#define crush_xxh_round(acc, v) do {				\
+		acc = acc + (v) * CRUSH_XXH_PRIME32_2;		\
+		acc = crush_xxh_rotl(acc, 13);			\
+		acc = acc * CRUSH_XXH_PRIME32_1;		\
+	} while (0)
+
+/* a 32-bit word @v after the stripes */
+#define crush_xxh_tail(h, v) do {				\
+		h = h + (v) * CRUSH_XXH_PRIME32_3;		\
+		h = crush_xxh_rotl(h, 17) * CRUSH_XXH_PRIME32_4;	\
+	} while (0)
+
+#define crush_xxh_avalanche(h) do {				\
+		h = h ^ (h >> 15);				\
+		h = h * CRUSH_XXH_PRIME32_2;			\
+		h = h ^ (h >> 13);				\
+		h = h * CRUSH_XXH_PRIME32_3;			\
+		h = h ^ (h >> 16);				\
+	} while (0)
+
+/* the inputs of fewer than 16 bytes start from the seed */
+#define crush_xxh_short_init(len) \
+	((__u32)crush_hash_seed + CRUSH_XXH_PRIME32_5 + (len))
+
+/*
+ * The CRUSH_HASH_RJENKINS1 functions, for callers that know the hash
+ * type at compile time and want to skip the crush_hash32_N() dispatch.
+ */
+static inline __u32 crush_hash32_rjenkins1(__u32 a)
+{
+	__u32 hash = crush_hash_seed ^ a;
+	__u32 b = a;
+	__u32 x = 231232;
+	__u32 y = 1232;
+	crush_hashmix(b, x, hash);
+	crush_hashmix(y, a, hash);
+	return hash;
+}
+
+static inline __u32 crush_hash32_rjenkins1_2(__u32 a, __u32 b)
+{
+	__u32 hash = crush_hash_seed ^ a ^ b;
+	__u32 x = 231232;
+	__u32 y = 1232;
+	crush_hashmix(a, b, hash);
+	crush_hashmix(x, a, hash);
+	crush_hashmix(b, y, hash);
+	return hash;
+}
+
+static inline __u32 crush_hash32_rjenkins1_3(__u32 a, __u32 b, __u32 c)
+{
+	__u32 hash = crush_hash_seed ^ a ^ b ^ c;
+	__u32 x = 231232;
+	__u32 y = 1232;
+	crush_hashmix(a, b, hash);
+	crush_hashmix(c, x, hash);
+	crush_hashmix(y, a, hash);
+	crush_hashmix(b, x, hash);
+	crush_hashmix(y, c, hash);
+	return hash;
+}
+
+static inline __u32 crush_hash32_rjenkins1_4(__u32 a, __u32 b, __u32 c,
+					     __u32 d)
+{
+	__u32 hash = crush_hash_seed ^ a ^ b ^ c ^ d;
+	__u32 x = 231232;
+	__u32 y = 1232;
+	crush_hashmix(a, b, hash);
+	crush_hashmix(c, d, hash);
+	crush_hashmix(a, x, hash);
+	crush_hashmix(y, b, hash);
+	crush_hashmix(c, x, hash);
+	crush_hashmix(y, d, hash);
+	return hash;
+}
+
+static inline __u32 crush_hash32_rjenkins1_5(__u32 a, __u32 b, __u32 c,
+					     __u32 d, __u32 e)
+{
+	__u32 hash = crush_hash_seed ^ a ^ b ^ c ^ d ^ e;
+	__u32 x = 231232;
+	__u32 y = 1232;
+	crush_hashmix(a, b, hash);
+	crush_hashmix(c, d, hash);
+	crush_hashmix(e, x, hash);
+	crush_hashmix(y, a, hash);
+	crush_hashmix(b, x, hash);
+	crush_hashmix(y, c, hash);
+	crush_hashmix(d, x, hash);
+	crush_hashmix(y, e, hash);
+	return hash;
+}
+
+/*
+ * The CRUSH_HASH_XXHASH32 functions, the XXH32 with the seed
+ * crush_hash_seed of their arguments as little endian words.
+ */
+static inline __u32 crush_hash32_xxhash32(__u32 a)
+{
+	__u32 hash = crush_xxh_short_init(4);
+	crush_xxh_tail(hash, a);
+	crush_xxh_avalanche(hash);
+	return hash;
+}
+
+static inline __u32 crush_hash32_xxhash32_2(__u32 a, __u32 b)
+{
+	__u32 hash = crush_xxh_short_init(8);
+	crush_xxh_tail(hash, a);
+	crush_xxh_tail(hash, b);
+	crush_xxh_avalanche(hash);
+	return hash;
+}
+
+static inline __u32 crush_hash32_xxhash32_3(__u32 a, __u32 b, __u32 c)
+{
+	__u32 hash = crush_xxh_short_init(12);
+	crush_xxh_tail(hash, a);
+	crush_xxh_tail(hash, b);
+	crush_xxh_tail(hash, c);
+	crush_xxh_avalanche(hash);
+	return hash;
+}
+
+/* the 16 bytes of @a, @b, @c and @d are the first stripe */
+static inline __u32 crush_hash32_xxhash32_stripe(__u32 a, __u32 b, __u32 c,
+						 __u32 d, __u32 len)
+{
+	__u32 v1 = (__u32)crush_hash_seed + CRUSH_XXH_PRIME32_1 +
+		CRUSH_XXH_PRIME32_2;
+	__u32 v2 = (__u32)crush_hash_seed + CRUSH_XXH_PRIME32_2;
+	__u32 v3 = (__u32)crush_hash_seed;
+	__u32 v4 = (__u32)crush_hash_seed - CRUSH_XXH_PRIME32_1;
+	crush_xxh_round(v1, a);
+	crush_xxh_round(v2, b);
+	crush_xxh_round(v3, c);
+	crush_xxh_round(v4, d);
+	return crush_xxh_rotl(v1, 1) + crush_xxh_rotl(v2, 7) +
+		crush_xxh_rotl(v3, 12) + crush_xxh_rotl(v4, 18) + len;
+}
+
+static inline __u32 crush_hash32_xxhash32_4(__u32 a, __u32 b, __u32 c,
+					    __u32 d)
+{
+	__u32 hash = crush_hash32_xxhash32_stripe(a, b, c, d, 16);
+	crush_xxh_avalanche(hash);
+	return hash;
+}
+
+static inline __u32 crush_hash32_xxhash32_5(__u32 a, __u32 b, __u32 c,
+					    __u32 d, __u32 e)
+{
+	__u32 hash = crush_hash32_xxhash32_stripe(a, b, c, d, 20);
+	crush_xxh_tail(hash, e);
+	crush_xxh_avalanche(hash);
+	return hash;
+}
+
 #endif
@@ -2,8 +2,36 @@
 
 #include "helpers.h"
 
+/* the buckets with no parent according to the tracked changes */
+static int crush_find_tracked_roots(struct crush_map *map, int **buckets)
+{
+  int root_count = 0;
+  int pos;
+
+  /* references to buckets that do not exist */
+  for (pos = map->max_buckets; pos < map->bucket_parents_size; pos++)
+    if (map->bucket_parents[pos].refs > 0)
+      return -EINVAL;
+
+  int *roots = (int*)malloc(map->max_buckets * sizeof(int));
+  if (roots == NULL)
+    return -ENOMEM;
+  for (pos = 0; pos < map->max_buckets; pos++) {
+    if (map->buckets[pos] == NULL)
+      continue;
+    if (pos < map->bucket_parents_size && map->bucket_parents[pos].refs > 0)
+      continue;
+    roots[root_count++] = -1-pos;
+  }
+  *buckets = roots;
+  return root_count;
+}
+
 int crush_find_roots(struct crush_map *map, int **buckets)
 {
+  if (map->changes_tracked)
+    return crush_find_tracked_roots(map, buckets);
+
   int ref[map->max_buckets];
   int root_count = map->max_buckets;
   int pos, i;
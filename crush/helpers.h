@@ -14,6 +14,9 @@
  * returns on error, the value of the __buckets__ argument is
  * undefined.
  *
+ * If the changes of __map__ are tracked (see crush_finalize()), the
+ * items of the buckets are not visited.
+ *
  * - return -ENOMEM if __malloc(3)__ fails to allocate the array
  * - return -EINVAL if a bucket references a non existent item
  * 
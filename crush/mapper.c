@@ -18,6 +18,7 @@
 # include <linux/crush/crush.h>
 # include <linux/crush/hash.h>
 #else
+# include <errno.h>
 # include "crush_compat.h"
 # include "crush.h"
 # include "hash.h"
@@ -25,6 +26,11 @@
 #include "crush_ln_table.h"
 #include "mapper.h"
 
+#if !defined(__KERNEL__) && defined(__GNUC__) && defined(__x86_64__)
+# define CRUSH_X86_SIMD
+# include <immintrin.h>
+#endif
+
 #define dprintk(args...) /* printf(args) */
 
 /*
@@ -61,6 +67,59 @@ int crush_find_rule(const struct crush_map *map, int ruleset, int type, int size
  * will produce an item in the bucket.
  */
 
+/*
+ * @h % (@size - @p): with CRUSH_FASTMOD it is ((M * @h) * d) >> 64
+ * with d = @size - @p and M = (2^64 - 1) / d + 1, which is exact for
+ * 32 bit values (Lemire et al., "Faster Remainder by Direct
+ * Computation", 2019). M is computed the first time it is needed, the
+ * work->perm_magic of a uniform bucket keeps it for the next values.
+ */
+static inline unsigned int bucket_perm_mod(struct crush_work_bucket *work,
+					   __u32 h, unsigned int size,
+					   unsigned int p)
+{
+	__u32 d = size - p;
+#ifdef CRUSH_FASTMOD
+	__u64 magic;
+
+	if (work->perm_magic) {
+		magic = work->perm_magic[p];
+		/* 0 is also the reciprocal of 1 */
+		if (magic == 0) {
+			magic = ~0ULL / d + 1;
+			work->perm_magic[p] = magic;
+		}
+		return ((unsigned __int128)(magic * h) * d) >> 64;
+	}
+#endif
+	return h % d;
+}
+
+/*
+ * Set the permutation of @work back to the identity. A step p of
+ * bucket_perm_choose() swaps the entry p with an entry beyond it and
+ * the entry p is not modified afterwards: an entry beyond the first
+ * perm_n that is not itself was moved to one of the first perm_n
+ * entries. Only those need to be restored, not the whole bucket.
+ */
+static void bucket_perm_undo(struct crush_work_bucket *work)
+{
+	unsigned int n = work->perm_n;
+	unsigned int i;
+
+	if (n == 0xffff) {
+		/* only the entry 0 was set, see bucket_perm_choose() */
+		work->perm[0] = 0;
+	} else {
+		for (i = 0; i < n; i++)
+			if (work->perm[i] >= n)
+				work->perm[work->perm[i]] = work->perm[i];
+		for (i = 0; i < n; i++)
+			work->perm[i] = i;
+	}
+	work->perm_n = 0;
+}
+
 /*
  * Choose based on a random permutation of the bucket.
  *
@@ -69,6 +128,10 @@ int crush_find_rule(const struct crush_map *map, int ruleset, int type, int size
  * calculate an actual random permutation of the bucket members.
  * Since this is expensive, we optimize for the r=0 case, which
  * captures the vast majority of calls.
+ *
+ * The permutation is the identity beyond the entries its first
+ * perm_n steps swapped, so that starting a new one only costs undoing
+ * those, see bucket_perm_undo().
  */
 static int bucket_perm_choose(const struct crush_bucket *bucket,
 			      struct crush_work_bucket *work,
@@ -81,23 +144,22 @@ static int bucket_perm_choose(const struct crush_bucket *bucket,
 	if (work->perm_x != (__u32)x || work->perm_n == 0) {
 		dprintk("bucket %d new x=%d\n", bucket->id, x);
 		work->perm_x = x;
+		if (work->perm_n)
+			bucket_perm_undo(work);
 
 		/* optimize common r=0 case */
 		if (pr == 0) {
-			s = crush_hash32_3(bucket->hash, x, bucket->id, 0) %
-				bucket->size;
+			s = bucket_perm_mod(work,
+					    crush_hash32_3(bucket->hash, x,
+							   bucket->id, 0),
+					    bucket->size, 0);
 			work->perm[0] = s;
 			work->perm_n = 0xffff;   /* magic value, see below */
 			goto out;
 		}
-
-		for (i = 0; i < bucket->size; i++)
-			work->perm[i] = i;
-		work->perm_n = 0;
 	} else if (work->perm_n == 0xffff) {
-		/* clean up after the r=0 case above */
-		for (i = 1; i < bucket->size; i++)
-			work->perm[i] = i;
+		/* clean up after the r=0 case above: the other entries
+		   are the identity, swap the entry 0 with the entry s */
 		work->perm[work->perm[0]] = 0;
 		work->perm_n = 1;
 	}
@@ -109,8 +171,10 @@ static int bucket_perm_choose(const struct crush_bucket *bucket,
 		unsigned int p = work->perm_n;
 		/* no point in swapping the final entry */
 		if (p < bucket->size - 1) {
-			i = crush_hash32_3(bucket->hash, x, bucket->id, p) %
-				(bucket->size - p);
+			i = bucket_perm_mod(work,
+					    crush_hash32_3(bucket->hash, x,
+							   bucket->id, p),
+					    bucket->size, p);
 			if (i) {
 				unsigned int t = work->perm[p + i];
 				work->perm[p + i] = work->perm[p];
@@ -130,11 +194,59 @@ out:
 	return bucket->items[s];
 }
 
+/*
+ * the permutation of @bucket: a uniform bucket has its own, laid out
+ * the first time it is needed, and the others share one for the local
+ * fallback retries
+ */
+static struct crush_work_bucket *crush_work_perm(struct crush_work *work,
+						 const struct crush_bucket *bucket)
+{
+#ifdef __KERNEL__
+	return work->work[-1-bucket->id];
+#else
+	struct crush_work_bucket **w;
+	__u32 i;
+
+	if (bucket->alg != CRUSH_BUCKET_UNIFORM) {
+		struct crush_work_bucket *shared = work->shared;
+
+		if (work->shared_id != bucket->id) {
+			work->shared_id = bucket->id;
+			bucket_perm_undo(shared);
+			for (i = work->shared_identity; i < bucket->size; i++)
+				shared->perm[i] = i;
+			if (bucket->size > work->shared_identity)
+				work->shared_identity = bucket->size;
+		}
+		return shared;
+	}
+	w = &work->work[-1-bucket->id];
+	if (*w == NULL) {
+		*w = (struct crush_work_bucket *)work->work_point;
+		work->work_point += CRUSH_WORK_UNIFORM_SIZE(bucket->size);
+		(*w)->perm_x = 0;
+		(*w)->perm_n = 0;
+		(*w)->perm = (__u32 *)(*w + 1);
+		for (i = 0; i < bucket->size; i++)
+			(*w)->perm[i] = i;
+		(*w)->perm_magic = NULL;
+#ifdef CRUSH_FASTMOD
+		(*w)->perm_magic = (__u64 *)((char *)*w +
+					     CRUSH_WORK_BUCKET_SIZE(bucket->size));
+		memset((*w)->perm_magic, 0, bucket->size * sizeof(__u64));
+#endif
+	}
+	return *w;
+#endif
+}
+
 /* uniform */
 static int bucket_uniform_choose(const struct crush_bucket_uniform *bucket,
-				 struct crush_work_bucket *work, int x, int r)
+				 struct crush_work *work, int x, int r)
 {
-	return bucket_perm_choose(&bucket->h, work, x, r);
+	return bucket_perm_choose(&bucket->h, crush_work_perm(work, &bucket->h),
+				  x, r);
 }
 
 /* list */
@@ -312,6 +424,20 @@ static inline __u32 *get_choose_arg_weights(const struct crush_bucket_straw2 *bu
   return arg->weight_set[position].weights;
 }
 
+static inline const struct crush_straw2_recip *
+get_choose_arg_recips(const struct crush_bucket_straw2 *bucket,
+		      const struct crush_choose_arg *arg,
+		      int position)
+{
+	if ((arg == NULL) ||
+	    (arg->weight_set == NULL) ||
+	    (arg->weight_set_size == 0))
+		return bucket->item_recips;
+	if (position >= arg->weight_set_size)
+		position = arg->weight_set_size - 1;
+	return arg->weight_set[position].recips;
+}
+
 static inline int *get_choose_arg_ids(const struct crush_bucket_straw2 *bucket,
                                         const struct crush_choose_arg *arg)
 {
@@ -320,44 +446,569 @@ static inline int *get_choose_arg_ids(const struct crush_bucket_straw2 *bucket,
   return arg->ids;
 }
 
+/*
+ * div64_s64(@ln, @weight) for @ln in [-2^48, 0], with a multiplication
+ * instead of the division if @recip is the reciprocal of @weight.
+ */
+static inline __s64 bucket_straw2_div(__s64 ln, __u32 weight,
+				      const struct crush_straw2_recip *recip)
+{
+#ifdef __SIZEOF_INT128__
+	if (recip && recip->weight == weight)
+		return -(__s64)(((unsigned __int128)(__u64)-ln *
+				 recip->magic) >> recip->shift);
+#endif
+	return div64_s64(ln, weight);
+}
+
+/*
+ * the draw of the item @id, with 16.16 fixed point @weight, for the
+ * input @x and the replica @r. The @recip of the weight is optional.
+ */
+static inline __s64 bucket_straw2_draw(int hash, int x, int id, int r,
+				       __u32 weight,
+				       const struct crush_straw2_recip *recip)
+{
+	unsigned int u;
+	__s64 ln;
+
+	if (!weight)
+		return S64_MIN;
+
+	if (hash == CRUSH_HASH_RJENKINS1)
+		u = crush_hash32_rjenkins1_3(x, id, r);
+	else if (hash == CRUSH_HASH_XXHASH32)
+		u = crush_hash32_xxhash32_3(x, id, r);
+	else
+		u = crush_hash32_3(hash, x, id, r);
+	u &= 0xffff;
+
+	/*
+	 * for some reason slightly less than 0x10000 produces
+	 * a slightly more accurate distribution... probably a
+	 * rounding effect.
+	 *
+	 * the natural log lookup table maps [0,0xffff]
+	 * (corresponding to real numbers [1/0x10000, 1] to
+	 * [0, 0xffffffffffff] (corresponding to real numbers
+	 * [-11.090355,0]).
+	 */
+	ln = crush_ln(u) - 0x1000000000000ll;
+
+	/*
+	 * divide by 16.16 fixed-point weight.  note
+	 * that the ln value is negative, so a larger
+	 * weight means a larger (less negative) value
+	 * for draw.
+	 */
+	return bucket_straw2_div(ln, weight, recip);
+}
+
+#ifndef __KERNEL__
+static unsigned int crush_fast_paths;
+
+static unsigned int crush_supported_fast_paths(void)
+{
+	unsigned int supported = CRUSH_FAST_PATH_OPTIMAL_TUNABLES;
+
+#ifdef CRUSH_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		supported |= CRUSH_FAST_PATH_AVX2;
+	if (__builtin_cpu_supports("avx512f"))
+		supported |= CRUSH_FAST_PATH_AVX512;
+#endif
+	return supported;
+}
+
+static void __attribute__((constructor)) crush_init_fast_paths(void)
+{
+	crush_fast_paths = crush_supported_fast_paths();
+}
+
+unsigned int crush_get_fast_paths(void)
+{
+	return crush_fast_paths;
+}
+
+unsigned int crush_set_fast_paths(unsigned int fast_paths)
+{
+	crush_fast_paths = fast_paths & crush_supported_fast_paths();
+	return crush_fast_paths;
+}
+
+#define crush_optimal_fast_path()					\
+	(crush_fast_paths & CRUSH_FAST_PATH_OPTIMAL_TUNABLES)
+#else
+#define crush_optimal_fast_path() 1
+#endif
+
+#ifdef CRUSH_X86_SIMD
+/*
+ * Vectorized straw2 draws for wide buckets. The rjenkins1 or xxhash32
+ * hash of each item is computed in a 32-bit lane, crush_ln() and the
+ * division by the weight in a 64-bit lane. There is no vector
+ * integer division: the quotient is computed in double precision,
+ * which is exact to within one because both operands are < 2^53,
+ * and then corrected with the remainder. The result is identical to
+ * bucket_straw2_draw().
+ */
+
+/* 2^52 as a double, to convert integers < 2^52 from and to double */
+#define CRUSH_DOUBLE_MAGIC 0x4330000000000000ll
+
+static inline __attribute__((target("avx2")))
+__m256i crush_hash32_rjenkins1_3_avx2(__m256i a, __m256i b, __m256i c)
+{
+	__m256i hash = _mm256_xor_si256(
+		_mm256_xor_si256(_mm256_set1_epi32(crush_hash_seed), a),
+		_mm256_xor_si256(b, c));
+	__m256i x = _mm256_set1_epi32(231232);
+	__m256i y = _mm256_set1_epi32(1232);
+
+#define SUB _mm256_sub_epi32
+#define XOR _mm256_xor_si256
+#define SRL _mm256_srli_epi32
+#define SLL _mm256_slli_epi32
+	crush_hashmix_vec(a, b, hash, SUB, XOR, SRL, SLL);
+	crush_hashmix_vec(c, x, hash, SUB, XOR, SRL, SLL);
+	crush_hashmix_vec(y, a, hash, SUB, XOR, SRL, SLL);
+	crush_hashmix_vec(b, x, hash, SUB, XOR, SRL, SLL);
+	crush_hashmix_vec(y, c, hash, SUB, XOR, SRL, SLL);
+#undef SUB
+#undef XOR
+#undef SRL
+#undef SLL
+	return hash;
+}
+
+static inline __attribute__((target("avx2")))
+__m256i crush_hash32_xxhash32_3_avx2(__m256i a, __m256i b, __m256i c)
+{
+	__m256i hash = _mm256_set1_epi32(crush_xxh_short_init(12));
+	__m256i prime2 = _mm256_set1_epi32(CRUSH_XXH_PRIME32_2);
+	__m256i prime3 = _mm256_set1_epi32(CRUSH_XXH_PRIME32_3);
+	__m256i prime4 = _mm256_set1_epi32(CRUSH_XXH_PRIME32_4);
+
+#define TAIL(v) do {							\
+		hash = _mm256_add_epi32(hash, _mm256_mullo_epi32(v, prime3)); \
+		hash = _mm256_or_si256(_mm256_slli_epi32(hash, 17),	\
+				       _mm256_srli_epi32(hash, 15));	\
+		hash = _mm256_mullo_epi32(hash, prime4);		\
+	} while (0)
+	TAIL(a);
+	TAIL(b);
+	TAIL(c);
+#undef TAIL
+	hash = _mm256_xor_si256(hash, _mm256_srli_epi32(hash, 15));
+	hash = _mm256_mullo_epi32(hash, prime2);
+	hash = _mm256_xor_si256(hash, _mm256_srli_epi32(hash, 13));
+	hash = _mm256_mullo_epi32(hash, prime3);
+	hash = _mm256_xor_si256(hash, _mm256_srli_epi32(hash, 16));
+	return hash;
+}
+
+/*
+ * the draws of four items: @v is the normalized crush_ln() input,
+ * @iexpon its exponent, @irh the index of RH in __RH_LH_tbl and
+ * @weight the weight of each item.
+ */
+static inline __attribute__((target("avx2")))
+__m256i bucket_straw2_draw4_avx2(__m128i v, __m128i iexpon, __m128i irh,
+				 __m128i weight)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i one = _mm256_set1_epi64x(1);
+	const __m256i magic = _mm256_set1_epi64x(CRUSH_DOUBLE_MAGIC);
+	const __m256d magicd = _mm256_castsi256_pd(magic);
+	__m256i RH, LH, LL, x64, xl64, index2, n, w, zero_w, q, rem;
+	__m256d nd, wd, qd;
+
+	/* crush_ln() */
+	RH = _mm256_i32gather_epi64((const long long *)__RH_LH_tbl, irh, 8);
+	LH = _mm256_i32gather_epi64((const long long *)__RH_LH_tbl + 1, irh, 8);
+	x64 = _mm256_cvtepu32_epi64(v);
+	xl64 = _mm256_add_epi64(
+		_mm256_mul_epu32(x64, RH),
+		_mm256_slli_epi64(
+			_mm256_mul_epu32(x64, _mm256_srli_epi64(RH, 32)), 32));
+	index2 = _mm256_and_si256(_mm256_srli_epi64(xl64, 48),
+				  _mm256_set1_epi64x(0xff));
+	LL = _mm256_i64gather_epi64((const long long *)__LL_tbl, index2, 8);
+	LH = _mm256_srli_epi64(_mm256_add_epi64(LH, LL), 48 - 12 - 32);
+	/* n = -ln = 2^48 - crush_ln(u) */
+	n = _mm256_sub_epi64(
+		_mm256_set1_epi64x(0x1000000000000ll),
+		_mm256_add_epi64(
+			_mm256_slli_epi64(_mm256_cvtepu32_epi64(iexpon), 12 + 32),
+			LH));
+
+	/* q = n / weight */
+	w = _mm256_cvtepu32_epi64(weight);
+	zero_w = _mm256_cmpeq_epi64(w, zero);
+	w = _mm256_sub_epi64(w, zero_w);
+	nd = _mm256_sub_pd(_mm256_castsi256_pd(_mm256_or_si256(n, magic)), magicd);
+	wd = _mm256_sub_pd(_mm256_castsi256_pd(_mm256_or_si256(w, magic)), magicd);
+	qd = _mm256_round_pd(_mm256_div_pd(nd, wd),
+			     _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+	q = _mm256_sub_epi64(_mm256_castpd_si256(_mm256_add_pd(qd, magicd)),
+			     magic);
+	rem = _mm256_sub_epi64(
+		n,
+		_mm256_add_epi64(
+			_mm256_mul_epu32(q, w),
+			_mm256_slli_epi64(
+				_mm256_mul_epu32(_mm256_srli_epi64(q, 32), w),
+				32)));
+	q = _mm256_add_epi64(q, _mm256_cmpgt_epi64(zero, rem));
+	q = _mm256_sub_epi64(q, _mm256_cmpgt_epi64(rem,
+						   _mm256_sub_epi64(w, one)));
+
+	return _mm256_blendv_epi8(_mm256_sub_epi64(zero, q),
+				  _mm256_set1_epi64x(S64_MIN), zero_w);
+}
+
+static __attribute__((target("avx2")))
+int bucket_straw2_choose_avx2(const struct crush_bucket_straw2 *bucket,
+			      int x, int r, const __u32 *weights,
+			      const struct crush_straw2_recip *recips,
+			      const int *ids)
+{
+	const __m256i four = _mm256_set1_epi64x(4);
+	__m256i high_draw[2], high_index[2], index[2];
+	__s64 draws[8], indexes[8], draw, high_draw_s;
+	unsigned int i, j, high;
+
+	index[0] = _mm256_set_epi64x(3, 2, 1, 0);
+	index[1] = _mm256_set_epi64x(7, 6, 5, 4);
+	for (i = 0; i + 8 <= bucket->h.size; i += 8) {
+		__m256i u, v, e, iexpon, irh, w;
+
+		if (bucket->h.hash == CRUSH_HASH_XXHASH32)
+			u = crush_hash32_xxhash32_3_avx2(
+				_mm256_set1_epi32(x),
+				_mm256_loadu_si256((const __m256i *)(ids + i)),
+				_mm256_set1_epi32(r));
+		else
+			u = crush_hash32_rjenkins1_3_avx2(
+				_mm256_set1_epi32(x),
+				_mm256_loadu_si256((const __m256i *)(ids + i)),
+				_mm256_set1_epi32(r));
+		v = _mm256_add_epi32(_mm256_and_si256(u,
+						      _mm256_set1_epi32(0xffff)),
+				     _mm256_set1_epi32(1));
+		/* normalize the input: the exponent is found by the
+		 * conversion to float, which is exact for v <= 2^16 */
+		e = _mm256_sub_epi32(
+			_mm256_srli_epi32(
+				_mm256_castps_si256(_mm256_cvtepi32_ps(v)), 23),
+			_mm256_set1_epi32(127));
+		iexpon = _mm256_min_epi32(e, _mm256_set1_epi32(15));
+		v = _mm256_sllv_epi32(v, _mm256_sub_epi32(_mm256_set1_epi32(15),
+							  iexpon));
+		irh = _mm256_sub_epi32(
+			_mm256_slli_epi32(_mm256_srli_epi32(v, 8), 1),
+			_mm256_set1_epi32(256));
+		w = _mm256_loadu_si256((const __m256i *)(weights + i));
+
+		for (j = 0; j < 2; j++) {
+			__m256i d, gt;
+
+			if (j == 0)
+				d = bucket_straw2_draw4_avx2(
+					_mm256_castsi256_si128(v),
+					_mm256_castsi256_si128(iexpon),
+					_mm256_castsi256_si128(irh),
+					_mm256_castsi256_si128(w));
+			else
+				d = bucket_straw2_draw4_avx2(
+					_mm256_extracti128_si256(v, 1),
+					_mm256_extracti128_si256(iexpon, 1),
+					_mm256_extracti128_si256(irh, 1),
+					_mm256_extracti128_si256(w, 1));
+			if (i == 0) {
+				high_draw[j] = d;
+				high_index[j] = index[j];
+			} else {
+				gt = _mm256_cmpgt_epi64(d, high_draw[j]);
+				high_draw[j] = _mm256_blendv_epi8(high_draw[j],
+								  d, gt);
+				high_index[j] = _mm256_blendv_epi8(
+					high_index[j], index[j], gt);
+			}
+			index[j] = _mm256_add_epi64(index[j],
+						    _mm256_add_epi64(four, four));
+		}
+	}
+
+	/* the first of the items with the highest draw wins */
+	_mm256_storeu_si256((__m256i *)draws, high_draw[0]);
+	_mm256_storeu_si256((__m256i *)(draws + 4), high_draw[1]);
+	_mm256_storeu_si256((__m256i *)indexes, high_index[0]);
+	_mm256_storeu_si256((__m256i *)(indexes + 4), high_index[1]);
+	high = indexes[0];
+	high_draw_s = draws[0];
+	for (j = 1; j < 8; j++) {
+		if (draws[j] > high_draw_s ||
+		    (draws[j] == high_draw_s && indexes[j] < high)) {
+			high = indexes[j];
+			high_draw_s = draws[j];
+		}
+	}
+
+	for (; i < bucket->h.size; i++) {
+		draw = bucket_straw2_draw(bucket->h.hash, x, ids[i], r,
+					  weights[i],
+					  recips ? &recips[i] : NULL);
+		if (draw > high_draw_s) {
+			high = i;
+			high_draw_s = draw;
+		}
+	}
+
+	return bucket->h.items[high];
+}
+
+static inline __attribute__((target("avx512f")))
+__m512i crush_hash32_rjenkins1_3_avx512(__m512i a, __m512i b, __m512i c)
+{
+	__m512i hash = _mm512_xor_si512(
+		_mm512_xor_si512(_mm512_set1_epi32(crush_hash_seed), a),
+		_mm512_xor_si512(b, c));
+	__m512i x = _mm512_set1_epi32(231232);
+	__m512i y = _mm512_set1_epi32(1232);
+
+#define SUB _mm512_sub_epi32
+#define XOR _mm512_xor_si512
+#define SRL _mm512_srli_epi32
+#define SLL _mm512_slli_epi32
+	crush_hashmix_vec(a, b, hash, SUB, XOR, SRL, SLL);
+	crush_hashmix_vec(c, x, hash, SUB, XOR, SRL, SLL);
+	crush_hashmix_vec(y, a, hash, SUB, XOR, SRL, SLL);
+	crush_hashmix_vec(b, x, hash, SUB, XOR, SRL, SLL);
+	crush_hashmix_vec(y, c, hash, SUB, XOR, SRL, SLL);
+#undef SUB
+#undef XOR
+#undef SRL
+#undef SLL
+	return hash;
+}
+
+static inline __attribute__((target("avx512f")))
+__m512i crush_hash32_xxhash32_3_avx512(__m512i a, __m512i b, __m512i c)
+{
+	__m512i hash = _mm512_set1_epi32(crush_xxh_short_init(12));
+	__m512i prime2 = _mm512_set1_epi32(CRUSH_XXH_PRIME32_2);
+	__m512i prime3 = _mm512_set1_epi32(CRUSH_XXH_PRIME32_3);
+	__m512i prime4 = _mm512_set1_epi32(CRUSH_XXH_PRIME32_4);
+
+#define TAIL(v) do {							\
+		hash = _mm512_add_epi32(hash, _mm512_mullo_epi32(v, prime3)); \
+		hash = _mm512_mullo_epi32(_mm512_rol_epi32(hash, 17), prime4); \
+	} while (0)
+	TAIL(a);
+	TAIL(b);
+	TAIL(c);
+#undef TAIL
+	hash = _mm512_xor_si512(hash, _mm512_srli_epi32(hash, 15));
+	hash = _mm512_mullo_epi32(hash, prime2);
+	hash = _mm512_xor_si512(hash, _mm512_srli_epi32(hash, 13));
+	hash = _mm512_mullo_epi32(hash, prime3);
+	hash = _mm512_xor_si512(hash, _mm512_srli_epi32(hash, 16));
+	return hash;
+}
+
+/* same as bucket_straw2_draw4_avx2() for eight items */
+static inline __attribute__((target("avx512f")))
+__m512i bucket_straw2_draw8_avx512(__m256i v, __m256i iexpon, __m256i irh,
+				   __m256i weight)
+{
+	const __m512i zero = _mm512_setzero_si512();
+	const __m512i one = _mm512_set1_epi64(1);
+	const __m512i magic = _mm512_set1_epi64(CRUSH_DOUBLE_MAGIC);
+	const __m512d magicd = _mm512_castsi512_pd(magic);
+	__m512i RH, LH, LL, x64, xl64, index2, n, w, q, rem;
+	__m512d nd, wd, qd;
+	__mmask8 zero_w;
+
+	/* crush_ln() */
+	RH = _mm512_i32gather_epi64(irh, (const void *)__RH_LH_tbl, 8);
+	LH = _mm512_i32gather_epi64(irh, (const void *)(__RH_LH_tbl + 1), 8);
+	x64 = _mm512_cvtepu32_epi64(v);
+	xl64 = _mm512_add_epi64(
+		_mm512_mul_epu32(x64, RH),
+		_mm512_slli_epi64(
+			_mm512_mul_epu32(x64, _mm512_srli_epi64(RH, 32)), 32));
+	index2 = _mm512_and_si512(_mm512_srli_epi64(xl64, 48),
+				  _mm512_set1_epi64(0xff));
+	LL = _mm512_i64gather_epi64(index2, (const void *)__LL_tbl, 8);
+	LH = _mm512_srli_epi64(_mm512_add_epi64(LH, LL), 48 - 12 - 32);
+	/* n = -ln = 2^48 - crush_ln(u) */
+	n = _mm512_sub_epi64(
+		_mm512_set1_epi64(0x1000000000000ll),
+		_mm512_add_epi64(
+			_mm512_slli_epi64(_mm512_cvtepu32_epi64(iexpon), 12 + 32),
+			LH));
+
+	/* q = n / weight */
+	w = _mm512_cvtepu32_epi64(weight);
+	zero_w = _mm512_cmpeq_epi64_mask(w, zero);
+	w = _mm512_mask_mov_epi64(w, zero_w, one);
+	nd = _mm512_sub_pd(_mm512_castsi512_pd(_mm512_or_si512(n, magic)), magicd);
+	wd = _mm512_sub_pd(_mm512_castsi512_pd(_mm512_or_si512(w, magic)), magicd);
+	qd = _mm512_roundscale_pd(_mm512_div_pd(nd, wd),
+				  _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+	q = _mm512_sub_epi64(_mm512_castpd_si512(_mm512_add_pd(qd, magicd)),
+			     magic);
+	rem = _mm512_sub_epi64(
+		n,
+		_mm512_add_epi64(
+			_mm512_mul_epu32(q, w),
+			_mm512_slli_epi64(
+				_mm512_mul_epu32(_mm512_srli_epi64(q, 32), w),
+				32)));
+	q = _mm512_mask_sub_epi64(q, _mm512_cmpgt_epi64_mask(zero, rem),
+				  q, one);
+	q = _mm512_mask_add_epi64(q, _mm512_cmpge_epi64_mask(rem, w),
+				  q, one);
+
+	return _mm512_mask_mov_epi64(_mm512_sub_epi64(zero, q), zero_w,
+				     _mm512_set1_epi64(S64_MIN));
+}
+
+static __attribute__((target("avx512f")))
+int bucket_straw2_choose_avx512(const struct crush_bucket_straw2 *bucket,
+				int x, int r, const __u32 *weights,
+				const struct crush_straw2_recip *recips,
+				const int *ids)
+{
+	const __m512i sixteen = _mm512_set1_epi64(16);
+	__m512i high_draw[2], high_index[2], index[2];
+	__s64 draws[16], indexes[16], draw, high_draw_s;
+	unsigned int i, j, high;
+
+	index[0] = _mm512_set_epi64(7, 6, 5, 4, 3, 2, 1, 0);
+	index[1] = _mm512_set_epi64(15, 14, 13, 12, 11, 10, 9, 8);
+	for (i = 0; i + 16 <= bucket->h.size; i += 16) {
+		__m512i u, v, e, iexpon, irh, w;
+
+		if (bucket->h.hash == CRUSH_HASH_XXHASH32)
+			u = crush_hash32_xxhash32_3_avx512(
+				_mm512_set1_epi32(x),
+				_mm512_loadu_si512((const void *)(ids + i)),
+				_mm512_set1_epi32(r));
+		else
+			u = crush_hash32_rjenkins1_3_avx512(
+				_mm512_set1_epi32(x),
+				_mm512_loadu_si512((const void *)(ids + i)),
+				_mm512_set1_epi32(r));
+		v = _mm512_add_epi32(_mm512_and_si512(u,
+						      _mm512_set1_epi32(0xffff)),
+				     _mm512_set1_epi32(1));
+		/* normalize the input, see bucket_straw2_choose_avx2() */
+		e = _mm512_sub_epi32(
+			_mm512_srli_epi32(
+				_mm512_castps_si512(_mm512_cvtepi32_ps(v)), 23),
+			_mm512_set1_epi32(127));
+		iexpon = _mm512_min_epi32(e, _mm512_set1_epi32(15));
+		v = _mm512_sllv_epi32(v, _mm512_sub_epi32(_mm512_set1_epi32(15),
+							  iexpon));
+		irh = _mm512_sub_epi32(
+			_mm512_slli_epi32(_mm512_srli_epi32(v, 8), 1),
+			_mm512_set1_epi32(256));
+		w = _mm512_loadu_si512((const void *)(weights + i));
+
+		for (j = 0; j < 2; j++) {
+			__m512i d;
+			__mmask8 gt;
+
+			if (j == 0)
+				d = bucket_straw2_draw8_avx512(
+					_mm512_castsi512_si256(v),
+					_mm512_castsi512_si256(iexpon),
+					_mm512_castsi512_si256(irh),
+					_mm512_castsi512_si256(w));
+			else
+				d = bucket_straw2_draw8_avx512(
+					_mm512_extracti64x4_epi64(v, 1),
+					_mm512_extracti64x4_epi64(iexpon, 1),
+					_mm512_extracti64x4_epi64(irh, 1),
+					_mm512_extracti64x4_epi64(w, 1));
+			if (i == 0) {
+				high_draw[j] = d;
+				high_index[j] = index[j];
+			} else {
+				gt = _mm512_cmpgt_epi64_mask(d, high_draw[j]);
+				high_draw[j] = _mm512_mask_mov_epi64(
+					high_draw[j], gt, d);
+				high_index[j] = _mm512_mask_mov_epi64(
+					high_index[j], gt, index[j]);
+			}
+			index[j] = _mm512_add_epi64(index[j], sixteen);
+		}
+	}
+
+	/* the first of the items with the highest draw wins */
+	_mm512_storeu_si512((void *)draws, high_draw[0]);
+	_mm512_storeu_si512((void *)(draws + 8), high_draw[1]);
+	_mm512_storeu_si512((void *)indexes, high_index[0]);
+	_mm512_storeu_si512((void *)(indexes + 8), high_index[1]);
+	high = indexes[0];
+	high_draw_s = draws[0];
+	for (j = 1; j < 16; j++) {
+		if (draws[j] > high_draw_s ||
+		    (draws[j] == high_draw_s && indexes[j] < high)) {
+			high = indexes[j];
+			high_draw_s = draws[j];
+		}
+	}
+
+	for (; i < bucket->h.size; i++) {
+		draw = bucket_straw2_draw(bucket->h.hash, x, ids[i], r,
+					  weights[i],
+					  recips ? &recips[i] : NULL);
+		if (draw > high_draw_s) {
+			high = i;
+			high_draw_s = draw;
+		}
+	}
+
+	return bucket->h.items[high];
+}
+#endif /* CRUSH_X86_SIMD */
+
 static int bucket_straw2_choose(const struct crush_bucket_straw2 *bucket,
 				int x, int r, const struct crush_choose_arg *arg,
                                 int position)
 {
 	unsigned int i, high = 0;
-	unsigned int u;
-	__s64 ln, draw, high_draw = 0;
+	__s64 draw, high_draw = 0;
         __u32 *weights = get_choose_arg_weights(bucket, arg, position);
+	const struct crush_straw2_recip *recips =
+		get_choose_arg_recips(bucket, arg, position);
         int *ids = get_choose_arg_ids(bucket, arg);
+
+#ifdef CRUSH_X86_SIMD
+	if (bucket->h.hash == CRUSH_HASH_RJENKINS1 ||
+	    bucket->h.hash == CRUSH_HASH_XXHASH32) {
+		if ((crush_fast_paths & CRUSH_FAST_PATH_AVX512) &&
+		    bucket->h.size >= 16)
+			return bucket_straw2_choose_avx512(bucket, x, r,
+							   weights, recips,
+							   ids);
+		if ((crush_fast_paths & CRUSH_FAST_PATH_AVX2) &&
+		    bucket->h.size >= 8)
+			return bucket_straw2_choose_avx2(bucket, x, r,
+							 weights, recips,
+							 ids);
+	}
+#endif
+
 	for (i = 0; i < bucket->h.size; i++) {
                 dprintk("weight 0x%x item %d\n", weights[i], ids[i]);
-		if (weights[i]) {
-			u = crush_hash32_3(bucket->h.hash, x, ids[i], r);
-			u &= 0xffff;
-
-			/*
-			 * for some reason slightly less than 0x10000 produces
-			 * a slightly more accurate distribution... probably a
-			 * rounding effect.
-			 *
-			 * the natural log lookup table maps [0,0xffff]
-			 * (corresponding to real numbers [1/0x10000, 1] to
-			 * [0, 0xffffffffffff] (corresponding to real numbers
-			 * [-11.090355,0]).
-			 */
-			ln = crush_ln(u) - 0x1000000000000ll;
-
-			/*
-			 * divide by 16.16 fixed-point weight.  note
-			 * that the ln value is negative, so a larger
-			 * weight means a larger (less negative) value
-			 * for draw.
-			 */
-			draw = div64_s64(ln, weights[i]);
-		} else {
-			draw = S64_MIN;
-		}
-
+		draw = bucket_straw2_draw(bucket->h.hash, x, ids[i], r,
+					  weights[i],
+					  recips ? &recips[i] : NULL);
 		if (i == 0 || draw > high_draw) {
 			high = i;
 			high_draw = draw;
@@ -368,8 +1019,122 @@ static int bucket_straw2_choose(const struct crush_bucket_straw2 *bucket,
 }
 
 
+#ifndef __KERNEL__
+#define crush_visit(work, id)						\
+	do {								\
+		if ((work)->track_visited)				\
+			(work)->visited |= CRUSH_VISITED_BIT(id);	\
+	} while (0)
+#else
+#define crush_visit(work, id) do { } while (0)
+#endif
+
+#if !defined(__KERNEL__) && defined(CRUSH_TRACE)
+/*
+ * The number of hashes crush_bucket_choose() computes to choose @item
+ * from @in. The permutations of the uniform buckets are counted as
+ * one hash although they may compute more or none.
+ */
+static __u32 crush_trace_hashes(const struct crush_bucket *in, int item)
+{
+	__u32 i;
+
+	switch (in->alg) {
+	case CRUSH_BUCKET_LIST:
+		/* the items are tried from the last one */
+		for (i = 0; i < in->size; i++)
+			if (in->items[i] == item)
+				return in->size - i;
+		return in->size;
+	case CRUSH_BUCKET_TREE:
+		/* one hash for each node from the root to the leaf */
+		return height(
+			((const struct crush_bucket_tree *)in)->num_nodes >> 1);
+	case CRUSH_BUCKET_STRAW:
+	case CRUSH_BUCKET_STRAW2:
+		return in->size;
+	default:
+		return 1;
+	}
+}
+
+static void crush_trace_event(struct crush_work *work, int type,
+			      const struct crush_bucket *in, int item,
+			      int r, unsigned int ftotal)
+{
+	struct crush_trace *trace = work->trace;
+	struct crush_trace_event event;
+
+	if (work->trace_step < trace->max_steps) {
+		struct crush_trace_stats *stats =
+			&trace->steps[work->trace_step];
+
+		switch (type) {
+		case CRUSH_TRACE_CHOOSE:
+			stats->buckets++;
+			stats->hashes += crush_trace_hashes(in, item);
+			break;
+		case CRUSH_TRACE_COLLIDE:
+			stats->collisions++;
+			break;
+		case CRUSH_TRACE_REJECT:
+			stats->rejections++;
+			break;
+		case CRUSH_TRACE_RETRY_BUCKET:
+			stats->local_retries++;
+			break;
+		case CRUSH_TRACE_RETRY_DESCENT:
+			stats->descent_retries++;
+			break;
+		case CRUSH_TRACE_SKIP:
+			stats->skipped++;
+			break;
+		case CRUSH_TRACE_PLACE:
+			stats->placed++;
+			break;
+		}
+	}
+	if (trace->fn) {
+		event.type = type;
+		event.step = work->trace_step;
+		event.bucket = in->id;
+		event.item = item;
+		event.r = r;
+		event.ftotal = ftotal;
+		trace->fn(&event, trace->arg);
+	}
+}
+
+/* is_out() computes a hash for the devices that are partially out */
+static void crush_trace_is_out(struct crush_work *work,
+			       const __u32 *weight, int weight_max, int item)
+{
+	struct crush_trace *trace = work->trace;
+
+	if (work->trace_step < trace->max_steps &&
+	    item < weight_max && weight[item] > 0 && weight[item] < 0x10000)
+		trace->steps[work->trace_step].hashes++;
+}
+
+#define crush_trace(work, args...)					\
+	do {								\
+		if ((work)->trace)					\
+			crush_trace_event(work, args);			\
+	} while (0)
+#define crush_trace_weight(work, args...)				\
+	do {								\
+		if ((work)->trace)					\
+			crush_trace_is_out(work, args);			\
+	} while (0)
+#define crush_trace_step(work, step) ((work)->trace_step = (step))
+#else
+#define crush_trace(work, args...) do { } while (0)
+#define crush_trace_weight(work, args...) do { } while (0)
+#define crush_trace_step(work, step) do { } while (0)
+#endif
+
 static int crush_bucket_choose(const struct crush_bucket *in,
-			       struct crush_work_bucket *work,
+			       struct crush_work *work,
 			       int x, int r,
                                const struct crush_choose_arg *arg,
                                int position)
@@ -401,13 +1166,21 @@ static int crush_bucket_choose(const struct crush_bucket *in,
 	}
 }
 
+/* the hash telling whether a device partially out is out for @x */
+static inline __u32 crush_device_hash(int hash, int x, int item)
+{
+	if (hash == CRUSH_HASH_RJENKINS1)
+		return crush_hash32_rjenkins1_2(x, item);
+	return crush_hash32_2(hash, x, item);
+}
+
 /*
  * true if device is marked "out" (failed, fully offloaded)
- * of the cluster
+ * of the cluster, @hash being that of the bucket it was chosen from
  */
 static int is_out(const struct crush_map *map,
 		  const __u32 *weight, int weight_max,
-		  int item, int x)
+		  int item, int x, int hash)
 {
 	if (item >= weight_max)
 		return 1;
@@ -415,7 +1188,7 @@ static int is_out(const struct crush_map *map,
 		return 0;
 	if (weight[item] == 0)
 		return 1;
-	if ((crush_hash32_2(CRUSH_HASH_RJENKINS1, x, item) & 0xffff)
+	if ((crush_device_hash(hash, x, item) & 0xffff)
 	    < weight[item])
 		return 0;
 	return 1;
@@ -440,8 +1213,54 @@ static int is_out(const struct crush_map *map,
  * @vary_r: pass r to recursive calls
  * @out2: second output vector for leaf items (if @recurse_to_leaf)
  * @parent_r: r value passed from the parent
+ * @alg: CRUSH_BUCKET_STRAW2 if all the buckets are straw2, 0 otherwise
+ *
+ * It is inlined in crush_choose_firstn() and, with the tunables of
+ * set_optimal_crush_map() as constants, in crush_choose_firstn_optimal()
+ * so that the branches on them are resolved at compile time. The
+ * executors of crush_make_rule_executor() inline it with @alg and
+ * the tunables of their rule as constants.
  */
-static int crush_choose_firstn(const struct crush_map *map,
+static int crush_choose_firstn_leaf(const struct crush_map *map,
+				    struct crush_work *work,
+				    const struct crush_bucket *bucket,
+				    const __u32 *weight, int weight_max,
+				    int x, int numrep,
+				    int *out, int outpos,
+				    int out_size,
+				    unsigned int tries,
+				    unsigned int local_retries,
+				    unsigned int local_fallback_retries,
+				    unsigned int stable,
+				    int parent_r,
+				    const struct crush_choose_arg *choose_args);
+static int crush_choose_firstn_optimal_leaf(const struct crush_map *map,
+					    struct crush_work *work,
+					    const struct crush_bucket *bucket,
+					    const __u32 *weight, int weight_max,
+					    int x,
+					    int *out, int outpos,
+					    int out_size,
+					    unsigned int tries,
+					    int parent_r,
+					    const struct crush_choose_arg *choose_args);
+#ifndef __KERNEL__
+static int crush_straw2_firstn_leaf(const struct crush_map *map,
+				    struct crush_work *work,
+				    const struct crush_bucket *bucket,
+				    const __u32 *weight, int weight_max,
+				    int x, int numrep,
+				    int *out, int outpos,
+				    int out_size,
+				    unsigned int tries,
+				    unsigned int local_retries,
+				    unsigned int stable,
+				    int parent_r,
+				    const struct crush_choose_arg *choose_args);
+#endif
+
+static inline __attribute__((__always_inline__))
+int __crush_choose_firstn(const struct crush_map *map,
 			       struct crush_work *work,
 			       const struct crush_bucket *bucket,
 			       const __u32 *weight, int weight_max,
@@ -457,7 +1276,8 @@ static int crush_choose_firstn(const struct crush_map *map,
 			       unsigned int stable,
 			       int *out2,
 			       int parent_r,
-                               const struct crush_choose_arg *choose_args)
+                               const struct crush_choose_arg *choose_args,
+			       int alg)
 {
 	int rep;
 	unsigned int ftotal, flocal;
@@ -496,7 +1316,11 @@ parent_r %d stable %d\n",
 				r += ftotal;
 
 				/* bucket choose */
+				crush_visit(work, in->id);
 				if (in->size == 0) {
+					crush_trace(work, CRUSH_TRACE_REJECT,
+						    in, CRUSH_ITEM_NONE, r,
+						    ftotal);
 					reject = 1;
 					goto reject;
 				}
@@ -504,14 +1328,21 @@ parent_r %d stable %d\n",
 				    flocal >= (in->size>>1) &&
 				    flocal > local_fallback_retries)
 					item = bucket_perm_choose(
-						in, work->work[-1-in->id],
+						in, crush_work_perm(work, in),
 						x, r);
+				else if (alg == CRUSH_BUCKET_STRAW2)
+					item = bucket_straw2_choose(
+						(const struct crush_bucket_straw2 *)in,
+						x, r,
+						(choose_args ? &choose_args[-1-in->id] : 0),
+						outpos);
 				else
 					item = crush_bucket_choose(
-						in, work->work[-1-in->id],
-						x, r,
+						in, work, x, r,
                                                 (choose_args ? &choose_args[-1-in->id] : 0),
                                                 outpos);
+				crush_trace(work, CRUSH_TRACE_CHOOSE,
+					    in, item, r, ftotal);
 				if (item >= map->max_devices) {
 					dprintk("   bad item %d\n", item);
 					skip_rep = 1;
@@ -519,10 +1350,12 @@ parent_r %d stable %d\n",
 				}
 
 				/* desired type? */
-				if (item < 0)
+				if (item < 0) {
+					crush_visit(work, item);
 					itemtype = map->buckets[-1-item]->type;
-				else
+				} else {
 					itemtype = 0;
+				}
 				dprintk("  item %d type %d\n", item, itemtype);
 
 				/* keep going? */
@@ -542,6 +1375,10 @@ parent_r %d stable %d\n",
 				for (i = 0; i < outpos; i++) {
 					if (out[i] == item) {
 						collide = 1;
+						crush_trace(work,
+							    CRUSH_TRACE_COLLIDE,
+							    in, item, r,
+							    ftotal);
 						break;
 					}
 				}
@@ -550,28 +1387,66 @@ parent_r %d stable %d\n",
 				if (!collide && recurse_to_leaf) {
 					if (item < 0) {
 						int sub_r;
+						int leaf_outpos;
 						if (vary_r)
 							sub_r = r >> (vary_r-1);
 						else
 							sub_r = 0;
-						if (crush_choose_firstn(
-							    map,
-							    work,
-							    map->buckets[-1-item],
-							    weight, weight_max,
-							    x, stable ? 1 : outpos+1, 0,
-							    out2, outpos, count,
-							    recurse_tries, 0,
-							    local_retries,
-							    local_fallback_retries,
-							    0,
-							    vary_r,
-							    stable,
-							    NULL,
-							    sub_r,
-                                                            choose_args) <= outpos)
+#ifndef __KERNEL__
+						if (alg == CRUSH_BUCKET_STRAW2)
+							leaf_outpos =
+							crush_straw2_firstn_leaf(
+								map,
+								work,
+								map->buckets[-1-item],
+								weight, weight_max,
+								x, stable ? 1 : outpos+1,
+								out2, outpos, count,
+								recurse_tries,
+								local_retries,
+								stable,
+								sub_r,
+								choose_args);
+						else
+#endif
+						if (local_retries == 0 &&
+						    local_fallback_retries == 0 &&
+						    stable &&
+						    crush_optimal_fast_path())
+							leaf_outpos =
+							crush_choose_firstn_optimal_leaf(
+								map,
+								work,
+								map->buckets[-1-item],
+								weight, weight_max,
+								x,
+								out2, outpos, count,
+								recurse_tries,
+								sub_r,
+								choose_args);
+						else
+							leaf_outpos =
+							crush_choose_firstn_leaf(
+								map,
+								work,
+								map->buckets[-1-item],
+								weight, weight_max,
+								x, stable ? 1 : outpos+1,
+								out2, outpos, count,
+								recurse_tries,
+								local_retries,
+								local_fallback_retries,
+								stable,
+								sub_r,
+								choose_args);
+						if (leaf_outpos <= outpos) {
 							/* didn't get leaf */
+							crush_trace(work,
+								    CRUSH_TRACE_REJECT,
+								    in, item, r,
+								    ftotal);
 							reject = 1;
+						}
 					} else {
 						/* we already have a leaf! */
 						out2[outpos] = item;
@@ -580,10 +1455,20 @@ parent_r %d stable %d\n",
 
 				if (!reject && !collide) {
 					/* out? */
-					if (itemtype == 0)
+					if (itemtype == 0) {
+						crush_trace_weight(work, weight,
+								   weight_max,
+								   item);
 						reject = is_out(map, weight,
 								weight_max,
-								item, x);
+								item, x,
+								in->hash);
+						if (reject)
+							crush_trace(work,
+								    CRUSH_TRACE_REJECT,
+								    in, item, r,
+								    ftotal);
+					}
 				}
 
 reject:
@@ -604,6 +1489,16 @@ reject:
 					else
 						/* else give up */
 						skip_rep = 1;
+					if (retry_bucket)
+						crush_trace(work,
+							    CRUSH_TRACE_RETRY_BUCKET,
+							    in, item, r,
+							    ftotal);
+					else if (retry_descent)
+						crush_trace(work,
+							    CRUSH_TRACE_RETRY_DESCENT,
+							    in, item, r,
+							    ftotal);
 					dprintk("  reject %d  collide %d  "
 						"ftotal %u  flocal %u\n",
 						reject, collide, ftotal,
@@ -614,16 +1509,19 @@ reject:
 
 		if (skip_rep) {
 			dprintk("skip rep\n");
+			crush_trace(work, CRUSH_TRACE_SKIP,
+				    in, CRUSH_ITEM_NONE, r, ftotal);
 			continue;
 		}
 
 		dprintk("CHOOSE got %d\n", item);
+		crush_trace(work, CRUSH_TRACE_PLACE, in, item, r, ftotal);
 		out[outpos] = item;
 		outpos++;
 		count--;
 #ifndef __KERNEL__
-		if (map->choose_tries && ftotal <= map->choose_total_tries)
-			map->choose_tries[ftotal]++;
+		if (ftotal < work->choose_tries_size)
+			work->choose_tries[ftotal]++;
 #endif
 	}
 
@@ -631,12 +1529,157 @@ reject:
 	return outpos;
 }
 
+static __attribute__((__noinline__))
+int crush_choose_firstn(const struct crush_map *map,
+			struct crush_work *work,
+			const struct crush_bucket *bucket,
+			const __u32 *weight, int weight_max,
+			int x, int numrep, int type,
+			int *out, int outpos,
+			int out_size,
+			unsigned int tries,
+			unsigned int recurse_tries,
+			unsigned int local_retries,
+			unsigned int local_fallback_retries,
+			int recurse_to_leaf,
+			unsigned int vary_r,
+			unsigned int stable,
+			int *out2,
+			int parent_r,
+			const struct crush_choose_arg *choose_args)
+{
+	return __crush_choose_firstn(map, work, bucket, weight, weight_max,
+				     x, numrep, type, out, outpos, out_size,
+				     tries, recurse_tries,
+				     local_retries, local_fallback_retries,
+				     recurse_to_leaf, vary_r, stable,
+				     out2, parent_r, choose_args, 0);
+}
+
+/* crush_choose_firstn() with local tries 0, vary_r 1 and stable 1 */
+static __attribute__((__noinline__))
+int crush_choose_firstn_optimal(const struct crush_map *map,
+				struct crush_work *work,
+				const struct crush_bucket *bucket,
+				const __u32 *weight, int weight_max,
+				int x, int numrep, int type,
+				int *out, int outpos,
+				int out_size,
+				unsigned int tries,
+				unsigned int recurse_tries,
+				int recurse_to_leaf,
+				int *out2,
+				const struct crush_choose_arg *choose_args)
+{
+	return __crush_choose_firstn(map, work, bucket, weight, weight_max,
+				     x, numrep, type, out, outpos, out_size,
+				     tries, recurse_tries, 0, 0,
+				     recurse_to_leaf, 1, 1,
+				     out2, 0, choose_args, 0);
+}
+
+/* the recursive call of crush_choose_firstn() to find a leaf */
+static __attribute__((__noinline__))
+int crush_choose_firstn_leaf(const struct crush_map *map,
+			     struct crush_work *work,
+			     const struct crush_bucket *bucket,
+			     const __u32 *weight, int weight_max,
+			     int x, int numrep,
+			     int *out, int outpos,
+			     int out_size,
+			     unsigned int tries,
+			     unsigned int local_retries,
+			     unsigned int local_fallback_retries,
+			     unsigned int stable,
+			     int parent_r,
+			     const struct crush_choose_arg *choose_args)
+{
+	return __crush_choose_firstn(map, work, bucket, weight, weight_max,
+				     x, numrep, 0, out, outpos, out_size,
+				     tries, 0,
+				     local_retries, local_fallback_retries,
+				     0, 0, stable,
+				     NULL, parent_r, choose_args, 0);
+}
+
+/* the recursive call of crush_choose_firstn_optimal() to find a leaf */
+static __attribute__((__noinline__))
+int crush_choose_firstn_optimal_leaf(const struct crush_map *map,
+				     struct crush_work *work,
+				     const struct crush_bucket *bucket,
+				     const __u32 *weight, int weight_max,
+				     int x,
+				     int *out, int outpos,
+				     int out_size,
+				     unsigned int tries,
+				     int parent_r,
+				     const struct crush_choose_arg *choose_args)
+{
+	return __crush_choose_firstn(map, work, bucket, weight, weight_max,
+				     x, 1, 0, out, outpos, out_size,
+				     tries, 0, 0, 0,
+				     0, 0, 1,
+				     NULL, parent_r, choose_args, 0);
+}
+
+#ifndef __KERNEL__
+/* the recursive call of a straw2 rule executor to find a leaf */
+static __attribute__((__noinline__))
+int crush_straw2_firstn_leaf(const struct crush_map *map,
+			     struct crush_work *work,
+			     const struct crush_bucket *bucket,
+			     const __u32 *weight, int weight_max,
+			     int x, int numrep,
+			     int *out, int outpos,
+			     int out_size,
+			     unsigned int tries,
+			     unsigned int local_retries,
+			     unsigned int stable,
+			     int parent_r,
+			     const struct crush_choose_arg *choose_args)
+{
+	return __crush_choose_firstn(map, work, bucket, weight, weight_max,
+				     x, numrep, 0, out, outpos, out_size,
+				     tries, 0, local_retries, 0,
+				     0, 0, stable,
+				     NULL, parent_r, choose_args,
+				     CRUSH_BUCKET_STRAW2);
+}
+#endif
+
 
 /**
  * crush_choose_indep: alternative breadth-first positionally stable mapping
  *
+ * It reads none of the local tries, vary_r and stable tunables: it
+ * is inlined in crush_choose_indep() and crush_choose_indep_leaf(),
+ * the recursive call that finds a leaf, where @out2 is NULL. @alg is
+ * CRUSH_BUCKET_STRAW2 in the executors of crush_make_rule_executor(),
+ * where all the buckets are, and 0 otherwise.
  */
-static void crush_choose_indep(const struct crush_map *map,
+static void crush_choose_indep_leaf(const struct crush_map *map,
+				    struct crush_work *work,
+				    const struct crush_bucket *bucket,
+				    const __u32 *weight, int weight_max,
+				    int x, int numrep,
+				    int *out, int outpos,
+				    unsigned int tries,
+				    int parent_r,
+				    const struct crush_choose_arg *choose_args);
+#ifndef __KERNEL__
+static void crush_straw2_indep_leaf(const struct crush_map *map,
+				    struct crush_work *work,
+				    const struct crush_bucket *bucket,
+				    const __u32 *weight, int weight_max,
+				    int x, int numrep,
+				    int *out, int outpos,
+				    unsigned int tries,
+				    int parent_r,
+				    const struct crush_choose_arg *choose_args);
+#endif
+
+static inline __attribute__((__always_inline__))
+void __crush_choose_indep(const struct crush_map *map,
 			       struct crush_work *work,
 			       const struct crush_bucket *bucket,
 			       const __u32 *weight, int weight_max,
@@ -647,7 +1690,8 @@ static void crush_choose_indep(const struct crush_map *map,
 			       int recurse_to_leaf,
 			       int *out2,
 			       int parent_r,
-                               const struct crush_choose_arg *choose_args)
+                               const struct crush_choose_arg *choose_args,
+			       int alg)
 {
 	const struct crush_bucket *in = bucket;
 	int endpos = outpos + left;
@@ -689,6 +1733,10 @@ static void crush_choose_indep(const struct crush_map *map,
 				continue;
 
 			in = bucket;  /* initial bucket */
+			if (ftotal > 0)
+				crush_trace(work, CRUSH_TRACE_RETRY_DESCENT,
+					    in, CRUSH_ITEM_NONE, rep + parent_r,
+					    ftotal);
 
 			/* choose through intervening buckets */
 			for (;;) {
@@ -703,7 +1751,8 @@ static void crush_choose_indep(const struct crush_map *map,
 				r = rep + parent_r;
 
 				/* be careful */
-				if (in->alg == CRUSH_BUCKET_UNIFORM &&
+				if (alg != CRUSH_BUCKET_STRAW2 &&
+				    in->alg == CRUSH_BUCKET_UNIFORM &&
 				    in->size % numrep == 0)
 					/* r'=r+(n+1)*f_total */
 					r += (numrep+1) * ftotal;
@@ -712,18 +1761,33 @@ static void crush_choose_indep(const struct crush_map *map,
 					r += numrep * ftotal;
 
 				/* bucket choose */
+				crush_visit(work, in->id);
 				if (in->size == 0) {
 					dprintk("   empty bucket\n");
+					crush_trace(work, CRUSH_TRACE_REJECT,
+						    in, CRUSH_ITEM_NONE, r,
+						    ftotal);
 					break;
 				}
 
-				item = crush_bucket_choose(
-					in, work->work[-1-in->id],
-					x, r,
-                                        (choose_args ? &choose_args[-1-in->id] : 0),
-                                        outpos);
+				if (alg == CRUSH_BUCKET_STRAW2)
+					item = bucket_straw2_choose(
+						(const struct crush_bucket_straw2 *)in,
+						x, r,
+						(choose_args ? &choose_args[-1-in->id] : 0),
+						outpos);
+				else
+					item = crush_bucket_choose(
+						in, work, x, r,
+						(choose_args ? &choose_args[-1-in->id] : 0),
+						outpos);
+				crush_trace(work, CRUSH_TRACE_CHOOSE,
+					    in, item, r, ftotal);
 				if (item >= map->max_devices) {
 					dprintk("   bad item %d\n", item);
+					crush_trace(work, CRUSH_TRACE_SKIP,
+						    in, CRUSH_ITEM_NONE, r,
+						    ftotal);
 					out[rep] = CRUSH_ITEM_NONE;
 					if (out2)
 						out2[rep] = CRUSH_ITEM_NONE;
@@ -732,10 +1796,12 @@ static void crush_choose_indep(const struct crush_map *map,
 				}
 
 				/* desired type? */
-				if (item < 0)
+				if (item < 0) {
+					crush_visit(work, item);
 					itemtype = map->buckets[-1-item]->type;
-				else
+				} else {
 					itemtype = 0;
+				}
 				dprintk("  item %d type %d\n", item, itemtype);
 
 				/* keep going? */
@@ -743,6 +1809,10 @@ static void crush_choose_indep(const struct crush_map *map,
 					if (item >= 0 ||
 					    (-1-item) >= map->max_buckets) {
 						dprintk("   bad item type %d\n", type);
+						crush_trace(work,
+							    CRUSH_TRACE_SKIP,
+							    in, CRUSH_ITEM_NONE,
+							    r, ftotal);
 						out[rep] = CRUSH_ITEM_NONE;
 						if (out2)
 							out2[rep] =
@@ -762,22 +1832,42 @@ static void crush_choose_indep(const struct crush_map *map,
 						break;
 					}
 				}
-				if (collide)
+				if (collide) {
+					crush_trace(work, CRUSH_TRACE_COLLIDE,
+						    in, item, r, ftotal);
 					break;
+				}
 
 				if (recurse_to_leaf) {
 					if (item < 0) {
-						crush_choose_indep(
+#ifndef __KERNEL__
+						if (alg == CRUSH_BUCKET_STRAW2)
+							crush_straw2_indep_leaf(
+								map,
+								work,
+								map->buckets[-1-item],
+								weight, weight_max,
+								x, numrep,
+								out2, rep,
+								recurse_tries,
+								r, choose_args);
+						else
+#endif
+						crush_choose_indep_leaf(
 							map,
 							work,
 							map->buckets[-1-item],
 							weight, weight_max,
-							x, 1, numrep, 0,
+							x, numrep,
 							out2, rep,
-							recurse_tries, 0,
-							0, NULL, r, choose_args);
+							recurse_tries,
+							r, choose_args);
 						if (out2[rep] == CRUSH_ITEM_NONE) {
 							/* placed nothing; no leaf */
+							crush_trace(work,
+								    CRUSH_TRACE_REJECT,
+								    in, item, r,
+								    ftotal);
 							break;
 						}
 					} else {
@@ -787,11 +1877,23 @@ static void crush_choose_indep(const struct crush_map *map,
 				}
 
 				/* out? */
-				if (itemtype == 0 &&
-				    is_out(map, weight, weight_max, item, x))
-					break;
+				if (itemtype == 0) {
+					crush_trace_weight(work, weight,
+							   weight_max, item);
+					if (is_out(map, weight,
+						   weight_max, item, x,
+						   in->hash)) {
+						crush_trace(work,
+							    CRUSH_TRACE_REJECT,
+							    in, item, r,
+							    ftotal);
+						break;
+					}
+				}
 
 				/* yay! */
+				crush_trace(work, CRUSH_TRACE_PLACE,
+					    in, item, r, ftotal);
 				out[rep] = item;
 				left--;
 				break;
@@ -800,6 +1902,9 @@ static void crush_choose_indep(const struct crush_map *map,
 	}
 	for (rep = outpos; rep < endpos; rep++) {
 		if (out[rep] == CRUSH_ITEM_UNDEF) {
+			crush_trace(work, CRUSH_TRACE_SKIP,
+				    bucket, CRUSH_ITEM_NONE, rep + parent_r,
+				    ftotal);
 			out[rep] = CRUSH_ITEM_NONE;
 		}
 		if (out2 && out2[rep] == CRUSH_ITEM_UNDEF) {
@@ -807,8 +1912,8 @@ static void crush_choose_indep(const struct crush_map *map,
 		}
 	}
 #ifndef __KERNEL__
-	if (map->choose_tries && ftotal <= map->choose_total_tries)
-		map->choose_tries[ftotal]++;
+	if (ftotal < work->choose_tries_size)
+		work->choose_tries[ftotal]++;
 #endif
 #ifdef DEBUG_INDEP
 	if (out2) {
@@ -826,6 +1931,61 @@ static void crush_choose_indep(const struct crush_map *map,
 #endif
 }
 
+static __attribute__((__noinline__))
+void crush_choose_indep(const struct crush_map *map,
+			struct crush_work *work,
+			const struct crush_bucket *bucket,
+			const __u32 *weight, int weight_max,
+			int x, int left, int numrep, int type,
+			int *out, int outpos,
+			unsigned int tries,
+			unsigned int recurse_tries,
+			int recurse_to_leaf,
+			int *out2,
+			int parent_r,
+			const struct crush_choose_arg *choose_args)
+{
+	__crush_choose_indep(map, work, bucket, weight, weight_max,
+			     x, left, numrep, type, out, outpos,
+			     tries, recurse_tries, recurse_to_leaf,
+			     out2, parent_r, choose_args, 0);
+}
+
+static __attribute__((__noinline__))
+void crush_choose_indep_leaf(const struct crush_map *map,
+			     struct crush_work *work,
+			     const struct crush_bucket *bucket,
+			     const __u32 *weight, int weight_max,
+			     int x, int numrep,
+			     int *out, int outpos,
+			     unsigned int tries,
+			     int parent_r,
+			     const struct crush_choose_arg *choose_args)
+{
+	__crush_choose_indep(map, work, bucket, weight, weight_max,
+			     x, 1, numrep, 0, out, outpos, tries, 0, 0,
+			     NULL, parent_r, choose_args, 0);
+}
+
+#ifndef __KERNEL__
+/* the recursive call of a straw2 rule executor to find a leaf */
+static __attribute__((__noinline__))
+void crush_straw2_indep_leaf(const struct crush_map *map,
+			     struct crush_work *work,
+			     const struct crush_bucket *bucket,
+			     const __u32 *weight, int weight_max,
+			     int x, int numrep,
+			     int *out, int outpos,
+			     unsigned int tries,
+			     int parent_r,
+			     const struct crush_choose_arg *choose_args)
+{
+	__crush_choose_indep(map, work, bucket, weight, weight_max,
+			     x, 1, numrep, 0, out, outpos, tries, 0, 0,
+			     NULL, parent_r, choose_args, CRUSH_BUCKET_STRAW2);
+}
+#endif
+
 
 /* This takes a chunk of memory and sets it up to be a shiny new
    working area for a CRUSH placement computation. It must be called
@@ -837,7 +1997,14 @@ static void crush_choose_indep(const struct crush_map *map,
 
    If you do retain the working space between calls to crush, make it
    thread-local. If you reinstitute the locking I've spent so much
-   time getting rid of, I will be very unhappy with you. */
+   time getting rid of, I will be very unhappy with you.
+
+   Only the uniform buckets have a permutation of their own, laid out
+   by crush_work_perm() the first time they are used. The other
+   buckets share one for the local fallback retries. Setting up the
+   working area only clears an array of pointers to them. The kernel
+   decoder sizes the working area for a permutation of each bucket,
+   all laid out here as they always were. */
 
 void crush_init_workspace(const struct crush_map *m, void *v) {
 	/* We work by moving through the available space and setting
@@ -848,26 +2015,324 @@ void crush_init_workspace(const struct crush_map *m, void *v) {
 	   point to by incrementing the point. */
 	struct crush_work *w = (struct crush_work *)v;
 	char *point = (char *)v;
+#ifdef __KERNEL__
 	__s32 b;
+	__u32 i;
+#endif
 	point += sizeof(struct crush_work);
 	w->work = (struct crush_work_bucket **)point;
 	point += m->max_buckets * sizeof(struct crush_work_bucket *);
+#ifdef __KERNEL__
+	/* the working size is that of a permutation for each bucket */
 	for (b = 0; b < m->max_buckets; ++b) {
 		if (m->buckets[b] == 0)
 			continue;
 
 		w->work[b] = (struct crush_work_bucket *) point;
-		switch (m->buckets[b]->alg) {
-		default:
-			point += sizeof(struct crush_work_bucket);
-			break;
-		}
+		point += sizeof(struct crush_work_bucket);
 		w->work[b]->perm_x = 0;
 		w->work[b]->perm_n = 0;
 		w->work[b]->perm = (__u32 *)point;
+		w->work[b]->perm_magic = NULL;
+		for (i = 0; i < m->buckets[b]->size; i++)
+			w->work[b]->perm[i] = i;
 		point += m->buckets[b]->size * sizeof(__u32);
 	}
 	BUG_ON((char *)point - (char *)w != m->working_size);
+#else
+	/* the uniform buckets are set up by crush_work_perm() */
+	memset(w->work, 0, m->max_buckets * sizeof(struct crush_work_bucket *));
+	w->shared = (struct crush_work_bucket *)point;
+	w->shared->perm_x = 0;
+	w->shared->perm_n = 0;
+	w->shared->perm = (__u32 *)(w->shared + 1);
+	w->shared->perm_magic = NULL;
+	w->shared_id = 0;
+	w->shared_identity = 0;
+	point += CRUSH_WORK_BUCKET_SIZE(m->shared_perm_size);
+	w->work_point = point;
+	point += m->buckets_working_size;
+	w->visited = 0;
+	w->track_visited = 0;
+#ifdef CRUSH_TRACE
+	w->trace = NULL;
+	w->trace_step = 0;
+#endif
+	/* crush_finalize() reserves the rest for the histogram of the
+	   retries, (choose_total_tries + 1) entries when it ran */
+	w->choose_tries = (__u32 *)point;
+	w->choose_tries_size = (m->working_size - (point - (char *)w)) /
+		sizeof(__u32);
+	memset(w->choose_tries, 0, w->choose_tries_size * sizeof(__u32));
+	point += w->choose_tries_size * sizeof(__u32);
+	BUG_ON((char *)point - (char *)w != m->working_size);
+#endif
+}
+
+#ifndef __KERNEL__
+int crush_merge_choose_tries(const void *cwin, __u32 *choose_tries, int size)
+{
+	const struct crush_work *w = (const struct crush_work *)cwin;
+	int i;
+
+	for (i = 0; i < size && i < (int)w->choose_tries_size; i++)
+		choose_tries[i] += w->choose_tries[i];
+	return w->choose_tries_size;
+}
+
+void crush_clear_choose_tries(void *cwin)
+{
+	struct crush_work *w = (struct crush_work *)cwin;
+
+	memset(w->choose_tries, 0, w->choose_tries_size * sizeof(__u32));
+}
+
+void crush_track_visited(void *cwin, int track)
+{
+	struct crush_work *w = (struct crush_work *)cwin;
+
+	w->track_visited = track != 0;
+	w->visited = 0;
+}
+
+__u64 crush_get_visited(const void *cwin)
+{
+	const struct crush_work *w = (const struct crush_work *)cwin;
+
+	return w->visited;
+}
+
+int crush_set_trace(void *cwin, struct crush_trace *trace)
+{
+#ifdef CRUSH_TRACE
+	struct crush_work *w = (struct crush_work *)cwin;
+
+	w->trace = trace;
+	return 0;
+#else
+	return -EOPNOTSUPP;
+#endif
+}
+#endif
+
+/*
+ * The tunables in effect at a given step of a rule: they are
+ * initialized from the map and overridden by the CRUSH_RULE_SET_*
+ * steps found earlier in the rule.
+ */
+struct crush_rule_tunables {
+	int choose_tries;
+	int choose_leaf_tries;
+	int choose_local_retries;
+	int choose_local_fallback_retries;
+	int vary_r;
+	int stable;
+};
+
+static void crush_init_rule_tunables(const struct crush_map *map,
+				     struct crush_rule_tunables *t)
+{
+	/*
+	 * the original choose_total_tries value was off by one (it
+	 * counted "retries" and not "tries").  add one.
+	 */
+	t->choose_tries = map->choose_total_tries + 1;
+	t->choose_leaf_tries = 0;
+	/*
+	 * the local tries values were counted as "retries", though,
+	 * and need no adjustment
+	 */
+	t->choose_local_retries = map->choose_local_tries;
+	t->choose_local_fallback_retries = map->choose_local_fallback_tries;
+
+	t->vary_r = map->chooseleaf_vary_r;
+	t->stable = map->chooseleaf_stable;
+}
+
+/*
+ * Apply @curstep to @t if it is one of the CRUSH_RULE_SET_* steps
+ * and return 1, otherwise return 0.
+ */
+static int crush_apply_rule_tunable(const struct crush_rule_step *curstep,
+				    struct crush_rule_tunables *t)
+{
+	switch (curstep->op) {
+	case CRUSH_RULE_SET_CHOOSE_TRIES:
+		if (curstep->arg1 > 0)
+			t->choose_tries = curstep->arg1;
+		return 1;
+
+	case CRUSH_RULE_SET_CHOOSELEAF_TRIES:
+		if (curstep->arg1 > 0)
+			t->choose_leaf_tries = curstep->arg1;
+		return 1;
+
+	case CRUSH_RULE_SET_CHOOSE_LOCAL_TRIES:
+		if (curstep->arg1 >= 0)
+			t->choose_local_retries = curstep->arg1;
+		return 1;
+
+	case CRUSH_RULE_SET_CHOOSE_LOCAL_FALLBACK_TRIES:
+		if (curstep->arg1 >= 0)
+			t->choose_local_fallback_retries = curstep->arg1;
+		return 1;
+
+	case CRUSH_RULE_SET_CHOOSELEAF_VARY_R:
+		if (curstep->arg1 >= 0)
+			t->vary_r = curstep->arg1;
+		return 1;
+
+	case CRUSH_RULE_SET_CHOOSELEAF_STABLE:
+		if (curstep->arg1 >= 0)
+			t->stable = curstep->arg1;
+		return 1;
+
+	default:
+		return 0;
+	}
+}
+
+/*
+ * true if the CRUSH_RULE_CHOOSE*_FIRSTN steps run with @t can use
+ * crush_choose_firstn_optimal(), as they do after
+ * set_optimal_crush_map()
+ */
+static int crush_optimal_tunables(const struct crush_rule_tunables *t)
+{
+	return crush_optimal_fast_path() &&
+		t->choose_local_retries == 0 &&
+		t->choose_local_fallback_retries == 0 &&
+		t->vary_r == 1 &&
+		t->stable == 1;
+}
+
+/* true if the argument of a CRUSH_RULE_TAKE step is a known item */
+static int crush_valid_take(const struct crush_map *map, int arg1)
+{
+	return (arg1 >= 0 && arg1 < map->max_devices) ||
+		(-1-arg1 >= 0 &&
+		 -1-arg1 < map->max_buckets &&
+		 map->buckets[-1-arg1]);
+}
+
+/*
+ * Run a CRUSH_RULE_CHOOSE* step for @x on the @wsize items of @w and
+ * store the selection in @o (and the leaves in @c when recursing to
+ * leaves). Return the number of items stored in @o.
+ */
+static int crush_do_choose_step(const struct crush_map *map,
+				struct crush_work *cw,
+				const struct crush_rule_step *curstep,
+				const struct crush_rule_tunables *t,
+				int x, int result_max,
+				const int *w, int wsize, int *o, int *c,
+				const __u32 *weight, int weight_max,
+				const struct crush_choose_arg *choose_args)
+{
+	int firstn = curstep->op == CRUSH_RULE_CHOOSELEAF_FIRSTN ||
+		curstep->op == CRUSH_RULE_CHOOSE_FIRSTN;
+	int recurse_to_leaf =
+		curstep->op == CRUSH_RULE_CHOOSELEAF_FIRSTN ||
+		curstep->op == CRUSH_RULE_CHOOSELEAF_INDEP;
+	int optimal = firstn && crush_optimal_tunables(t);
+	int osize = 0;
+	int out_size;
+	int numrep;
+	int recurse_tries;
+	int i, j;
+
+	if (!firstn)
+		recurse_tries = t->choose_leaf_tries ?
+			t->choose_leaf_tries : 1;
+	else if (t->choose_leaf_tries)
+		recurse_tries = t->choose_leaf_tries;
+	else if (map->chooseleaf_descend_once)
+		recurse_tries = 1;
+	else
+		recurse_tries = t->choose_tries;
+
+	for (i = 0; i < wsize; i++) {
+		int bno;
+		/*
+		 * see CRUSH_N, CRUSH_N_MINUS macros.
+		 * basically, numrep <= 0 means relative to
+		 * the provided result_max
+		 */
+		numrep = curstep->arg1;
+		if (numrep <= 0) {
+			numrep += result_max;
+			if (numrep <= 0)
+				continue;
+		}
+		j = 0;
+		/* make sure bucket id is valid */
+		bno = -1 - w[i];
+		if (bno < 0 || bno >= map->max_buckets) {
+			// w[i] is probably CRUSH_ITEM_NONE
+			dprintk("  bad w[i] %d\n", w[i]);
+			continue;
+		}
+		if (optimal) {
+			osize += crush_choose_firstn_optimal(
+				map,
+				cw,
+				map->buckets[bno],
+				weight, weight_max,
+				x, numrep,
+				curstep->arg2,
+				o+osize, j,
+				result_max-osize,
+				t->choose_tries,
+				recurse_tries,
+				recurse_to_leaf,
+				c+osize,
+				choose_args);
+		} else if (firstn) {
+			osize += crush_choose_firstn(
+				map,
+				cw,
+				map->buckets[bno],
+				weight, weight_max,
+				x, numrep,
+				curstep->arg2,
+				o+osize, j,
+				result_max-osize,
+				t->choose_tries,
+				recurse_tries,
+				t->choose_local_retries,
+				t->choose_local_fallback_retries,
+				recurse_to_leaf,
+				t->vary_r,
+				t->stable,
+				c+osize,
+				0,
+				choose_args);
+		} else {
+			out_size = ((numrep < (result_max-osize)) ?
+				    numrep : (result_max-osize));
+			crush_choose_indep(
+				map,
+				cw,
+				map->buckets[bno],
+				weight, weight_max,
+				x, out_size, numrep,
+				curstep->arg2,
+				o+osize, j,
+				t->choose_tries,
+				recurse_tries,
+				recurse_to_leaf,
+				c+osize,
+				0,
+				choose_args);
+			osize += out_size;
+		}
+	}
+
+	if (recurse_to_leaf)
+		/* copy final _leaf_ values to output set */
+		memcpy(o, c, osize*sizeof(*o));
+
+	return osize;
 }
 
 /**
@@ -893,30 +2358,12 @@ int crush_do_rule(const struct crush_map *map,
 	int *c = b + result_max;
 	int *w = a;
 	int *o = b;
-	int recurse_to_leaf;
 	int wsize = 0;
-	int osize;
 	int *tmp;
 	const struct crush_rule *rule;
+	struct crush_rule_tunables t;
 	__u32 step;
-	int i, j;
-	int numrep;
-	int out_size;
-	/*
-	 * the original choose_total_tries value was off by one (it
-	 * counted "retries" and not "tries").  add one.
-	 */
-	int choose_tries = map->choose_total_tries + 1;
-	int choose_leaf_tries = 0;
-	/*
-	 * the local tries values were counted as "retries", though,
-	 * and need no adjustment
-	 */
-	int choose_local_retries = map->choose_local_tries;
-	int choose_local_fallback_retries = map->choose_local_fallback_tries;
-
-	int vary_r = map->chooseleaf_vary_r;
-	int stable = map->chooseleaf_stable;
+	int i;
 
 	if ((__u32)ruleno >= map->max_rules) {
 		dprintk(" bad ruleno %d\n", ruleno);
@@ -925,18 +2372,22 @@ int crush_do_rule(const struct crush_map *map,
 
 	rule = map->rules[ruleno];
 	result_len = 0;
+	crush_init_rule_tunables(map, &t);
+#ifndef __KERNEL__
+	cw->visited = 0;
+#endif
 
 	for (step = 0; step < rule->len; step++) {
-		int firstn = 0;
 		const struct crush_rule_step *curstep = &rule->steps[step];
 
+		if (crush_apply_rule_tunable(curstep, &t))
+			continue;
+
 		switch (curstep->op) {
 		case CRUSH_RULE_TAKE:
-			if ((curstep->arg1 >= 0 &&
-			     curstep->arg1 < map->max_devices) ||
-			    (-1-curstep->arg1 >= 0 &&
-			     -1-curstep->arg1 < map->max_buckets &&
-			     map->buckets[-1-curstep->arg1])) {
+			if (crush_valid_take(map, curstep->arg1)) {
+				if (curstep->arg1 < 0)
+					crush_visit(cw, curstep->arg1);
 				w[0] = curstep->arg1;
 				wsize = 1;
 			} else {
@@ -944,134 +2395,24 @@ int crush_do_rule(const struct crush_map *map,
 			}
 			break;
 
-		case CRUSH_RULE_SET_CHOOSE_TRIES:
-			if (curstep->arg1 > 0)
-				choose_tries = curstep->arg1;
-			break;
-
-		case CRUSH_RULE_SET_CHOOSELEAF_TRIES:
-			if (curstep->arg1 > 0)
-				choose_leaf_tries = curstep->arg1;
-			break;
-
-		case CRUSH_RULE_SET_CHOOSE_LOCAL_TRIES:
-			if (curstep->arg1 >= 0)
-				choose_local_retries = curstep->arg1;
-			break;
-
-		case CRUSH_RULE_SET_CHOOSE_LOCAL_FALLBACK_TRIES:
-			if (curstep->arg1 >= 0)
-				choose_local_fallback_retries = curstep->arg1;
-			break;
-
-		case CRUSH_RULE_SET_CHOOSELEAF_VARY_R:
-			if (curstep->arg1 >= 0)
-				vary_r = curstep->arg1;
-			break;
-
-		case CRUSH_RULE_SET_CHOOSELEAF_STABLE:
-			if (curstep->arg1 >= 0)
-				stable = curstep->arg1;
-			break;
-
 		case CRUSH_RULE_CHOOSELEAF_FIRSTN:
 		case CRUSH_RULE_CHOOSE_FIRSTN:
-			firstn = 1;
-			/* fall through */
 		case CRUSH_RULE_CHOOSELEAF_INDEP:
 		case CRUSH_RULE_CHOOSE_INDEP:
 			if (wsize == 0)
 				break;
 
-			recurse_to_leaf =
-				curstep->op ==
-				 CRUSH_RULE_CHOOSELEAF_FIRSTN ||
-				curstep->op ==
-				CRUSH_RULE_CHOOSELEAF_INDEP;
-
-			/* reset output */
-			osize = 0;
-
-			for (i = 0; i < wsize; i++) {
-				int bno;
-				/*
-				 * see CRUSH_N, CRUSH_N_MINUS macros.
-				 * basically, numrep <= 0 means relative to
-				 * the provided result_max
-				 */
-				numrep = curstep->arg1;
-				if (numrep <= 0) {
-					numrep += result_max;
-					if (numrep <= 0)
-						continue;
-				}
-				j = 0;
-				/* make sure bucket id is valid */
-				bno = -1 - w[i];
-				if (bno < 0 || bno >= map->max_buckets) {
-					// w[i] is probably CRUSH_ITEM_NONE
-					dprintk("  bad w[i] %d\n", w[i]);
-					continue;
-				}
-				if (firstn) {
-					int recurse_tries;
-					if (choose_leaf_tries)
-						recurse_tries =
-							choose_leaf_tries;
-					else if (map->chooseleaf_descend_once)
-						recurse_tries = 1;
-					else
-						recurse_tries = choose_tries;
-					osize += crush_choose_firstn(
-						map,
-						cw,
-						map->buckets[bno],
-						weight, weight_max,
-						x, numrep,
-						curstep->arg2,
-						o+osize, j,
-						result_max-osize,
-						choose_tries,
-						recurse_tries,
-						choose_local_retries,
-						choose_local_fallback_retries,
-						recurse_to_leaf,
-						vary_r,
-						stable,
-						c+osize,
-						0,
-						choose_args);
-				} else {
-					out_size = ((numrep < (result_max-osize)) ?
-						    numrep : (result_max-osize));
-					crush_choose_indep(
-						map,
-						cw,
-						map->buckets[bno],
-						weight, weight_max,
-						x, out_size, numrep,
-						curstep->arg2,
-						o+osize, j,
-						choose_tries,
-						choose_leaf_tries ?
-						   choose_leaf_tries : 1,
-						recurse_to_leaf,
-						c+osize,
-						0,
-						choose_args);
-					osize += out_size;
-				}
-			}
-
-			if (recurse_to_leaf)
-				/* copy final _leaf_ values to output set */
-				memcpy(o, c, osize*sizeof(*o));
+			crush_trace_step(cw, step);
+			wsize = crush_do_choose_step(map, cw, curstep, &t,
+						     x, result_max,
+						     w, wsize, o, c,
+						     weight, weight_max,
+						     choose_args);
 
 			/* swap o and w arrays */
 			tmp = o;
 			o = w;
 			w = tmp;
-			wsize = osize;
 			break;
 
 
@@ -1092,3 +2433,350 @@ int crush_do_rule(const struct crush_map *map,
 
 	return result_len;
 }
+
+/*
+ * A rule step decoded once by crush_do_rule_batch(): only the TAKE,
+ * CHOOSE* and EMIT steps are kept, each with the tunables that were
+ * in effect when the interpreter reached it.
+ */
+struct crush_batch_step {
+	const struct crush_rule_step *step;
+	struct crush_rule_tunables t;
+};
+
+#define CRUSH_BATCH_MAX_STEPS 32
+
+/**
+ * crush_do_rule_batch - calculate the mappings of an array of inputs
+ * @map: the crush_map
+ * @ruleno: the rule id
+ * @xs: hash inputs
+ * @n: number of hash inputs
+ * @results: @n result vectors of @result_max items each
+ * @result_max: maximum result size
+ * @result_lens: the length of each of the @n result vectors
+ * @weight: weight vector (for map leaves)
+ * @weight_max: size of weight vector
+ * @cwin: Pointer to at least map->working_size bytes of memory or NULL.
+ * @choose_args: weights and ids for each known bucket
+ */
+int crush_do_rule_batch(const struct crush_map *map,
+			int ruleno, const int *xs, int n,
+			int *results, int result_max, int *result_lens,
+			const __u32 *weight, int weight_max,
+			void *cwin, const struct crush_choose_arg *choose_args)
+{
+	struct crush_batch_step plan[CRUSH_BATCH_MAX_STEPS];
+	int plan_len = 0;
+	struct crush_work *cw = cwin;
+	int *a = (int *)((char *)cw + map->working_size);
+	int *b = a + result_max;
+	int *c = b + result_max;
+	const struct crush_rule *rule;
+	struct crush_rule_tunables t;
+	__u32 step;
+	int i, k, p;
+
+	if ((__u32)ruleno >= map->max_rules || map->rules[ruleno] == NULL) {
+		dprintk(" bad ruleno %d\n", ruleno);
+		for (i = 0; i < n; i++)
+			result_lens[i] = 0;
+		return 0;
+	}
+
+	rule = map->rules[ruleno];
+	crush_init_rule_tunables(map, &t);
+
+	for (step = 0; step < rule->len; step++) {
+		const struct crush_rule_step *curstep = &rule->steps[step];
+
+		if (crush_apply_rule_tunable(curstep, &t))
+			continue;
+
+		switch (curstep->op) {
+		case CRUSH_RULE_TAKE:
+			if (!crush_valid_take(map, curstep->arg1)) {
+				dprintk(" bad take value %d\n", curstep->arg1);
+				continue;
+			}
+			break;
+		case CRUSH_RULE_CHOOSELEAF_FIRSTN:
+		case CRUSH_RULE_CHOOSE_FIRSTN:
+		case CRUSH_RULE_CHOOSELEAF_INDEP:
+		case CRUSH_RULE_CHOOSE_INDEP:
+		case CRUSH_RULE_EMIT:
+			break;
+		default:
+			dprintk(" unknown op %d at step %d\n",
+				curstep->op, step);
+			continue;
+		}
+
+		if (plan_len == CRUSH_BATCH_MAX_STEPS) {
+			/* unusually long rule, let the interpreter do it */
+			for (i = 0; i < n; i++)
+				result_lens[i] = crush_do_rule(
+					map, ruleno, xs[i],
+					results + i * result_max, result_max,
+					weight, weight_max, cwin, choose_args);
+			return n;
+		}
+		plan[plan_len].step = curstep;
+		plan[plan_len].t = t;
+		plan_len++;
+	}
+
+	for (i = 0; i < n; i++) {
+		int x = xs[i];
+		int *result = results + i * result_max;
+		int result_len = 0;
+		int *w = a;
+		int *o = b;
+		int *tmp;
+		int wsize = 0;
+
+#ifndef __KERNEL__
+		cw->visited = 0;
+#endif
+		for (p = 0; p < plan_len; p++) {
+			const struct crush_rule_step *curstep = plan[p].step;
+
+			switch (curstep->op) {
+			case CRUSH_RULE_TAKE:
+				if (curstep->arg1 < 0)
+					crush_visit(cw, curstep->arg1);
+				w[0] = curstep->arg1;
+				wsize = 1;
+				break;
+
+			case CRUSH_RULE_EMIT:
+				for (k = 0; k < wsize && result_len < result_max; k++)
+					result[result_len++] = w[k];
+				wsize = 0;
+				break;
+
+			default:
+				if (wsize == 0)
+					break;
+				crush_trace_step(cw, curstep - rule->steps);
+				wsize = crush_do_choose_step(map, cw, curstep,
+							     &plan[p].t,
+							     x, result_max,
+							     w, wsize, o, c,
+							     weight, weight_max,
+							     choose_args);
+				tmp = o;
+				o = w;
+				w = tmp;
+				break;
+			}
+		}
+		result_lens[i] = result_len;
+	}
+
+	return n;
+}
+
+#ifndef __KERNEL__
+/*
+ * The rule executors made by crush_make_rule_executor():
+ * __crush_choose_firstn() and __crush_choose_indep() for maps made of
+ * straw2 buckets only and without local fallback retries, inlined
+ * in a function for each value of recurse_to_leaf, vary_r and stable
+ * so that they are constants.
+ */
+/*
+ * The TAKE step of the rule of @e followed by its CHOOSE* step, as
+ * crush_do_rule() and crush_do_choose_step() would run them. Return
+ * the number of items stored in @result or -1 if the working space
+ * is traced and the interpreter must run instead.
+ */
+static inline __attribute__((always_inline))
+int crush_straw2_execute(const struct crush_rule_executor *e,
+			 int x, int *result, int result_max,
+			 const __u32 *weight, int weight_max,
+			 void *cwin,
+			 const struct crush_choose_arg *choose_args,
+			 int firstn, int recurse_to_leaf,
+			 unsigned int vary_r, unsigned int stable)
+{
+	const struct crush_map *map = e->map;
+	struct crush_work *cw = cwin;
+	int *c = (int *)((char *)cw + map->working_size) + 2 * result_max;
+	const struct crush_bucket *bucket = map->buckets[-1-e->take];
+	int numrep = e->numrep;
+	int osize;
+
+#ifdef CRUSH_TRACE
+	if (cw->trace)
+		return -1;
+#endif
+	cw->visited = 0;
+	crush_visit(cw, e->take);
+	if (numrep <= 0) {
+		numrep += result_max;
+		if (numrep <= 0)
+			return 0;
+	}
+	if (firstn) {
+		osize = __crush_choose_firstn(map, cw, bucket,
+					      weight, weight_max,
+					      x, numrep, e->type,
+					      result, 0, result_max,
+					      e->tries, e->recurse_tries,
+					      e->local_retries, 0,
+					      recurse_to_leaf, vary_r, stable,
+					      c, 0, choose_args,
+					      CRUSH_BUCKET_STRAW2);
+	} else {
+		osize = numrep < result_max ? numrep : result_max;
+		__crush_choose_indep(map, cw, bucket,
+				     weight, weight_max,
+				     x, osize, numrep, e->type,
+				     result, 0,
+				     e->tries, e->recurse_tries,
+				     recurse_to_leaf, c, 0, choose_args,
+				     CRUSH_BUCKET_STRAW2);
+	}
+	if (recurse_to_leaf)
+		memcpy(result, c, osize * sizeof(*result));
+	return osize;
+}
+
+static int crush_generic_execute(const struct crush_rule_executor *e,
+				 int x, int *result, int result_max,
+				 const __u32 *weight, int weight_max,
+				 void *cwin,
+				 const struct crush_choose_arg *choose_args)
+{
+	return crush_do_rule(e->map, e->ruleno, x, result, result_max,
+			     weight, weight_max, cwin, choose_args);
+}
+
+#define CRUSH_STRAW2_EXECUTOR(name, firstn, recurse_to_leaf, vary_r, stable) \
+	static int name(const struct crush_rule_executor *e,		\
+			int x, int *result, int result_max,		\
+			const __u32 *weight, int weight_max,		\
+			void *cwin,					\
+			const struct crush_choose_arg *choose_args)	\
+	{								\
+		int result_len = crush_straw2_execute(			\
+			e, x, result, result_max, weight, weight_max,	\
+			cwin, choose_args,				\
+			firstn, recurse_to_leaf, vary_r, stable);	\
+		if (result_len < 0)					\
+			return crush_generic_execute(			\
+				e, x, result, result_max,		\
+				weight, weight_max, cwin, choose_args); \
+		return result_len;					\
+	}
+
+CRUSH_STRAW2_EXECUTOR(crush_straw2_choose_firstn, 1, 0, 0, 0)
+CRUSH_STRAW2_EXECUTOR(crush_straw2_chooseleaf_firstn, 1, 1, 0, 0)
+CRUSH_STRAW2_EXECUTOR(crush_straw2_chooseleaf_firstn_stable, 1, 1, 0, 1)
+CRUSH_STRAW2_EXECUTOR(crush_straw2_chooseleaf_firstn_vary_r, 1, 1, 1, 0)
+CRUSH_STRAW2_EXECUTOR(crush_straw2_chooseleaf_firstn_vary_r_stable, 1, 1, 1, 1)
+CRUSH_STRAW2_EXECUTOR(crush_straw2_choose_indep, 0, 0, 0, 0)
+CRUSH_STRAW2_EXECUTOR(crush_straw2_chooseleaf_indep, 0, 1, 0, 0)
+
+/*
+ * The specialized executor for the CHOOSE* @curstep with the
+ * tunables @t or NULL if there is none.
+ */
+static crush_rule_execute_fn
+crush_straw2_executor(const struct crush_rule_step *curstep,
+		      const struct crush_rule_tunables *t)
+{
+	switch (curstep->op) {
+	case CRUSH_RULE_CHOOSE_FIRSTN:
+		/* vary_r and stable only matter when recursing to a leaf */
+		return crush_straw2_choose_firstn;
+	case CRUSH_RULE_CHOOSELEAF_FIRSTN:
+		if (t->vary_r > 1)
+			return NULL;
+		if (t->vary_r)
+			return t->stable ?
+				crush_straw2_chooseleaf_firstn_vary_r_stable :
+				crush_straw2_chooseleaf_firstn_vary_r;
+		return t->stable ? crush_straw2_chooseleaf_firstn_stable :
+			crush_straw2_chooseleaf_firstn;
+	case CRUSH_RULE_CHOOSE_INDEP:
+		return crush_straw2_choose_indep;
+	case CRUSH_RULE_CHOOSELEAF_INDEP:
+		return crush_straw2_chooseleaf_indep;
+	default:
+		return NULL;
+	}
+}
+
+int crush_make_rule_executor(const struct crush_map *map, int ruleno,
+			     struct crush_rule_executor *e)
+{
+	const struct crush_rule *rule;
+	const struct crush_rule_step *steps[3];
+	struct crush_rule_tunables t, choose_t;
+	int count = 0;
+	__u32 step;
+	__s32 b;
+
+	if ((__u32)ruleno >= map->max_rules || map->rules[ruleno] == NULL)
+		return -EINVAL;
+	rule = map->rules[ruleno];
+
+	e->fn = crush_generic_execute;
+	e->map = map;
+	e->ruleno = ruleno;
+
+	/* TAKE, CHOOSE* and EMIT, the tunables being folded */
+	crush_init_rule_tunables(map, &t);
+	choose_t = t;
+	for (step = 0; step < rule->len; step++) {
+		const struct crush_rule_step *curstep = &rule->steps[step];
+
+		if (crush_apply_rule_tunable(curstep, &t))
+			continue;
+		if (count == 3)
+			return 0;
+		if (count == 1)
+			choose_t = t;
+		steps[count++] = curstep;
+	}
+	if (count != 3 ||
+	    steps[0]->op != CRUSH_RULE_TAKE ||
+	    steps[2]->op != CRUSH_RULE_EMIT ||
+	    steps[0]->arg1 >= 0 ||
+	    !crush_valid_take(map, steps[0]->arg1))
+		return 0;
+
+	for (b = 0; b < map->max_buckets; b++)
+		if (map->buckets[b] &&
+		    map->buckets[b]->alg != CRUSH_BUCKET_STRAW2)
+			return 0;
+	if (choose_t.choose_local_fallback_retries > 0)
+		return 0;
+	e->fn = crush_straw2_executor(steps[1], &choose_t);
+	if (e->fn == NULL) {
+		e->fn = crush_generic_execute;
+		return 0;
+	}
+
+	e->take = steps[0]->arg1;
+	e->numrep = steps[1]->arg1;
+	e->type = steps[1]->arg2;
+	e->tries = choose_t.choose_tries;
+	e->local_retries = choose_t.choose_local_retries;
+	if (steps[1]->op == CRUSH_RULE_CHOOSELEAF_FIRSTN ||
+	    steps[1]->op == CRUSH_RULE_CHOOSE_FIRSTN) {
+		if (choose_t.choose_leaf_tries)
+			e->recurse_tries = choose_t.choose_leaf_tries;
+		else if (map->chooseleaf_descend_once)
+			e->recurse_tries = 1;
+		else
+			e->recurse_tries = choose_t.choose_tries;
+	} else {
+		e->recurse_tries = choose_t.choose_leaf_tries ?
+			choose_t.choose_leaf_tries : 1;
+	}
+	return 1;
+}
+#endif
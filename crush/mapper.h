@@ -78,6 +78,190 @@ extern int crush_do_rule(const struct crush_map *map,
 			 const __u32 *weights, int weight_max,
 			 void *cwin, const struct crush_choose_arg *choose_args);
 
+/** @ingroup API
+ *
+ * Map each of the __n__ values of __xs__ to __result_max__ items, as
+ * crush_do_rule() would, and store them in the __results__ array. The
+ * rule __ruleno__ is decoded once for all values instead of once per
+ * value, and then the values are mapped one after the other. They
+ * are not pushed through the rule one step at a time for all the
+ * values. A CHOOSE* step already descends to the leaves for each
+ * value, so the order would only change between the steps of rules
+ * with several of them. It would also need room for the items of
+ * every value between steps, which the working space does not have.
+ * In crush_do_rule_batch of bench_crush, a step by step version
+ * tried on straw2 16^3 and 64^3 maps was not faster than this one,
+ * and neither was faster than a loop of crush_do_rule(): each was
+ * within a few percent of the loop, which is the noise of that
+ * machine.
+ *
+ * The items for __xs[i]__ are stored in
+ * __results[i * result_max, (i + 1) * result_max[__ and their number is
+ * stored in __result_lens[i]__. They are identical to the items
+ * crush_do_rule() would store in __result__ for the same value.
+ *
+ * The __cwin__ argument must be set as for crush_do_rule():
+ *
+ *         char __cwin__[crush_work_size(__map__, __result_max__)];
+ *         crush_init_workspace(__map__, __cwin__);
+ *
+ * @param map the crush_map
+ * @param ruleno a positive integer < __CRUSH_MAX_RULES__
+ * @param xs the __n__ values to map
+ * @param n the size of the __xs__ array
+ * @param results an array of items of size __n__ * __result_max__
+ * @param result_max the maximum number of items for each value
+ * @param result_lens an array of size __n__
+ * @param weights an array of weights of size __weight_max__
+ * @param weight_max the size of the __weights__ array
+ * @param cwin must be an char array initialized by crush_init_workspace
+ * @param choose_args weights and ids for each known bucket
+ *
+ * @return 0 if __ruleno__ does not exist or __n__ on success
+ */
+extern int crush_do_rule_batch(const struct crush_map *map,
+			       int ruleno, const int *xs, int n,
+			       int *results, int result_max, int *result_lens,
+			       const __u32 *weights, int weight_max,
+			       void *cwin,
+			       const struct crush_choose_arg *choose_args);
+
+#ifndef __KERNEL__
+struct crush_rule_executor;
+
+typedef int (*crush_rule_execute_fn)(const struct crush_rule_executor *e,
+				     int x, int *result, int result_max,
+				     const __u32 *weights, int weight_max,
+				     void *cwin,
+				     const struct crush_choose_arg *choose_args);
+
+/** @ingroup API
+ *
+ * A rule of a map prepared by crush_make_rule_executor() to be run by
+ * crush_execute_rule(). The members other than __fn__, __map__ and
+ * __ruleno__ are only set for the specialized executors.
+ */
+struct crush_rule_executor {
+	crush_rule_execute_fn fn;
+	const struct crush_map *map;
+	int ruleno;
+	/*! the bucket of the TAKE step */
+	int take;
+	/*! the arguments of the CHOOSE* step */
+	int numrep;
+	int type;
+	/*! the tunables in effect for the CHOOSE* step */
+	unsigned int tries;
+	unsigned int recurse_tries;
+	unsigned int local_retries;
+};
+
+/** @ingroup API
+ *
+ * Prepare __e__ to map values with the rule __ruleno__ of __map__
+ * using crush_execute_rule(). When all the buckets of __map__ are
+ * ::CRUSH_BUCKET_STRAW2 buckets and the rule is made of a TAKE step
+ * of a bucket, a CHOOSE* step and an EMIT step, with or without
+ * CRUSH_RULE_SET_* steps, __e__ is given a function specialized for
+ * this rule: the steps are not interpreted, the tunables are
+ * constants and the buckets are not dispatched on their algorithm.
+ * It is not specialized if __choose_local_fallback_tries__ is set or
+ * __chooseleaf_vary_r__ is more than 1. Otherwise __e__ calls
+ * crush_do_rule().
+ *
+ * The items found by crush_execute_rule() are always the same as
+ * those found by crush_do_rule() and the working space is updated
+ * the same way. The decisions of a specialized executor are not
+ * reported to a crush_trace: crush_do_rule() is called instead when
+ * the working space has one, see crush_set_trace().
+ *
+ * __e__ holds pointers to __map__ and must be made again if
+ * __map__ is modified.
+ *
+ * - return -EINVAL if __ruleno__ is not a rule of __map__
+ *
+ * @param map a finalized crush_map
+ * @param ruleno a positive integer < __CRUSH_MAX_RULES__
+ * @param e the executor to prepare
+ *
+ * @returns 1 if __e__ is specialized, 0 if it is not, < 0 on error
+ */
+extern int crush_make_rule_executor(const struct crush_map *map, int ruleno,
+				    struct crush_rule_executor *e);
+
+/** @ingroup API
+ *
+ * Map __x__ with the rule of __e__ as crush_do_rule() would. See
+ * crush_do_rule() for the arguments.
+ *
+ * @param e an executor prepared by crush_make_rule_executor()
+ * @param x the value to map to __result_max__ items
+ * @param result an array of items of size __result_max__
+ * @param result_max the size of the __result__ array
+ * @param weights an array of weights of size __weight_max__
+ * @param weight_max the size of the __weights__ array
+ * @param cwin must be an char array initialized by crush_init_workspace
+ * @param choose_args weights and ids for each known bucket
+ *
+ * @return the size of __result__
+ */
+static inline int crush_execute_rule(const struct crush_rule_executor *e,
+				     int x, int *result, int result_max,
+				     const __u32 *weights, int weight_max,
+				     void *cwin,
+				     const struct crush_choose_arg *choose_args)
+{
+	return e->fn(e, x, result, result_max, weights, weight_max,
+		     cwin, choose_args);
+}
+
+/** @ingroup API
+ *
+ * The mapper uses the vector instructions of the CPU, when it has
+ * them, to choose items in wide ::CRUSH_BUCKET_STRAW2 buckets. The
+ * items chosen are always the same, with or without them.
+ *
+ * - __CRUSH_FAST_PATH_AVX2__ for buckets with 8 items or more
+ * - __CRUSH_FAST_PATH_AVX512__ for buckets with 16 items or more
+ *
+ * It also runs the CRUSH_RULE_CHOOSE*_FIRSTN steps with the tunables
+ * set by set_optimal_crush_map() as constants. It is supported by all
+ * CPUs. The gain is small. In crush_do_rule/rules of bench_crush, on
+ * straw2 16^3 with 10% of the devices down, firstn rules take about
+ * 2530ns instead of 2660ns, which is 3 to 4% faster. Indep rules do
+ * not use it and take the same time.
+ *
+ * - __CRUSH_FAST_PATH_OPTIMAL_TUNABLES__ for the steps run with local
+ *   tries 0, local fallback tries 0, vary_r 1 and stable 1
+ */
+#define CRUSH_FAST_PATH_AVX2		(1 << 0)
+#define CRUSH_FAST_PATH_AVX512		(1 << 1)
+#define CRUSH_FAST_PATH_OPTIMAL_TUNABLES	(1 << 2)
+
+/** @ingroup API
+ *
+ * Return the mask of the __CRUSH_FAST_PATH_*__ in use by the
+ * mapper. When the library is loaded, all the fast paths supported
+ * by the CPU are in use.
+ *
+ * @returns a mask of __CRUSH_FAST_PATH_*__
+ */
+extern unsigned int crush_get_fast_paths(void);
+/** @ingroup API
+ *
+ * Set the mask of the __CRUSH_FAST_PATH_*__ in use by the mapper,
+ * ignoring those that are not supported by the CPU. It is not
+ * thread safe and must not be called while crush_do_rule() runs in
+ * another thread. It is meant for benchmarks and tests comparing the
+ * fast paths with the reference implementation.
+ *
+ * @param fast_paths a mask of __CRUSH_FAST_PATH_*__
+ *
+ * @returns the mask of the __CRUSH_FAST_PATH_*__ now in use
+ */
+extern unsigned int crush_set_fast_paths(unsigned int fast_paths);
+#endif
+
 /* Returns the exact amount of workspace that will need to be used
    for a given combination of crush_map and result_max. The caller can
    then allocate this much on its own, either on the stack, in a
@@ -90,4 +274,184 @@ static inline size_t crush_work_size(const struct crush_map *map,
 
 extern void crush_init_workspace(const struct crush_map *m, void *v);
 
+#ifndef __KERNEL__
+/** @ingroup API
+ *
+ * Each time crush_do_rule() finds an item after __n__ retries, it
+ * increments the entry __n__ of the histogram of the retries stored
+ * in the __cwin__ working space. The histogram has
+ * __choose_total_tries + 1__ entries, __choose_total_tries__ being the
+ * value of the tunable when crush_finalize() ran, and is set to zero
+ * by crush_init_workspace(). Retries beyond the histogram are not
+ * counted.
+ *
+ * Add the entries of the histogram found in __cwin__ to the first
+ * __size__ entries of __choose_tries__. Threads mapping values each
+ * with their own working space do not share any counter: their
+ * histograms can be merged when they are done, for instance:
+ *
+ *         __u32 choose_tries[map->choose_total_tries + 1] = { 0 };
+ *         for (i = 0; i < thread_count; i++)
+ *                 crush_merge_choose_tries(cwin[i], choose_tries,
+ *                                          map->choose_total_tries + 1);
+ *
+ * @param cwin a working space initialized by crush_init_workspace()
+ * @param choose_tries the histogram to add to or NULL
+ * @param size the size of the __choose_tries__ array
+ *
+ * @returns the number of entries in the histogram of __cwin__
+ */
+extern int crush_merge_choose_tries(const void *cwin, __u32 *choose_tries,
+				    int size);
+/** @ingroup API
+ *
+ * Set all the entries of the histogram of the retries of the __cwin__
+ * working space to zero. See crush_merge_choose_tries().
+ *
+ * @param cwin a working space initialized by crush_init_workspace()
+ */
+extern void crush_clear_choose_tries(void *cwin);
+
+/** @ingroup API
+ *
+ * The bit of the mask returned by crush_get_visited() for the bucket
+ * __id__. Buckets whose ids are equal modulo 64 share the same bit.
+ */
+#define CRUSH_VISITED_BIT(id) (1ULL << ((-1-(id)) & 63))
+
+/** @ingroup API
+ *
+ * Record, or stop recording if __track__ is zero, the buckets visited
+ * by crush_do_rule() with the __cwin__ working space, for
+ * crush_get_visited(). It is off after crush_init_workspace(), so
+ * that the mapper does not update the mask for each bucket unless it
+ * is needed, as by crush_map_visited() and crush_map_delta().
+ *
+ * @param cwin a working space initialized by crush_init_workspace()
+ * @param track non zero to record the visited buckets
+ */
+extern void crush_track_visited(void *cwin, int track);
+
+/** @ingroup API
+ *
+ * Return the mask of the buckets visited by the last crush_do_rule()
+ * or by the last value mapped by crush_do_rule_batch() with the
+ * __cwin__ working space: the CRUSH_VISITED_BIT() of each bucket it
+ * chose an item from, took or looked at the type of. A value is mapped
+ * to the same items by two maps that only differ by buckets that are
+ * not in its mask, see crush_map_delta(). The mask is 0 unless
+ * crush_track_visited() is on for __cwin__.
+ *
+ * @param cwin a working space initialized by crush_init_workspace()
+ *
+ * @returns the mask of the visited buckets
+ */
+extern __u64 crush_get_visited(const void *cwin);
+
+/** @ingroup API
+ *
+ * The kinds of decisions reported by the mapper to a crush_trace, in
+ * the order they happen for an item:
+ *
+ * - __CRUSH_TRACE_CHOOSE__ a bucket chose __item__
+ * - __CRUSH_TRACE_COLLIDE__ __item__ was already chosen
+ * - __CRUSH_TRACE_REJECT__ __item__ is out, has no leaf or __bucket__
+ *   is empty
+ * - __CRUSH_TRACE_RETRY_BUCKET__ the next try chooses again from
+ *   __bucket__
+ * - __CRUSH_TRACE_RETRY_DESCENT__ the next try starts again from the
+ *   bucket of the step
+ * - __CRUSH_TRACE_SKIP__ no item was found after __ftotal__ tries
+ * - __CRUSH_TRACE_PLACE__ __item__ is stored in the result
+ */
+enum {
+	CRUSH_TRACE_CHOOSE = 0,
+	CRUSH_TRACE_COLLIDE = 1,
+	CRUSH_TRACE_REJECT = 2,
+	CRUSH_TRACE_RETRY_BUCKET = 3,
+	CRUSH_TRACE_RETRY_DESCENT = 4,
+	CRUSH_TRACE_SKIP = 5,
+	CRUSH_TRACE_PLACE = 6
+};
+
+/** @ingroup API
+ *
+ * A decision of the mapper given to the __fn__ of a crush_trace.
+ */
+struct crush_trace_event {
+	/*! a __CRUSH_TRACE_*__ kind of decision */
+	int type;
+	/*! the index of the rule step in __rule->steps__ */
+	int step;
+	/*! the bucket the item was chosen from */
+	int bucket;
+	/*! the chosen item, CRUSH_ITEM_NONE if there is none */
+	int item;
+	/*! the replica rank given to the bucket */
+	int r;
+	/*! the number of failed tries so far */
+	unsigned int ftotal;
+};
+
+/** @ingroup API
+ *
+ * The counters of the decisions taken by the mapper for a rule step.
+ */
+struct crush_trace_stats {
+	/*! the number of items chosen from a bucket */
+	__u32 buckets;
+	/*! the number of hashes computed to choose them and to tell
+	  whether a device is out */
+	__u32 hashes;
+	__u32 collisions;
+	__u32 rejections;
+	/*! the number of tries choosing again from the same bucket */
+	__u32 local_retries;
+	/*! the number of tries starting again from the bucket of the step */
+	__u32 descent_retries;
+	/*! the number of replicas for which no item was found */
+	__u32 skipped;
+	/*! the number of items stored in the result */
+	__u32 placed;
+};
+
+/** @ingroup API
+ *
+ * Where the mapper reports its decisions, see crush_set_trace(). The
+ * counters of the step __i__ of a rule are added to __steps[i]__ if
+ * __i__ < __max_steps__ and each decision is given to __fn__ if it is
+ * not NULL. The mapper never sets the counters to zero: the caller
+ * does it to get the counters of a single call.
+ */
+struct crush_trace {
+	/*! an array of __max_steps__ counters or NULL */
+	struct crush_trace_stats *steps;
+	__u32 max_steps;
+	/*! called with each decision and __arg__, or NULL */
+	void (*fn)(const struct crush_trace_event *event, void *arg);
+	void *arg;
+};
+
+/** @ingroup API
+ *
+ * Report the decisions taken by crush_do_rule() and
+ * crush_do_rule_batch() with the __cwin__ working space to __trace__,
+ * until crush_set_trace() is called again or crush_init_workspace()
+ * is called on __cwin__. A NULL __trace__ stops the reports.
+ *
+ * The mapper only reports its decisions if the library is built with
+ * __CRUSH_TRACE__ defined in __acconfig.h__, which is what
+ * __cmake -DCRUSH_TRACE=ON__ does. Otherwise it does not spend any
+ * time on it and crush_set_trace() fails.
+ *
+ * - return -EOPNOTSUPP if the library is built without __CRUSH_TRACE__
+ *
+ * @param cwin a working space initialized by crush_init_workspace()
+ * @param trace where to report the decisions or NULL
+ *
+ * @returns 0 on success, < 0 on error
+ */
+extern int crush_set_trace(void *cwin, struct crush_trace *trace);
+#endif
+
 #endif
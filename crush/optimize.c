@@ -0,0 +1,550 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "optimize.h"
+#include "builder.h"
+#include "delta.h"
+#include "mapper.h"
+#include "parallel.h"
+
+/* the number of values mapped again by each crush_map_delta() */
+#define CRUSH_OPTIMIZE_CHUNK 1024
+
+/* a weight set stops changing when its step is below */
+#define CRUSH_OPTIMIZE_MIN_STEP (1.0 / 64)
+
+struct crush_optimizer {
+	const struct crush_map *map;
+	int ruleno;
+	const int *xs;
+	int n;
+	int result_max;
+	const __u32 *weights;
+	int weight_max;
+	const struct crush_choose_arg *choose_args;
+	int nthreads;
+	/* the results of crush_map_visited() kept up to date */
+	int *results;
+	int *result_lens;
+	__u64 *visited;
+	/* the results the counts were made from */
+	int *former;
+	int *former_lens;
+	/* scratch for crush_map_delta() and the values it moved */
+	int *moved;
+	char *flags;
+	__u64 changed;
+	long mapped;
+	int error;
+	/* the number of weight sets of each bucket */
+	int positions;
+	/* the rule has a CRUSH_RULE_CHOOSE*_INDEP step to leaf_type */
+	int indep;
+	int leaf_type;
+	/* devices are at [0,max_devices[, bucket b at max_devices - 1 - b */
+	int items;
+	int *parents;
+	double *targets;
+	/* the number of values chosen at each position for each item */
+	double *counts;
+	/* expected at each position for each device */
+	double *expected;
+	/* the step of each weight set of each bucket */
+	double *steps;
+	__u32 *former_weights;
+	__u32 *new_weights;
+};
+
+static inline int crush_optimize_index(const struct crush_optimizer *o,
+				       int item)
+{
+	return item >= 0 ? item : o->map->max_devices - 1 - item;
+}
+
+/* true if @item is below a bucket of the leaf_type of an indep step */
+static int crush_optimize_below_leaf(const struct crush_optimizer *o,
+				     int item)
+{
+	if (o->leaf_type == 0)
+		return 0;
+	for (item = o->parents[crush_optimize_index(o, item)]; item != 0;
+	     item = o->parents[crush_optimize_index(o, item)])
+		if (o->map->buckets[-1-item]->type == o->leaf_type)
+			return 1;
+	return 0;
+}
+
+/*
+ * add @sign to the counts of the items found in @result and above, at
+ * the position of the weight set crush_do_rule() chose them with: the
+ * position in the result for a firstn step. An indep step chooses at
+ * position 0 and only the items below its leaf_type bucket are chosen
+ * at their position in the result.
+ */
+static void crush_optimize_count(struct crush_optimizer *o,
+				 const int *result, int len, double sign)
+{
+	int i;
+
+	for (i = 0; i < len; i++) {
+		int p = i < o->positions ? i : o->positions - 1;
+		int item = result[i];
+
+		if (item < 0 || item >= o->map->max_devices)
+			continue;
+		if (o->indep && !crush_optimize_below_leaf(o, item))
+			p = 0;
+		/* the parent of a root is 0, which is not a bucket */
+		do {
+			int index = crush_optimize_index(o, item);
+
+			o->counts[(size_t)p * o->items + index] += sign;
+			if (o->indep && item < 0 &&
+			    o->map->buckets[-1-item]->type == o->leaf_type)
+				p = 0;
+			item = o->parents[index];
+		} while (item != 0);
+	}
+}
+
+static void crush_optimize_delta_chunk(void *arg, int worker,
+				       int begin, int end)
+{
+	struct crush_optimizer *o = (struct crush_optimizer *)arg;
+	size_t offset = (size_t)begin * o->result_max;
+	long mapped = 0;
+	int i, count;
+
+	for (i = begin; i < end; i++)
+		if (o->visited[i] & o->changed)
+			mapped++;
+	__atomic_add_fetch(&o->mapped, mapped, __ATOMIC_RELAXED);
+	count = crush_map_delta(o->map, o->ruleno, o->changed,
+				o->xs + begin, end - begin,
+				o->results + offset, o->result_max,
+				o->result_lens + begin, o->visited + begin,
+				o->weights, o->weight_max, o->choose_args,
+				o->moved + begin);
+	if (count < 0) {
+		__atomic_store_n(&o->error, count, __ATOMIC_RELAXED);
+		return;
+	}
+	for (i = 0; i < count; i++)
+		o->flags[begin + o->moved[begin + i]] = 1;
+}
+
+static void crush_optimize_visited_chunk(void *arg, int worker,
+					 int begin, int end)
+{
+	struct crush_optimizer *o = (struct crush_optimizer *)arg;
+	size_t offset = (size_t)begin * o->result_max;
+	int ret;
+
+	ret = crush_map_visited(o->map, o->ruleno, o->xs + begin, end - begin,
+				o->results + offset, o->result_max,
+				o->result_lens + begin, o->visited + begin,
+				o->weights, o->weight_max, o->choose_args);
+	if (ret < 0)
+		__atomic_store_n(&o->error, ret, __ATOMIC_RELAXED);
+}
+
+/*
+ * map again the values that visited the buckets of @changed and
+ * update the counts of those that moved
+ */
+static int crush_optimize_remap(struct crush_optimizer *o, __u64 changed)
+{
+	int ret, i;
+
+	o->changed = changed;
+	memset(o->flags, 0, o->n);
+	ret = crush_parallel_run(0, o->n, CRUSH_OPTIMIZE_CHUNK, o->nthreads,
+				 crush_optimize_delta_chunk, o);
+	if (ret < 0)
+		return ret;
+	if (o->error)
+		return o->error;
+	for (i = 0; i < o->n; i++) {
+		size_t offset = (size_t)i * o->result_max;
+
+		if (!o->flags[i])
+			continue;
+		crush_optimize_count(o, o->former + offset,
+				     o->former_lens[i], -1);
+		crush_optimize_count(o, o->results + offset,
+				     o->result_lens[i], 1);
+		memcpy(o->former + offset, o->results + offset,
+		       o->result_lens[i] * sizeof(int));
+		o->former_lens[i] = o->result_lens[i];
+	}
+	return 0;
+}
+
+/* see crush_optimize_stats */
+static double crush_optimize_deviation(struct crush_optimizer *o)
+{
+	double total_target = 0, deviation = 0;
+	int p, d;
+
+	for (d = 0; d < o->map->max_devices; d++)
+		total_target += o->targets[d];
+	for (p = 0; p < o->positions; p++) {
+		const double *counts = o->counts + (size_t)p * o->items;
+		double placed = 0;
+
+		for (d = 0; d < o->map->max_devices; d++)
+			placed += counts[d];
+		for (d = 0; d < o->map->max_devices; d++) {
+			double expected = total_target > 0 ?
+				placed * o->targets[d] / total_target : 0;
+			double diff = counts[d] - expected;
+
+			deviation += diff * diff;
+		}
+	}
+	return deviation;
+}
+
+/*
+ * the deviation of the items of @bucket at @p from their share of the
+ * values that chose an item of @bucket at @p
+ */
+static double crush_optimize_bucket_deviation(const struct crush_optimizer *o,
+					      const struct crush_bucket *bucket,
+					      int p)
+{
+	const double *counts = o->counts + (size_t)p * o->items;
+	double target = o->targets[crush_optimize_index(o, bucket->id)];
+	double total = 0, deviation = 0;
+	__u32 i;
+
+	if (target <= 0)
+		return 0;
+	for (i = 0; i < bucket->size; i++)
+		total += counts[crush_optimize_index(o, bucket->items[i])];
+	for (i = 0; i < bucket->size; i++) {
+		int index = crush_optimize_index(o, bucket->items[i]);
+		double diff = counts[index] - total * o->targets[index] / target;
+
+		deviation += diff * diff;
+	}
+	return deviation;
+}
+
+/*
+ * compute in @o->new_weights the weights of @bucket at @p moved by
+ * @step towards the share of each item, return 0 if they do not change
+ */
+static int crush_optimize_move(struct crush_optimizer *o,
+			       const struct crush_bucket *bucket,
+			       const __u32 *weights, int p, double step)
+{
+	const double *counts = o->counts + (size_t)p * o->items;
+	double target = o->targets[crush_optimize_index(o, bucket->id)];
+	double total = 0;
+	int changes = 0;
+	__u32 i;
+
+	for (i = 0; i < bucket->size; i++)
+		total += counts[crush_optimize_index(o, bucket->items[i])];
+	for (i = 0; i < bucket->size; i++) {
+		int index = crush_optimize_index(o, bucket->items[i]);
+		double expected = total * o->targets[index] / target;
+		double factor = 1 + step * ((expected + 1) /
+					    (counts[index] + 1) - 1);
+		double weight;
+
+		o->new_weights[i] = weights[i];
+		if (weights[i] == 0 || o->targets[index] <= 0)
+			continue;
+		if (factor < 0.5)
+			factor = 0.5;
+		else if (factor > 2)
+			factor = 2;
+		weight = weights[i] * factor + 0.5;
+		if (weight < 1)
+			weight = 1;
+		else if (weight > 0x7fffffff)
+			weight = 0x7fffffff;
+		o->new_weights[i] = (__u32)weight;
+		changes += o->new_weights[i] != weights[i];
+	}
+	return changes;
+}
+
+/*
+ * find the positions at which the rule uses the weight sets: an indep
+ * rule must have a single choose step, the steps after the first
+ * choosing at the positions of its output rather than of the result
+ */
+static int crush_optimize_rule(struct crush_optimizer *o)
+{
+	const struct crush_rule *rule = o->map->rules[o->ruleno];
+	int chooses = 0;
+	__u32 step;
+
+	for (step = 0; step < rule->len; step++) {
+		switch (rule->steps[step].op) {
+		case CRUSH_RULE_CHOOSE_INDEP:
+			o->indep = 1;
+			o->leaf_type = 0;
+			chooses++;
+			break;
+		case CRUSH_RULE_CHOOSELEAF_INDEP:
+			o->indep = 1;
+			o->leaf_type = rule->steps[step].arg2;
+			chooses++;
+			break;
+		case CRUSH_RULE_CHOOSE_FIRSTN:
+		case CRUSH_RULE_CHOOSELEAF_FIRSTN:
+			chooses++;
+			break;
+		}
+	}
+	if (o->indep && chooses > 1)
+		return -EINVAL;
+	return 0;
+}
+
+/*
+ * index the parent of each item, sum the targets of the buckets and
+ * check that the weight sets match the buckets
+ */
+static int crush_optimize_index_map(struct crush_optimizer *o,
+				    const __u32 *targets)
+{
+	const struct crush_map *map = o->map;
+	int b, d, changed;
+	__u32 i;
+
+	o->positions = 0;
+	for (b = 0; b < map->max_buckets; b++) {
+		const struct crush_bucket *bucket = map->buckets[b];
+		const struct crush_choose_arg *arg = &o->choose_args[b];
+
+		if (bucket == NULL)
+			continue;
+		if (bucket->alg != CRUSH_BUCKET_STRAW2 ||
+		    arg->weight_set_size == 0 ||
+		    (o->positions && (int)arg->weight_set_size != o->positions))
+			return -EINVAL;
+		o->positions = arg->weight_set_size;
+		for (i = 0; i < arg->weight_set_size; i++)
+			if (arg->weight_set[i].size != bucket->size)
+				return -EINVAL;
+		for (i = 0; i < bucket->size; i++) {
+			int item = bucket->items[i];
+			int index;
+
+			if (item >= map->max_devices ||
+			    -1-item >= map->max_buckets)
+				return -EINVAL;
+			index = crush_optimize_index(o, item);
+			if (o->parents[index] != 0)
+				return -EINVAL;
+			o->parents[index] = bucket->id;
+		}
+	}
+	if (o->positions == 0)
+		return -EINVAL;
+
+	for (d = 0; d < map->max_devices; d++)
+		o->targets[d] = d < o->weight_max ? targets[d] : 0;
+	/* the targets of the buckets, from the devices up */
+	do {
+		changed = 0;
+		for (b = 0; b < map->max_buckets; b++) {
+			const struct crush_bucket *bucket = map->buckets[b];
+			double target = 0;
+
+			if (bucket == NULL)
+				continue;
+			for (i = 0; i < bucket->size; i++)
+				target += o->targets[crush_optimize_index(
+						o, bucket->items[i])];
+			if (target != o->targets[map->max_devices + b]) {
+				o->targets[map->max_devices + b] = target;
+				changed = 1;
+			}
+		}
+	} while (changed);
+	return 0;
+}
+
+static void crush_optimize_free(struct crush_optimizer *o)
+{
+	free(o->results);
+	free(o->result_lens);
+	free(o->visited);
+	free(o->former);
+	free(o->former_lens);
+	free(o->moved);
+	free(o->flags);
+	free(o->parents);
+	free(o->targets);
+	free(o->counts);
+	free(o->steps);
+	free(o->former_weights);
+	free(o->new_weights);
+}
+
+static int crush_optimize_alloc(struct crush_optimizer *o)
+{
+	const struct crush_map *map = o->map;
+	size_t results = (size_t)o->n * o->result_max;
+	__u32 max_size = 0;
+	int b;
+
+	for (b = 0; b < map->max_buckets; b++)
+		if (map->buckets[b] && map->buckets[b]->size > max_size)
+			max_size = map->buckets[b]->size;
+	o->items = map->max_devices + map->max_buckets;
+	o->results = malloc(results * sizeof(int) + 1);
+	o->result_lens = malloc(o->n * sizeof(int) + 1);
+	o->visited = malloc(o->n * sizeof(__u64) + 1);
+	o->former = malloc(results * sizeof(int) + 1);
+	o->former_lens = malloc(o->n * sizeof(int) + 1);
+	o->moved = malloc(o->n * sizeof(int) + 1);
+	o->flags = malloc(o->n + 1);
+	o->parents = calloc(o->items + 1, sizeof(int));
+	o->targets = calloc(o->items + 1, sizeof(double));
+	o->former_weights = malloc(max_size * sizeof(__u32) + 1);
+	o->new_weights = malloc(max_size * sizeof(__u32) + 1);
+	if (!o->results || !o->result_lens || !o->visited || !o->former ||
+	    !o->former_lens || !o->moved || !o->flags || !o->parents ||
+	    !o->targets || !o->former_weights || !o->new_weights)
+		return -ENOMEM;
+	return 0;
+}
+
+int crush_optimize_choose_args(const struct crush_map *map, int ruleno,
+			       const int *xs, int n, int result_max,
+			       const __u32 *weights, int weight_max,
+			       const __u32 *targets,
+			       struct crush_choose_arg *choose_args,
+			       int max_iterations, int nthreads,
+			       struct crush_optimize_stats *stats)
+{
+	struct crush_optimizer o;
+	double deviation, before;
+	int iterations = 0, accepted = 0;
+	int ret, b, p, i;
+
+	if ((__u32)ruleno >= map->max_rules || map->rules[ruleno] == NULL ||
+	    result_max <= 0 || n < 0)
+		return -EINVAL;
+
+	memset(&o, 0, sizeof(o));
+	o.map = map;
+	o.ruleno = ruleno;
+	o.xs = xs;
+	o.n = n;
+	o.result_max = result_max;
+	o.weights = weights;
+	o.weight_max = weight_max;
+	o.choose_args = choose_args;
+	o.nthreads = nthreads;
+	ret = crush_optimize_rule(&o);
+	if (ret < 0)
+		return ret;
+	ret = crush_optimize_alloc(&o);
+	if (ret < 0)
+		goto out;
+	ret = crush_optimize_index_map(&o, targets);
+	if (ret < 0)
+		goto out;
+	o.counts = calloc((size_t)o.positions * o.items + 1, sizeof(double));
+	o.steps = malloc(((size_t)o.positions * map->max_buckets + 1) *
+			 sizeof(double));
+	if (!o.counts || !o.steps) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < o.positions * map->max_buckets; i++)
+		o.steps[i] = 1;
+
+	ret = crush_parallel_run(0, n, CRUSH_OPTIMIZE_CHUNK, nthreads,
+				 crush_optimize_visited_chunk, &o);
+	if (ret >= 0)
+		ret = o.error;
+	if (ret < 0)
+		goto out;
+	o.mapped = n;
+	memcpy(o.former, o.results, (size_t)n * result_max * sizeof(int));
+	memcpy(o.former_lens, o.result_lens, n * sizeof(int));
+	for (i = 0; i < n; i++)
+		crush_optimize_count(&o, o.results + (size_t)i * result_max,
+				     o.result_lens[i], 1);
+	before = deviation = crush_optimize_deviation(&o);
+
+	while (iterations < max_iterations && deviation > 0) {
+		const struct crush_bucket *bucket = NULL;
+		struct crush_weight_set *ws;
+		double worst = 0, step, after;
+		int worst_p = 0;
+
+		/* the weight set furthest from the targets */
+		for (b = 0; b < map->max_buckets; b++) {
+			if (map->buckets[b] == NULL)
+				continue;
+			for (p = 0; p < o.positions; p++) {
+				double d;
+
+				if (o.steps[b * o.positions + p] <
+				    CRUSH_OPTIMIZE_MIN_STEP)
+					continue;
+				d = crush_optimize_bucket_deviation(
+					&o, map->buckets[b], p);
+				if (d > worst) {
+					worst = d;
+					bucket = map->buckets[b];
+					worst_p = p;
+				}
+			}
+		}
+		if (bucket == NULL)
+			break;
+		iterations++;
+		b = -1 - bucket->id;
+		p = worst_p;
+		step = o.steps[b * o.positions + p];
+		ws = &choose_args[b].weight_set[p];
+		if (!crush_optimize_move(&o, bucket, ws->weights, p, step)) {
+			o.steps[b * o.positions + p] = step / 2;
+			continue;
+		}
+		memcpy(o.former_weights, ws->weights,
+		       bucket->size * sizeof(__u32));
+		crush_choose_args_set_weights(map, choose_args, bucket->id, p,
+					      o.new_weights);
+		ret = crush_optimize_remap(&o, CRUSH_VISITED_BIT(bucket->id));
+		if (ret < 0)
+			goto out;
+		after = crush_optimize_deviation(&o);
+		if (after < deviation) {
+			deviation = after;
+			accepted++;
+			continue;
+		}
+		/* revert and try a smaller change next time */
+		crush_choose_args_set_weights(map, choose_args, bucket->id, p,
+					      o.former_weights);
+		ret = crush_optimize_remap(&o, CRUSH_VISITED_BIT(bucket->id));
+		if (ret < 0)
+			goto out;
+		o.steps[b * o.positions + p] = step / 2;
+	}
+
+	if (stats) {
+		stats->deviation_before = before;
+		stats->deviation_after = deviation;
+		stats->iterations = iterations;
+		stats->accepted = accepted;
+		stats->mapped = o.mapped;
+	}
+	ret = accepted;
+out:
+	crush_optimize_free(&o);
+	return ret;
+}
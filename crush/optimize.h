@@ -0,0 +1,95 @@
+#ifndef CEPH_CRUSH_OPTIMIZE_H
+#define CEPH_CRUSH_OPTIMIZE_H
+
+/*
+ * Tune the weight sets of choose_args so that the values are mapped
+ * to the devices in proportion to their target weights.
+ *
+ * LGPL2
+ */
+
+#include "crush.h"
+
+/** @ingroup API
+ *
+ * What crush_optimize_choose_args() did. The deviation is the sum,
+ * for each device and each position, of the square of the difference
+ * between the number of values mapped to the device at this position
+ * and the number expected from its target weight.
+ */
+struct crush_optimize_stats {
+	/*! the deviation before the first iteration */
+	double deviation_before;
+	/*! the deviation after the last iteration */
+	double deviation_after;
+	/*! the number of weight sets tried */
+	int iterations;
+	/*! the number of weight sets kept because they lowered the deviation */
+	int accepted;
+	/*! the number of values crush_do_rule() mapped in total */
+	long mapped;
+};
+
+/** @ingroup API
+ *
+ * Modify the weight sets of __choose_args__ so that the __n__ values
+ * of __xs__, mapped with the rule __ruleno__ to __result_max__ items,
+ * are spread over the devices in proportion to __targets__.
+ *
+ * The values are mapped once. Each iteration then picks the weight
+ * set of the bucket whose items are furthest from their share of the
+ * values at a given position, moves its weights towards the target
+ * weights of the items and maps again, with crush_map_delta(), the
+ * values that went through this bucket only. The new weights are kept
+ * if they lower the deviation (see crush_optimize_stats) and reverted
+ * otherwise, in which case the next change of this weight set is
+ * smaller. The values are mapped by __nthreads__ threads, as
+ * explained in crush_parallel_run(), and the outcome does not depend
+ * on __nthreads__.
+ *
+ * The item found at position __p__ of the result is attributed to the
+ * weight set __p__, or to the last weight set if there are fewer, which
+ * is how crush_do_rule() uses them for the CRUSH_RULE_CHOOSE_FIRSTN and
+ * CRUSH_RULE_CHOOSELEAF_FIRSTN steps. A CRUSH_RULE_CHOOSE_INDEP step
+ * chooses all the items with the weight set 0 and so does a
+ * CRUSH_RULE_CHOOSELEAF_INDEP step, except for the items below the
+ * buckets of its type which are attributed to the weight set __p__.
+ * A rule with such a step must have no other choose step. The target
+ * of a device that is out in __weights__ should be zero. The target
+ * weight of a bucket is the sum of the targets of the devices below
+ * it.
+ *
+ * All the buckets of __map__ must be ::CRUSH_BUCKET_STRAW2 buckets
+ * holding each item at most once, and have the same number of weight
+ * sets in __choose_args__, as returned by crush_make_choose_args().
+ *
+ * - return -EINVAL if __ruleno__ does not exist, __result_max__ <= 0, a
+ *   bucket is not a straw2 bucket, an item is in more than one bucket,
+ *   the weight sets do not match the buckets or the rule has an indep
+ *   step and another choose step
+ * - return -ENOMEM if __malloc(3)__ fails
+ *
+ * @param map a finalized crush_map
+ * @param ruleno the rule used to map the values
+ * @param xs the __n__ values to map
+ * @param n the size of the __xs__ array
+ * @param result_max the number of items for each value
+ * @param weights an array of weights of size __weight_max__
+ * @param weight_max the size of the __weights__ array
+ * @param targets an array of __weight_max__ target weights
+ * @param choose_args the weight sets to modify
+ * @param max_iterations the maximum number of weight sets to try
+ * @param nthreads the number of threads
+ * @param stats what was done or NULL
+ *
+ * @returns the number of weight sets kept on success, < 0 on error
+ */
+extern int crush_optimize_choose_args(const struct crush_map *map, int ruleno,
+				      const int *xs, int n, int result_max,
+				      const __u32 *weights, int weight_max,
+				      const __u32 *targets,
+				      struct crush_choose_arg *choose_args,
+				      int max_iterations, int nthreads,
+				      struct crush_optimize_stats *stats);
+
+#endif
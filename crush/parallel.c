@@ -0,0 +1,472 @@
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "parallel.h"
+#include "mapper.h"
+
+/* the number of values mapped by each crush_do_rule_batch() */
+#define CRUSH_MAP_RANGE_CHUNK 256
+
+#define CRUSH_CACHE_LINE 64
+
+/*
+ * The values [begin,end[ that remain to be run by a thread. Each share
+ * is in its own cache line so that a thread taking its next chunk
+ * does not slow down the others.
+ */
+struct crush_parallel_share {
+	pthread_mutex_t lock;
+	int begin;
+	int end;
+} __attribute__((aligned(CRUSH_CACHE_LINE)));
+
+struct crush_parallel {
+	struct crush_parallel_share *shares;
+	int nthreads;
+	unsigned int chunk;
+	crush_parallel_fn fn;
+	void *arg;
+};
+
+struct crush_parallel_worker {
+	struct crush_parallel *p;
+	int worker;
+	pthread_t thread;
+};
+
+static inline unsigned int crush_parallel_left(const struct crush_parallel_share *s)
+{
+	/* the difference of two ints does not fit in an int */
+	return (unsigned int)s->end - (unsigned int)s->begin;
+}
+
+/* take the next chunk of the share @s, return 0 if it is empty */
+static int crush_parallel_take(struct crush_parallel *p,
+			       struct crush_parallel_share *s,
+			       int *begin, int *end)
+{
+	unsigned int left;
+
+	pthread_mutex_lock(&s->lock);
+	left = crush_parallel_left(s);
+	if (left > 0) {
+		*begin = s->begin;
+		*end = left > p->chunk ? (int)(s->begin + p->chunk) : s->end;
+		s->begin = *end;
+	}
+	pthread_mutex_unlock(&s->lock);
+	return left > 0;
+}
+
+/*
+ * move the second half of the largest share to the empty share of
+ * @worker, return 0 if all the shares are empty.
+ */
+static int crush_parallel_steal(struct crush_parallel *p, int worker)
+{
+	struct crush_parallel_share *victim;
+	unsigned int left, most;
+	int i, begin, end;
+
+	for (;;) {
+		victim = NULL;
+		most = 0;
+		for (i = 0; i < p->nthreads; i++) {
+			if (i == worker)
+				continue;
+			pthread_mutex_lock(&p->shares[i].lock);
+			left = crush_parallel_left(&p->shares[i]);
+			pthread_mutex_unlock(&p->shares[i].lock);
+			if (left > most) {
+				most = left;
+				victim = &p->shares[i];
+			}
+		}
+		if (victim == NULL)
+			return 0;
+
+		pthread_mutex_lock(&victim->lock);
+		left = crush_parallel_left(victim);
+		if (left > 0) {
+			end = victim->end;
+			begin = (unsigned int)victim->begin + left / 2;
+			victim->end = begin;
+		}
+		pthread_mutex_unlock(&victim->lock);
+		/* try again if the victim ran out in the meantime */
+		if (left > 0)
+			break;
+	}
+
+	pthread_mutex_lock(&p->shares[worker].lock);
+	p->shares[worker].begin = begin;
+	p->shares[worker].end = end;
+	pthread_mutex_unlock(&p->shares[worker].lock);
+	return 1;
+}
+
+static void *crush_parallel_work(void *arg)
+{
+	struct crush_parallel_worker *w = (struct crush_parallel_worker *)arg;
+	struct crush_parallel *p = w->p;
+	int begin, end;
+
+	do {
+		while (crush_parallel_take(p, &p->shares[w->worker],
+					   &begin, &end))
+			p->fn(p->arg, w->worker, begin, end);
+	} while (crush_parallel_steal(p, w->worker));
+	return NULL;
+}
+
+int crush_parallel_nthreads(int nthreads)
+{
+	long online;
+
+	if (nthreads > 0)
+		return nthreads;
+	online = sysconf(_SC_NPROCESSORS_ONLN);
+	return online > 0 ? (int)online : 1;
+}
+
+int crush_parallel_run(int begin, int end, int chunk, int nthreads,
+		       crush_parallel_fn fn, void *arg)
+{
+	struct crush_parallel p;
+	struct crush_parallel_worker *workers;
+	void *shares;
+	unsigned long long size;
+	int i, created;
+
+	if (begin > end || chunk <= 0)
+		return -EINVAL;
+
+	p.nthreads = crush_parallel_nthreads(nthreads);
+	p.chunk = chunk;
+	p.fn = fn;
+	p.arg = arg;
+	if (posix_memalign(&shares, CRUSH_CACHE_LINE,
+			   sizeof(struct crush_parallel_share) * p.nthreads))
+		return -ENOMEM;
+	p.shares = (struct crush_parallel_share *)shares;
+	workers = malloc(sizeof(struct crush_parallel_worker) * p.nthreads);
+	if (!workers) {
+		free(shares);
+		return -ENOMEM;
+	}
+
+	size = (unsigned int)end - (unsigned int)begin;
+	for (i = 0; i < p.nthreads; i++) {
+		pthread_mutex_init(&p.shares[i].lock, NULL);
+		p.shares[i].begin = (unsigned int)begin +
+			(unsigned int)(size * i / p.nthreads);
+		p.shares[i].end = (unsigned int)begin +
+			(unsigned int)(size * (i + 1) / p.nthreads);
+		workers[i].p = &p;
+		workers[i].worker = i;
+	}
+
+	/* the calling thread is worker 0, the share of a worker that
+	   cannot be created is stolen by the others */
+	for (created = 1; created < p.nthreads; created++)
+		if (pthread_create(&workers[created].thread, NULL,
+				   crush_parallel_work, &workers[created]))
+			break;
+	crush_parallel_work(&workers[0]);
+	for (i = 1; i < created; i++)
+		pthread_join(workers[i].thread, NULL);
+
+	for (i = 0; i < p.nthreads; i++)
+		pthread_mutex_destroy(&p.shares[i].lock);
+	free(workers);
+	free(shares);
+	return p.nthreads;
+}
+
+struct crush_map_range {
+	const struct crush_map *map;
+	int ruleno;
+	int x_begin;
+	int *results;
+	int result_max;
+	int *result_lens;
+	const __u32 *weights;
+	int weight_max;
+	const struct crush_choose_arg *choose_args;
+	char **cwin;
+};
+
+static void crush_map_range_chunk(void *arg, int worker, int begin, int end)
+{
+	struct crush_map_range *r = (struct crush_map_range *)arg;
+	size_t offset = (unsigned int)begin - (unsigned int)r->x_begin;
+	int xs[CRUSH_MAP_RANGE_CHUNK];
+	int i, n = end - begin;
+
+	for (i = 0; i < n; i++)
+		xs[i] = begin + i;
+	crush_do_rule_batch(r->map, r->ruleno, xs, n,
+			    r->results + offset * r->result_max, r->result_max,
+			    r->result_lens + offset,
+			    r->weights, r->weight_max,
+			    r->cwin[worker], r->choose_args);
+}
+
+int crush_map_range(const struct crush_map *map, int ruleno,
+		    int x_begin, int x_end,
+		    int *results, int result_max, int *result_lens,
+		    const __u32 *weights, int weight_max,
+		    const struct crush_choose_arg *choose_args,
+		    int nthreads)
+{
+	struct crush_map_range r;
+	size_t cwin_size;
+	int i, ret = 0;
+
+	if ((__u32)ruleno >= map->max_rules || map->rules[ruleno] == NULL ||
+	    x_begin > x_end || result_max <= 0 ||
+	    (unsigned int)x_end - (unsigned int)x_begin > INT_MAX)
+		return -EINVAL;
+
+	r.map = map;
+	r.ruleno = ruleno;
+	r.x_begin = x_begin;
+	r.results = results;
+	r.result_max = result_max;
+	r.result_lens = result_lens;
+	r.weights = weights;
+	r.weight_max = weight_max;
+	r.choose_args = choose_args;
+
+	nthreads = crush_parallel_nthreads(nthreads);
+	r.cwin = calloc(nthreads, sizeof(char *));
+	if (!r.cwin)
+		return -ENOMEM;
+	cwin_size = crush_work_size(map, result_max);
+	for (i = 0; i < nthreads; i++) {
+		r.cwin[i] = malloc(cwin_size);
+		if (!r.cwin[i]) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		crush_init_workspace(map, r.cwin[i]);
+	}
+
+	ret = crush_parallel_run(x_begin, x_end, CRUSH_MAP_RANGE_CHUNK,
+				 nthreads, crush_map_range_chunk, &r);
+	if (ret >= 0)
+		ret = (unsigned int)x_end - (unsigned int)x_begin;
+out:
+	for (i = 0; i < nthreads; i++)
+		free(r.cwin[i]);
+	free(r.cwin);
+	return ret;
+}
+
+/*
+ * The working space, results and counts of a thread of crush_simulate().
+ * The counts of the devices are followed by the number of values
+ * mapped to fewer than result_max devices.
+ */
+struct crush_simulator_worker {
+	char *cwin;
+	int *results;
+	int *result_lens;
+	__u64 *counts;
+};
+
+struct crush_simulator {
+	const struct crush_map *map;
+	int ruleno;
+	int result_max;
+	const __u32 *weights;
+	int weight_max;
+	const struct crush_choose_arg *choose_args;
+	struct crush_simulator_worker *workers;
+};
+
+static void crush_simulate_chunk(void *arg, int worker, int begin, int end)
+{
+	struct crush_simulator *s = (struct crush_simulator *)arg;
+	struct crush_simulator_worker *w = &s->workers[worker];
+	int xs[CRUSH_MAP_RANGE_CHUNK];
+	int i, j, n = end - begin;
+
+	/* crush_parallel_run() never hands out an empty chunk */
+	i = 0;
+	do
+		xs[i] = begin + i;
+	while (++i < n);
+	crush_do_rule_batch(s->map, s->ruleno, xs, n,
+			    w->results, s->result_max, w->result_lens,
+			    s->weights, s->weight_max,
+			    w->cwin, s->choose_args);
+	for (i = 0; i < n; i++) {
+		const int *result = w->results + (size_t)i * s->result_max;
+		int devices = 0;
+
+		for (j = 0; j < w->result_lens[i]; j++) {
+			if (result[j] < 0 || result[j] >= s->weight_max)
+				continue;
+			w->counts[result[j]]++;
+			devices++;
+		}
+		if (devices < s->result_max)
+			w->counts[s->weight_max]++;
+	}
+}
+
+static double crush_simulation_ratio(const struct crush_simulation_device *d)
+{
+	return d->expected > 0 ? d->count / d->expected : HUGE_VAL;
+}
+
+/* decreasing ratio, then increasing device */
+static int crush_simulation_cmp(const void *a, const void *b)
+{
+	const struct crush_simulation_device *da = a;
+	const struct crush_simulation_device *db = b;
+	double ra = crush_simulation_ratio(da);
+	double rb = crush_simulation_ratio(db);
+
+	if (ra != rb)
+		return ra > rb ? -1 : 1;
+	return da->device < db->device ? -1 : da->device > db->device;
+}
+
+/* the statistics of the @counts of the devices */
+static int crush_simulation_stats(struct crush_simulation *simulation,
+				  const __u64 *counts, int weight_max,
+				  const __u32 *targets)
+{
+	struct crush_simulation_device *devices;
+	double sum_targets = 0;
+	double variance = 0;
+	int count = 0;
+	int i;
+
+	simulation->items = 0;
+	for (i = 0; i < weight_max; i++) {
+		simulation->items += counts[i];
+		sum_targets += targets[i];
+	}
+	devices = malloc(((size_t)weight_max + 1) * sizeof(*devices));
+	if (!devices)
+		return -ENOMEM;
+	for (i = 0; i < weight_max; i++) {
+		struct crush_simulation_device *d = &devices[count];
+
+		if (targets[i] == 0 && counts[i] == 0)
+			continue;
+		d->device = i;
+		d->count = counts[i];
+		d->expected = sum_targets > 0 ?
+			simulation->items * (targets[i] / sum_targets) : 0;
+		variance += (d->count - d->expected) * (d->count - d->expected);
+		count++;
+	}
+	qsort(devices, count, sizeof(*devices), crush_simulation_cmp);
+
+	simulation->stddev = count > 0 ? sqrt(variance / count) : 0;
+	simulation->max_ratio = count > 0 ?
+		crush_simulation_ratio(&devices[0]) : 0;
+	simulation->min_ratio = count > 0 ?
+		crush_simulation_ratio(&devices[count - 1]) : 0;
+	simulation->worst = simulation->max_worst < count ?
+		simulation->max_worst : count;
+	for (i = 0; i < simulation->worst; i++) {
+		if (simulation->overfull)
+			simulation->overfull[i] = devices[i];
+		if (simulation->underfull)
+			simulation->underfull[i] = devices[count - 1 - i];
+	}
+	free(devices);
+	return 0;
+}
+
+int crush_simulate(const struct crush_map *map, int ruleno,
+		   int x_begin, int x_end, int result_max,
+		   const __u32 *weights, int weight_max,
+		   const struct crush_choose_arg *choose_args,
+		   const __u32 *targets,
+		   int nthreads,
+		   struct crush_simulation *simulation)
+{
+	struct crush_simulator s;
+	struct crush_simulator_worker *total;
+	size_t cwin_size;
+	int i, j, ret = 0;
+
+	if ((__u32)ruleno >= map->max_rules || map->rules[ruleno] == NULL ||
+	    x_begin > x_end || result_max <= 0 || weight_max < 0 ||
+	    (unsigned int)x_end - (unsigned int)x_begin > INT_MAX)
+		return -EINVAL;
+
+	s.map = map;
+	s.ruleno = ruleno;
+	s.result_max = result_max;
+	s.weights = weights;
+	s.weight_max = weight_max;
+	s.choose_args = choose_args;
+
+	nthreads = crush_parallel_nthreads(nthreads);
+	s.workers = calloc(nthreads, sizeof(*s.workers));
+	if (!s.workers)
+		return -ENOMEM;
+	cwin_size = crush_work_size(map, result_max);
+	for (i = 0; i < nthreads; i++) {
+		struct crush_simulator_worker *w = &s.workers[i];
+
+		w->cwin = malloc(cwin_size);
+		w->results = malloc((size_t)CRUSH_MAP_RANGE_CHUNK *
+				    (result_max + 1) * sizeof(int));
+		w->counts = calloc((size_t)weight_max + 1, sizeof(__u64));
+		if (!w->cwin || !w->results || !w->counts) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		w->result_lens = w->results +
+			(size_t)CRUSH_MAP_RANGE_CHUNK * result_max;
+		crush_init_workspace(map, w->cwin);
+	}
+
+	ret = crush_parallel_run(x_begin, x_end, CRUSH_MAP_RANGE_CHUNK,
+				 nthreads, crush_simulate_chunk, &s);
+	if (ret < 0)
+		goto out;
+
+	total = &s.workers[0];
+	for (i = 1; i < nthreads; i++)
+		for (j = 0; j <= weight_max; j++)
+			total->counts[j] += s.workers[i].counts[j];
+	if (simulation->choose_tries) {
+		memset(simulation->choose_tries, 0,
+		       simulation->choose_tries_size * sizeof(__u32));
+		for (i = 0; i < nthreads; i++)
+			crush_merge_choose_tries(s.workers[i].cwin,
+						 simulation->choose_tries,
+						 simulation->choose_tries_size);
+	}
+	if (simulation->counts)
+		memcpy(simulation->counts, total->counts,
+		       weight_max * sizeof(__u64));
+	simulation->values = (unsigned int)x_end - (unsigned int)x_begin;
+	simulation->short_values = total->counts[weight_max];
+	ret = crush_simulation_stats(simulation, total->counts, weight_max,
+				     targets);
+	if (ret >= 0)
+		ret = simulation->values;
+out:
+	for (i = 0; i < nthreads; i++) {
+		free(s.workers[i].cwin);
+		free(s.workers[i].results);
+		free(s.workers[i].counts);
+	}
+	free(s.workers);
+	return ret;
+}
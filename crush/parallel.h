@@ -0,0 +1,193 @@
+#ifndef CEPH_CRUSH_PARALLEL_H
+#define CEPH_CRUSH_PARALLEL_H
+
+/*
+ * Map ranges of values with a pool of threads.
+ *
+ * LGPL2
+ */
+
+#include "crush.h"
+
+/** @ingroup API
+ *
+ * The function called by crush_parallel_run() for each chunk of the
+ * range, with the __arg__ given to crush_parallel_run(). The
+ * __worker__ is in [0,__nthreads__[ and a given __worker__ is never
+ * running more than one chunk at a time: it can be used as an index
+ * to per-thread data. The chunk is [__begin__,__end__[ and it is
+ * never empty.
+ */
+typedef void (*crush_parallel_fn)(void *arg, int worker, int begin, int end);
+
+/** @ingroup API
+ *
+ * The number of threads crush_parallel_run() uses when given
+ * __nthreads__, for callers allocating per-thread data.
+ *
+ * @param nthreads the number of threads or <= 0 for one per online processor
+ *
+ * @returns the number of threads, > 0
+ */
+extern int crush_parallel_nthreads(int nthreads);
+
+/** @ingroup API
+ *
+ * Call __fn__ for chunks of at most __chunk__ values covering
+ * [__begin__,__end__[ exactly once, from __nthreads__ threads
+ * including the calling thread. Each thread is given an equal share
+ * of the range and takes its chunks from the beginning of it. A thread
+ * that completed its share steals the second half of what remains in
+ * the largest share of another thread, so that the threads finish at
+ * about the same time even when some chunks take longer than others.
+ *
+ * If __nthreads__ is lower or equal to zero, one thread per online
+ * processor is used: callers with per-thread data can get their number
+ * with crush_parallel_nthreads(). If a thread cannot be created, the share it
+ * was given is run by the other threads.
+ *
+ * - return -EINVAL if __begin__ > __end__ or __chunk__ <= 0
+ * - return -ENOMEM if __malloc(3)__ fails
+ *
+ * @param begin the first value of the range
+ * @param end the value after the last value of the range
+ * @param chunk the maximum number of values given to __fn__ at once
+ * @param nthreads the number of threads
+ * @param fn the function called for each chunk
+ * @param arg the first argument of __fn__
+ *
+ * @returns the number of threads on success, < 0 on error
+ */
+extern int crush_parallel_run(int begin, int end, int chunk, int nthreads,
+			      crush_parallel_fn fn, void *arg);
+
+/** @ingroup API
+ *
+ * Map each value __x__ in [__x_begin__,__x_end__[ to __result_max__
+ * items with the rule __ruleno__, as crush_do_rule() would, using
+ * __nthreads__ threads as explained in crush_parallel_run(). Each
+ * thread allocates and uses its own working space.
+ *
+ * The items for __x__ are stored in
+ * __results[(x - x_begin) * result_max, (x - x_begin + 1) * result_max[__
+ * and their number is stored in __result_lens[x - x_begin]__.
+ *
+ * - return -EINVAL if __ruleno__ does not exist, __x_begin__ > __x_end__,
+ *   there are more than __INT_MAX__ values or __result_max__ <= 0
+ * - return -ENOMEM if __malloc(3)__ fails
+ *
+ * @param map the crush_map
+ * @param ruleno a positive integer < __CRUSH_MAX_RULES__
+ * @param x_begin the first value to map
+ * @param x_end the value after the last value to map
+ * @param results an array of items of size (__x_end__ - __x_begin__) * __result_max__
+ * @param result_max the maximum number of items for each value
+ * @param result_lens an array of size __x_end__ - __x_begin__
+ * @param weights an array of weights of size __weight_max__
+ * @param weight_max the size of the __weights__ array
+ * @param choose_args weights and ids for each known bucket
+ * @param nthreads the number of threads
+ *
+ * @returns the number of values mapped on success, < 0 on error
+ */
+extern int crush_map_range(const struct crush_map *map, int ruleno,
+			   int x_begin, int x_end,
+			   int *results, int result_max, int *result_lens,
+			   const __u32 *weights, int weight_max,
+			   const struct crush_choose_arg *choose_args,
+			   int nthreads);
+
+
+/** @ingroup API
+ *
+ * A device found by crush_simulate(), with the number of items it was
+ * chosen for and the number expected from its target weight.
+ */
+struct crush_simulation_device {
+	int device;
+	__u64 count;
+	double expected;
+};
+
+/** @ingroup API
+ *
+ * Where crush_simulate() stores its statistics. The arrays are owned
+ * by the caller and each may be NULL. The other members are set by
+ * crush_simulate().
+ *
+ * The expected count of a device is its share of the __items__, in
+ * proportion to its target weight. The devices that do not have a
+ * target weight and were not chosen are ignored.
+ */
+struct crush_simulation {
+	/*! an array of __weight_max__ counts of items for each device */
+	__u64 *counts;
+	/*! the histogram of the retries, see crush_merge_choose_tries() */
+	__u32 *choose_tries;
+	int choose_tries_size;
+	/*! the devices chosen most often and least often compared to
+	  their expected count, arrays of __max_worst__ devices */
+	struct crush_simulation_device *overfull;
+	struct crush_simulation_device *underfull;
+	int max_worst;
+	/*! the number of devices stored in __overfull__ and __underfull__ */
+	int worst;
+	/*! the number of values mapped */
+	__u64 values;
+	/*! the number of values mapped to fewer than __result_max__ devices */
+	__u64 short_values;
+	/*! the number of devices chosen for all the values */
+	__u64 items;
+	/*! the standard deviation of the counts from the expected counts */
+	double stddev;
+	/*! the largest and lowest count divided by the expected count,
+	  HUGE_VAL for a device chosen without a target weight */
+	double max_ratio;
+	double min_ratio;
+};
+
+/** @ingroup API
+ *
+ * Map each value in [__x_begin__,__x_end__[ to __result_max__ items
+ * with the rule __ruleno__, as crush_do_rule() would, and store in
+ * __simulation__ how they are spread over the devices compared to
+ * the __targets__ weights. The values are mapped by __nthreads__
+ * threads, as explained in crush_parallel_run(), a chunk at a time:
+ * each thread allocates its working space and __weight_max__
+ * counters, whatever the number of values. The outcome does not
+ * depend on __nthreads__.
+ *
+ * The __overfull__ devices are sorted by decreasing ratio of their
+ * count to their expected count, the devices chosen without a target
+ * weight first, and the __underfull__ devices by increasing ratio.
+ * The __choose_tries__ histogram is set to zero before the first
+ * value is mapped.
+ *
+ * - return -EINVAL if __ruleno__ does not exist, __x_begin__ > __x_end__,
+ *   there are more than __INT_MAX__ values, __result_max__ <= 0 or
+ *   __weight_max__ < 0
+ * - return -ENOMEM if __malloc(3)__ fails
+ *
+ * @param map the crush_map
+ * @param ruleno a positive integer < __CRUSH_MAX_RULES__
+ * @param x_begin the first value to map
+ * @param x_end the value after the last value to map
+ * @param result_max the maximum number of items for each value
+ * @param weights an array of weights of size __weight_max__
+ * @param weight_max the size of the __weights__ array
+ * @param choose_args weights and ids for each known bucket
+ * @param targets an array of __weight_max__ target weights
+ * @param nthreads the number of threads
+ * @param simulation where to store the statistics
+ *
+ * @returns the number of values mapped on success, < 0 on error
+ */
+extern int crush_simulate(const struct crush_map *map, int ruleno,
+			  int x_begin, int x_end, int result_max,
+			  const __u32 *weights, int weight_max,
+			  const struct crush_choose_arg *choose_args,
+			  const __u32 *targets,
+			  int nthreads,
+			  struct crush_simulation *simulation);
+
+#endif
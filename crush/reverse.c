@@ -0,0 +1,470 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "reverse.h"
+#include "delta.h"
+#include "parallel.h"
+
+/* the number of devices encoded at once by a thread */
+#define CRUSH_REVERSE_CHUNK 64
+
+/*
+ * The entries of a device are the keys x * result_max + position, x
+ * seen as unsigned, in increasing order. Each is stored as the
+ * difference with the previous one, the first with 0, in 7 bit
+ * groups from the lowest with the high bit set on all but the last.
+ */
+struct crush_reverse_device {
+	unsigned char *data;
+	__u32 size;	/* in bytes */
+	__u32 count;	/* the number of entries */
+};
+
+struct crush_reverse {
+	int max_devices;
+	int result_max;
+	struct crush_reverse_device *devices;
+	size_t size;	/* the bytes of all data */
+};
+
+/* an entry to add to or remove from a device */
+struct crush_reverse_change {
+	__s32 device;
+	__s32 add;
+	__u64 key;
+};
+
+static inline __u64 crush_reverse_key(const struct crush_reverse *reverse,
+				      int x, int position)
+{
+	return (__u64)(__u32)x * reverse->result_max + position;
+}
+
+static inline int crush_reverse_is_device(const struct crush_reverse *reverse,
+					  int item)
+{
+	return item >= 0 && item < reverse->max_devices;
+}
+
+static inline const unsigned char *crush_reverse_read(const unsigned char *p,
+						      __u64 *value)
+{
+	__u64 v = 0;
+	int shift = 0;
+
+	do {
+		v |= (__u64)(*p & 0x7f) << shift;
+		shift += 7;
+	} while (*p++ & 0x80);
+	*value = v;
+	return p;
+}
+
+static inline unsigned char *crush_reverse_write(unsigned char *p,
+						 __u64 value)
+{
+	while (value >= 0x80) {
+		*p++ = (value & 0x7f) | 0x80;
+		value >>= 7;
+	}
+	*p++ = value;
+	return p;
+}
+
+static inline __u32 crush_reverse_bytes(__u64 value)
+{
+	__u32 bytes = 1;
+
+	while (value >= 0x80) {
+		value >>= 7;
+		bytes++;
+	}
+	return bytes;
+}
+
+/* replace the entries of @device with the @count sorted @keys */
+static int crush_reverse_encode(struct crush_reverse_device *device,
+				const __u64 *keys, __u32 count)
+{
+	unsigned char *data, *p;
+	__u64 previous = 0;
+	__u32 size = 0, i;
+
+	for (i = 0; i < count; i++) {
+		size += crush_reverse_bytes(keys[i] - previous);
+		previous = keys[i];
+	}
+	data = malloc(size + 1);
+	if (!data)
+		return -ENOMEM;
+	previous = 0;
+	for (i = 0, p = data; i < count; i++) {
+		p = crush_reverse_write(p, keys[i] - previous);
+		previous = keys[i];
+	}
+	free(device->data);
+	device->data = data;
+	device->size = size;
+	device->count = count;
+	return 0;
+}
+
+/* store the keys of @device in @keys */
+static void crush_reverse_decode(const struct crush_reverse_device *device,
+				 __u64 *keys)
+{
+	const unsigned char *p = device->data;
+	__u64 key = 0, delta;
+	__u32 i;
+
+	for (i = 0; i < device->count; i++) {
+		p = crush_reverse_read(p, &delta);
+		key += delta;
+		keys[i] = key;
+	}
+}
+
+static int crush_reverse_key_cmp(const void *a, const void *b)
+{
+	__u64 ka = *(const __u64 *)a;
+	__u64 kb = *(const __u64 *)b;
+
+	return ka < kb ? -1 : ka > kb;
+}
+
+struct crush_reverse_build {
+	struct crush_reverse *reverse;
+	__u64 *keys;
+	size_t *offsets;
+	int error;
+};
+
+static void crush_reverse_build_chunk(void *arg, int worker,
+				      int begin, int end)
+{
+	struct crush_reverse_build *build = (struct crush_reverse_build *)arg;
+	struct crush_reverse *reverse = build->reverse;
+	int d;
+
+	for (d = begin; d < end; d++) {
+		__u64 *keys = build->keys + build->offsets[d];
+		__u32 count = build->offsets[d + 1] - build->offsets[d];
+
+		if (count == 0)
+			continue;
+		qsort(keys, count, sizeof(__u64), crush_reverse_key_cmp);
+		if (crush_reverse_encode(&reverse->devices[d], keys, count) < 0) {
+			__atomic_store_n(&build->error, -ENOMEM,
+					 __ATOMIC_RELAXED);
+			return;
+		}
+	}
+}
+
+struct crush_reverse *crush_reverse_create(int max_devices,
+					   const int *xs, int n,
+					   const int *results,
+					   int result_max,
+					   const int *result_lens,
+					   int nthreads)
+{
+	struct crush_reverse_build build;
+	struct crush_reverse *reverse;
+	int i, j, d, ret;
+
+	if (max_devices < 0 || n < 0 || result_max <= 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	reverse = malloc(sizeof(*reverse));
+	if (!reverse)
+		return NULL;
+	reverse->max_devices = max_devices;
+	reverse->result_max = result_max;
+	reverse->size = 0;
+	reverse->devices = calloc(max_devices + 1, sizeof(*reverse->devices));
+	build.reverse = reverse;
+	build.offsets = calloc(max_devices + 1, sizeof(size_t));
+	build.keys = NULL;
+	build.error = 0;
+	if (!reverse->devices || !build.offsets)
+		goto nomem;
+
+	/* the keys of each device, in the order of xs */
+	for (i = 0; i < n; i++)
+		for (j = 0; j < result_lens[i]; j++) {
+			int item = results[(size_t)i * result_max + j];
+
+			if (crush_reverse_is_device(reverse, item))
+				build.offsets[item + 1]++;
+		}
+	for (d = 0; d < max_devices; d++)
+		build.offsets[d + 1] += build.offsets[d];
+	build.keys = malloc(sizeof(__u64) * build.offsets[max_devices] + 1);
+	if (!build.keys)
+		goto nomem;
+	for (i = 0; i < n; i++)
+		for (j = 0; j < result_lens[i]; j++) {
+			int item = results[(size_t)i * result_max + j];
+
+			if (crush_reverse_is_device(reverse, item))
+				build.keys[build.offsets[item]++] =
+					crush_reverse_key(reverse, xs[i], j);
+		}
+	/* the loop above moved each offset to the next device */
+	for (d = max_devices; d > 0; d--)
+		build.offsets[d] = build.offsets[d - 1];
+	build.offsets[0] = 0;
+
+	ret = crush_parallel_run(0, max_devices, CRUSH_REVERSE_CHUNK, nthreads,
+				 crush_reverse_build_chunk, &build);
+	if (ret < 0 || build.error < 0)
+		goto nomem;
+	for (d = 0; d < max_devices; d++)
+		reverse->size += reverse->devices[d].size;
+	free(build.keys);
+	free(build.offsets);
+	return reverse;
+
+nomem:
+	free(build.keys);
+	free(build.offsets);
+	crush_reverse_destroy(reverse);
+	errno = ENOMEM;
+	return NULL;
+}
+
+void crush_reverse_destroy(struct crush_reverse *reverse)
+{
+	int d;
+
+	if (reverse->devices)
+		for (d = 0; d < reverse->max_devices; d++)
+			free(reverse->devices[d].data);
+	free(reverse->devices);
+	free(reverse);
+}
+
+static int crush_reverse_change_cmp(const void *a, const void *b)
+{
+	const struct crush_reverse_change *ca = a;
+	const struct crush_reverse_change *cb = b;
+
+	if (ca->device != cb->device)
+		return ca->device < cb->device ? -1 : 1;
+	if (ca->key != cb->key)
+		return ca->key < cb->key ? -1 : 1;
+	/* remove before adding */
+	return ca->add - cb->add;
+}
+
+/* apply the @count sorted @changes of @device */
+static int crush_reverse_apply(struct crush_reverse *reverse, int device,
+			       const struct crush_reverse_change *changes,
+			       int count, __u64 **scratch, size_t *scratch_size)
+{
+	struct crush_reverse_device *dev = &reverse->devices[device];
+	size_t size = (size_t)2 * dev->count + count;
+	__u64 *keys, *out;
+	__u32 i = 0, kept = 0;
+	int j = 0, ret;
+
+	if (size > *scratch_size) {
+		__u64 *bigger = realloc(*scratch, sizeof(__u64) * size);
+
+		if (!bigger)
+			return -ENOMEM;
+		*scratch = bigger;
+		*scratch_size = size;
+	}
+	keys = *scratch;
+	out = keys + dev->count;
+	crush_reverse_decode(dev, keys);
+	while (i < dev->count || j < count) {
+		if (j < count && (i == dev->count || changes[j].key <= keys[i])) {
+			if (changes[j].add)
+				out[kept++] = changes[j].key;
+			else if (i < dev->count && keys[i] == changes[j].key)
+				i++;
+			j++;
+		} else {
+			out[kept++] = keys[i++];
+		}
+	}
+	reverse->size -= dev->size;
+	ret = crush_reverse_encode(dev, out, kept);
+	reverse->size += dev->size;
+	return ret;
+}
+
+int crush_reverse_update(struct crush_reverse *reverse,
+			 const int *xs, int n,
+			 const int *former, const int *former_lens,
+			 const int *results, const int *result_lens)
+{
+	struct crush_reverse_change *changes;
+	__u64 *scratch = NULL;
+	size_t scratch_size = 0;
+	int result_max = reverse->result_max;
+	int count = 0, modified = 0;
+	int i, j, begin, ret = 0;
+
+	if (n < 0)
+		return -EINVAL;
+	changes = malloc(sizeof(*changes) * 2 * (size_t)n * result_max + 1);
+	if (!changes)
+		return -ENOMEM;
+	for (i = 0; i < n; i++) {
+		const int *a = former + (size_t)i * result_max;
+		const int *b = results + (size_t)i * result_max;
+
+		for (j = 0; j < former_lens[i] || j < result_lens[i]; j++) {
+			int from = j < former_lens[i] ? a[j] : CRUSH_ITEM_NONE;
+			int to = j < result_lens[i] ? b[j] : CRUSH_ITEM_NONE;
+			__u64 key = crush_reverse_key(reverse, xs[i], j);
+
+			if (from == to)
+				continue;
+			if (crush_reverse_is_device(reverse, from)) {
+				changes[count].device = from;
+				changes[count].add = 0;
+				changes[count++].key = key;
+			}
+			if (crush_reverse_is_device(reverse, to)) {
+				changes[count].device = to;
+				changes[count].add = 1;
+				changes[count++].key = key;
+			}
+		}
+	}
+	qsort(changes, count, sizeof(*changes), crush_reverse_change_cmp);
+	for (begin = 0; begin < count; begin = i) {
+		for (i = begin; i < count &&
+			     changes[i].device == changes[begin].device; i++)
+			;
+		ret = crush_reverse_apply(reverse, changes[begin].device,
+					  changes + begin, i - begin,
+					  &scratch, &scratch_size);
+		if (ret < 0)
+			goto out;
+		modified++;
+	}
+	ret = modified;
+out:
+	free(scratch);
+	free(changes);
+	return ret;
+}
+
+int crush_reverse_delta(struct crush_reverse *reverse,
+			const struct crush_map *map, int ruleno,
+			__u64 changed,
+			const int *xs, int n,
+			int *results, int result_max, int *result_lens,
+			__u64 *visited,
+			const __u32 *weights, int weight_max,
+			const struct crush_choose_arg *choose_args,
+			int *moved)
+{
+	int *former = NULL, *former_lens = NULL, *indexes = NULL;
+	int *moved_xs = NULL, *moved_results = NULL, *moved_lens = NULL;
+	int candidates = 0, count, i, c, ret;
+
+	if (result_max != reverse->result_max || n < 0)
+		return -EINVAL;
+	/* the results crush_map_delta() may modify */
+	for (i = 0; i < n; i++)
+		if (visited[i] & changed)
+			candidates++;
+	former = malloc(sizeof(int) * (size_t)candidates * result_max + 1);
+	former_lens = malloc(sizeof(int) * candidates + 1);
+	indexes = malloc(sizeof(int) * candidates + 1);
+	if (!former || !former_lens || !indexes) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	for (i = 0, c = 0; i < n; i++) {
+		if (!(visited[i] & changed))
+			continue;
+		memcpy(former + (size_t)c * result_max,
+		       results + (size_t)i * result_max,
+		       sizeof(int) * result_lens[i]);
+		former_lens[c] = result_lens[i];
+		indexes[c++] = i;
+	}
+
+	count = crush_map_delta(map, ruleno, changed, xs, n, results,
+				result_max, result_lens, visited, weights,
+				weight_max, choose_args, moved);
+	if (count <= 0) {
+		ret = count;
+		goto out;
+	}
+
+	/* the values that moved, their former results in place */
+	moved_xs = malloc(sizeof(int) * count);
+	moved_results = malloc(sizeof(int) * (size_t)count * result_max);
+	moved_lens = malloc(sizeof(int) * count);
+	if (!moved_xs || !moved_results || !moved_lens) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	for (i = 0, c = 0; i < count; i++) {
+		int index = moved[i];
+
+		/* both are in increasing order */
+		while (indexes[c] != index)
+			c++;
+		moved_xs[i] = xs[index];
+		memmove(former + (size_t)i * result_max,
+			former + (size_t)c * result_max,
+			sizeof(int) * former_lens[c]);
+		former_lens[i] = former_lens[c];
+		memcpy(moved_results + (size_t)i * result_max,
+		       results + (size_t)index * result_max,
+		       sizeof(int) * result_lens[index]);
+		moved_lens[i] = result_lens[index];
+	}
+	ret = crush_reverse_update(reverse, moved_xs, count, former,
+				   former_lens, moved_results, moved_lens);
+	if (ret >= 0)
+		ret = count;
+out:
+	free(former);
+	free(former_lens);
+	free(indexes);
+	free(moved_xs);
+	free(moved_results);
+	free(moved_lens);
+	return ret;
+}
+
+int crush_reverse_get(const struct crush_reverse *reverse, int device,
+		      int *xs, int *positions, int max)
+{
+	const struct crush_reverse_device *dev;
+	const unsigned char *p;
+	__u64 key = 0, delta;
+	__u32 i;
+
+	if (!crush_reverse_is_device(reverse, device))
+		return 0;
+	dev = &reverse->devices[device];
+	p = dev->data;
+	for (i = 0; i < dev->count && (int)i < max; i++) {
+		p = crush_reverse_read(p, &delta);
+		key += delta;
+		xs[i] = (__u32)(key / reverse->result_max);
+		if (positions)
+			positions[i] = key % reverse->result_max;
+	}
+	return dev->count;
+}
+
+size_t crush_reverse_size(const struct crush_reverse *reverse)
+{
+	return sizeof(*reverse) +
+		sizeof(*reverse->devices) * reverse->max_devices +
+		reverse->size;
+}
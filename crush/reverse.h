@@ -0,0 +1,156 @@
+#ifndef CEPH_CRUSH_REVERSE_H
+#define CEPH_CRUSH_REVERSE_H
+
+/*
+ * The values mapped to each device, the reverse of crush_do_rule().
+ *
+ * LGPL2
+ */
+
+#include "crush.h"
+
+struct crush_reverse;
+
+/** @ingroup API
+ *
+ * Index the devices of the results of the __n__ values of __xs__, as
+ * stored by crush_do_rule_batch(), crush_map_visited() or
+ * crush_map_range(): for each device in [0,__max_devices__[, the
+ * values mapped to it and the position of the device in their result,
+ * in increasing order of the value seen as unsigned. The items that
+ * are not devices, such as __CRUSH_ITEM_NONE__, are ignored.
+ *
+ * The entries of a device are delta encoded in a variable number of
+ * bytes: a device holding one value in k of a contiguous range takes
+ * about one byte per entry if k * __result_max__ < 128 and two if it
+ * is below 16384. The devices are encoded by __nthreads__ threads, as
+ * explained in crush_parallel_run().
+ *
+ * The index must be deallocated with crush_reverse_destroy().
+ *
+ * - __errno__ is EINVAL if __max_devices__ < 0, __n__ < 0 or
+ *   __result_max__ <= 0
+ * - __errno__ is ENOMEM if __malloc(3)__ fails
+ *
+ * @param max_devices the number of devices to index
+ * @param xs the __n__ values that were mapped
+ * @param n the size of the __xs__ array
+ * @param results an array of items of size __n__ * __result_max__
+ * @param result_max the maximum number of items for each value
+ * @param result_lens an array of size __n__
+ * @param nthreads the number of threads
+ *
+ * @returns the index or NULL with __errno__ set on error
+ */
+extern struct crush_reverse *crush_reverse_create(int max_devices,
+						  const int *xs, int n,
+						  const int *results,
+						  int result_max,
+						  const int *result_lens,
+						  int nthreads);
+
+/** @ingroup API
+ *
+ * Deallocate an index returned by crush_reverse_create().
+ *
+ * @param reverse the index to deallocate
+ */
+extern void crush_reverse_destroy(struct crush_reverse *reverse);
+
+/** @ingroup API
+ *
+ * Replace in __reverse__ the entries of the __n__ values of __xs__
+ * that were mapped to __former__ by those of their new __results__,
+ * all stored as crush_do_rule_batch() does for the __result_max__ of
+ * crush_reverse_create(). Only the devices whose entries differ are
+ * encoded again. The __former__ items must be those __reverse__
+ * holds: the entries that cannot be found are ignored.
+ *
+ * A value may be given with the same results: it is not modified.
+ * On failure, __reverse__ is left with the entries of some values
+ * replaced and others not.
+ *
+ * - return -EINVAL if __n__ < 0
+ * - return -ENOMEM if __malloc(3)__ fails
+ *
+ * @param reverse the index
+ * @param xs the __n__ values that were mapped again
+ * @param n the size of the __xs__ array
+ * @param former an array of items of size __n__ * __result_max__
+ * @param former_lens an array of size __n__
+ * @param results an array of items of size __n__ * __result_max__
+ * @param result_lens an array of size __n__
+ *
+ * @returns the number of devices modified on success, < 0 on error
+ */
+extern int crush_reverse_update(struct crush_reverse *reverse,
+				const int *xs, int n,
+				const int *former, const int *former_lens,
+				const int *results, const int *result_lens);
+
+/** @ingroup API
+ *
+ * Map again the values as crush_map_delta() does, with the same
+ * arguments, and update __reverse__, which indexes __results__, with
+ * crush_reverse_update() for the values that moved.
+ *
+ * - return the errors of crush_map_delta() and crush_reverse_update()
+ * - return -EINVAL if __result_max__ is not that of
+ *   crush_reverse_create()
+ *
+ * @param reverse the index of __results__
+ * @param map the edited crush_map, finalized
+ * @param ruleno the rule the values were mapped with
+ * @param changed the mask of the edited buckets, see crush_changed_buckets()
+ * @param xs the __n__ values to map
+ * @param n the size of the __xs__ array
+ * @param results an array of items of size __n__ * __result_max__
+ * @param result_max the maximum number of items for each value
+ * @param result_lens an array of size __n__
+ * @param visited an array of size __n__
+ * @param weights an array of weights of size __weight_max__
+ * @param weight_max the size of the __weights__ array
+ * @param choose_args weights and ids for each known bucket
+ * @param moved an array of size __n__
+ *
+ * @returns the number of values in __moved__ on success, < 0 on error
+ */
+extern int crush_reverse_delta(struct crush_reverse *reverse,
+			       const struct crush_map *map, int ruleno,
+			       __u64 changed,
+			       const int *xs, int n,
+			       int *results, int result_max, int *result_lens,
+			       __u64 *visited,
+			       const __u32 *weights, int weight_max,
+			       const struct crush_choose_arg *choose_args,
+			       int *moved);
+
+/** @ingroup API
+ *
+ * Store in __xs__ and __positions__ the first __max__ values mapped
+ * to __device__ and its position in their results, in increasing
+ * order of the value seen as unsigned. The __positions__ may be NULL.
+ *
+ * @param reverse the index
+ * @param device the device
+ * @param xs an array of size __max__
+ * @param positions an array of size __max__ or NULL
+ * @param max the size of the __xs__ array
+ *
+ * @returns the number of values mapped to __device__, which may be
+ *          larger than __max__, or 0 if it is not indexed
+ */
+extern int crush_reverse_get(const struct crush_reverse *reverse, int device,
+			     int *xs, int *positions, int max);
+
+/** @ingroup API
+ *
+ * The memory used by __reverse__, in bytes.
+ *
+ * @param reverse the index
+ *
+ * @returns the number of bytes allocated for __reverse__
+ */
+extern size_t crush_reverse_size(const struct crush_reverse *reverse);
+
+#endif
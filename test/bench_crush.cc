@@ -0,0 +1,447 @@
+/*
+ * Benchmarks of the mapper and the builder. To keep track of the
+ * results over releases:
+ *
+ *     bench_crush --benchmark_out=bench_crush.json --benchmark_out_format=json
+ *
+ * or make bench, which does the same in the build directory.
+ */
+#include <benchmark/benchmark.h>
+#include <chrono>
+#include <vector>
+
+extern "C" {
+#include "crush/builder.h"
+#include "crush/epoch.h"
+#include "crush/hash.h"
+#include "crush/mapper.h"
+}
+
+#include "fuzz.h"
+
+static const int result_max = 3;
+// the weight of the root must fit in 16.16 fixed point
+static const int max_devices = 1 << 16;
+static const int device_weight = 0x1000;
+
+struct bench_map {
+  crush_map *m;
+  int ruleno;
+  int device_count;
+  int hash;
+  std::vector<__u32> weights;
+  crush_choose_arg *choose_args;
+};
+
+// add the buckets of level (1 is for the buckets holding the devices)
+// and return the id of the one created
+static int add_level(bench_map *b, int alg, int width, int level)
+{
+  int items[width];
+  int weights[width];
+  for (int i = 0; i < width; i++) {
+    if (level == 1) {
+      items[i] = b->device_count++;
+      weights[i] = device_weight;
+    } else {
+      items[i] = add_level(b, alg, width, level - 1);
+      weights[i] = b->m->buckets[-1-items[i]]->weight;
+    }
+  }
+  if (alg == CRUSH_BUCKET_UNIFORM && level > 1)
+    for (int i = 0; i < width; i++)
+      weights[i] = weights[0];
+  crush_bucket *bucket = crush_make_bucket(b->m, alg, b->hash, level,
+                                           width, items, weights);
+  int id = 0;
+  if (bucket == NULL || crush_add_bucket(b->m, 0, bucket, &id) < 0)
+    abort();
+  return id;
+}
+
+// a hierarchy of depth levels of buckets with width items each
+static void make_map(bench_map *b, int alg, int width, int depth, bool indep,
+                     bool choose_args, int down_percent,
+                     int hash = CRUSH_HASH_DEFAULT)
+{
+  b->m = crush_create();
+  b->device_count = 0;
+  b->hash = hash;
+  int root = add_level(b, alg, width, depth);
+  crush_finalize(b->m);
+  crush_rule *rule = crush_make_rule(3, 0, 0, 0, 0);
+  crush_rule_set_step(rule, 0, CRUSH_RULE_TAKE, root, 0);
+  crush_rule_set_step(rule, 1, indep ? CRUSH_RULE_CHOOSELEAF_INDEP :
+                      CRUSH_RULE_CHOOSELEAF_FIRSTN, 0, 1);
+  crush_rule_set_step(rule, 2, CRUSH_RULE_EMIT, 0, 0);
+  b->ruleno = crush_add_rule(b->m, rule, -1);
+  b->weights.assign(b->device_count, 0x10000);
+  for (int d = 0; d < b->device_count; d++)
+    if (crush_hash32(CRUSH_HASH_DEFAULT, d) % 100 < (__u32)down_percent)
+      b->weights[d] = 0;
+  b->choose_args = choose_args ? crush_make_choose_args(b->m, result_max) : NULL;
+}
+
+static void destroy_map(bench_map *b)
+{
+  if (b->choose_args)
+    crush_destroy_choose_args(b->choose_args);
+  crush_destroy(b->m);
+}
+
+// alg, width, depth, indep, choose_args, down_percent, hash
+static void BM_crush_do_rule(benchmark::State &state)
+{
+  bench_map b;
+  make_map(&b, state.range(0), state.range(1), state.range(2),
+           state.range(3), state.range(4), state.range(5), state.range(6));
+  std::vector<char> cwin(crush_work_size(b.m, result_max));
+  crush_init_workspace(b.m, cwin.data());
+  int result[result_max];
+  int x = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(
+      crush_do_rule(b.m, b.ruleno, x++, result, result_max,
+                    b.weights.data(), b.device_count, cwin.data(),
+                    b.choose_args));
+  }
+  state.SetItemsProcessed(state.iterations());
+  state.counters["devices"] = b.device_count;
+  destroy_map(&b);
+}
+
+// same as BM_crush_do_rule with crush_execute_rule()
+static void BM_crush_execute_rule(benchmark::State &state)
+{
+  bench_map b;
+  make_map(&b, state.range(0), state.range(1), state.range(2),
+           state.range(3), state.range(4), state.range(5), state.range(6));
+  crush_rule_executor e;
+  state.counters["specialized"] = crush_make_rule_executor(b.m, b.ruleno, &e);
+  std::vector<char> cwin(crush_work_size(b.m, result_max));
+  crush_init_workspace(b.m, cwin.data());
+  int result[result_max];
+  int x = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(
+      crush_execute_rule(&e, x++, result, result_max,
+                         b.weights.data(), b.device_count, cwin.data(),
+                         b.choose_args));
+  }
+  state.SetItemsProcessed(state.iterations());
+  state.counters["devices"] = b.device_count;
+  destroy_map(&b);
+}
+
+static bool fits(int width, int depth)
+{
+  long devices = 1;
+  for (int i = 0; i < depth; i++)
+    devices *= width;
+  return devices <= max_devices;
+}
+
+static void algs(benchmark::internal::Benchmark *bench)
+{
+  for (int alg : { CRUSH_BUCKET_UNIFORM, CRUSH_BUCKET_LIST, CRUSH_BUCKET_TREE,
+                   CRUSH_BUCKET_STRAW, CRUSH_BUCKET_STRAW2 })
+    for (int width : { 4, 16, 64, 256 })
+      // num_nodes of a tree bucket is an __u8
+      if (alg != CRUSH_BUCKET_TREE || width < 128)
+        bench->Args({ alg, width, 2, 0, 0, 0, CRUSH_HASH_DEFAULT });
+}
+
+static void depths(benchmark::internal::Benchmark *bench)
+{
+  for (int width : { 4, 16 })
+    for (int depth = 2; depth <= 6; depth++)
+      if (fits(width, depth))
+        bench->Args({ CRUSH_BUCKET_STRAW2, width, depth, 0, 0, 0, CRUSH_HASH_DEFAULT });
+}
+
+static void rules(benchmark::internal::Benchmark *bench)
+{
+  for (int indep : { 0, 1 })
+    for (int choose_args : { 0, 1 })
+      for (int down_percent : { 0, 10, 30 })
+        bench->Args({ CRUSH_BUCKET_STRAW2, 16, 3, indep, choose_args, down_percent,
+                      CRUSH_HASH_DEFAULT });
+}
+
+static void hashes(benchmark::internal::Benchmark *bench)
+{
+  for (int hash : { CRUSH_HASH_RJENKINS1, CRUSH_HASH_XXHASH32 })
+    for (int alg : { CRUSH_BUCKET_STRAW, CRUSH_BUCKET_STRAW2 })
+      for (int width : { 4, 16, 64, 256 })
+        bench->Args({ alg, width, 2, 0, 0, 10, hash });
+}
+
+#define DO_RULE_ARGS { "alg", "width", "depth", "indep", "choose_args", "down", "hash" }
+
+BENCHMARK(BM_crush_do_rule)->Name("crush_do_rule/algs")
+  ->ArgNames(DO_RULE_ARGS)->Apply(algs);
+BENCHMARK(BM_crush_do_rule)->Name("crush_do_rule/depths")
+  ->ArgNames(DO_RULE_ARGS)->Apply(depths);
+BENCHMARK(BM_crush_do_rule)->Name("crush_do_rule/rules")
+  ->ArgNames(DO_RULE_ARGS)->Apply(rules);
+BENCHMARK(BM_crush_execute_rule)->Name("crush_execute_rule/rules")
+  ->ArgNames(DO_RULE_ARGS)->Apply(rules);
+BENCHMARK(BM_crush_do_rule)->Name("crush_do_rule/hashes")
+  ->ArgNames(DO_RULE_ARGS)->Apply(hashes);
+
+// batch, width, steps: 256 values mapped on straw2 width^3 by a loop
+// of crush_do_rule() or by crush_do_rule_batch(), with a chooseleaf
+// step or with a choose step of result_max level 2 buckets followed by
+// a chooseleaf step of one host in each
+static void BM_crush_do_rule_batch(benchmark::State &state)
+{
+  bench_map b;
+  make_map(&b, CRUSH_BUCKET_STRAW2, state.range(1), 3, false, false, 10);
+  int ruleno = b.ruleno;
+  if (state.range(2) == 2) {
+    crush_rule *rule = crush_make_rule(4, 0, 0, 0, 0);
+    crush_rule_set_step(rule, 0, CRUSH_RULE_TAKE, b.m->rules[b.ruleno]->steps[0].arg1, 0);
+    crush_rule_set_step(rule, 1, CRUSH_RULE_CHOOSE_FIRSTN, 0, 2);
+    crush_rule_set_step(rule, 2, CRUSH_RULE_CHOOSELEAF_FIRSTN, 1, 1);
+    crush_rule_set_step(rule, 3, CRUSH_RULE_EMIT, 0, 0);
+    ruleno = crush_add_rule(b.m, rule, -1);
+  }
+  const int n = 256;
+  std::vector<int> xs(n);
+  std::vector<int> results(n * result_max);
+  std::vector<int> result_lens(n);
+  std::vector<char> cwin(crush_work_size(b.m, result_max));
+  crush_init_workspace(b.m, cwin.data());
+  bool batch = state.range(0);
+  int x = 0;
+  for (auto _ : state) {
+    for (int i = 0; i < n; i++)
+      xs[i] = x++;
+    if (batch) {
+      crush_do_rule_batch(b.m, ruleno, xs.data(), n, results.data(), result_max,
+                          result_lens.data(), b.weights.data(), b.device_count,
+                          cwin.data(), NULL);
+    } else {
+      for (int i = 0; i < n; i++)
+        result_lens[i] = crush_do_rule(b.m, ruleno, xs[i],
+                                       results.data() + i * result_max, result_max,
+                                       b.weights.data(), b.device_count,
+                                       cwin.data(), NULL);
+    }
+    benchmark::DoNotOptimize(results.data());
+  }
+  state.SetItemsProcessed(state.iterations() * n);
+  destroy_map(&b);
+}
+BENCHMARK(BM_crush_do_rule_batch)->Name("crush_do_rule_batch")
+  ->ArgNames({ "batch", "width", "steps" })
+  ->ArgsProduct({ { 0, 1 }, { 16, 64 }, { 1, 2 } });
+
+// the handle the threads of BM_crush_reader_do_rule map values with
+static bench_map reader_map;
+static crush_handle *reader_handle;
+
+static void setup_reader_handle(const benchmark::State &)
+{
+  make_map(&reader_map, CRUSH_BUCKET_STRAW2, 16, 3, false, false, 0);
+  reader_handle = crush_handle_create(reader_map.m, NULL);
+}
+
+static void teardown_reader_handle(const benchmark::State &)
+{
+  crush_handle_destroy(reader_handle);
+}
+
+// same as BM_crush_do_rule with crush_reader_do_rule() from each thread
+static void BM_crush_reader_do_rule(benchmark::State &state)
+{
+  crush_reader *reader = crush_reader_create(reader_handle);
+  int result[result_max];
+  int x = state.thread_index() << 24;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(
+      crush_reader_do_rule(reader, reader_map.ruleno, x++, result, result_max,
+                           reader_map.weights.data(), reader_map.device_count));
+  }
+  state.SetItemsProcessed(state.iterations());
+  crush_reader_destroy(reader);
+}
+BENCHMARK(BM_crush_reader_do_rule)->Name("crush_reader_do_rule")
+  ->Setup(setup_reader_handle)->Teardown(teardown_reader_handle)
+  ->ThreadRange(1, 8)->UseRealTime();
+
+// path, straw2: a fuzz_path of fuzz.h mapping values with the rules of
+// random maps, the speedup being the time the reference path takes to
+// map the same number of values divided by the time of the path
+static void BM_fuzz_path(benchmark::State &state)
+{
+  int path = state.range(0);
+  if (!fuzz_path_supported(path)) {
+    state.SkipWithError("not supported by the CPU");
+    return;
+  }
+  const int maps = 8;
+  const int block = 64;
+  std::vector<fuzz_map> f(maps);
+  std::vector<fuzz_path *> paths;
+  std::vector<fuzz_path *> references;
+  int values = 0;
+  for (int i = 0; i < maps; i++) {
+    fuzz_make_map(&f[i], i + 1, state.range(1), crush_create());
+    paths.push_back(fuzz_make_path(path, f[i]));
+    references.push_back(fuzz_make_path(FUZZ_REFERENCE, f[i]));
+    values += f[i].rules.size() * block;
+  }
+  std::vector<int> results(block * fuzz_result_max);
+  std::vector<int> result_lens(block);
+  // a block of values for each rule of each map
+  auto map_blocks = [&](const std::vector<fuzz_path *> &p, int x) {
+    for (int i = 0; i < maps; i++)
+      for (const fuzz_rule &r : f[i].rules)
+        p[i]->map(r, x, block, results.data(), result_lens.data());
+  };
+  typedef std::chrono::duration<double> seconds;
+  const int rounds = 20;
+  auto start = std::chrono::steady_clock::now();
+  for (int round = 0; round < rounds; round++)
+    map_blocks(references, round * block);
+  double reference = seconds(std::chrono::steady_clock::now() - start).count() / rounds;
+  int x = 0;
+  start = std::chrono::steady_clock::now();
+  for (auto _ : state) {
+    map_blocks(paths, x);
+    x += block;
+  }
+  double elapsed = seconds(std::chrono::steady_clock::now() - start).count();
+  state.counters["speedup"] = reference * state.iterations() / elapsed;
+  state.SetItemsProcessed(state.iterations() * values);
+  state.SetLabel(fuzz_path_names[path]);
+  for (int i = 0; i < maps; i++) {
+    delete paths[i];
+    delete references[i];
+    fuzz_destroy_map(&f[i]);
+  }
+}
+
+static void fuzz_paths(benchmark::internal::Benchmark *bench)
+{
+  for (int path = 0; path < FUZZ_PATHS; path++)
+    for (int straw2 : { 0, 1 })
+      bench->Args({ path, straw2 });
+}
+BENCHMARK(BM_fuzz_path)->Name("fuzz")->ArgNames({ "path", "straw2" })
+  ->Apply(fuzz_paths);
+
+// width, depth
+static void BM_crush_make_choose_args(benchmark::State &state)
+{
+  bench_map b;
+  make_map(&b, CRUSH_BUCKET_STRAW2, state.range(0), state.range(1),
+           false, false, 0);
+  for (auto _ : state) {
+    crush_choose_arg *choose_args = crush_make_choose_args(b.m, result_max);
+    benchmark::DoNotOptimize(choose_args);
+    crush_destroy_choose_args(choose_args);
+  }
+  state.counters["buckets"] = b.m->max_buckets;
+  destroy_map(&b);
+}
+BENCHMARK(BM_crush_make_choose_args)->Name("crush_make_choose_args")
+  ->ArgNames({ "width", "depth" })
+  ->Args({ 16, 2 })->Args({ 16, 3 })->Args({ 64, 2 })->Args({ 64, 3 });
+
+// width, depth: what a balancer does for each candidate weight set
+static void BM_crush_copy_choose_args(benchmark::State &state)
+{
+  bench_map b;
+  make_map(&b, CRUSH_BUCKET_STRAW2, state.range(0), state.range(1),
+           false, true, 0);
+  size_t size = crush_choose_args_size(b.m, result_max);
+  std::vector<__u64> arena((size + sizeof(__u64) - 1) / sizeof(__u64));
+  crush_choose_arg *candidate = crush_init_choose_args(b.m, result_max,
+                                                       arena.data(), size);
+  int bucket_id = -1 - (b.m->max_buckets - 1);
+  int i = 0;
+  for (auto _ : state) {
+    crush_copy_choose_args(b.m, candidate, b.choose_args);
+    crush_choose_args_set_weight(b.m, candidate, bucket_id, 0,
+                                 i++ % state.range(0), 0x8000);
+    benchmark::DoNotOptimize(candidate);
+  }
+  state.counters["buckets"] = b.m->max_buckets;
+  destroy_map(&b);
+}
+BENCHMARK(BM_crush_copy_choose_args)->Name("crush_copy_choose_args")
+  ->ArgNames({ "width", "depth" })
+  ->Args({ 16, 2 })->Args({ 16, 3 })->Args({ 64, 2 })->Args({ 64, 3 });
+
+// alg, width, depth
+static void BM_crush_init_workspace(benchmark::State &state)
+{
+  bench_map b;
+  make_map(&b, state.range(0), state.range(1), state.range(2), false, false, 0);
+  std::vector<char> cwin(crush_work_size(b.m, result_max));
+  for (auto _ : state) {
+    crush_init_workspace(b.m, cwin.data());
+    benchmark::ClobberMemory();
+  }
+  state.counters["working_size"] = b.m->working_size;
+  destroy_map(&b);
+}
+BENCHMARK(BM_crush_init_workspace)->Name("crush_init_workspace")
+  ->ArgNames({ "alg", "width", "depth" })
+  ->Args({ CRUSH_BUCKET_STRAW2, 16, 3 })->Args({ CRUSH_BUCKET_STRAW2, 40, 3 })
+  ->Args({ CRUSH_BUCKET_UNIFORM, 16, 3 });
+
+// size
+static void BM_crush_calc_straw(benchmark::State &state)
+{
+  crush_map *m = crush_create();
+  int size = state.range(0);
+  std::vector<int> items(size), weights(size);
+  for (int i = 0; i < size; i++) {
+    items[i] = i;
+    weights[i] = 0x10000 * (1 + i % 7);
+  }
+  crush_bucket_straw *straw = crush_make_straw_bucket(m, CRUSH_HASH_DEFAULT, 1, size,
+                                                      items.data(), weights.data());
+  for (auto _ : state)
+    benchmark::DoNotOptimize(crush_calc_straw(m, straw));
+  state.SetComplexityN(size);
+  crush_destroy_bucket(&straw->h);
+  crush_destroy(m);
+}
+BENCHMARK(BM_crush_calc_straw)->Name("crush_calc_straw")
+  ->ArgNames({ "size" })->RangeMultiplier(4)->Range(4, 4096)->Complexity();
+
+// size
+static void BM_crush_calc_straw_item(benchmark::State &state)
+{
+  crush_map *m = crush_create();
+  int size = state.range(0);
+  std::vector<int> items(size), weights(size);
+  for (int i = 0; i < size; i++) {
+    items[i] = i;
+    weights[i] = 0x10000 * (1 + i % 7);
+  }
+  crush_bucket_straw *straw = crush_make_straw_bucket(m, CRUSH_HASH_DEFAULT, 1, size,
+                                                      items.data(), weights.data());
+  int i = 0;
+  for (auto _ : state) {
+    // what crush_bucket_adjust_item_weight() does
+    int idx = i++ % size;
+    straw->item_weights[idx] = 0x10000 * (1 + (idx + i) % 7);
+    benchmark::DoNotOptimize(crush_calc_straw_item(m, straw, idx));
+  }
+  state.SetComplexityN(size);
+  crush_destroy_bucket(&straw->h);
+  crush_destroy(m);
+}
+BENCHMARK(BM_crush_calc_straw_item)->Name("crush_calc_straw_item")
+  ->ArgNames({ "size" })->RangeMultiplier(4)->Range(4, 4096)->Complexity();
+
+BENCHMARK_MAIN();
+
+// Local Variables:
+// compile-command: "cd ../build ; make bench_crush && test/bench_crush"
+// End:
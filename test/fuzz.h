@@ -0,0 +1,447 @@
+/*
+ * Random maps, rules, weights and choose_args, and the ways of mapping
+ * values that must find the same items as crush_do_rule() run without
+ * the fast paths of the mapper. Shared by test_fuzz.cc, which compares
+ * them, and bench_crush.cc, which times them.
+ */
+#ifndef CRUSH_TEST_FUZZ_H
+#define CRUSH_TEST_FUZZ_H
+
+#include <stdlib.h>
+#include <random>
+#include <vector>
+
+extern "C" {
+#include "crush/builder.h"
+#include "crush/cache.h"
+#include "crush/encoding.h"
+#include "crush/hash.h"
+#include "crush/mapper.h"
+#include "crush/parallel.h"
+}
+
+// the largest result_max of the rules
+static const int fuzz_result_max = 6;
+
+struct fuzz_rule {
+  int ruleno;
+  int result_max;
+  // a CHOOSELEAF_INDEP step of type 0 keeps the last device it tried
+  // when none is in, which may be out or already in the result
+  bool out_leaves;
+};
+
+// a hierarchy of levels of buckets of random algorithms, hashes, sizes
+// and weights, the buckets of level n being of type n and the devices
+// of type 0. With straw2, all the buckets are straw2 buckets and some
+// are wide enough for the vector instructions.
+struct fuzz_map {
+  unsigned seed;
+  bool straw2;
+  crush_map *m;
+  int levels;
+  int device_count;
+  std::vector<fuzz_rule> rules;
+  std::vector<__u32> weights;
+  crush_choose_arg *choose_args;
+};
+
+static inline int fuzz_rand(std::mt19937 &rng, int lo, int hi)
+{
+  return std::uniform_int_distribution<int>(lo, hi)(rng);
+}
+
+static inline int fuzz_add_bucket(fuzz_map *f, std::mt19937 &rng, int level)
+{
+  static const int algs[] = { CRUSH_BUCKET_UNIFORM, CRUSH_BUCKET_LIST,
+                              CRUSH_BUCKET_TREE, CRUSH_BUCKET_STRAW,
+                              CRUSH_BUCKET_STRAW2 };
+  int alg = f->straw2 ? CRUSH_BUCKET_STRAW2 : algs[fuzz_rand(rng, 0, 4)];
+  int width = level > 1 ? fuzz_rand(rng, 1, 5) :
+    fuzz_rand(rng, 1, f->straw2 ? 40 : 12);
+  int hash = fuzz_rand(rng, 0, 1) ? CRUSH_HASH_XXHASH32 : CRUSH_HASH_RJENKINS1;
+  std::vector<int> items(width);
+  std::vector<int> weights(width);
+  for (int i = 0; i < width; i++) {
+    if (level == 1) {
+      items[i] = f->device_count++;
+      weights[i] = fuzz_rand(rng, 0, 9) == 0 ? 0 : fuzz_rand(rng, 1, 8) * 0x8000;
+    } else {
+      items[i] = fuzz_add_bucket(f, rng, level - 1);
+      weights[i] = f->m->buckets[-1-items[i]]->weight;
+    }
+  }
+  // the items of uniform buckets have the same weight, which is not 0
+  if (alg == CRUSH_BUCKET_UNIFORM)
+    for (int i = 0; i < width; i++)
+      weights[i] = weights[0] ? weights[0] : 0x10000;
+  crush_bucket *b = crush_make_bucket(f->m, alg, hash, level, width,
+                                      items.data(), weights.data());
+  int id = 0;
+  if (b == NULL || crush_add_bucket(f->m, 0, b, &id) < 0)
+    abort();
+  return id;
+}
+
+// TAKE the root, CRUSH_RULE_SET_* steps and one or two CHOOSE* steps
+static inline void fuzz_add_rule(fuzz_map *f, std::mt19937 &rng, int root)
+{
+  static const int ops[] = { CRUSH_RULE_CHOOSE_FIRSTN, CRUSH_RULE_CHOOSE_INDEP,
+                             CRUSH_RULE_CHOOSELEAF_FIRSTN,
+                             CRUSH_RULE_CHOOSELEAF_INDEP };
+  std::vector<std::vector<int> > steps;
+  steps.push_back({ CRUSH_RULE_TAKE, root, 0 });
+  for (int sets = fuzz_rand(rng, 0, 2); sets > 0; sets--) {
+    int op = fuzz_rand(rng, CRUSH_RULE_SET_CHOOSE_TRIES,
+                       CRUSH_RULE_SET_CHOOSELEAF_STABLE);
+    int arg;
+    switch (op) {
+    case CRUSH_RULE_SET_CHOOSE_TRIES: arg = fuzz_rand(rng, 1, 60); break;
+    case CRUSH_RULE_SET_CHOOSELEAF_TRIES: arg = fuzz_rand(rng, 1, 5); break;
+    case CRUSH_RULE_SET_CHOOSELEAF_VARY_R: arg = fuzz_rand(rng, 0, 3); break;
+    case CRUSH_RULE_SET_CHOOSELEAF_STABLE: arg = fuzz_rand(rng, 0, 1); break;
+    default: arg = fuzz_rand(rng, 0, 3); break;
+    }
+    steps.push_back({ op, arg, 0 });
+  }
+  int type = fuzz_rand(rng, 0, f->levels - 1);
+  if (type > 0 && fuzz_rand(rng, 0, 1)) {
+    // choose buckets, then items of a lower type in each of them
+    steps.push_back({ ops[fuzz_rand(rng, 0, 1)], fuzz_rand(rng, 1, 3), type });
+    steps.push_back({ ops[fuzz_rand(rng, 0, 3)], fuzz_rand(rng, -1, 2),
+                      fuzz_rand(rng, 0, type - 1) });
+  } else {
+    steps.push_back({ ops[fuzz_rand(rng, 0, 3)], fuzz_rand(rng, -1, 4), type });
+  }
+  steps.push_back({ CRUSH_RULE_EMIT, 0, 0 });
+  fuzz_rule r;
+  r.out_leaves = false;
+  for (const std::vector<int> &step : steps)
+    if (step[0] == CRUSH_RULE_CHOOSELEAF_INDEP && step[2] == 0)
+      r.out_leaves = true;
+  crush_rule *rule = crush_make_rule(steps.size(), 0, 0, 0, 0);
+  for (size_t i = 0; i < steps.size(); i++)
+    crush_rule_set_step(rule, i, steps[i][0], steps[i][1], steps[i][2]);
+  r.ruleno = crush_add_rule(f->m, rule, -1);
+  r.result_max = fuzz_rand(rng, 1, fuzz_result_max);
+  if (r.ruleno < 0)
+    abort();
+  f->rules.push_back(r);
+}
+
+// weight sets of 1 to 3 positions, each weight in [w/2,3w/2] or 0
+static inline crush_choose_arg *fuzz_make_choose_args(fuzz_map *f, std::mt19937 &rng)
+{
+  crush_choose_arg *choose_args = crush_make_choose_args(f->m, fuzz_rand(rng, 1, 3));
+  if (choose_args == NULL)
+    abort();
+  for (int b = 0; b < f->m->max_buckets; b++) {
+    for (__u32 p = 0; p < choose_args[b].weight_set_size; p++) {
+      crush_weight_set *ws = &choose_args[b].weight_set[p];
+      for (__u32 i = 0; i < ws->size; i++)
+        ws->weights[i] = fuzz_rand(rng, 0, 9) == 0 ? 0 :
+          ws->weights[i] / 2 + fuzz_rand(rng, 0, ws->weights[i]);
+      if (ws->recips)
+        crush_update_straw2_recips(ws->recips, ws->weights, ws->size);
+    }
+  }
+  return choose_args;
+}
+
+// build in m, empty, the map of seed: the same seed gives the same map
+static inline void fuzz_make_map(fuzz_map *f, unsigned seed, bool straw2, crush_map *m)
+{
+  std::mt19937 rng(seed);
+  f->seed = seed;
+  f->straw2 = straw2;
+  f->m = m;
+  f->device_count = 0;
+  f->rules.clear();
+  switch (fuzz_rand(rng, 0, 3)) {
+  case 2:
+    set_legacy_crush_map(m);
+    break;
+  case 3:
+    m->choose_local_tries = fuzz_rand(rng, 0, 2);
+    m->choose_local_fallback_tries = fuzz_rand(rng, 0, 5);
+    m->choose_total_tries = fuzz_rand(rng, 1, 50);
+    m->chooseleaf_descend_once = fuzz_rand(rng, 0, 1);
+    m->chooseleaf_vary_r = fuzz_rand(rng, 0, 3);
+    m->chooseleaf_stable = fuzz_rand(rng, 0, 1);
+    break;
+  }
+  f->levels = fuzz_rand(rng, 1, 3);
+  int root = fuzz_add_bucket(f, rng, f->levels);
+  crush_finalize(m);
+  for (int r = 0; r < 3; r++)
+    fuzz_add_rule(f, rng, root);
+  // most devices are in, some out or partially out and some have no
+  // weight because weight_max is too small
+  int weight_max = f->device_count;
+  if (fuzz_rand(rng, 0, 7) == 0)
+    weight_max -= fuzz_rand(rng, 0, weight_max - 1);
+  f->weights.resize(weight_max);
+  for (int d = 0; d < weight_max; d++) {
+    int in = fuzz_rand(rng, 0, 9);
+    f->weights[d] = in == 0 ? 0 : in == 1 ? fuzz_rand(rng, 1, 0xffff) : 0x10000;
+  }
+  f->choose_args = straw2 && fuzz_rand(rng, 0, 1) ? fuzz_make_choose_args(f, rng) : NULL;
+}
+
+static inline void fuzz_destroy_map(fuzz_map *f)
+{
+  if (f->choose_args)
+    crush_destroy_choose_args(f->choose_args);
+  crush_destroy(f->m);
+}
+
+// the mask of all the fast paths the CPU supports
+static inline unsigned int fuzz_all_fast_paths()
+{
+  static const unsigned int all = crush_set_fast_paths(~0u);
+  return all;
+}
+
+// a way of mapping the values [x, x + n[ with a rule of a fuzz_map,
+// storing the items of each value as crush_do_rule_batch() does
+class fuzz_path {
+public:
+  virtual ~fuzz_path() {}
+  virtual void map(const fuzz_rule &r, int x, int n,
+                   int *results, int *result_lens) = 0;
+};
+
+// crush_do_rule() with the map given and the fast_paths mask
+class fuzz_do_rule : public fuzz_path {
+  const crush_map *m;
+  const fuzz_map &f;
+  const crush_choose_arg *choose_args;
+  unsigned int fast_paths;
+  std::vector<char> cwin;
+public:
+  fuzz_do_rule(const fuzz_map &f, unsigned int fast_paths,
+               const crush_map *m = NULL,
+               const crush_choose_arg *choose_args = NULL)
+    : m(m ? m : f.m), f(f),
+      choose_args(m ? choose_args : f.choose_args),
+      fast_paths(fast_paths),
+      cwin(crush_work_size(this->m, fuzz_result_max)) {
+    crush_init_workspace(this->m, cwin.data());
+  }
+  void map(const fuzz_rule &r, int x, int n,
+           int *results, int *result_lens) {
+    crush_set_fast_paths(fast_paths);
+    for (int i = 0; i < n; i++)
+      result_lens[i] = crush_do_rule(m, r.ruleno, x + i,
+                                     results + i * r.result_max, r.result_max,
+                                     f.weights.data(), f.weights.size(),
+                                     cwin.data(), choose_args);
+    crush_set_fast_paths(fuzz_all_fast_paths());
+  }
+};
+
+class fuzz_do_rule_batch : public fuzz_path {
+  const fuzz_map &f;
+  std::vector<char> cwin;
+  std::vector<int> xs;
+public:
+  fuzz_do_rule_batch(const fuzz_map &f)
+    : f(f), cwin(crush_work_size(f.m, fuzz_result_max)) {
+    crush_init_workspace(f.m, cwin.data());
+  }
+  void map(const fuzz_rule &r, int x, int n,
+           int *results, int *result_lens) {
+    xs.resize(n);
+    for (int i = 0; i < n; i++)
+      xs[i] = x + i;
+    crush_do_rule_batch(f.m, r.ruleno, xs.data(), n, results, r.result_max,
+                        result_lens, f.weights.data(), f.weights.size(),
+                        cwin.data(), f.choose_args);
+  }
+};
+
+class fuzz_execute_rule : public fuzz_path {
+  const fuzz_map &f;
+  std::vector<crush_rule_executor> executors;
+  std::vector<char> cwin;
+public:
+  fuzz_execute_rule(const fuzz_map &f)
+    : f(f), executors(f.m->max_rules),
+      cwin(crush_work_size(f.m, fuzz_result_max)) {
+    for (const fuzz_rule &r : f.rules)
+      crush_make_rule_executor(f.m, r.ruleno, &executors[r.ruleno]);
+    crush_init_workspace(f.m, cwin.data());
+  }
+  void map(const fuzz_rule &r, int x, int n,
+           int *results, int *result_lens) {
+    const crush_rule_executor *e = &executors[r.ruleno];
+    for (int i = 0; i < n; i++)
+      result_lens[i] = crush_execute_rule(e, x + i, results + i * r.result_max,
+                                          r.result_max, f.weights.data(),
+                                          f.weights.size(), cwin.data(),
+                                          f.choose_args);
+  }
+};
+
+// crush_do_rule() with a copy of the map made by crush_flatten()
+class fuzz_flatten : public fuzz_path {
+  crush_map *flat;
+  fuzz_do_rule do_rule;
+public:
+  fuzz_flatten(const fuzz_map &f)
+    : flat(crush_flatten(f.m)),
+      do_rule(f, fuzz_all_fast_paths(), flat, f.choose_args) {}
+  ~fuzz_flatten() {
+    crush_destroy(flat);
+  }
+  void map(const fuzz_rule &r, int x, int n,
+           int *results, int *result_lens) {
+    do_rule.map(r, x, n, results, result_lens);
+  }
+};
+
+// crush_do_rule() with the map and choose_args encoded and decoded
+class fuzz_decode : public fuzz_path {
+  crush_choose_arg *choose_args;
+  crush_map *decoded;
+  fuzz_do_rule *do_rule;
+public:
+  fuzz_decode(const fuzz_map &f) : choose_args(NULL), decoded(NULL) {
+    void *buf;
+    size_t len;
+    if (crush_encode(f.m, f.choose_args, &buf, &len) == 0) {
+      decoded = crush_decode(buf, len, &choose_args);
+      free(buf);
+    }
+    if (decoded == NULL)
+      abort();
+    do_rule = new fuzz_do_rule(f, fuzz_all_fast_paths(), decoded, choose_args);
+  }
+  ~fuzz_decode() {
+    delete do_rule;
+    if (choose_args)
+      crush_destroy_choose_args(choose_args);
+    crush_destroy(decoded);
+  }
+  void map(const fuzz_rule &r, int x, int n,
+           int *results, int *result_lens) {
+    do_rule->map(r, x, n, results, result_lens);
+  }
+};
+
+// crush_do_rule() with the same map built in an arena
+class fuzz_arena : public fuzz_path {
+  fuzz_map arena;
+  fuzz_do_rule *do_rule;
+public:
+  fuzz_arena(const fuzz_map &f) {
+    fuzz_make_map(&arena, f.seed, f.straw2, crush_create_arena(NULL, 0));
+    do_rule = new fuzz_do_rule(arena, fuzz_all_fast_paths());
+  }
+  ~fuzz_arena() {
+    delete do_rule;
+    fuzz_destroy_map(&arena);
+  }
+  void map(const fuzz_rule &r, int x, int n,
+           int *results, int *result_lens) {
+    do_rule->map(r, x, n, results, result_lens);
+  }
+};
+
+// each value is mapped twice by crush_cache_do_rule(), the second time
+// from the cache
+class fuzz_cache : public fuzz_path {
+  const fuzz_map &f;
+  crush_cache *cache;
+  std::vector<char> cwin;
+public:
+  fuzz_cache(const fuzz_map &f)
+    : f(f), cache(crush_cache_create(fuzz_result_max, 1 << 20)),
+      cwin(crush_work_size(f.m, fuzz_result_max)) {
+    crush_init_workspace(f.m, cwin.data());
+  }
+  ~fuzz_cache() {
+    crush_cache_destroy(cache);
+  }
+  void map(const fuzz_rule &r, int x, int n,
+           int *results, int *result_lens) {
+    for (int pass = 0; pass < 2; pass++)
+      for (int i = 0; i < n; i++)
+        result_lens[i] = crush_cache_do_rule(cache, f.m, r.ruleno, x + i,
+                                             results + i * r.result_max,
+                                             r.result_max, 0, f.weights.data(),
+                                             f.weights.size(), cwin.data(),
+                                             f.choose_args);
+  }
+};
+
+class fuzz_map_range : public fuzz_path {
+  const fuzz_map &f;
+public:
+  fuzz_map_range(const fuzz_map &f) : f(f) {}
+  void map(const fuzz_rule &r, int x, int n,
+           int *results, int *result_lens) {
+    crush_map_range(f.m, r.ruleno, x, x + n, results, r.result_max,
+                    result_lens, f.weights.data(), f.weights.size(),
+                    f.choose_args, 2);
+  }
+};
+
+// the fuzz_path of fuzz_make_path(), the first being the reference
+enum {
+  FUZZ_REFERENCE,
+  FUZZ_AVX2,
+  FUZZ_AVX512,
+  FUZZ_OPTIMAL_TUNABLES,
+  FUZZ_ALL_FAST_PATHS,
+  FUZZ_BATCH,
+  FUZZ_EXECUTOR,
+  FUZZ_FLATTEN,
+  FUZZ_DECODE,
+  FUZZ_ARENA,
+  FUZZ_CACHE,
+  FUZZ_MAP_RANGE,
+  FUZZ_PATHS
+};
+
+static const char *fuzz_path_names[FUZZ_PATHS] = {
+  "reference", "avx2", "avx512", "optimal_tunables", "all_fast_paths",
+  "batch", "executor", "flatten", "decode", "arena", "cache",
+  "map_range",
+};
+
+// the fast paths mask of the crush_do_rule() paths
+static inline unsigned int fuzz_path_fast_paths(int path)
+{
+  switch (path) {
+  case FUZZ_REFERENCE: return 0;
+  case FUZZ_AVX2: return CRUSH_FAST_PATH_AVX2;
+  case FUZZ_AVX512: return CRUSH_FAST_PATH_AVX512;
+  case FUZZ_OPTIMAL_TUNABLES: return CRUSH_FAST_PATH_OPTIMAL_TUNABLES;
+  default: return fuzz_all_fast_paths();
+  }
+}
+
+// whether the CPU has the fast paths of path
+static inline bool fuzz_path_supported(int path)
+{
+  unsigned int fast_paths = fuzz_path_fast_paths(path);
+  return (fuzz_all_fast_paths() & fast_paths) == fast_paths;
+}
+
+// the caller deletes the path before destroying the map
+static inline fuzz_path *fuzz_make_path(int path, const fuzz_map &f)
+{
+  switch (path) {
+  case FUZZ_BATCH: return new fuzz_do_rule_batch(f);
+  case FUZZ_EXECUTOR: return new fuzz_execute_rule(f);
+  case FUZZ_FLATTEN: return new fuzz_flatten(f);
+  case FUZZ_DECODE: return new fuzz_decode(f);
+  case FUZZ_ARENA: return new fuzz_arena(f);
+  case FUZZ_CACHE: return new fuzz_cache(f);
+  case FUZZ_MAP_RANGE: return new fuzz_map_range(f);
+  default: return new fuzz_do_rule(f, fuzz_path_fast_paths(path));
+  }
+}
+
+#endif
@@ -0,0 +1,83 @@
+/*
+ * A root holding hosts of devices, the map most tests are made with,
+ * and the rules of a single choose step over it.
+ */
+#ifndef CRUSH_TEST_HOSTS_H
+#define CRUSH_TEST_HOSTS_H
+
+#include <gtest/gtest.h>
+#include <functional>
+
+extern "C" {
+#include "crush/builder.h"
+#include "crush/hash.h"
+}
+
+// the weight of the device i of a host
+typedef std::function<int(int host, int i)> hosts_weight;
+
+static inline int hosts_unit_weight(int, int)
+{
+  return 0x10000;
+}
+
+// 1, 2, 3 and 4 in each host
+static inline int hosts_mixed_weight(int, int i)
+{
+  return 0x10000 * (1 + i % 4);
+}
+
+// a root of type host_type + 1 holding host_count buckets of type
+// host_type, the devices of the host h being [h * b_size, (h + 1) * b_size[.
+// All the buckets are of the algorithm alg and the devices of the
+// uniform buckets weigh 0x10000.
+static inline crush_map *build_hosts_map(int alg, int host_count, int b_size,
+                                         int host_type, int *rootno,
+                                         const hosts_weight &weight = hosts_unit_weight)
+{
+  crush_map *m = crush_create();
+  crush_bucket *root = crush_make_bucket(m, alg, CRUSH_HASH_DEFAULT, host_type + 1,
+                                         0, NULL, NULL);
+  EXPECT_EQ(0, crush_add_bucket(m, 0, root, rootno));
+  for (int host = 0; host < host_count; host++) {
+    int items[b_size];
+    int weights[b_size];
+    for (int i = 0; i < b_size; i++) {
+      items[i] = host * b_size + i;
+      weights[i] = alg == CRUSH_BUCKET_UNIFORM ? 0x10000 : weight(host, i);
+    }
+    crush_bucket *b = crush_make_bucket(m, alg, CRUSH_HASH_DEFAULT, host_type,
+                                        b_size, items, weights);
+    int bno = 0;
+    EXPECT_EQ(0, crush_add_bucket(m, 0, b, &bno));
+    if (alg == CRUSH_BUCKET_UNIFORM)
+      ((crush_bucket_uniform *)root)->item_weight = b->weight;
+    EXPECT_EQ(0, crush_bucket_add_item(m, root, bno, b->weight));
+  }
+  crush_finalize(m);
+  return m;
+}
+
+// take rootno, choose with op items of type and emit
+static inline int add_simple_rule(crush_map *m, int rootno, int op, int type)
+{
+  struct crush_rule *rule = crush_make_rule(3, 0, 0, 0, 0);
+  crush_rule_set_step(rule, 0, CRUSH_RULE_TAKE, rootno, 0);
+  crush_rule_set_step(rule, 1, op, 0, type);
+  crush_rule_set_step(rule, 2, CRUSH_RULE_EMIT, 0, 0);
+  return crush_add_rule(m, rule, -1);
+}
+
+// straw2 hosts of type 1 and a rule choosing a device in each host
+static inline crush_map *build_chooseleaf_map(int host_count, int b_size, int *ruleno,
+                                              const hosts_weight &weight = hosts_unit_weight)
+{
+  const int host_type = 1;
+  int rootno = 0;
+  crush_map *m = build_hosts_map(CRUSH_BUCKET_STRAW2, host_count, b_size,
+                                 host_type, &rootno, weight);
+  *ruleno = add_simple_rule(m, rootno, CRUSH_RULE_CHOOSELEAF_FIRSTN, host_type);
+  return m;
+}
+
+#endif
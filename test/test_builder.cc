@@ -1,8 +1,15 @@
+#include <errno.h>
+#include <math.h>
+
 #include <gtest/gtest.h>
+#include <vector>
 
 extern "C" {
 #include "crush/builder.h"
+#include "crush/hash.h"
+#include "crush/mapper.h"
 }
+#include "hosts.h"
 
 TEST(builder, crush_create) {
   crush_map *m = crush_create();
@@ -177,6 +184,755 @@ TEST(builder, crush_make_rule) {
   crush_destroy_rule(rule);
 }
 
+TEST(builder, crush_update_straw2_recips) {
+  std::vector<__u32> weights = { 0, 1, 2, 3, 7, 10, 0xffff, 0x10000, 0x10001,
+                                 0x12345, 0x7fffffff, 0x80000000, 0xfffffffe,
+                                 0xffffffff };
+  for (__u32 w = 5; w < 0x80000000u / 3; w = w * 3 + 1)
+    weights.push_back(w);
+  std::vector<crush_straw2_recip> recips(weights.size());
+  crush_update_straw2_recips(recips.data(), weights.data(), weights.size());
+
+  const __u64 max = 1ull << 48;
+  for (size_t i = 0; i < weights.size(); i++) {
+    __u32 w = weights[i];
+    ASSERT_EQ(w, recips[i].weight);
+    if (w == 0) {
+      ASSERT_EQ(0u, recips[i].magic);
+      continue;
+    }
+    std::vector<__u64> ns = { 0, 1, max - 1, max, w - 1ull, w, w + 1ull,
+                              (max / w) * w, (max / w) * w - 1 };
+    for (__u64 n = 12345; n < max; n = n * 5 + 3)
+      ns.push_back(n);
+    for (auto n : ns) {
+      if (n > max)
+        continue;
+      __u64 q = ((unsigned __int128)n * recips[i].magic) >> recips[i].shift;
+      ASSERT_EQ(n / w, q) << "n " << n << " weight " << w;
+    }
+  }
+
+  // the reciprocals of the item weights are maintained
+  crush_map *m = crush_create();
+  int items[3] = { 0, 1, 2 };
+  int item_weights[3] = { 0x10000, 0x20000, 0x30000 };
+  crush_bucket *b = crush_make_bucket(m, CRUSH_BUCKET_STRAW2, CRUSH_HASH_DEFAULT, 1,
+                                      3, items, item_weights);
+  int bno = 0;
+  ASSERT_EQ(0, crush_add_bucket(m, 0, b, &bno));
+  crush_bucket_straw2 *straw2 = (crush_bucket_straw2 *)b;
+  ASSERT_EQ(NULL, straw2->item_recips);
+  crush_finalize(m);
+  ASSERT_TRUE(straw2->item_recips != NULL);
+  for (int i = 0; i < 3; i++)
+    ASSERT_EQ(straw2->item_weights[i], straw2->item_recips[i].weight);
+  ASSERT_EQ(0x10000, crush_bucket_adjust_item_weight(m, b, 1, 0x30000));
+  ASSERT_EQ(0x30000u, straw2->item_recips[1].weight);
+
+  crush_choose_arg *choose_args = crush_make_choose_args(m, 2);
+  for (int position = 0; position < 2; position++) {
+    crush_weight_set *ws = &choose_args[-1-bno].weight_set[position];
+    for (int i = 0; i < 3; i++)
+      ASSERT_EQ(ws->weights[i], ws->recips[i].weight);
+  }
+  crush_destroy_choose_args(choose_args);
+
+  ASSERT_EQ(0, crush_bucket_add_item(m, b, 3, 0x10000));
+  ASSERT_EQ(NULL, straw2->item_recips);
+  crush_finalize(m);
+  ASSERT_EQ(0x10000u, straw2->item_recips[3].weight);
+  crush_destroy(m);
+}
+
+TEST(builder, crush_init_choose_args) {
+  crush_map *m = crush_create();
+  crush_bucket *root = crush_make_bucket(m, CRUSH_BUCKET_STRAW2, CRUSH_HASH_DEFAULT, 2,
+                                         0, NULL, NULL);
+  int rootno = 0;
+  ASSERT_EQ(0, crush_add_bucket(m, 0, root, &rootno));
+  const int host_count = 3;
+  const int host_size = 4;
+  int hosts[host_count];
+  for (int h = 0; h < host_count; h++) {
+    int items[host_size];
+    int weights[host_size];
+    for (int i = 0; i < host_size; i++) {
+      items[i] = h * host_size + i;
+      weights[i] = 0x10000 * (1 + i);
+    }
+    crush_bucket *b = crush_make_bucket(m, CRUSH_BUCKET_STRAW2, CRUSH_HASH_DEFAULT, 1,
+                                        host_size, items, weights);
+    ASSERT_EQ(0, crush_add_bucket(m, 0, b, &hosts[h]));
+    ASSERT_EQ(0, crush_bucket_add_item(m, root, hosts[h], b->weight));
+  }
+  crush_finalize(m);
+  crush_rule *rule = crush_make_rule(3, 0, 0, 0, 0);
+  crush_rule_set_step(rule, 0, CRUSH_RULE_TAKE, rootno, 0);
+  crush_rule_set_step(rule, 1, CRUSH_RULE_CHOOSELEAF_FIRSTN, 0, 1);
+  crush_rule_set_step(rule, 2, CRUSH_RULE_EMIT, 0, 0);
+  int ruleno = crush_add_rule(m, rule, -1);
+
+  const int num_positions = 2;
+  size_t size = crush_choose_args_size(m, num_positions);
+  crush_choose_arg *args = crush_make_choose_args(m, num_positions);
+  ASSERT_TRUE(args != NULL);
+
+  std::vector<__u64> arena((size + sizeof(__u64) - 1) / sizeof(__u64));
+  errno = 0;
+  ASSERT_EQ(NULL, crush_init_choose_args(m, num_positions, arena.data(), size - 1));
+  ASSERT_EQ(ENOSPC, errno);
+  errno = 0;
+  ASSERT_EQ(NULL, crush_init_choose_args(m, -1, arena.data(), size));
+  ASSERT_EQ(EINVAL, errno);
+  crush_choose_arg *pooled = crush_init_choose_args(m, num_positions, arena.data(), size);
+  ASSERT_EQ((void *)arena.data(), (void *)pooled);
+  const int ids_max = 8;
+  int ids[ids_max];
+  ASSERT_EQ(0, crush_diff_choose_args(m, args, pooled, ids, ids_max));
+
+  // update a single weight and a whole weight set in place
+  ASSERT_EQ(-EINVAL, crush_choose_args_set_weight(m, pooled, 1, 0, 0, 0));
+  ASSERT_EQ(-EINVAL, crush_choose_args_set_weight(m, pooled, hosts[0], num_positions, 0, 0));
+  ASSERT_EQ(-EINVAL, crush_choose_args_set_weight(m, pooled, hosts[0], 0, host_size, 0));
+  ASSERT_EQ(0, crush_choose_args_set_weight(m, pooled, hosts[1], 1, 2, 0x1234));
+  crush_weight_set *ws = &pooled[-1-hosts[1]].weight_set[1];
+  ASSERT_EQ(0x1234u, ws->weights[2]);
+  ASSERT_EQ(0x1234u, ws->recips[2].weight);
+  ASSERT_EQ(1, crush_diff_choose_args(m, args, pooled, ids, ids_max));
+  ASSERT_EQ(hosts[1], ids[0]);
+
+  __u32 weights[host_size] = { 0, 0x8000, 0x10000, 0x30000 };
+  ASSERT_EQ(-EINVAL, crush_choose_args_set_weights(m, pooled, -1-m->max_buckets, 0, weights));
+  ASSERT_EQ(0, crush_choose_args_set_weights(m, pooled, hosts[2], 0, weights));
+  ws = &pooled[-1-hosts[2]].weight_set[0];
+  std::vector<crush_straw2_recip> recips(host_size);
+  crush_update_straw2_recips(recips.data(), weights, host_size);
+  for (int i = 0; i < host_size; i++) {
+    ASSERT_EQ(weights[i], ws->weights[i]);
+    ASSERT_EQ(recips[i].magic, ws->recips[i].magic);
+    ASSERT_EQ(recips[i].shift, ws->recips[i].shift);
+  }
+  ASSERT_EQ(2, crush_diff_choose_args(m, args, pooled, ids, 1));
+  ASSERT_EQ(hosts[1], ids[0]);
+
+  // clone in another arena
+  std::vector<__u64> other((size + sizeof(__u64) - 1) / sizeof(__u64));
+  crush_choose_arg *clone = crush_init_choose_args(m, num_positions, other.data(), size);
+  ASSERT_EQ(0, crush_copy_choose_args(m, clone, pooled));
+  ASSERT_EQ(0, crush_diff_choose_args(m, clone, pooled, ids, ids_max));
+  const int result_max = 3;
+  char cwin[crush_work_size(m, result_max)];
+  crush_init_workspace(m, cwin);
+  std::vector<__u32> device_weights(host_count * host_size, 0x10000);
+  for (int x = 0; x < 100; x++) {
+    int expected[result_max], result[result_max];
+    int len = crush_do_rule(m, ruleno, x, expected, result_max,
+                            device_weights.data(), device_weights.size(), cwin, pooled);
+    ASSERT_EQ(len, crush_do_rule(m, ruleno, x, result, result_max,
+                                 device_weights.data(), device_weights.size(), cwin, clone));
+    for (int i = 0; i < len; i++)
+      ASSERT_EQ(expected[i], result[i]);
+  }
+
+  // copy back and reset
+  ASSERT_EQ(0, crush_copy_choose_args(m, pooled, args));
+  ASSERT_EQ(0, crush_diff_choose_args(m, args, pooled, ids, ids_max));
+  ASSERT_EQ(2, crush_diff_choose_args(m, args, clone, ids, ids_max));
+  crush_init_choose_args(m, num_positions, other.data(), size);
+  ASSERT_EQ(0, crush_diff_choose_args(m, args, clone, ids, ids_max));
+
+  // a different number of weight sets
+  crush_choose_arg *single = crush_make_choose_args(m, 1);
+  ASSERT_EQ(-EINVAL, crush_copy_choose_args(m, single, args));
+  ASSERT_EQ(host_count + 1, crush_diff_choose_args(m, args, single, ids, ids_max));
+  crush_destroy_choose_args(single);
+
+  crush_destroy_choose_args(args);
+  crush_destroy(m);
+}
+
+// the values crush_finalize() computes when it goes over the whole map
+static void expect_finalized(crush_map *m)
+{
+  int max_devices = 0;
+  for (int b = 0; b < m->max_buckets; b++) {
+    crush_bucket *bucket = m->buckets[b];
+    if (bucket == NULL)
+      continue;
+    for (__u32 i = 0; i < bucket->size; i++)
+      if (bucket->items[i] >= max_devices)
+        max_devices = bucket->items[i] + 1;
+    if (bucket->alg == CRUSH_BUCKET_STRAW2 && bucket->size > 0) {
+      crush_bucket_straw2 *straw2 = (crush_bucket_straw2 *)bucket;
+      ASSERT_TRUE(straw2->item_recips != NULL);
+      for (__u32 i = 0; i < bucket->size; i++)
+        ASSERT_EQ(straw2->item_weights[i], straw2->item_recips[i].weight);
+    }
+  }
+  ASSERT_EQ(max_devices, m->max_devices);
+  size_t working_size = m->working_size;
+  crush_calc_working_size(m);
+  ASSERT_EQ(m->working_size, working_size);
+  ASSERT_EQ(0, m->dirty_buckets_count);
+}
+
+TEST(builder, crush_finalize_incremental) {
+  crush_map *m = crush_create();
+  // the first crush_finalize() goes over the whole map
+  ASSERT_FALSE(m->changes_tracked);
+  crush_bucket *root = crush_make_bucket(m, CRUSH_BUCKET_STRAW2, CRUSH_HASH_DEFAULT,
+                                         2, 0, NULL, NULL);
+  int rootno;
+  ASSERT_EQ(0, crush_add_bucket(m, 0, root, &rootno));
+  crush_finalize(m);
+  ASSERT_TRUE(m->changes_tracked);
+  std::vector<crush_bucket *> hosts;
+  // tree buckets do not reliably survive random edits
+  const int algs[] = { CRUSH_BUCKET_UNIFORM, CRUSH_BUCKET_LIST,
+                       CRUSH_BUCKET_STRAW, CRUSH_BUCKET_STRAW2 };
+  int device = 0;
+  unsigned int seed = 7;
+  for (int edit = 0; edit < 2000; edit++) {
+    int op = rand_r(&seed) % 10;
+    if (hosts.empty() || op == 0) {
+      int alg = algs[rand_r(&seed) % 4];
+      int items[3] = { device, device + 1, device + 2 };
+      int weights[3] = { 0x10000, 0x10000, 0x10000 };
+      device += 3;
+      crush_bucket *b = crush_make_bucket(m, alg, CRUSH_HASH_DEFAULT, 1, 3,
+                                          items, weights);
+      int bno;
+      ASSERT_EQ(0, crush_add_bucket(m, 0, b, &bno));
+      ASSERT_EQ(0, crush_bucket_add_item(m, root, bno, b->weight));
+      hosts.push_back(b);
+    } else {
+      size_t h = rand_r(&seed) % hosts.size();
+      crush_bucket *b = hosts[h];
+      if (op == 1) {
+        // removing the last item of a bucket returns -ENOENT but removes it
+        __u32 size = root->size;
+        crush_bucket_remove_item(m, root, b->id);
+        ASSERT_EQ(size - 1, root->size);
+        ASSERT_EQ(0, crush_remove_bucket(m, b));
+        hosts.erase(hosts.begin() + h);
+      } else if (op < 5) {
+        // reuse ids of removed devices below the highest one
+        int item = rand_r(&seed) % 2 ? device++ : rand_r(&seed) % device;
+        // may fail with -ERANGE and leave the bucket unchanged
+        crush_bucket_add_item(m, b, item, 0x10000);
+      } else if (op < 8 && b->size > 1) {
+        // removing the last item reallocs to 0 bytes and may fail
+        int item = b->items[rand_r(&seed) % b->size];
+        __u32 size = b->size;
+        crush_bucket_remove_item(m, b, item);
+        ASSERT_EQ(size - 1, b->size);
+      } else if (b->size > 0 && b->alg != CRUSH_BUCKET_UNIFORM) {
+        int item = b->items[rand_r(&seed) % b->size];
+        crush_bucket_adjust_item_weight(m, b, item, 0x10000 * (1 + op));
+      }
+    }
+    // max_devices and working_size are up to date without crush_finalize()
+    if (rand_r(&seed) % 3)
+      continue;
+    crush_finalize(m);
+    expect_finalized(m);
+  }
+  crush_finalize(m);
+  expect_finalized(m);
+
+  // a tree bucket replaces the items it removes with 0
+  int items[4] = { 10 * device, 10 * device + 1, 10 * device + 2, 10 * device + 3 };
+  int weights[4] = { 0x10000, 0x10000, 0x10000, 0x10000 };
+  crush_bucket *tree = crush_make_bucket(m, CRUSH_BUCKET_TREE, CRUSH_HASH_DEFAULT,
+                                         1, 4, items, weights);
+  int treeno;
+  ASSERT_EQ(0, crush_add_bucket(m, 0, tree, &treeno));
+  ASSERT_EQ(items[3] + 1, m->max_devices);
+  ASSERT_EQ(0, crush_bucket_remove_item(m, tree, items[1]));
+  ASSERT_EQ(0, tree->items[1]);
+  ASSERT_EQ(items[3] + 1, m->max_devices);
+  ASSERT_EQ(0, crush_bucket_remove_item(m, tree, items[3]));
+  ASSERT_EQ(3u, tree->size);
+  ASSERT_EQ(items[2] + 1, m->max_devices);
+  crush_finalize(m);
+  expect_finalized(m);
+  ASSERT_EQ(0, crush_remove_bucket(m, tree));
+  crush_finalize(m);
+  expect_finalized(m);
+
+  // tracking may be restarted by going over the whole map
+  m->changes_tracked = 0;
+  crush_bucket_add_item(m, hosts[0], 10 * device, 0x10000);
+  crush_finalize(m);
+  ASSERT_TRUE(m->changes_tracked);
+  ASSERT_EQ(10 * device + 1, m->max_devices);
+  expect_finalized(m);
+  crush_destroy(m);
+}
+
+// decoders fill map->buckets without crush_add_bucket()
+TEST(builder, crush_finalize_buckets_set_directly) {
+  const int algs[] = { CRUSH_BUCKET_STRAW2, CRUSH_BUCKET_UNIFORM };
+  for (int alg : algs) {
+    crush_map *m = crush_create();
+    int items[3] = { 0, 1, 2 };
+    int weights[3] = { 0x10000, 0x10000, 0x10000 };
+    crush_bucket *b = crush_make_bucket(m, alg, CRUSH_HASH_DEFAULT, 1, 3,
+                                        items, weights);
+    b->id = -1;
+    m->buckets = (crush_bucket **)calloc(1, sizeof(*m->buckets));
+    m->buckets[0] = b;
+    m->max_buckets = 1;
+    crush_finalize(m);
+    ASSERT_EQ(3, m->max_devices);
+    expect_finalized(m);
+    int ruleno = add_simple_rule(m, b->id, CRUSH_RULE_CHOOSE_FIRSTN, 0);
+    ASSERT_LE(0, ruleno);
+
+    const int result_max = 3;
+    std::vector<char> cwin(crush_work_size(m, result_max));
+    crush_init_workspace(m, cwin.data());
+    __u32 device_weights[3] = { 0x10000, 0x10000, 0x10000 };
+    int result[result_max];
+    for (int x = 0; x < 100; x++)
+      ASSERT_EQ(3, crush_do_rule(m, ruleno, x, result, result_max,
+                                 device_weights, 3, cwin.data(), NULL));
+    crush_destroy(m);
+  }
+}
+
+// the weight of each bucket is the sum of the weights of its items
+static void expect_weights(crush_map *m)
+{
+  for (int b = 0; b < m->max_buckets; b++) {
+    crush_bucket *bucket = m->buckets[b];
+    if (bucket == NULL)
+      continue;
+    __u32 sum = 0;
+    for (__u32 i = 0; i < bucket->size; i++) {
+      __u32 weight = crush_get_bucket_item_weight(bucket, i);
+      sum += weight;
+      int item = bucket->items[i];
+      if (item < 0)
+        ASSERT_EQ(m->buckets[-1-item]->weight, weight);
+    }
+    ASSERT_EQ(sum, bucket->weight);
+  }
+}
+
+TEST(builder, crush_set_device_weight) {
+  crush_map *m = crush_create();
+  crush_bucket *root = crush_make_bucket(m, CRUSH_BUCKET_STRAW2, CRUSH_HASH_DEFAULT,
+                                         3, 0, NULL, NULL);
+  int rootno;
+  ASSERT_EQ(0, crush_add_bucket(m, 0, root, &rootno));
+  const int racks[] = { CRUSH_BUCKET_LIST, CRUSH_BUCKET_STRAW2 };
+  const int hosts[] = { CRUSH_BUCKET_UNIFORM, CRUSH_BUCKET_LIST, CRUSH_BUCKET_TREE,
+                        CRUSH_BUCKET_STRAW, CRUSH_BUCKET_STRAW2 };
+  int device = 0;
+  for (int rack_alg : racks) {
+    crush_bucket *rack = crush_make_bucket(m, rack_alg, CRUSH_HASH_DEFAULT,
+                                           2, 0, NULL, NULL);
+    int rackno;
+    ASSERT_EQ(0, crush_add_bucket(m, 0, rack, &rackno));
+    for (int host_alg : hosts) {
+      int items[4], weights[4];
+      for (int i = 0; i < 4; i++) {
+        items[i] = device++;
+        weights[i] = 0x10000;
+      }
+      crush_bucket *host = crush_make_bucket(m, host_alg, CRUSH_HASH_DEFAULT,
+                                             1, 4, items, weights);
+      int hostno;
+      ASSERT_EQ(0, crush_add_bucket(m, 0, host, &hostno));
+      ASSERT_EQ(0, crush_bucket_add_item(m, rack, hostno, host->weight));
+      ASSERT_EQ(rackno, crush_get_parent(m, hostno, NULL));
+    }
+    ASSERT_EQ(0, crush_bucket_add_item(m, root, rackno, rack->weight));
+  }
+  crush_finalize(m);
+  expect_weights(m);
+
+  for (int d = 0; d < device; d++) {
+    int pos = -1;
+    int parent = crush_get_parent(m, d, &pos);
+    ASSERT_GT(0, parent);
+    ASSERT_EQ(d, m->buckets[-1-parent]->items[pos]);
+  }
+  ASSERT_EQ(0, crush_get_parent(m, rootno, NULL));
+  ASSERT_EQ(0, crush_get_parent(m, device, NULL));
+
+  for (int d = 0; d < device; d++) {
+    ASSERT_EQ(0, crush_set_device_weight(m, d, 0x10000 * (1 + d % 4)));
+    expect_weights(m);
+  }
+  ASSERT_EQ(-ENOENT, crush_set_device_weight(m, device, 0x10000));
+  ASSERT_EQ(-EINVAL, crush_set_device_weight(m, -1, 0x10000));
+  ASSERT_EQ(-ERANGE, crush_set_device_weight(m, 1, 0x7fffffff));
+
+  // the positions follow the items that are moved by a removal
+  crush_bucket *host = m->buckets[-1-crush_get_parent(m, 5, NULL)];
+  ASSERT_EQ(0, crush_bucket_remove_item(m, host, 5));
+  ASSERT_EQ(0, crush_get_parent(m, 5, NULL));
+  for (__u32 i = 0; i < host->size; i++) {
+    int pos = -1;
+    ASSERT_EQ(host->id, crush_get_parent(m, host->items[i], &pos));
+    ASSERT_EQ((int)i, pos);
+  }
+  ASSERT_EQ(0, crush_reweight_bucket(m, root));
+
+  // a device in two buckets is reweighted in both
+  crush_bucket *other = m->buckets[-1-crush_get_parent(m, 9, NULL)];
+  ASSERT_EQ(0, crush_bucket_add_item(m, host, 9, 0x10000));
+  ASSERT_EQ(0, crush_reweight_bucket(m, root));
+  ASSERT_EQ(0, crush_set_device_weight(m, 9, 0x30000));
+  expect_weights(m);
+  int pos;
+  ASSERT_EQ(host->id, crush_get_parent(m, 9, &pos));
+  ASSERT_EQ(0x30000, crush_get_bucket_item_weight(host, pos));
+  ASSERT_EQ(0, crush_bucket_remove_item(m, host, 9));
+  ASSERT_EQ(other->id, crush_get_parent(m, 9, &pos));
+  ASSERT_EQ(9, other->items[pos]);
+  ASSERT_EQ(0, crush_reweight_bucket(m, root));
+
+  // the same without tracking
+  m->changes_tracked = 0;
+  for (int d = 0; d < device; d++) {
+    if (d == 5)
+      continue;
+    ASSERT_EQ(0, crush_set_device_weight(m, d, 0x20000));
+    expect_weights(m);
+  }
+  ASSERT_EQ(0, crush_get_parent(m, 5, NULL));
+  crush_destroy(m);
+}
+
+TEST(builder, crush_flatten) {
+  crush_map *m = crush_create();
+  const int host_type = 1;
+  crush_bucket *root = crush_make_bucket(m, CRUSH_BUCKET_STRAW2, CRUSH_HASH_DEFAULT,
+                                         host_type + 1, 0, NULL, NULL);
+  int rootno = 0;
+  ASSERT_EQ(0, crush_add_bucket(m, 0, root, &rootno));
+  const int b_size = 6;
+  int device = 0;
+  for (int alg : { CRUSH_BUCKET_UNIFORM, CRUSH_BUCKET_LIST, CRUSH_BUCKET_TREE,
+                   CRUSH_BUCKET_STRAW, CRUSH_BUCKET_STRAW2 }) {
+    int items[b_size];
+    int weights[b_size];
+    for (int i = 0; i < b_size; i++) {
+      items[i] = device++;
+      weights[i] = alg == CRUSH_BUCKET_UNIFORM ? 0x10000 : 0x10000 * (1 + i % 3);
+    }
+    crush_bucket *b = crush_make_bucket(m, alg, CRUSH_HASH_DEFAULT, host_type,
+                                        b_size, items, weights);
+    ASSERT_TRUE(b != NULL);
+    int bno = 0;
+    ASSERT_EQ(0, crush_add_bucket(m, 0, b, &bno));
+    ASSERT_EQ(0, crush_bucket_add_item(m, root, bno, b->weight));
+  }
+  crush_finalize(m);
+  std::vector<int> rules;
+  for (int op : { CRUSH_RULE_CHOOSELEAF_FIRSTN, CRUSH_RULE_CHOOSELEAF_INDEP }) {
+    struct crush_rule *rule = crush_make_rule(3, 0, 0, 0, 0);
+    crush_rule_set_step(rule, 0, CRUSH_RULE_TAKE, rootno, 0);
+    crush_rule_set_step(rule, 1, op, 0, host_type);
+    crush_rule_set_step(rule, 2, CRUSH_RULE_EMIT, 0, 0);
+    rules.push_back(crush_add_rule(m, rule, -1));
+  }
+
+  crush_map *flat = crush_flatten(m);
+  ASSERT_TRUE(flat != NULL);
+  ASSERT_EQ(flat, flat->arena);
+  ASSERT_EQ(m->max_buckets, flat->max_buckets);
+  ASSERT_EQ(m->max_rules, flat->max_rules);
+  ASSERT_EQ(m->working_size, flat->working_size);
+  // the root is laid out before its children, themselves in order
+  char *previous = (char *)flat;
+  for (int b = 0; b < m->max_buckets; b++) {
+    if (m->buckets[b] == NULL) {
+      ASSERT_EQ(NULL, flat->buckets[b]);
+      continue;
+    }
+    ASSERT_LT(previous, (char *)flat->buckets[b]);
+    previous = (char *)flat->buckets[b];
+    ASSERT_LT(previous, (char *)flat->buckets[b]->items);
+    ASSERT_EQ(m->buckets[b]->id, flat->buckets[b]->id);
+    ASSERT_EQ(m->buckets[b]->size, flat->buckets[b]->size);
+    for (__u32 i = 0; i < m->buckets[b]->size; i++) {
+      ASSERT_EQ(m->buckets[b]->items[i], flat->buckets[b]->items[i]);
+      ASSERT_EQ(crush_get_bucket_item_weight(m->buckets[b], i),
+                crush_get_bucket_item_weight(flat->buckets[b], i));
+    }
+  }
+
+  const int device_count = device;
+  std::vector<__u32> weights(device_count, 0x10000);
+  weights[3] = 0;
+  const int result_max = 3;
+  int cwin_size = crush_work_size(m, result_max);
+  ASSERT_EQ(cwin_size, (int)crush_work_size(flat, result_max));
+  char cwin[cwin_size];
+  char flat_cwin[cwin_size];
+  crush_init_workspace(m, cwin);
+  crush_init_workspace(flat, flat_cwin);
+  for (int ruleno : rules) {
+    for (int x = 0; x < 1000; x++) {
+      int expected[result_max], result[result_max];
+      int len = crush_do_rule(m, ruleno, x, expected, result_max,
+                              weights.data(), device_count, cwin, NULL);
+      ASSERT_EQ(len, crush_do_rule(flat, ruleno, x, result, result_max,
+                                   weights.data(), device_count, flat_cwin, NULL));
+      for (int i = 0; i < len; i++)
+        ASSERT_EQ(expected[i], result[i]);
+    }
+  }
+
+  // the copy does not depend on the map
+  crush_destroy(m);
+  int result[result_max];
+  ASSERT_LT(0, crush_do_rule(flat, rules[0], 1, result, result_max,
+                             weights.data(), device_count, flat_cwin, NULL));
+  crush_destroy(flat);
+}
+
+// the straws computed by the insertion sort of the original crush_calc_straw()
+static std::vector<__u32> reference_straws(int straw_calc_version,
+                                           const __u32 *weights, int size)
+{
+  std::vector<__u32> straws(size);
+  std::vector<int> reverse(size);
+  if (size)
+    reverse[0] = 0;
+  for (int i = 1; i < size; i++) {
+    int j;
+    for (j = 0; j < i; j++)
+      if (weights[i] < weights[reverse[j]]) {
+        for (int k = i; k > j; k--)
+          reverse[k] = reverse[k-1];
+        reverse[j] = i;
+        break;
+      }
+    if (j == i)
+      reverse[i] = i;
+  }
+  int numleft = size;
+  double straw = 1.0, wbelow = 0, lastw = 0, wnext, pbelow;
+  int i = 0;
+  while (i < size) {
+    if (weights[reverse[i]] == 0) {
+      straws[reverse[i]] = 0;
+      i++;
+      if (straw_calc_version >= 1)
+        numleft--;
+      continue;
+    }
+    straws[reverse[i]] = straw * 0x10000;
+    i++;
+    if (i == size)
+      break;
+    if (straw_calc_version == 0) {
+      if (weights[reverse[i]] == weights[reverse[i-1]])
+        continue;
+      wbelow += ((double)weights[reverse[i-1]] - lastw) * numleft;
+      for (int j = i; j < size; j++)
+        if (weights[reverse[j]] == weights[reverse[i]])
+          numleft--;
+        else
+          break;
+    } else {
+      wbelow += ((double)weights[reverse[i-1]] - lastw) * numleft;
+      numleft--;
+    }
+    wnext = numleft * (weights[reverse[i]] - weights[reverse[i-1]]);
+    pbelow = wbelow / (wbelow + wnext);
+    straw *= pow((double)1.0 / pbelow, (double)1.0 / (double)numleft);
+    lastw = weights[reverse[i-1]];
+  }
+  return straws;
+}
+
+static void expect_reference_straws(const crush_map *m,
+                                    const crush_bucket_straw *straw)
+{
+  std::vector<__u32> expected = reference_straws(m->straw_calc_version,
+                                                 straw->item_weights,
+                                                 straw->h.size);
+  for (__u32 i = 0; i < straw->h.size; i++)
+    ASSERT_EQ(expected[i], straw->straws[i]) << "item " << i;
+}
+
+TEST(builder, crush_calc_straw) {
+  for (int version = 0; version <= 1; version++) {
+    crush_map *m = crush_create();
+    m->straw_calc_version = version;
+    const int size = 200;
+    std::vector<int> items(size), weights(size);
+    unsigned seed = 17;
+    for (int i = 0; i < size; i++) {
+      items[i] = i;
+      seed = seed * 1103515245 + 12345;
+      // duplicates and zeros
+      weights[i] = (seed >> 16) % 9 * 0x8000;
+    }
+    crush_bucket_straw *straw = crush_make_straw_bucket(m, CRUSH_HASH_DEFAULT, 1, size / 2,
+                                                        items.data(), weights.data());
+    ASSERT_TRUE(straw != NULL);
+    expect_reference_straws(m, straw);
+
+    // the order is updated in linear time, the straws are the same
+    crush_bucket *b = &straw->h;
+    for (int i = size / 2; i < size; i++) {
+      ASSERT_EQ(0, crush_bucket_add_item(m, b, items[i], weights[i]));
+      expect_reference_straws(m, straw);
+    }
+    for (int i = 0; i < size; i += 3) {
+      seed = seed * 1103515245 + 12345;
+      int weight = (seed >> 16) % 9 * 0x8000;
+      ASSERT_EQ(weight - weights[i], crush_bucket_adjust_item_weight(m, b, items[i], weight));
+      weights[i] = weight;
+      expect_reference_straws(m, straw);
+    }
+    // the order sorted for another bucket is not used
+    crush_bucket_straw *other = crush_make_straw_bucket(m, CRUSH_HASH_DEFAULT, 1, 10,
+                                                        items.data(), weights.data());
+    straw->item_weights[5] += 0x10000;
+    straw->item_weights[7] = 0;
+    ASSERT_EQ(0, crush_calc_straw_item(m, straw, 5));
+    expect_reference_straws(m, straw);
+    // the weights of two items were modified but only one is given
+    straw->item_weights[5] -= 0x8000;
+    straw->item_weights[9] += 0x8000;
+    ASSERT_EQ(0, crush_calc_straw_item(m, straw, 9));
+    expect_reference_straws(m, straw);
+    ASSERT_EQ(-EINVAL, crush_calc_straw_item(m, straw, size));
+    ASSERT_EQ(0, crush_bucket_remove_item(m, b, items[0]));
+    expect_reference_straws(m, straw);
+
+    crush_destroy_bucket(&other->h);
+    crush_destroy_bucket(b);
+    crush_destroy(m);
+  }
+}
+
+// the hierarchy of build_hosts_map(), one host per algorithm, with items
+// added one by one
+static int build_hosts(crush_map *m, int host_type, int b_size)
+{
+  crush_bucket *root = crush_make_bucket(m, CRUSH_BUCKET_STRAW2, CRUSH_HASH_DEFAULT,
+                                         host_type + 1, 0, NULL, NULL);
+  int rootno = 0;
+  EXPECT_EQ(0, crush_add_bucket(m, 0, root, &rootno));
+  int device = 0;
+  for (int alg : { CRUSH_BUCKET_UNIFORM, CRUSH_BUCKET_LIST, CRUSH_BUCKET_TREE,
+                   CRUSH_BUCKET_STRAW, CRUSH_BUCKET_STRAW2 }) {
+    // the uniform buckets get the weight of their items from the first
+    int first[] = { device };
+    int first_weight[] = { 0x10000 };
+    crush_bucket *b = crush_make_bucket(m, alg, CRUSH_HASH_DEFAULT, host_type,
+                                        1, first, first_weight);
+    EXPECT_TRUE(b != NULL);
+    // one device more than kept, removed once added
+    for (int i = 1; i <= b_size; i++) {
+      int weight = alg == CRUSH_BUCKET_UNIFORM ? 0x10000 : 0x10000 * (1 + i % 3);
+      EXPECT_EQ(0, crush_bucket_add_item(m, b, device + i, weight));
+    }
+    EXPECT_EQ(0, crush_bucket_remove_item(m, b, device + b_size / 2));
+    device += b_size + 1;
+    int bno = 0;
+    EXPECT_EQ(0, crush_add_bucket(m, 0, b, &bno));
+    EXPECT_EQ(0, crush_bucket_add_item(m, root, bno, b->weight));
+  }
+  crush_finalize(m);
+  EXPECT_EQ(0, add_simple_rule(m, rootno, CRUSH_RULE_CHOOSELEAF_FIRSTN, host_type));
+  return device;
+}
+
+TEST(builder, crush_create_arena) {
+  const int host_type = 1;
+  const int b_size = 40;
+  crush_map *m = crush_create();
+  const int device_count = build_hosts(m, host_type, b_size);
+  ASSERT_EQ(0u, crush_arena_size(m));
+
+  errno = 0;
+  alignas(16) static char memory[1 << 12];
+  ASSERT_EQ(NULL, crush_create_arena(memory, 16));
+  ASSERT_EQ(EINVAL, errno);
+  errno = 0;
+  ASSERT_EQ(NULL, crush_create_arena(memory + 1, sizeof(memory) - 1));
+  ASSERT_EQ(EINVAL, errno);
+
+  // the arena grows out of the memory given
+  crush_map *in_memory = crush_create_arena(memory, sizeof(memory));
+  ASSERT_TRUE(in_memory != NULL);
+  ASSERT_LE((char *)memory, (char *)in_memory);
+  ASSERT_GT((char *)memory + sizeof(memory), (char *)in_memory);
+  size_t empty_size = crush_arena_size(in_memory);
+  ASSERT_LT(0u, empty_size);
+  ASSERT_EQ(device_count, build_hosts(in_memory, host_type, b_size));
+  ASSERT_LT(sizeof(memory), crush_arena_size(in_memory));
+
+  crush_map *arena = crush_create_arena(NULL, 0);
+  ASSERT_TRUE(arena != NULL);
+  ASSERT_EQ(device_count, build_hosts(arena, host_type, b_size));
+  ASSERT_LT(empty_size, crush_arena_size(arena));
+
+  std::vector<__u32> weights(device_count, 0x10000);
+  weights[3] = 0;
+  const int result_max = 3;
+  for (crush_map *other : { in_memory, arena }) {
+    ASSERT_EQ(m->max_buckets, other->max_buckets);
+    for (int b = 0; b < m->max_buckets; b++) {
+      if (m->buckets[b] == NULL) {
+        ASSERT_EQ(NULL, other->buckets[b]);
+        continue;
+      }
+      ASSERT_EQ(m->buckets[b]->size, other->buckets[b]->size);
+      ASSERT_EQ(m->buckets[b]->weight, other->buckets[b]->weight);
+      for (__u32 i = 0; i < m->buckets[b]->size; i++) {
+        ASSERT_EQ(m->buckets[b]->items[i], other->buckets[b]->items[i]);
+        ASSERT_EQ(crush_get_bucket_item_weight(m->buckets[b], i),
+                  crush_get_bucket_item_weight(other->buckets[b], i));
+      }
+    }
+    std::vector<char> cwin(crush_work_size(m, result_max));
+    std::vector<char> other_cwin(crush_work_size(other, result_max));
+    crush_init_workspace(m, cwin.data());
+    crush_init_workspace(other, other_cwin.data());
+    for (int x = 0; x < 1000; x++) {
+      int expected[result_max], result[result_max];
+      int len = crush_do_rule(m, 0, x, expected, result_max,
+                              weights.data(), device_count, cwin.data(), NULL);
+      ASSERT_EQ(len, crush_do_rule(other, 0, x, result, result_max,
+                                   weights.data(), device_count,
+                                   other_cwin.data(), NULL));
+      for (int i = 0; i < len; i++)
+        ASSERT_EQ(expected[i], result[i]);
+    }
+  }
+
+  // buckets removed stay in the arena, buckets made for no map are
+  // deallocated with it
+  int items[] = { device_count };
+  int item_weights[] = { 0x10000 };
+  crush_bucket *foreign = crush_make_bucket(NULL, CRUSH_BUCKET_STRAW2,
+                                            CRUSH_HASH_DEFAULT, host_type,
+                                            1, items, item_weights);
+  int foreignno = 0;
+  ASSERT_EQ(0, crush_add_bucket(arena, 0, foreign, &foreignno));
+  ASSERT_EQ(0, crush_bucket_add_item(arena, foreign, device_count + 1, 0x10000));
+  size_t size = crush_arena_size(arena);
+  ASSERT_EQ(0, crush_remove_bucket(arena, arena->buckets[1]));
+  ASSERT_EQ(NULL, arena->buckets[1]);
+  ASSERT_EQ(size, crush_arena_size(arena));
+
+  crush_destroy(m);
+  crush_destroy(in_memory);
+  crush_destroy(arena);
+}
+
 // Local Variables:
 // compile-command: "cd ../build ; make unittest_builder && valgrind --tool=memcheck test/unittest_builder"
 // End:
@@ -0,0 +1,158 @@
+#include <errno.h>
+
+#include <gtest/gtest.h>
+#include <vector>
+
+extern "C" {
+#include "crush/builder.h"
+#include "crush/cache.h"
+#include "crush/hash.h"
+#include "crush/mapper.h"
+#include "crush/parallel.h"
+}
+#include "hosts.h"
+
+static const int host_type = 1;
+static const int result_max = 3;
+
+static crush_map *build_map(int *ruleno)
+{
+  return build_chooseleaf_map(8, 4, ruleno);
+}
+
+static void expect_mapping(crush_map *m, int ruleno, int x,
+                           const std::vector<__u32> &weights, void *cwin,
+                           const int *result, int len)
+{
+  int expected[result_max];
+  ASSERT_EQ(crush_do_rule(m, ruleno, x, expected, result_max,
+                          weights.data(), weights.size(), cwin, NULL), len);
+  for (int i = 0; i < len; i++)
+    ASSERT_EQ(expected[i], result[i]);
+}
+
+TEST(cache, crush_cache_do_rule) {
+  int ruleno;
+  crush_map *m = build_map(&ruleno);
+  std::vector<__u32> weights(32, 0x10000);
+  std::vector<__u32> other_weights(32, 0x10000);
+  for (int i = 0; i < 32; i += 3)
+    other_weights[i] = 0;
+  char cwin[crush_work_size(m, result_max)];
+  crush_init_workspace(m, cwin);
+
+  errno = 0;
+  ASSERT_EQ(NULL, crush_cache_create(0, 1 << 20));
+  ASSERT_EQ(EINVAL, errno);
+  ASSERT_EQ(NULL, crush_cache_create(result_max, 16));
+  ASSERT_EQ(EINVAL, errno);
+
+  crush_cache *cache = crush_cache_create(result_max, 16 << 10);
+  ASSERT_TRUE(cache != NULL);
+  for (int round = 0; round < 3; round++) {
+    for (int x = 0; x < 1000; x++) {
+      int result[result_max];
+      int len = crush_cache_do_rule(cache, m, ruleno, x, result, result_max, 1,
+                                    weights.data(), weights.size(), cwin, NULL);
+      expect_mapping(m, ruleno, x, weights, cwin, result, len);
+      // another generation of the weights is not mixed up with the first
+      len = crush_cache_do_rule(cache, m, ruleno, x, result, result_max, 2,
+                                other_weights.data(), other_weights.size(),
+                                cwin, NULL);
+      expect_mapping(m, ruleno, x, other_weights, cwin, result, len);
+    }
+  }
+
+  // the results of the former map are forgotten
+  int x = 42;
+  int result[result_max];
+  crush_cache_do_rule(cache, m, ruleno, x, result, result_max, 1,
+                      weights.data(), weights.size(), cwin, NULL);
+  crush_map *edited = build_map(&ruleno);
+  for (int d = 0; d < 32; d++)
+    if (d != result[0])
+      crush_set_device_weight(edited, d, 0x100);
+  crush_finalize(edited);
+  char edited_cwin[crush_work_size(edited, result_max)];
+  crush_init_workspace(edited, edited_cwin);
+  int stale[result_max];
+  ASSERT_EQ(result_max,
+            crush_cache_do_rule(cache, edited, ruleno, x, stale, result_max, 1,
+                                weights.data(), weights.size(), edited_cwin, NULL));
+  for (int i = 0; i < result_max; i++)
+    ASSERT_EQ(result[i], stale[i]);
+  crush_cache_invalidate(cache);
+  int len = crush_cache_do_rule(cache, edited, ruleno, x, result, result_max, 1,
+                                weights.data(), weights.size(), edited_cwin, NULL);
+  expect_mapping(edited, ruleno, x, weights, edited_cwin, result, len);
+
+  // larger results are not cached
+  int large[result_max + 1];
+  char large_cwin[crush_work_size(m, result_max + 1)];
+  crush_init_workspace(m, large_cwin);
+  len = crush_cache_do_rule(cache, m, ruleno, x, large, result_max + 1, 1,
+                            weights.data(), weights.size(), large_cwin, NULL);
+  ASSERT_EQ(result_max + 1, len);
+
+  crush_cache_destroy(cache);
+  crush_destroy(edited);
+  crush_destroy(m);
+}
+
+struct shared {
+  crush_map *m;
+  int ruleno;
+  crush_cache *cache;
+  std::vector<__u32> weights;
+  std::vector<std::vector<char> > cwin;
+  std::vector<int> expected;
+  std::vector<int> errors;
+};
+
+static void lookup(void *arg, int worker, int begin, int end)
+{
+  shared *s = (shared *)arg;
+  for (int i = begin; i < end; i++) {
+    // many threads on few values and few entries
+    int x = i % 512;
+    int result[result_max];
+    int len = crush_cache_do_rule(s->cache, s->m, s->ruleno, x, result,
+                                  result_max, 7, s->weights.data(),
+                                  s->weights.size(), s->cwin[worker].data(),
+                                  NULL);
+    if (len != result_max)
+      s->errors[worker]++;
+    for (int j = 0; j < len; j++)
+      if (result[j] != s->expected[x * result_max + j])
+        s->errors[worker]++;
+  }
+}
+
+TEST(cache, concurrent) {
+  shared s;
+  s.m = build_map(&s.ruleno);
+  s.weights.resize(32, 0x10000);
+  s.cache = crush_cache_create(result_max, 4 << 10);
+  ASSERT_TRUE(s.cache != NULL);
+  const int nthreads = 8;
+  s.cwin.resize(nthreads);
+  for (int i = 0; i < nthreads; i++) {
+    s.cwin[i].resize(crush_work_size(s.m, result_max));
+    crush_init_workspace(s.m, s.cwin[i].data());
+  }
+  s.expected.resize(512 * result_max);
+  for (int x = 0; x < 512; x++)
+    ASSERT_EQ(result_max, crush_do_rule(s.m, s.ruleno, x, &s.expected[x * result_max],
+                                        result_max, s.weights.data(), s.weights.size(),
+                                        s.cwin[0].data(), NULL));
+  s.errors.resize(nthreads, 0);
+  ASSERT_EQ(nthreads, crush_parallel_run(0, 400000, 64, nthreads, lookup, &s));
+  for (int i = 0; i < nthreads; i++)
+    ASSERT_EQ(0, s.errors[i]);
+  crush_cache_destroy(s.cache);
+  crush_destroy(s.m);
+}
+
+// Local Variables:
+// compile-command: "cd ../build ; make unittest_cache && valgrind --tool=memcheck test/unittest_cache"
+// End:
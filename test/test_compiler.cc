@@ -0,0 +1,424 @@
+#include <gtest/gtest.h>
+#include <errno.h>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include "crush/builder.h"
+#include "crush/compiler.h"
+#include "crush/hash.h"
+#include "crush/mapper.h"
+}
+
+// crush/sample.txt
+static const char *sample =
+  "# devices\n"
+  "device 1 osd001\n"
+  "device 2 osd002\n"
+  "device 3 osd003 down   # same as offload 1.0\n"
+  "device 4 osd004 offload 0       # 0.0 -> normal, 1.0 -> failed\n"
+  "device 5 osd005 offload 0.1\n"
+  "device 6 osd006 offload 0.1\n"
+  "\n"
+  "# hierarchy\n"
+  "type 0 osd   # 'device' is actually the default for 0\n"
+  "type 2 cab\n"
+  "type 3 row\n"
+  "type 10 pool\n"
+  "\n"
+  "cab root {\n"
+  "       id -1         # optional\n"
+  "       alg tree     # required\n"
+  "       item osd001\n"
+  "       item osd002 weight 600 pos 1\n"
+  "       item osd003 weight 600 pos 0\n"
+  "       item osd004 weight 600 pos 3\n"
+  "       item osd005 weight 600 pos 4\n"
+  "}\n"
+  "\n"
+  "# rules\n"
+  "rule normal {\n"
+  "     # these are required.\n"
+  "     pool 0\n"
+  "     type replicated \n"
+  "     min_size 1\n"
+  "     max_size 4\n"
+  "     # need 1 or more of these.\n"
+  "     step take root\n"
+  "     step choose firstn 0 type osd\n"
+  "     step emit\n"
+  "}\n"
+  "\n"
+  "rule {\n"
+  "     pool 1\n"
+  "     type erasure\n"
+  "     min_size 3\n"
+  "     max_size 6\n"
+  "     step take root\n"
+  "     step choose indep 0 type osd\n"
+  "     step emit\n"
+  "}\n";
+
+static crush_text *compile(const std::string &text)
+{
+  char error[256];
+  crush_text *t = crush_compile(text.c_str(), text.size(), error, sizeof(error));
+  EXPECT_TRUE(t != NULL) << error;
+  return t;
+}
+
+static std::string decompile(const crush_text *t)
+{
+  char *buf;
+  size_t len;
+  EXPECT_EQ(0, crush_decompile(t, &buf, &len));
+  std::string text(buf, len);
+  EXPECT_EQ(strlen(buf), len);
+  free(buf);
+  return text;
+}
+
+static void expect_same_mappings(const crush_map *a, const crush_map *b,
+                                 const __u32 *weights, int weight_max)
+{
+  ASSERT_EQ(a->max_rules, b->max_rules);
+  const int result_max = 4;
+  std::vector<char> a_cwin(crush_work_size(a, result_max));
+  std::vector<char> b_cwin(crush_work_size(b, result_max));
+  crush_init_workspace(a, a_cwin.data());
+  crush_init_workspace(b, b_cwin.data());
+  for (__u32 ruleno = 0; ruleno < a->max_rules; ruleno++) {
+    if (a->rules[ruleno] == NULL)
+      continue;
+    for (int x = 0; x < 500; x++) {
+      int a_result[result_max], b_result[result_max];
+      int len = crush_do_rule(a, ruleno, x, a_result, result_max,
+                              weights, weight_max, a_cwin.data(), NULL);
+      ASSERT_EQ(len, crush_do_rule(b, ruleno, x, b_result, result_max,
+                                   weights, weight_max, b_cwin.data(), NULL));
+      for (int i = 0; i < len; i++)
+        ASSERT_EQ(a_result[i], b_result[i]);
+    }
+  }
+}
+
+TEST(compiler, sample) {
+  crush_text *t = compile(sample);
+  ASSERT_TRUE(t != NULL);
+  crush_map *m = t->map;
+
+  ASSERT_EQ(7, t->max_devices);
+  ASSERT_EQ(NULL, t->device_names[0]);
+  ASSERT_STREQ("osd001", t->device_names[1]);
+  ASSERT_EQ(0x10000u, t->device_weights[1]);
+  ASSERT_EQ(0u, t->device_weights[3]);
+  ASSERT_EQ(0x10000u, t->device_weights[4]);
+  ASSERT_EQ(0x10000u - 6554u, t->device_weights[5]);
+  ASSERT_STREQ("osd006", t->device_names[6]);
+
+  ASSERT_EQ(11, t->max_types);
+  ASSERT_STREQ("osd", t->type_names[0]);
+  ASSERT_EQ(NULL, t->type_names[1]);
+  ASSERT_STREQ("pool", t->type_names[10]);
+
+  crush_bucket *root = m->buckets[0];
+  ASSERT_EQ(-1, root->id);
+  ASSERT_STREQ("root", t->bucket_names[0]);
+  ASSERT_EQ(CRUSH_BUCKET_TREE, root->alg);
+  ASSERT_EQ(2, root->type);
+  ASSERT_EQ(5u, root->size);
+  const int items[] = { 3, 2, 1, 4, 5 };
+  const int weights[] = { 600, 600, 1, 600, 600 };
+  for (int i = 0; i < 5; i++) {
+    ASSERT_EQ(items[i], root->items[i]);
+    ASSERT_EQ(weights[i] * 0x10000, crush_get_bucket_item_weight(root, i));
+  }
+  ASSERT_EQ(2401u * 0x10000, root->weight);
+
+  ASSERT_EQ(2u, m->max_rules);
+  ASSERT_STREQ("normal", t->rule_names[0]);
+  ASSERT_EQ(NULL, t->rule_names[1]);
+  crush_rule *rule = m->rules[0];
+  ASSERT_EQ(0, rule->mask.ruleset);
+  ASSERT_EQ(1, rule->mask.type);
+  ASSERT_EQ(1, rule->mask.min_size);
+  ASSERT_EQ(4, rule->mask.max_size);
+  ASSERT_EQ(3u, rule->len);
+  ASSERT_EQ((__u32)CRUSH_RULE_TAKE, rule->steps[0].op);
+  ASSERT_EQ(-1, rule->steps[0].arg1);
+  ASSERT_EQ((__u32)CRUSH_RULE_CHOOSE_FIRSTN, rule->steps[1].op);
+  ASSERT_EQ(0, rule->steps[1].arg1);
+  ASSERT_EQ(0, rule->steps[1].arg2);
+  ASSERT_EQ((__u32)CRUSH_RULE_EMIT, rule->steps[2].op);
+  rule = m->rules[1];
+  ASSERT_EQ(1, rule->mask.ruleset);
+  ASSERT_EQ(3, rule->mask.type);
+  ASSERT_EQ((__u32)CRUSH_RULE_CHOOSE_INDEP, rule->steps[1].op);
+
+  // the down device is never mapped
+  std::vector<char> cwin(crush_work_size(m, 3));
+  crush_init_workspace(m, cwin.data());
+  for (int x = 0; x < 100; x++) {
+    int result[3];
+    int len = crush_do_rule(m, 0, x, result, 3, t->device_weights,
+                            t->max_devices, cwin.data(), NULL);
+    ASSERT_LE(2, len);
+    for (int i = 0; i < len; i++)
+      ASSERT_NE(3, result[i]);
+  }
+
+  // the text of the decompiled map compiles into the same map
+  std::string text = decompile(t);
+  crush_text *again = compile(text);
+  ASSERT_TRUE(again != NULL);
+  ASSERT_EQ(text, decompile(again));
+  ASSERT_EQ(0, memcmp(t->device_weights, again->device_weights,
+                      sizeof(__u32) * t->max_devices));
+  expect_same_mappings(m, again->map, t->device_weights, t->max_devices);
+  crush_destroy_text(again);
+
+  // the map can be kept
+  t->map = NULL;
+  crush_destroy_text(t);
+  crush_destroy(m);
+}
+
+TEST(compiler, defaults) {
+  crush_text *t = compile(
+    "device 0 d0\n"
+    "device 1 d1\n"
+    "type 1 host\n"
+    "host h { alg straw2 item d0 item d1 weight 0.5 }\n"
+    "host g { alg uniform hash xxhash32 item d0 item d1 }\n"
+    "host root { alg straw item h item g weight 3.25 }\n"
+    "rule r { ruleset 3 type 7 min_size 1 max_size 2\n"
+    "  step take root\n"
+    "  step set_chooseleaf_tries 5\n"
+    "  step chooseleaf indep -1 type device\n"
+    "  step emit }\n");
+  ASSERT_TRUE(t != NULL);
+  crush_map *m = t->map;
+  // the tunables of crush_create()
+  ASSERT_EQ(50u, m->choose_total_tries);
+  ASSERT_EQ(1, m->chooseleaf_stable);
+  // the lowest free ids
+  ASSERT_STREQ("h", t->bucket_names[0]);
+  ASSERT_STREQ("g", t->bucket_names[1]);
+  ASSERT_STREQ("root", t->bucket_names[2]);
+  ASSERT_EQ(0x18000u, m->buckets[0]->weight);
+  ASSERT_EQ(0x20000u, m->buckets[1]->weight);
+  ASSERT_EQ(CRUSH_HASH_RJENKINS1, m->buckets[0]->hash);
+  ASSERT_EQ(CRUSH_HASH_XXHASH32, m->buckets[1]->hash);
+  // a bucket weighs its weight unless told otherwise
+  ASSERT_EQ(0x18000, crush_get_bucket_item_weight(m->buckets[2], 0));
+  ASSERT_EQ(0x34000, crush_get_bucket_item_weight(m->buckets[2], 1));
+  crush_rule *rule = m->rules[0];
+  ASSERT_EQ(3, rule->mask.ruleset);
+  ASSERT_EQ(7, rule->mask.type);
+  ASSERT_EQ((__u32)CRUSH_RULE_SET_CHOOSELEAF_TRIES, rule->steps[1].op);
+  ASSERT_EQ(5, rule->steps[1].arg1);
+  ASSERT_EQ(-1, rule->steps[2].arg1);
+  ASSERT_EQ(0, rule->steps[2].arg2);
+
+  std::string text = decompile(t);
+  ASSERT_NE(std::string::npos, text.find("hash 1\t# xxhash32"));
+  crush_text *again = compile(text);
+  ASSERT_TRUE(again != NULL);
+  ASSERT_EQ(text, decompile(again));
+  ASSERT_EQ(CRUSH_HASH_XXHASH32, again->map->buckets[1]->hash);
+  expect_same_mappings(m, again->map, t->device_weights, t->max_devices);
+  crush_destroy_text(again);
+  crush_destroy_text(t);
+}
+
+TEST(compiler, decompile_without_names) {
+  crush_map *m = crush_create();
+  set_legacy_crush_map(m);
+  m->straw_calc_version = 1;
+  crush_bucket *root = crush_make_bucket(m, CRUSH_BUCKET_STRAW2, CRUSH_HASH_DEFAULT,
+                                         3, 0, NULL, NULL);
+  int rootno;
+  ASSERT_EQ(0, crush_add_bucket(m, -5, root, &rootno));
+  int device = 0;
+  for (int alg : { CRUSH_BUCKET_UNIFORM, CRUSH_BUCKET_LIST, CRUSH_BUCKET_TREE,
+                   CRUSH_BUCKET_STRAW, CRUSH_BUCKET_STRAW2 }) {
+    int items[5], weights[5];
+    for (int i = 0; i < 5; i++) {
+      items[i] = device++;
+      weights[i] = alg == CRUSH_BUCKET_UNIFORM ? 0x10000 : 0x1234 * (i + 1);
+    }
+    crush_bucket *b = crush_make_bucket(m, alg, CRUSH_HASH_DEFAULT, 1, 5,
+                                        items, weights);
+    int bno;
+    ASSERT_EQ(0, crush_add_bucket(m, 0, b, &bno));
+    ASSERT_EQ(0, crush_bucket_add_item(m, root, bno, b->weight));
+  }
+  crush_finalize(m);
+  crush_rule *rule = crush_make_rule(3, 0, 1, 1, 10);
+  crush_rule_set_step(rule, 0, CRUSH_RULE_TAKE, rootno, 0);
+  crush_rule_set_step(rule, 1, CRUSH_RULE_CHOOSELEAF_FIRSTN, 0, 1);
+  crush_rule_set_step(rule, 2, CRUSH_RULE_EMIT, 0, 0);
+  crush_add_rule(m, rule, 2);
+
+  crush_text names;
+  memset(&names, 0, sizeof(names));
+  names.map = m;
+  std::string text = decompile(&names);
+  ASSERT_NE(std::string::npos, text.find("type1 bucket1 {"));
+  ASSERT_NE(std::string::npos, text.find("item device3 weight"));
+  ASSERT_NE(std::string::npos, text.find("tunable choose_total_tries 19"));
+
+  crush_text *t = compile(text);
+  ASSERT_TRUE(t != NULL);
+  ASSERT_EQ(m->max_devices, t->max_devices);
+  for (int i = 0; i < t->max_devices; i++)
+    ASSERT_EQ(0x10000u, t->device_weights[i]);
+  ASSERT_EQ(m->choose_local_tries, t->map->choose_local_tries);
+  ASSERT_EQ(m->straw_calc_version, t->map->straw_calc_version);
+  ASSERT_EQ(m->allowed_bucket_algs, t->map->allowed_bucket_algs);
+  for (int b = 0; b < m->max_buckets; b++) {
+    if (m->buckets[b] == NULL)
+      continue;
+    crush_bucket *expected = m->buckets[b], *bucket = t->map->buckets[b];
+    ASSERT_EQ(expected->id, bucket->id);
+    ASSERT_EQ(expected->alg, bucket->alg);
+    ASSERT_EQ(expected->weight, bucket->weight);
+    for (__u32 i = 0; i < expected->size; i++) {
+      ASSERT_EQ(expected->items[i], bucket->items[i]);
+      ASSERT_EQ(crush_get_bucket_item_weight(expected, i),
+                crush_get_bucket_item_weight(bucket, i));
+    }
+  }
+  ASSERT_TRUE(t->map->rules[2] != NULL);
+  std::vector<__u32> weights(m->max_devices, 0x10000);
+  expect_same_mappings(m, t->map, weights.data(), weights.size());
+  crush_destroy_text(t);
+  crush_destroy(m);
+}
+
+TEST(compiler, errors) {
+  const char *header =
+    "device 0 d0\n"
+    "device 1 d1\n"
+    "type 1 host\n";
+  struct {
+    const char *text;
+    const char *error;
+  } cases[] = {
+    { "devices 2 d2", "line 4: expected tunable, device, type, rule or a bucket type, got 'devices'" },
+    { "device 1 d2", "line 4: device 1 is already defined" },
+    { "device 2 d1", "line 4: item d1 is already defined" },
+    { "device -1 d3", "line 4: a device id -1 is not in [0,16777215]" },
+    { "device 2 d2 offload 1.5", "line 4: an offload 1.5 is too large" },
+    { "type 1 rack", "line 4: type 1 is already defined" },
+    { "tunable choose_tries 1", "line 4: expected a tunable, got 'choose_tries'" },
+    { "host h { alg straw2 }\ntunable chooseleaf_stable 0",
+      "line 5: tunable chooseleaf_stable must be set before the buckets" },
+    { "host h { item d0 }", "line 4: bucket h has no alg" },
+    { "host h { alg straw3 }", "line 4: expected a bucket alg, got 'straw3'" },
+    { "host h { alg straw2 item d2 }", "line 4: item d2 is not defined" },
+    { "host h { alg straw2 hash 2 }", "line 4: a hash 2 is not in [0,1]" },
+    { "host h {\n alg straw2\n item d0 weight x }", "line 6: expected a weight, got 'x'" },
+    { "host h { alg straw2 item d0 weight 1.5.2 }", "line 4: expected a weight, got '1.5.2'" },
+    { "host h { alg tree item d0 pos 1 }", "line 4: pos 1 is not lower than the size 1 of bucket h" },
+    { "host h { alg tree item d0 pos 0 item d1 pos 0 }", "line 4: pos 0 is used twice in bucket h" },
+    { "host h { alg uniform item d0 item d1 weight 2 }",
+      "line 4: the items of uniform bucket h do not have the same weight" },
+    { "host h { alg straw2 id -1 }\nhost g { alg straw2 id -1 }",
+      "line 5: bucket id -1 is already used" },
+    { "host h { alg straw2 }\nhost h { alg straw2 }", "line 5: item h is already defined" },
+    { "host h { alg straw2 ", "line 4: expected id, alg, hash, item or '}', got the end of the text" },
+    { "rule r { ruleset 0 type 1 min_size 1 }", "line 4: rule has no max_size" },
+    { "rule r { ruleset 0 type 1 min_size 1 max_size 2 step take d3 }",
+      "line 4: item d3 is not defined" },
+    { "rule r { ruleset 0 type 1 min_size 1 max_size 2 step choose firstn 0 type rack }",
+      "line 4: type rack is not defined" },
+    { "rule r { ruleset 0 type 1 min_size 1 max_size 2 step choose any 0 type host }",
+      "line 4: expected firstn or indep, got 'any'" },
+    { "rule r { ruleset 0 type 1 min_size 1 max_size 2 step jump }",
+      "line 4: expected a step, got 'jump'" },
+    { "rule r { id 0 ruleset 0 type 1 min_size 1 max_size 2 }\n"
+      "rule s { id 0 ruleset 0 type 1 min_size 1 max_size 2 }",
+      "line 5: rule id 0 is already used" },
+    { "rule r { ruleset 256 }", "line 4: a ruleset 256 is not in [0,255]" },
+  };
+  for (auto &c : cases) {
+    std::string text = std::string(header) + c.text;
+    char error[256];
+    errno = 0;
+    ASSERT_EQ(NULL, crush_compile(text.c_str(), text.size(), error, sizeof(error)))
+      << c.text;
+    ASSERT_EQ(EINVAL, errno);
+    ASSERT_STREQ(c.error, error);
+  }
+
+  // the error buffer is optional and the message is truncated
+  std::string text = std::string(header) + "host h { item d0 }";
+  ASSERT_EQ(NULL, crush_compile(text.c_str(), text.size(), NULL, 0));
+  char error[8];
+  ASSERT_EQ(NULL, crush_compile(text.c_str(), text.size(), error, sizeof(error)));
+  ASSERT_STREQ("line 4:", error);
+
+  // does not read beyond len
+  text = std::string(header) + "type 2 rack";
+  crush_text *t = crush_compile(text.c_str(), text.size() - 2, error, sizeof(error));
+  ASSERT_TRUE(t != NULL);
+  ASSERT_STREQ("ra", t->type_names[2]);
+  crush_destroy_text(t);
+}
+
+TEST(compiler, large) {
+  // 40 racks of 25 hosts of 40 devices
+  std::string text = "type 0 osd\ntype 1 host\ntype 2 rack\ntype 3 root\n";
+  const int racks = 40, hosts = 25, devices = 40;
+  char line[128];
+  for (int d = 0; d < racks * hosts * devices; d++) {
+    snprintf(line, sizeof(line), "device %d osd.%d\n", d, d);
+    text += line;
+  }
+  for (int r = 0; r < racks; r++) {
+    for (int h = 0; h < hosts; h++) {
+      snprintf(line, sizeof(line), "host host%d-%d {\n\talg straw2\n", r, h);
+      text += line;
+      for (int d = 0; d < devices; d++) {
+        snprintf(line, sizeof(line), "\titem osd.%d weight 1.5\n",
+                 (r * hosts + h) * devices + d);
+        text += line;
+      }
+      text += "}\n";
+    }
+    snprintf(line, sizeof(line), "rack rack%d {\n\talg straw2\n", r);
+    text += line;
+    for (int h = 0; h < hosts; h++) {
+      snprintf(line, sizeof(line), "\titem host%d-%d\n", r, h);
+      text += line;
+    }
+    text += "}\n";
+  }
+  text += "root default {\n\talg straw2\n";
+  for (int r = 0; r < racks; r++) {
+    snprintf(line, sizeof(line), "\titem rack%d\n", r);
+    text += line;
+  }
+  text += "}\n"
+    "rule data { ruleset 0 type replicated min_size 1 max_size 10\n"
+    "  step take default step chooseleaf firstn 0 type host step emit }\n";
+
+  crush_text *t = compile(text);
+  ASSERT_TRUE(t != NULL);
+  ASSERT_EQ(racks * hosts * devices, t->map->max_devices);
+  crush_bucket *root = t->map->buckets[racks * (hosts + 1)];
+  ASSERT_STREQ("default", t->bucket_names[racks * (hosts + 1)]);
+  ASSERT_EQ((__u32)racks, root->size);
+  ASSERT_EQ(racks * hosts * devices * 0x18000u, root->weight);
+
+  crush_text *again = compile(decompile(t));
+  ASSERT_TRUE(again != NULL);
+  expect_same_mappings(t->map, again->map, t->device_weights, t->max_devices);
+  crush_destroy_text(again);
+  crush_destroy_text(t);
+}
+
+// Local Variables:
+// compile-command: "cd ../build ; make unittest_compiler && valgrind --tool=memcheck test/unittest_compiler"
+// End:
@@ -0,0 +1,395 @@
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <vector>
+
+extern "C" {
+#include "crush/builder.h"
+#include "crush/delta.h"
+#include "crush/hash.h"
+#include "crush/mapper.h"
+}
+#include "hosts.h"
+
+static const int host_type = 1;
+static const int host_count = 10;
+static const int b_size = 10;
+
+static crush_map *build_map(int *ruleno)
+{
+  return build_chooseleaf_map(host_count, b_size, ruleno, hosts_mixed_weight);
+}
+
+TEST(delta, crush_get_visited) {
+  int ruleno;
+  crush_map *m = build_map(&ruleno);
+  const int result_max = 3;
+  char cwin[crush_work_size(m, result_max)];
+  crush_init_workspace(m, cwin);
+  ASSERT_EQ(0u, crush_get_visited(cwin));
+  std::vector<__u32> weights(host_count * b_size, 0x10000);
+  int result[result_max];
+  // nothing is recorded unless asked for
+  ASSERT_EQ(result_max, crush_do_rule(m, ruleno, 1234, result, result_max,
+                                      weights.data(), weights.size(), cwin, NULL));
+  ASSERT_EQ(0u, crush_get_visited(cwin));
+  crush_track_visited(cwin, 1);
+  ASSERT_EQ(result_max, crush_do_rule(m, ruleno, 1234, result, result_max,
+                                      weights.data(), weights.size(), cwin, NULL));
+  __u64 expected = CRUSH_VISITED_BIT(-1);
+  for (int i = 0; i < result_max; i++)
+    for (int b = 1; b < m->max_buckets; b++)
+      if (m->buckets[b] && m->buckets[b]->items[0] / b_size == result[i] / b_size)
+        expected |= CRUSH_VISITED_BIT(-1-b);
+  // the hosts of the result and those that were rejected
+  ASSERT_EQ(expected, crush_get_visited(cwin) & expected);
+  crush_track_visited(cwin, 0);
+  ASSERT_EQ(0u, crush_get_visited(cwin));
+  ASSERT_EQ(result_max, crush_do_rule(m, ruleno, 1234, result, result_max,
+                                      weights.data(), weights.size(), cwin, NULL));
+  ASSERT_EQ(0u, crush_get_visited(cwin));
+  crush_destroy(m);
+}
+
+TEST(delta, crush_map_delta) {
+  int ruleno;
+  crush_map *old_map = build_map(&ruleno);
+  crush_map *new_map = build_map(&ruleno);
+  ASSERT_EQ(0u, crush_changed_buckets(old_map, new_map, ruleno));
+
+  const int device_count = host_count * b_size;
+  std::vector<__u32> weights(device_count, 0x10000);
+  for (int i = 0; i < device_count; i += 9)
+    weights[i] = 0;
+  const int result_max = 3;
+  const int n = 20000;
+  std::vector<int> xs(n);
+  for (int i = 0; i < n; i++)
+    xs[i] = i * 7 - 3000;
+  std::vector<int> results(n * result_max);
+  std::vector<int> result_lens(n);
+  std::vector<__u64> visited(n);
+  ASSERT_EQ(n, crush_map_visited(old_map, ruleno, xs.data(), n,
+                                 results.data(), result_max, result_lens.data(),
+                                 visited.data(), weights.data(), device_count, NULL));
+
+  char cwin[crush_work_size(new_map, result_max)];
+  crush_init_workspace(new_map, cwin);
+  std::vector<int> moved(n);
+  // lower then raise the weight of a device, then remove it
+  for (int edit = 0; edit < 3; edit++) {
+    crush_map *former = crush_flatten(new_map);
+    ASSERT_TRUE(former != NULL);
+    if (edit == 0) {
+      ASSERT_EQ(0, crush_set_device_weight(new_map, 23, 0x8000));
+    } else if (edit == 1) {
+      ASSERT_EQ(0, crush_set_device_weight(new_map, 23, 0x50000));
+    } else {
+      crush_bucket *host = new_map->buckets[-1-crush_get_parent(new_map, 23, NULL)];
+      ASSERT_EQ(0, crush_bucket_remove_item(new_map, host, 23));
+      crush_reweight_bucket(new_map, new_map->buckets[0]);
+    }
+    crush_finalize(new_map);
+    crush_init_workspace(new_map, cwin);
+    __u64 changed = crush_changed_buckets(former, new_map, ruleno);
+    ASSERT_NE(0u, changed);
+    int remapped = 0;
+    for (int i = 0; i < n; i++)
+      if (visited[i] & changed)
+        remapped++;
+    if (edit == 1)
+      // a higher weight may win anywhere in the root
+      ASSERT_EQ(n, remapped);
+    else
+      // only the values that visited the host of the device
+      ASSERT_GT(n / 2, remapped);
+
+    std::vector<int> former_results = results;
+    std::vector<int> former_lens = result_lens;
+    int moved_count = crush_map_delta(new_map, ruleno, changed, xs.data(), n,
+                                      results.data(), result_max,
+                                      result_lens.data(), visited.data(),
+                                      weights.data(), device_count, NULL,
+                                      moved.data());
+    ASSERT_LT(0, moved_count);
+    int count = 0;
+    for (int i = 0; i < n; i++) {
+      int result[result_max];
+      int len = crush_do_rule(new_map, ruleno, xs[i], result, result_max,
+                              weights.data(), device_count, cwin, NULL);
+      ASSERT_EQ(len, result_lens[i]);
+      bool differs = len != former_lens[i];
+      for (int j = 0; j < len; j++) {
+        ASSERT_EQ(result[j], results[i * result_max + j]);
+        if (result[j] != former_results[i * result_max + j])
+          differs = true;
+      }
+      if (differs) {
+        ASSERT_GT(moved_count, count);
+        ASSERT_EQ(i, moved[count++]);
+      }
+    }
+    ASSERT_EQ(moved_count, count);
+    crush_destroy(former);
+  }
+
+  // a tunable or the rule may move any value
+  new_map->choose_total_tries++;
+  ASSERT_EQ(~0ULL, crush_changed_buckets(old_map, new_map, ruleno));
+  ASSERT_EQ(-EINVAL, crush_map_delta(new_map, ruleno + 1, ~0ULL, xs.data(), n,
+                                     results.data(), result_max,
+                                     result_lens.data(), visited.data(),
+                                     weights.data(), device_count, NULL,
+                                     moved.data()));
+  crush_destroy(old_map);
+  crush_destroy(new_map);
+}
+
+// count a replica of device and of its ancestors
+static void count_replica(crush_map *m, int device, std::vector<__u64> &devices,
+                          std::vector<__u64> &buckets)
+{
+  if (device < 0 || device >= (int)devices.size())
+    return;
+  devices[device]++;
+  int pos;
+  for (int item = crush_get_parent(m, device, &pos); item < 0;
+       item = crush_get_parent(m, item, &pos))
+    buckets[-1-item]++;
+}
+
+// the replicas that move, found by mapping each value with both maps
+struct naive_movement {
+  std::vector<__u64> device_out, device_in, bucket_out, bucket_in;
+  __u64 moved = 0, replicas = 0;
+};
+
+static void map_naive_movement(crush_map *old_map, crush_map *new_map, int rule,
+                               bool indep, const std::vector<int> &xs,
+                               int result_max, const std::vector<__u32> &weights,
+                               const crush_choose_arg *old_args,
+                               const crush_choose_arg *new_args,
+                               naive_movement *m)
+{
+  const int device_count = weights.size();
+  *m = naive_movement();
+  m->device_out.resize(device_count);
+  m->device_in.resize(device_count);
+  m->bucket_out.resize(new_map->max_buckets);
+  m->bucket_in.resize(new_map->max_buckets);
+  std::vector<char> old_cwin(crush_work_size(old_map, result_max));
+  std::vector<char> new_cwin(crush_work_size(new_map, result_max));
+  crush_init_workspace(old_map, old_cwin.data());
+  crush_init_workspace(new_map, new_cwin.data());
+  for (int x : xs) {
+    int former[result_max], result[result_max];
+    int former_len = crush_do_rule(old_map, rule, x, former, result_max,
+                                   weights.data(), device_count, old_cwin.data(), old_args);
+    int len = crush_do_rule(new_map, rule, x, result, result_max,
+                            weights.data(), device_count, new_cwin.data(), new_args);
+    if (former_len != len || !std::equal(former, former + len, result))
+      m->moved++;
+    for (int j = 0; j < std::max(former_len, len); j++) {
+      int a = j < former_len ? former[j] : CRUSH_ITEM_NONE;
+      int b = j < len ? result[j] : CRUSH_ITEM_NONE;
+      if (indep) {
+        if (a == b)
+          continue;
+      } else {
+        if (std::find(result, result + len, a) != result + len)
+          a = CRUSH_ITEM_NONE;
+        if (std::find(former, former + former_len, b) != former + former_len)
+          b = CRUSH_ITEM_NONE;
+      }
+      count_replica(old_map, a, m->device_out, m->bucket_out);
+      if (b >= 0 && b < device_count) {
+        m->replicas++;
+        count_replica(new_map, b, m->device_in, m->bucket_in);
+      }
+    }
+  }
+}
+
+// crush_map_movement() finds the counts of map_naive_movement()
+static void expect_movement(crush_map *old_map, crush_map *new_map, int rule,
+                            const std::vector<int> &xs, int result_max,
+                            const std::vector<__u32> &weights,
+                            const crush_choose_arg *old_args,
+                            const crush_choose_arg *new_args,
+                            const naive_movement &expected)
+{
+  const int device_count = weights.size();
+  const int max_buckets = new_map->max_buckets;
+  for (int nthreads : { 1, 4 }) {
+    std::vector<__u64> d_out(device_count), d_in(device_count);
+    std::vector<__u64> b_out(max_buckets), b_in(max_buckets);
+    crush_movement movement = {
+      d_out.data(), d_in.data(), b_out.data(), b_in.data(), max_buckets
+    };
+    ASSERT_EQ((int)expected.moved,
+              crush_map_movement(old_map, new_map, rule, xs.data(), xs.size(),
+                                 result_max, weights.data(), device_count,
+                                 old_args, new_args, nthreads, &movement));
+    ASSERT_EQ((__u64)xs.size(), movement.values);
+    ASSERT_EQ(expected.moved, movement.moved);
+    ASSERT_EQ(expected.replicas, movement.replicas);
+    ASSERT_LE(movement.moved, movement.remapped);
+    ASSERT_EQ(expected.device_out, d_out);
+    ASSERT_EQ(expected.device_in, d_in);
+    ASSERT_EQ(expected.bucket_out, b_out);
+    ASSERT_EQ(expected.bucket_in, b_in);
+    // the root receives all that moves
+    ASSERT_EQ(expected.replicas, b_in[0]);
+  }
+}
+
+TEST(delta, crush_map_movement) {
+  int ruleno;
+  crush_map *old_map = build_map(&ruleno);
+  crush_map *new_map = build_map(&ruleno);
+  int indep_ruleno = -1;
+  for (crush_map *m : { old_map, new_map }) {
+    struct crush_rule *rule = crush_make_rule(3, 0, 0, 0, 0);
+    crush_rule_set_step(rule, 0, CRUSH_RULE_TAKE, -1, 0);
+    crush_rule_set_step(rule, 1, CRUSH_RULE_CHOOSELEAF_INDEP, 0, host_type);
+    crush_rule_set_step(rule, 2, CRUSH_RULE_EMIT, 0, 0);
+    indep_ruleno = crush_add_rule(m, rule, -1);
+  }
+  // more weight on a device and a new host
+  ASSERT_EQ(0, crush_set_device_weight(new_map, 23, 0x60000));
+  {
+    int items[b_size];
+    int weights[b_size];
+    for (int i = 0; i < b_size; i++) {
+      items[i] = host_count * b_size + i;
+      weights[i] = 0x10000;
+    }
+    crush_bucket *b = crush_make_bucket(new_map, CRUSH_BUCKET_STRAW2, CRUSH_HASH_DEFAULT,
+                                        host_type, b_size, items, weights);
+    int bno = 0;
+    ASSERT_EQ(0, crush_add_bucket(new_map, 0, b, &bno));
+    ASSERT_EQ(0, crush_bucket_add_item(new_map, new_map->buckets[0], bno, b->weight));
+  }
+  crush_finalize(new_map);
+
+  const int device_count = (host_count + 1) * b_size;
+  std::vector<__u32> weights(device_count, 0x10000);
+  for (int i = 0; i < device_count; i += 9)
+    weights[i] = 0;
+  const int result_max = 3;
+  const int n = 20000;
+  std::vector<int> xs(n);
+  for (int i = 0; i < n; i++)
+    xs[i] = i * 7 - 3000;
+
+  for (int rule : { ruleno, indep_ruleno }) {
+    naive_movement expected;
+    map_naive_movement(old_map, new_map, rule, rule == indep_ruleno, xs, result_max,
+                       weights, NULL, NULL, &expected);
+    ASSERT_LT(0u, expected.moved);
+    // the new host takes about a tenth of the replicas
+    ASSERT_LT((__u64)n * result_max / 20, expected.replicas);
+    expect_movement(old_map, new_map, rule, xs, result_max, weights, NULL, NULL,
+                    expected);
+  }
+
+  // the values that did not go through the host of the lowered device
+  // are not mapped again
+  crush_map *former = crush_flatten(old_map);
+  crush_map *lowered = old_map;
+  ASSERT_EQ(0, crush_set_device_weight(lowered, 23, 0x8000));
+  crush_finalize(lowered);
+  crush_movement movement = {};
+  ASSERT_LE(0, crush_map_movement(former, lowered, ruleno, xs.data(), n,
+                                  result_max, weights.data(), device_count,
+                                  NULL, NULL, 2, &movement));
+  ASSERT_LT(0u, movement.moved);
+  ASSERT_GT((__u64)n / 2, movement.remapped);
+  crush_destroy(former);
+
+  ASSERT_EQ(-EINVAL, crush_map_movement(old_map, new_map, indep_ruleno + 1,
+                                        xs.data(), n, result_max, weights.data(),
+                                        device_count, NULL, NULL, 1, &movement));
+  ASSERT_EQ(-EINVAL, crush_map_movement(old_map, new_map, ruleno,
+                                        xs.data(), n, 0, weights.data(),
+                                        device_count, NULL, NULL, 1, &movement));
+  crush_destroy(old_map);
+  crush_destroy(new_map);
+}
+
+TEST(delta, crush_map_movement_choose_args) {
+  int ruleno;
+  crush_map *new_map = build_map(&ruleno);
+  crush_map *old_map = crush_flatten(new_map);
+  ASSERT_TRUE(old_map != NULL);
+  const int positions = 3;
+  crush_choose_arg *old_args = crush_make_choose_args(old_map, positions);
+  ASSERT_TRUE(old_args != NULL);
+  // the first host has less weight for the second replica
+  ASSERT_EQ(0, crush_choose_args_set_weight(old_map, old_args, -1, 1, 0, 0x8000));
+
+  // a new host has choose_args of its own
+  {
+    int items[b_size];
+    int weights[b_size];
+    for (int i = 0; i < b_size; i++) {
+      items[i] = host_count * b_size + i;
+      weights[i] = 0x10000;
+    }
+    crush_bucket *b = crush_make_bucket(new_map, CRUSH_BUCKET_STRAW2, CRUSH_HASH_DEFAULT,
+                                        host_type, b_size, items, weights);
+    int bno = 0;
+    ASSERT_EQ(0, crush_add_bucket(new_map, 0, b, &bno));
+    ASSERT_EQ(0, crush_bucket_add_item(new_map, new_map->buckets[0], bno, b->weight));
+  }
+  crush_finalize(new_map);
+  ASSERT_LT(old_map->buckets[0]->size, new_map->buckets[0]->size);
+  crush_choose_arg *new_args = crush_make_choose_args(new_map, positions);
+  ASSERT_TRUE(new_args != NULL);
+  ASSERT_EQ(0, crush_choose_args_set_weight(new_map, new_args, -1, 1, 0, 0x8000));
+
+  const int device_count = (host_count + 1) * b_size;
+  std::vector<__u32> weights(device_count, 0x10000);
+  const int result_max = 3;
+  const int n = 10000;
+  std::vector<int> xs(n);
+  for (int i = 0; i < n; i++)
+    xs[i] = i;
+
+  naive_movement expected;
+  map_naive_movement(old_map, new_map, ruleno, false, xs, result_max, weights,
+                     old_args, new_args, &expected);
+  ASSERT_LT(0u, expected.moved);
+  expect_movement(old_map, new_map, ruleno, xs, result_max, weights,
+                  old_args, new_args, expected);
+
+  // the choose_args of a host change and the maps do not: the values
+  // that visited the host are mapped again
+  crush_choose_arg *lowered_args = crush_make_choose_args(old_map, positions);
+  ASSERT_TRUE(lowered_args != NULL);
+  ASSERT_EQ(0, crush_choose_args_set_weight(old_map, lowered_args, -1, 1, 0, 0x8000));
+  ASSERT_EQ(0, crush_choose_args_set_weight(old_map, lowered_args, -2, 0, 1, 0x40000));
+  crush_map *same_map = build_map(&ruleno);
+  ASSERT_EQ(0u, crush_changed_buckets(old_map, same_map, ruleno));
+  std::vector<__u32> old_weights(host_count * b_size, 0x10000);
+  map_naive_movement(old_map, same_map, ruleno, false, xs, result_max, old_weights,
+                     old_args, lowered_args, &expected);
+  ASSERT_LT(0u, expected.moved);
+  expect_movement(old_map, same_map, ruleno, xs, result_max, old_weights,
+                  old_args, lowered_args, expected);
+  crush_movement movement = {};
+  ASSERT_LE(0, crush_map_movement(old_map, same_map, ruleno, xs.data(), n,
+                                  result_max, old_weights.data(), old_weights.size(),
+                                  old_args, lowered_args, 1, &movement));
+  ASSERT_GT((__u64)n, movement.remapped);
+
+  crush_destroy_choose_args(lowered_args);
+  crush_destroy_choose_args(new_args);
+  crush_destroy_choose_args(old_args);
+  crush_destroy(same_map);
+  crush_destroy(new_map);
+  crush_destroy(old_map);
+}
+
+// Local Variables:
+// compile-command: "cd ../build ; make unittest_delta && valgrind --tool=memcheck test/unittest_delta"
+// End:
@@ -0,0 +1,324 @@
+#include <gtest/gtest.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <vector>
+
+extern "C" {
+#include "crush/builder.h"
+#include "crush/encoding.h"
+#include "crush/hash.h"
+#include "crush/mapper.h"
+}
+
+static crush_map *build_map(bool straw2_only, int *rootno, std::vector<int> *rules)
+{
+  crush_map *m = crush_create();
+  set_legacy_crush_map(m);
+  m->choose_total_tries = 7;
+  const int host_type = 1;
+  crush_bucket *root = crush_make_bucket(m, CRUSH_BUCKET_STRAW2, CRUSH_HASH_DEFAULT,
+                                         host_type + 1, 0, NULL, NULL);
+  EXPECT_EQ(0, crush_add_bucket(m, 0, root, rootno));
+  const int b_size = 7;
+  int device = 0;
+  for (int alg : { CRUSH_BUCKET_UNIFORM, CRUSH_BUCKET_LIST, CRUSH_BUCKET_TREE,
+                   CRUSH_BUCKET_STRAW, CRUSH_BUCKET_STRAW2 }) {
+    if (straw2_only)
+      alg = CRUSH_BUCKET_STRAW2;
+    int items[b_size];
+    int weights[b_size];
+    for (int i = 0; i < b_size; i++) {
+      items[i] = device++;
+      weights[i] = alg == CRUSH_BUCKET_UNIFORM ? 0x10000 : 0x10000 * (1 + i % 3);
+    }
+    crush_bucket *b = crush_make_bucket(m, alg, CRUSH_HASH_DEFAULT, host_type,
+                                        b_size, items, weights);
+    int bno = 0;
+    EXPECT_EQ(0, crush_add_bucket(m, 0, b, &bno));
+    EXPECT_EQ(0, crush_bucket_add_item(m, root, bno, b->weight));
+  }
+  crush_finalize(m);
+  for (int op : { CRUSH_RULE_CHOOSELEAF_FIRSTN, CRUSH_RULE_CHOOSELEAF_INDEP }) {
+    struct crush_rule *rule = crush_make_rule(3, 1, 2, 1, 10);
+    crush_rule_set_step(rule, 0, CRUSH_RULE_TAKE, *rootno, 0);
+    crush_rule_set_step(rule, 1, op, 0, host_type);
+    crush_rule_set_step(rule, 2, CRUSH_RULE_EMIT, 0, 0);
+    rules->push_back(crush_add_rule(m, rule, -1));
+  }
+  return m;
+}
+
+static void expect_same_mappings(crush_map *m, crush_map *decoded,
+                                 const std::vector<int> &rules,
+                                 crush_choose_arg *args,
+                                 crush_choose_arg *decoded_args)
+{
+  const int device_count = m->max_devices;
+  std::vector<__u32> weights(device_count, 0x10000);
+  weights[2] = 0;
+  const int result_max = 3;
+  ASSERT_EQ(crush_work_size(m, result_max), crush_work_size(decoded, result_max));
+  std::vector<char> cwin(crush_work_size(m, result_max));
+  std::vector<char> decoded_cwin(crush_work_size(m, result_max));
+  crush_init_workspace(m, cwin.data());
+  crush_init_workspace(decoded, decoded_cwin.data());
+  for (int ruleno : rules) {
+    for (int x = 0; x < 1000; x++) {
+      int expected[result_max], result[result_max];
+      int len = crush_do_rule(m, ruleno, x, expected, result_max,
+                              weights.data(), device_count, cwin.data(), args);
+      ASSERT_EQ(len, crush_do_rule(decoded, ruleno, x, result, result_max,
+                                   weights.data(), device_count,
+                                   decoded_cwin.data(), decoded_args));
+      for (int i = 0; i < len; i++)
+        ASSERT_EQ(expected[i], result[i]);
+    }
+  }
+}
+
+TEST(encoding, crush_decode) {
+  int rootno;
+  std::vector<int> rules;
+  crush_map *m = build_map(false, &rootno, &rules);
+
+  void *buf;
+  size_t len;
+  ASSERT_EQ(0, crush_encode(m, NULL, &buf, &len));
+  ASSERT_EQ(0u, len % 8);
+
+  crush_choose_arg *args = (crush_choose_arg *)1;
+  crush_map *decoded = crush_decode(buf, len, &args);
+  ASSERT_TRUE(decoded != NULL);
+  ASSERT_EQ(NULL, args);
+  ASSERT_EQ(m->choose_local_tries, decoded->choose_local_tries);
+  ASSERT_EQ(m->choose_local_fallback_tries, decoded->choose_local_fallback_tries);
+  ASSERT_EQ(7u, decoded->choose_total_tries);
+  ASSERT_EQ(m->chooseleaf_descend_once, decoded->chooseleaf_descend_once);
+  ASSERT_EQ(m->chooseleaf_vary_r, decoded->chooseleaf_vary_r);
+  ASSERT_EQ(m->chooseleaf_stable, decoded->chooseleaf_stable);
+  ASSERT_EQ(m->straw_calc_version, decoded->straw_calc_version);
+  ASSERT_EQ(m->allowed_bucket_algs, decoded->allowed_bucket_algs);
+  ASSERT_EQ(m->max_buckets, decoded->max_buckets);
+  ASSERT_EQ(m->max_rules, decoded->max_rules);
+  ASSERT_EQ(m->max_devices, decoded->max_devices);
+  ASSERT_EQ(m->working_size, decoded->working_size);
+  for (int b = 0; b < m->max_buckets; b++) {
+    if (m->buckets[b] == NULL) {
+      ASSERT_EQ(NULL, decoded->buckets[b]);
+      continue;
+    }
+    ASSERT_EQ(m->buckets[b]->alg, decoded->buckets[b]->alg);
+    ASSERT_EQ(m->buckets[b]->type, decoded->buckets[b]->type);
+    ASSERT_EQ(m->buckets[b]->weight, decoded->buckets[b]->weight);
+    for (__u32 i = 0; i < m->buckets[b]->size; i++)
+      ASSERT_EQ(crush_get_bucket_item_weight(m->buckets[b], i),
+                crush_get_bucket_item_weight(decoded->buckets[b], i));
+  }
+  for (int ruleno : rules)
+    ASSERT_EQ(0, memcmp(m->rules[ruleno], decoded->rules[ruleno],
+                        crush_rule_size(m->rules[ruleno]->len)));
+  expect_same_mappings(m, decoded, rules, NULL, NULL);
+
+  // the decoded map does not depend on the encoding
+  memset(buf, 0, len);
+  free(buf);
+  expect_same_mappings(m, decoded, rules, NULL, NULL);
+  crush_destroy(decoded);
+  crush_destroy(m);
+}
+
+TEST(encoding, crush_decode_choose_args) {
+  int rootno;
+  std::vector<int> rules;
+  crush_map *m = build_map(true, &rootno, &rules);
+  crush_choose_arg *args = crush_make_choose_args(m, 2);
+  for (int b = 0; b < m->max_buckets; b++)
+    if (m->buckets[b] && m->buckets[b]->size > 1) {
+      args[b].weight_set[1].weights[0] = 0x1234;
+      args[b].ids[1] = 4242;
+    }
+  // a bucket without choose_args
+  args[-1-rootno].ids = NULL;
+  args[-1-rootno].weight_set = NULL;
+
+  void *buf;
+  size_t len;
+  ASSERT_EQ(0, crush_encode(m, args, &buf, &len));
+  crush_choose_arg *decoded_args = NULL;
+  crush_map *decoded = crush_decode(buf, len, &decoded_args);
+  ASSERT_TRUE(decoded != NULL);
+  ASSERT_TRUE(decoded_args != NULL);
+  ASSERT_EQ(NULL, decoded_args[-1-rootno].ids);
+  ASSERT_EQ(NULL, decoded_args[-1-rootno].weight_set);
+  for (int b = 0; b < m->max_buckets; b++) {
+    if (m->buckets[b] == NULL || b == -1-rootno)
+      continue;
+    ASSERT_EQ(args[b].ids_size, decoded_args[b].ids_size);
+    ASSERT_EQ(args[b].weight_set_size, decoded_args[b].weight_set_size);
+    for (__u32 position = 0; position < args[b].weight_set_size; position++) {
+      crush_weight_set *ws = &decoded_args[b].weight_set[position];
+      for (__u32 i = 0; i < ws->size; i++) {
+        ASSERT_EQ(args[b].weight_set[position].weights[i], ws->weights[i]);
+        ASSERT_EQ(ws->weights[i], ws->recips[i].weight);
+      }
+    }
+  }
+  expect_same_mappings(m, decoded, rules, args, decoded_args);
+
+  // the choose_args are ignored if not asked for
+  crush_map *without = crush_decode(buf, len, NULL);
+  ASSERT_TRUE(without != NULL);
+  crush_destroy(without);
+
+  free(buf);
+  crush_destroy_choose_args(decoded_args);
+  crush_destroy(decoded);
+  crush_destroy_choose_args(args);
+  crush_destroy(m);
+}
+
+TEST(encoding, crush_map_file) {
+  int rootno;
+  std::vector<int> rules;
+  crush_map *m = build_map(true, &rootno, &rules);
+  crush_choose_arg *args = crush_make_choose_args(m, 1);
+
+  void *buf;
+  size_t len;
+  ASSERT_EQ(0, crush_encode(m, args, &buf, &len));
+  char path[] = "/tmp/test_encoding.XXXXXX";
+  int fd = mkstemp(path);
+  ASSERT_LE(0, fd);
+  ASSERT_EQ((ssize_t)len, write(fd, buf, len));
+  close(fd);
+  free(buf);
+
+  crush_choose_arg *mapped_args = NULL;
+  crush_map *mapped = crush_map_file(path, &mapped_args);
+  ASSERT_TRUE(mapped != NULL);
+  ASSERT_TRUE(mapped_args != NULL);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  // the arrays are in the file
+  char *mapping = (char *)mapped->mapping;
+  ASSERT_TRUE(mapping != NULL);
+  ASSERT_EQ(len, mapped->mapping_size);
+  char *items = (char *)mapped->buckets[-1-rootno]->items;
+  ASSERT_LE(mapping, items);
+  ASSERT_GT(mapping + len, items);
+  // the choose_args are copied and can be modified
+  for (int b = 0; b < mapped->max_buckets; b++) {
+    crush_weight_set *ws = mapped_args[b].weight_set;
+    if (ws == NULL)
+      continue;
+    ASSERT_TRUE((char *)ws->weights < mapping || (char *)ws->weights >= mapping + len);
+  }
+#endif
+  expect_same_mappings(m, mapped, rules, args, mapped_args);
+  for (int b = 0; b < mapped->max_buckets; b++) {
+    crush_weight_set *ws = mapped_args[b].weight_set;
+    if (ws == NULL)
+      continue;
+    ws->weights[0] /= 2;
+    crush_update_straw2_recips(ws->recips, ws->weights, ws->size);
+    args[b].weight_set->weights[0] /= 2;
+    crush_update_straw2_recips(args[b].weight_set->recips,
+                               args[b].weight_set->weights, ws->size);
+  }
+  expect_same_mappings(m, mapped, rules, args, mapped_args);
+  crush_destroy_choose_args(mapped_args);
+  crush_destroy(mapped);
+
+  unlink(path);
+  errno = 0;
+  ASSERT_EQ(NULL, crush_map_file(path, NULL));
+  ASSERT_EQ(ENOENT, errno);
+
+  crush_destroy_choose_args(args);
+  crush_destroy(m);
+}
+
+TEST(encoding, invalid) {
+  int rootno;
+  std::vector<int> rules;
+  crush_map *m = build_map(true, &rootno, &rules);
+  crush_choose_arg *args = crush_make_choose_args(m, 2);
+  void *buf;
+  size_t len;
+  ASSERT_EQ(0, crush_encode(m, args, &buf, &len));
+  std::vector<char> copy((char *)buf, (char *)buf + len);
+
+  // truncated
+  for (size_t l : { (size_t)0, (size_t)4, len / 2, len - 1 }) {
+    errno = 0;
+    ASSERT_EQ(NULL, crush_decode(buf, l, NULL));
+    ASSERT_EQ(EINVAL, errno);
+  }
+  // bad magic
+  copy[0] ^= 1;
+  ASSERT_EQ(NULL, crush_decode(copy.data(), len, NULL));
+  copy[0] ^= 1;
+
+  // corrupted: either rejected or decoded without reading out of bounds
+  for (size_t i = 0; i < len; i++) {
+    for (int bit : { 0, 3, 7 }) {
+      copy[i] ^= 1 << bit;
+      crush_choose_arg *decoded_args = NULL;
+      crush_map *decoded = crush_decode(copy.data(), len, &decoded_args);
+      if (decoded) {
+        crush_destroy_choose_args(decoded_args);
+        crush_destroy(decoded);
+      }
+      copy[i] ^= 1 << bit;
+    }
+  }
+
+  free(buf);
+  crush_destroy_choose_args(args);
+  crush_destroy(m);
+}
+
+TEST(encoding, invalid_tree) {
+  int rootno;
+  std::vector<int> rules;
+  crush_map *m = build_map(false, &rootno, &rules);
+  void *buf;
+  size_t len;
+  ASSERT_EQ(0, crush_encode(m, NULL, &buf, &len));
+  // the bucket header of the tree: id, type, alg, hash, weight, size, num_nodes
+  const crush_bucket_tree *tree = NULL;
+  for (int b = 0; b < m->max_buckets; b++)
+    if (m->buckets[b] && m->buckets[b]->alg == CRUSH_BUCKET_TREE)
+      tree = (const crush_bucket_tree *)m->buckets[b];
+  ASSERT_TRUE(tree != NULL);
+  char *p = (char *)buf;
+  size_t offset;
+  for (offset = 0; offset + 20 <= len; offset += 4)
+    if (*(__s32 *)(p + offset) == tree->h.id &&
+        (__u8)p[offset + 6] == CRUSH_BUCKET_TREE &&
+        *(__u32 *)(p + offset + 12) == tree->h.size)
+      break;
+  ASSERT_GT(len, offset + 20);
+  __u32 *num_nodes = (__u32 *)(p + offset + 16);
+  ASSERT_EQ(tree->num_nodes, *num_nodes);
+
+  // too few nodes for the items, no nodes or not a power of two
+  for (__u32 bad : { 0u, tree->num_nodes / 2u, tree->num_nodes - 2u }) {
+    *num_nodes = bad;
+    errno = 0;
+    ASSERT_EQ(NULL, crush_decode(buf, len, NULL));
+    ASSERT_EQ(EINVAL, errno);
+  }
+  *num_nodes = tree->num_nodes;
+  crush_map *decoded = crush_decode(buf, len, NULL);
+  ASSERT_TRUE(decoded != NULL);
+  crush_destroy(decoded);
+
+  free(buf);
+  crush_destroy(m);
+}
+
+// Local Variables:
+// compile-command: "cd ../build ; make unittest_encoding && valgrind --tool=memcheck test/unittest_encoding"
+// End:
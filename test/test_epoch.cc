@@ -0,0 +1,166 @@
+#include <gtest/gtest.h>
+#include <errno.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include "crush/builder.h"
+#include "crush/epoch.h"
+#include "crush/hash.h"
+#include "crush/mapper.h"
+}
+#include "hosts.h"
+
+static const int host_type = 1;
+static const int b_size = 4;
+static const int result_max = 3;
+static const int max_devices = 64 * b_size;
+
+// hosts of b_size devices, the rule being 0
+static crush_map *build_map(int host_count)
+{
+  int ruleno;
+  crush_map *m = build_chooseleaf_map(host_count, b_size, &ruleno);
+  EXPECT_EQ(0, ruleno);
+  return m;
+}
+
+static int do_rule(const crush_map *m, int x, int *result,
+                   const crush_choose_arg *choose_args = NULL)
+{
+  std::vector<__u32> weights(max_devices, 0x10000);
+  std::vector<char> cwin(crush_work_size(m, result_max));
+  crush_init_workspace(m, cwin.data());
+  return crush_do_rule(m, 0, x, result, result_max, weights.data(), max_devices,
+                       cwin.data(), choose_args);
+}
+
+TEST(epoch, crush_handle_publish) {
+  errno = 0;
+  ASSERT_EQ(NULL, crush_handle_create(NULL, NULL));
+  ASSERT_EQ(EINVAL, errno);
+
+  crush_map *first = build_map(3);
+  crush_handle *handle = crush_handle_create(first, NULL);
+  ASSERT_TRUE(handle != NULL);
+  ASSERT_EQ(1, crush_handle_epoch(handle));
+  ASSERT_EQ(-EINVAL, crush_handle_publish(handle, NULL, NULL));
+
+  crush_reader *reader = crush_reader_create(handle);
+  crush_reader *other = crush_reader_create(handle);
+  const crush_choose_arg *choose_args = (const crush_choose_arg *)1;
+  ASSERT_EQ(first, crush_reader_enter(reader, &choose_args));
+  ASSERT_EQ(NULL, choose_args);
+  // the nested calls return the map pinned by the outermost
+  ASSERT_EQ(first, crush_reader_enter(reader, NULL));
+  crush_reader_leave(reader);
+
+  // the first map is kept while the reader uses it
+  crush_map *second = build_map(5);
+  crush_choose_arg *second_args = crush_make_choose_args(second, result_max);
+  ASSERT_EQ(2, crush_handle_publish(handle, second, second_args));
+  ASSERT_EQ(2, crush_handle_epoch(handle));
+  ASSERT_EQ(first, crush_reader_enter(reader, NULL));
+  ASSERT_EQ(second, crush_reader_enter(other, &choose_args));
+  ASSERT_EQ(second_args, choose_args);
+  ASSERT_EQ(1, crush_handle_reclaim(handle));
+  crush_reader_leave(reader);
+  crush_reader_leave(reader);
+  ASSERT_EQ(0, crush_handle_reclaim(handle));
+
+  // the second map is kept while the other reader uses it, and so is
+  // the third because the reader could have loaded it when entering
+  ASSERT_EQ(3, crush_handle_publish(handle, build_map(6), NULL));
+  const crush_map *fourth = build_map(7);
+  ASSERT_EQ(4, crush_handle_publish(handle, (crush_map *)fourth, NULL));
+  ASSERT_EQ(2, crush_handle_reclaim(handle));
+  int result[result_max];
+  ASSERT_EQ(3, do_rule(second, 42, result, second_args));
+  crush_reader_leave(other);
+  ASSERT_EQ(0, crush_handle_reclaim(handle));
+
+  // the readers destroyed are reused
+  crush_reader_destroy(other);
+  ASSERT_EQ(other, crush_reader_create(handle));
+  ASSERT_EQ(fourth, crush_reader_enter(other, NULL));
+  crush_reader_leave(other);
+
+  crush_handle_destroy(handle);
+}
+
+TEST(epoch, crush_reader_do_rule) {
+  crush_map *m = build_map(3);
+  crush_handle *handle = crush_handle_create(m, NULL);
+  crush_reader *reader = crush_reader_create(handle);
+  std::vector<__u32> weights(max_devices, 0x10000);
+  for (int host_count = 3; host_count < 10; host_count++) {
+    if (host_count > 3) {
+      m = build_map(host_count);
+      ASSERT_LT(0, crush_handle_publish(handle, m, NULL));
+    }
+    // the working space follows the map and result_max
+    for (int len : { result_max, 1 }) {
+      for (int x = 0; x < 100; x++) {
+        int expected[result_max], result[result_max];
+        int expected_len = do_rule(m, x, expected);
+        if (len < result_max)
+          expected_len = 1;
+        ASSERT_EQ(expected_len, crush_reader_do_rule(reader, 0, x, result, len,
+                                                     weights.data(), max_devices));
+        for (int i = 0; i < expected_len; i++)
+          ASSERT_EQ(expected[i], result[i]);
+      }
+    }
+  }
+  crush_handle_destroy(handle);
+}
+
+TEST(epoch, concurrent_readers) {
+  const int nthreads = 4;
+  const int epochs = 50;
+  crush_handle *handle = crush_handle_create(build_map(3), NULL);
+  std::atomic<bool> done(false);
+  std::atomic<long> mapped(0);
+  std::atomic<int> started(0);
+  std::vector<std::thread> readers;
+  for (int t = 0; t < nthreads; t++)
+    readers.emplace_back([&, t] {
+      crush_reader *reader = crush_reader_create(handle);
+      std::vector<__u32> weights(max_devices, 0x10000);
+      int x = t;
+      long count = 0;
+      while (!done) {
+        // the devices of the map pinned, which has a host more per epoch
+        const crush_map *m = crush_reader_enter(reader, NULL);
+        int result[result_max];
+        int len = crush_reader_do_rule(reader, 0, x, result, result_max,
+                                       weights.data(), max_devices);
+        EXPECT_EQ(3, len);
+        for (int i = 0; i < len; i++)
+          EXPECT_GT(m->max_devices, result[i]);
+        crush_reader_leave(reader);
+        if (count++ == 0)
+          started++;
+        x += nthreads;
+      }
+      mapped += count;
+      crush_reader_destroy(reader);
+    });
+  while (started < nthreads)
+    std::this_thread::yield();
+  for (int epoch = 2; epoch <= epochs; epoch++) {
+    ASSERT_EQ(epoch, crush_handle_publish(handle, build_map(epoch + 2), NULL));
+    std::this_thread::yield();
+  }
+  done = true;
+  for (auto &t : readers)
+    t.join();
+  ASSERT_EQ(0, crush_handle_reclaim(handle));
+  ASSERT_LE(nthreads, mapped.load());
+  crush_handle_destroy(handle);
+}
+
+// Local Variables:
+// compile-command: "cd ../build ; make unittest_epoch && valgrind --tool=memcheck test/unittest_epoch"
+// End:
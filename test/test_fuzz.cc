@@ -0,0 +1,103 @@
+#include <gtest/gtest.h>
+#include <stdlib.h>
+
+#include "fuzz.h"
+
+/*
+ * Compare each fuzz_path with crush_do_rule() run without the fast
+ * paths, for the values [0, CRUSH_FUZZ_VALUES[ and the rules of
+ * CRUSH_FUZZ_MAPS random maps starting from the seed CRUSH_FUZZ_SEED.
+ * The defaults keep make test short, before enabling a fast path:
+ *
+ *     CRUSH_FUZZ_MAPS=1000 CRUSH_FUZZ_VALUES=10000 test/unittest_fuzz
+ *
+ * maps 30 million values with each path.
+ */
+static int fuzz_env(const char *name, int value)
+{
+  const char *s = getenv(name);
+  return s ? atoi(s) : value;
+}
+
+// the items are devices that are in, buckets or CRUSH_ITEM_NONE and
+// none is found twice, unless the rule has out_leaves
+static void expect_valid(const fuzz_map &f, const fuzz_rule &r,
+                         const int *result, int len)
+{
+  for (int i = 0; i < len; i++) {
+    int item = result[i];
+    if (item == CRUSH_ITEM_NONE)
+      continue;
+    if (item >= 0) {
+      ASSERT_GT(f.device_count, item);
+      if (!r.out_leaves) {
+        ASSERT_GT((int)f.weights.size(), item);
+        ASSERT_LT(0u, f.weights[item]);
+      }
+    } else {
+      ASSERT_GT(f.m->max_buckets, -1-item);
+      ASSERT_TRUE(f.m->buckets[-1-item] != NULL);
+    }
+    for (int j = 0; j < i && !r.out_leaves; j++)
+      ASSERT_NE(item, result[j]);
+  }
+}
+
+TEST(fuzz, fast_paths) {
+  const int maps = fuzz_env("CRUSH_FUZZ_MAPS", 40);
+  const int values = fuzz_env("CRUSH_FUZZ_VALUES", 1000);
+  const unsigned first_seed = fuzz_env("CRUSH_FUZZ_SEED", 1);
+  const int block = 256;
+  std::vector<int> expected(block * fuzz_result_max);
+  std::vector<int> expected_lens(block);
+  std::vector<int> results(block * fuzz_result_max);
+  std::vector<int> result_lens(block);
+  int specialized = 0;
+
+  for (unsigned seed = first_seed; seed < first_seed + maps; seed++) {
+    fuzz_map f;
+    fuzz_make_map(&f, seed, seed % 2, crush_create());
+    std::vector<fuzz_path *> paths;
+    for (int p = 0; p < FUZZ_PATHS; p++)
+      paths.push_back(fuzz_path_supported(p) ? fuzz_make_path(p, f) : NULL);
+    for (const fuzz_rule &r : f.rules) {
+      crush_rule_executor e;
+      specialized += crush_make_rule_executor(f.m, r.ruleno, &e);
+      for (int x = 0; x < values; x += block) {
+        int n = std::min(block, values - x);
+        paths[FUZZ_REFERENCE]->map(r, x, n, expected.data(), expected_lens.data());
+        for (int i = 0; i < n; i++) {
+          ASSERT_LE(0, expected_lens[i]);
+          ASSERT_GE(r.result_max, expected_lens[i]);
+          expect_valid(f, r, &expected[i * r.result_max], expected_lens[i]);
+          if (HasFatalFailure())
+            FAIL() << "seed " << seed << " rule " << r.ruleno << " x " << x + i;
+        }
+        for (int p = FUZZ_REFERENCE + 1; p < FUZZ_PATHS; p++) {
+          if (paths[p] == NULL)
+            continue;
+          paths[p]->map(r, x, n, results.data(), result_lens.data());
+          for (int i = 0; i < n; i++) {
+            ASSERT_EQ(expected_lens[i], result_lens[i])
+              << fuzz_path_names[p] << " seed " << seed << " rule " << r.ruleno
+              << " x " << x + i;
+            for (int j = 0; j < expected_lens[i]; j++)
+              ASSERT_EQ(expected[i * r.result_max + j], results[i * r.result_max + j])
+                << fuzz_path_names[p] << " seed " << seed << " rule " << r.ruleno
+                << " x " << x + i;
+          }
+        }
+      }
+    }
+    for (fuzz_path *path : paths)
+      delete path;
+    fuzz_destroy_map(&f);
+  }
+  // some rules run the specialized executors
+  if (maps >= 10)
+    ASSERT_LT(0, specialized);
+}
+
+// Local Variables:
+// compile-command: "cd ../build ; make unittest_fuzz && valgrind --tool=memcheck test/unittest_fuzz"
+// End:
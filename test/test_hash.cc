@@ -0,0 +1,88 @@
+#include <gtest/gtest.h>
+
+extern "C" {
+#include "crush/hash.h"
+}
+
+TEST(hash, crush_hash32_rjenkins1) {
+  // values computed before the rjenkins1 functions were inlined
+  EXPECT_EQ(3574081617u, crush_hash32(CRUSH_HASH_RJENKINS1, 1));
+  EXPECT_EQ(3079532188u, crush_hash32_2(CRUSH_HASH_RJENKINS1, 1, 2));
+  EXPECT_EQ(1935332395u, crush_hash32_3(CRUSH_HASH_RJENKINS1, 1, 2, 3));
+  EXPECT_EQ(1768759062u, crush_hash32_4(CRUSH_HASH_RJENKINS1, 1, 2, 3, 4));
+  EXPECT_EQ(1262657953u, crush_hash32_5(CRUSH_HASH_RJENKINS1, 1, 2, 3, 4, 5));
+
+  for (__u32 a = 0; a < 1000; a++) {
+    __u32 b = a * 2654435761u, c = ~a, d = a << 7, e = a ^ 0x5a5a5a5a;
+    EXPECT_EQ(crush_hash32(CRUSH_HASH_RJENKINS1, a), crush_hash32_rjenkins1(a));
+    EXPECT_EQ(crush_hash32_2(CRUSH_HASH_RJENKINS1, a, b), crush_hash32_rjenkins1_2(a, b));
+    EXPECT_EQ(crush_hash32_3(CRUSH_HASH_RJENKINS1, a, b, c), crush_hash32_rjenkins1_3(a, b, c));
+    EXPECT_EQ(crush_hash32_4(CRUSH_HASH_RJENKINS1, a, b, c, d), crush_hash32_rjenkins1_4(a, b, c, d));
+    EXPECT_EQ(crush_hash32_5(CRUSH_HASH_RJENKINS1, a, b, c, d, e), crush_hash32_rjenkins1_5(a, b, c, d, e));
+  }
+}
+
+TEST(hash, crush_hash32_xxhash32) {
+  // XXH32 of the little endian words 1, 2, ... with the seed 1315423911
+  EXPECT_EQ(3343313156u, crush_hash32(CRUSH_HASH_XXHASH32, 1));
+  EXPECT_EQ(741498886u, crush_hash32_2(CRUSH_HASH_XXHASH32, 1, 2));
+  EXPECT_EQ(651604453u, crush_hash32_3(CRUSH_HASH_XXHASH32, 1, 2, 3));
+  EXPECT_EQ(2820895086u, crush_hash32_4(CRUSH_HASH_XXHASH32, 1, 2, 3, 4));
+  EXPECT_EQ(4046820811u, crush_hash32_5(CRUSH_HASH_XXHASH32, 1, 2, 3, 4, 5));
+  EXPECT_STREQ("xxhash32", crush_hash_name(CRUSH_HASH_XXHASH32));
+
+  // flipping a bit of an input flips each bit of the hash half of the time
+  const int samples = 2000;
+  for (int arg = 0; arg < 3; arg++) {
+    for (int bit = 0; bit < 32; bit++) {
+      int flips[32] = { 0 };
+      for (__u32 i = 0; i < samples; i++) {
+        __u32 in[3] = { i * 2654435761u, i, ~i * 40503u };
+        __u32 h = crush_hash32_3(CRUSH_HASH_XXHASH32, in[0], in[1], in[2]);
+        in[arg] ^= 1u << bit;
+        h ^= crush_hash32_3(CRUSH_HASH_XXHASH32, in[0], in[1], in[2]);
+        for (int j = 0; j < 32; j++)
+          flips[j] += (h >> j) & 1;
+      }
+      for (int j = 0; j < 32; j++) {
+        ASSERT_LT(samples * 4 / 10, flips[j]) << "arg " << arg << " bit " << bit;
+        ASSERT_GT(samples * 6 / 10, flips[j]) << "arg " << arg << " bit " << bit;
+      }
+    }
+  }
+}
+
+TEST(hash, crush_hash32_x8) {
+  __u32 b[CRUSH_HASH_LANES];
+  __u32 out[CRUSH_HASH_LANES];
+
+  for (__u32 a = 0; a < 1000; a++) {
+    __u32 c = a * 31 + 7, d = ~a;
+    for (int i = 0; i < CRUSH_HASH_LANES; i++)
+      b[i] = a * 2654435761u + i * 97;
+
+    for (int type : { CRUSH_HASH_RJENKINS1, CRUSH_HASH_XXHASH32 }) {
+      crush_hash32_2_x8(type, a, b, out);
+      for (int i = 0; i < CRUSH_HASH_LANES; i++)
+        ASSERT_EQ(crush_hash32_2(type, a, b[i]), out[i]);
+
+      crush_hash32_3_x8(type, a, b, c, out);
+      for (int i = 0; i < CRUSH_HASH_LANES; i++)
+        ASSERT_EQ(crush_hash32_3(type, a, b[i], c), out[i]);
+
+      crush_hash32_4_x8(type, a, b, c, d, out);
+      for (int i = 0; i < CRUSH_HASH_LANES; i++)
+        ASSERT_EQ(crush_hash32_4(type, a, b[i], c, d), out[i]);
+    }
+  }
+
+  // unknown hash types hash to zero, as the scalar functions
+  const int unknown = 200;
+  crush_hash32_3_x8(unknown, 1, b, 2, out);
+  for (int i = 0; i < CRUSH_HASH_LANES; i++)
+    ASSERT_EQ(crush_hash32_3(unknown, 1, b[i], 2), out[i]);
+}
+
+// Local Variables:
+// compile-command: "cd ../build ; make unittest_hash && valgrind --tool=memcheck test/unittest_hash"
+// End:
@@ -36,6 +36,8 @@ TEST(helpers, crush_find_roots) {
 
   ASSERT_EQ(crush_bucket_add_item(m, first, -200, 0x1000), 0);
   ASSERT_EQ(crush_find_roots(m, &roots), -EINVAL);
+  m->changes_tracked = 0;
+  ASSERT_EQ(crush_find_roots(m, &roots), -EINVAL);
 
   crush_destroy(m);
 }
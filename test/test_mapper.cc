@@ -1,5 +1,6 @@
 #include <gtest/gtest.h>
 
+#include <errno.h>
 #include <list>
 
 extern "C" {
@@ -7,6 +8,7 @@ extern "C" {
 #include "builder.h"
 #include "mapper.h"
 }
+#include "hosts.h"
 
 TEST(mapper, crush_do_rule_choose_arg) {
   crush_map *m = crush_create();
@@ -291,6 +293,708 @@ TEST(mapper, crush_do_rule_choose_arg) {
   crush_destroy(m);
 }
 
+// 1, 2 and 3 in turn over all the devices
+static crush_map *build_mapper_hosts(int alg, int host_count, int b_size,
+                                     int host_type, int *rootno)
+{
+  return build_hosts_map(alg, host_count, b_size, host_type, rootno,
+                         [b_size](int host, int i) {
+                           return 0x10000 * (1 + (host * b_size + i) % 3);
+                         });
+}
+
+TEST(mapper, crush_do_rule_batch) {
+  const int host_type = 1;
+  const int host_count = 8;
+  const int b_size = 5;
+  int rootno = 0;
+  crush_map *m = build_mapper_hosts(CRUSH_BUCKET_STRAW2, host_count, b_size,
+                                    host_type, &rootno);
+
+  std::vector<int> rules;
+  for (auto op : { CRUSH_RULE_CHOOSELEAF_FIRSTN, CRUSH_RULE_CHOOSELEAF_INDEP,
+                   CRUSH_RULE_CHOOSE_FIRSTN, CRUSH_RULE_CHOOSE_INDEP })
+    rules.push_back(add_simple_rule(m, rootno, op, host_type));
+  {
+    // a rule overriding tunables half way through
+    struct crush_rule *rule = crush_make_rule(6, 0, 0, 0, 0);
+    crush_rule_set_step(rule, 0, CRUSH_RULE_SET_CHOOSE_TRIES, 3, 0);
+    crush_rule_set_step(rule, 1, CRUSH_RULE_TAKE, rootno, 0);
+    crush_rule_set_step(rule, 2, CRUSH_RULE_CHOOSE_FIRSTN, 2, host_type);
+    crush_rule_set_step(rule, 3, CRUSH_RULE_SET_CHOOSELEAF_VARY_R, 0, 0);
+    crush_rule_set_step(rule, 4, CRUSH_RULE_CHOOSELEAF_FIRSTN, 1, 0);
+    crush_rule_set_step(rule, 5, CRUSH_RULE_EMIT, 0, 0);
+    rules.push_back(crush_add_rule(m, rule, -1));
+  }
+
+  const int device_count = host_count * b_size;
+  __u32 weights[device_count];
+  for (int i = 0; i < device_count; i++)
+    weights[i] = (i % 7) == 0 ? 0 : (i % 5) == 0 ? 0x8000 : 0x10000;
+
+  const int result_max = 3;
+  const int n = 1000;
+  std::vector<int> xs(n);
+  for (int i = 0; i < n; i++)
+    xs[i] = i * 7919;
+
+  int cwin_size = crush_work_size(m, result_max);
+  char cwin[cwin_size];
+  crush_init_workspace(m, cwin);
+
+  struct crush_choose_arg *choose_args = crush_make_choose_args(m, result_max);
+  choose_args[-1-(-2)].weight_set[0].weights[0] = 0x50000;
+
+  for (auto ruleno : rules) {
+    for (auto args : { (struct crush_choose_arg *)NULL, choose_args }) {
+      std::vector<int> results(n * result_max);
+      std::vector<int> result_lens(n);
+      ASSERT_EQ(n, crush_do_rule_batch(m, ruleno, xs.data(), n,
+                                       results.data(), result_max,
+                                       result_lens.data(),
+                                       weights, device_count,
+                                       cwin, args));
+      for (int i = 0; i < n; i++) {
+        int result[result_max];
+        int result_len = crush_do_rule(m, ruleno, xs[i], result, result_max,
+                                       weights, device_count, cwin, args);
+        ASSERT_EQ(result_len, result_lens[i]);
+        for (int j = 0; j < result_len; j++)
+          ASSERT_EQ(result[j], results[i * result_max + j]);
+      }
+    }
+  }
+
+  int result_len = 1;
+  int result[result_max];
+  ASSERT_EQ(0, crush_do_rule_batch(m, CRUSH_MAX_RULES - 1, xs.data(), 1,
+                                   result, result_max, &result_len,
+                                   weights, device_count, cwin, NULL));
+  ASSERT_EQ(0, result_len);
+
+  crush_destroy_choose_args(choose_args);
+  crush_destroy(m);
+}
+
+TEST(mapper, crush_init_workspace) {
+  const int host_type = 1;
+  const int host_count = 8;
+  const int b_size = 5;
+  int rootno = 0;
+  {
+    // only the uniform buckets have a permutation of their own
+    crush_map *m = build_mapper_hosts(CRUSH_BUCKET_STRAW2, host_count, b_size,
+                                      host_type, &rootno);
+    ASSERT_EQ((__u32)host_count, m->shared_perm_size);
+    ASSERT_EQ(sizeof(crush_work) + m->max_buckets * sizeof(crush_work_bucket *) +
+              CRUSH_WORK_BUCKET_SIZE(host_count) +
+              (m->choose_total_tries + 1) * sizeof(__u32), m->working_size);
+    crush_destroy(m);
+  }
+
+  for (auto alg : { CRUSH_BUCKET_UNIFORM, CRUSH_BUCKET_LIST, CRUSH_BUCKET_STRAW }) {
+    crush_map *m = build_mapper_hosts(alg, host_count, b_size, host_type, &rootno);
+    // the local fallback retries choose from a permutation of any bucket
+    m->choose_local_tries = 2;
+    m->choose_local_fallback_tries = 5;
+    m->choose_total_tries = 19;
+    m->chooseleaf_descend_once = 0;
+    crush_finalize(m);
+    int ruleno = add_simple_rule(m, rootno, CRUSH_RULE_CHOOSELEAF_FIRSTN, host_type);
+
+    const int device_count = host_count * b_size;
+    __u32 weights[device_count];
+    for (int i = 0; i < device_count; i++)
+      weights[i] = i % 3 ? 0 : 0x10000;
+    const int result_max = 3;
+    int cwin_size = crush_work_size(m, result_max);
+    char cwin[cwin_size];
+    char fresh_cwin[cwin_size];
+    crush_init_workspace(m, cwin);
+    for (int x = 0; x < 1000; x++) {
+      // the permutations laid out for the previous values do not matter
+      int expected[result_max], result[result_max];
+      crush_init_workspace(m, fresh_cwin);
+      int expected_len = crush_do_rule(m, ruleno, x, expected, result_max,
+                                       weights, device_count, fresh_cwin, NULL);
+      ASSERT_EQ(expected_len, crush_do_rule(m, ruleno, x, result, result_max,
+                                            weights, device_count, cwin, NULL));
+      for (int i = 0; i < expected_len; i++)
+        ASSERT_EQ(expected[i], result[i]);
+    }
+    crush_destroy(m);
+  }
+}
+
+// the permutation of a uniform bucket computed from scratch
+static std::vector<int> reference_perm(const crush_bucket *b, int x)
+{
+  std::vector<int> perm(b->size);
+  for (__u32 i = 0; i < b->size; i++)
+    perm[i] = i;
+  for (__u32 p = 0; p + 1 < b->size; p++) {
+    __u32 i = crush_hash32_3(b->hash, x, b->id, p) % (b->size - p);
+    std::swap(perm[p], perm[p + i]);
+  }
+  return perm;
+}
+
+TEST(mapper, bucket_perm_choose) {
+  for (int size : { 1, 2, 7, 300 }) {
+    crush_map *m = crush_create();
+    std::vector<int> items(size), weights(size, 0x10000);
+    for (int i = 0; i < size; i++)
+      items[i] = i;
+    crush_bucket *b = crush_make_bucket(m, CRUSH_BUCKET_UNIFORM, CRUSH_HASH_DEFAULT, 1,
+                                        size, items.data(), weights.data());
+    int bno;
+    ASSERT_EQ(0, crush_add_bucket(m, 0, b, &bno));
+    crush_finalize(m);
+    int ruleno = add_simple_rule(m, bno, CRUSH_RULE_CHOOSE_FIRSTN, 0);
+
+    // most devices are out and the permutations go deep
+    std::vector<__u32> device_weights(size);
+    for (int i = 0; i < size; i++)
+      device_weights[i] = i % 10 == 3 || size < 10 ? 0x10000 : 0;
+    const int result_max = 3;
+    char cwin[crush_work_size(m, result_max)];
+    crush_init_workspace(m, cwin);
+    for (int x = 0; x < 2000; x++) {
+      // the first devices that are in, in the order of the permutation
+      std::vector<int> expected;
+      for (int s : reference_perm(b, x))
+        if (device_weights[s] && (int)expected.size() < result_max)
+          expected.push_back(items[s]);
+      int result[result_max];
+      int len = crush_do_rule(m, ruleno, x, result, result_max,
+                              device_weights.data(), size, cwin, NULL);
+      // unless all the tries were rejected
+      ASSERT_GE((int)expected.size(), len) << "x " << x << " size " << size;
+      if (size < 10)
+        ASSERT_EQ((int)expected.size(), len);
+      for (int i = 0; i < len; i++)
+        ASSERT_EQ(expected[i], result[i]) << "x " << x << " size " << size;
+    }
+    crush_destroy(m);
+  }
+}
+
+TEST(mapper, straw2_fast_paths) {
+  unsigned int fast_paths = crush_get_fast_paths();
+  const int result_max = 1;
+
+  for (int size = 1; size < 70; size += 3)
+  for (int hash : { CRUSH_HASH_RJENKINS1, CRUSH_HASH_XXHASH32 }) {
+    crush_map *m = crush_create();
+    std::vector<int> items(size), weights(size);
+    for (int i = 0; i < size; i++) {
+      items[i] = i;
+      // a few zero weights and a wide range of others
+      weights[i] = (i % 11) == 3 ? 0 : 0x100 * (1 + (i * 37) % 4000);
+    }
+    crush_bucket *b = crush_make_bucket(m, CRUSH_BUCKET_STRAW2, hash, 1,
+                                        size, items.data(), weights.data());
+    int bno = 0;
+    ASSERT_EQ(0, crush_add_bucket(m, 0, b, &bno));
+    crush_finalize(m);
+    int ruleno = add_simple_rule(m, bno, CRUSH_RULE_CHOOSE_FIRSTN, 0);
+
+    std::vector<__u32> device_weights(size, 0x10000);
+    int cwin_size = crush_work_size(m, result_max);
+    char cwin[cwin_size];
+    crush_init_workspace(m, cwin);
+
+    struct crush_choose_arg *choose_args = crush_make_choose_args(m, 1);
+    // identical ids and weights draw identical straws: the first wins
+    struct crush_choose_arg *ties = crush_make_choose_args(m, 1);
+    for (int i = 0; i < size; i++) {
+      ties[-1-bno].ids[i] = 42;
+      ties[-1-bno].weight_set[0].weights[i] = 0x10000;
+    }
+    ties[-1-bno].weight_set[0].weights[0] = 0;
+
+    for (auto args : { (struct crush_choose_arg *)NULL, choose_args, ties }) {
+      for (int x = 0; x < 2000; x++) {
+        int expected[result_max];
+        crush_set_fast_paths(0);
+        int expected_len = crush_do_rule(m, ruleno, x, expected, result_max,
+                                         device_weights.data(), size, cwin, args);
+        for (auto mask : { CRUSH_FAST_PATH_AVX2, CRUSH_FAST_PATH_AVX512 }) {
+          int result[result_max];
+          crush_set_fast_paths(mask);
+          ASSERT_EQ(expected_len, crush_do_rule(m, ruleno, x, result, result_max,
+                                                device_weights.data(), size, cwin, args));
+          ASSERT_EQ(expected[0], result[0]) << "size " << size << " x " << x;
+        }
+        if (args == ties)
+          ASSERT_EQ(size > 1 ? 1 : 0, expected[0]);
+      }
+    }
+    crush_set_fast_paths(fast_paths);
+
+    crush_destroy_choose_args(ties);
+    crush_destroy_choose_args(choose_args);
+    crush_destroy(m);
+  }
+}
+
+TEST(mapper, xxhash32) {
+  const int result_max = 1;
+  std::vector<int> mapped[2];
+
+  for (int hash : { CRUSH_HASH_RJENKINS1, CRUSH_HASH_XXHASH32 }) {
+    crush_map *m = crush_create();
+    int items[2] = { 0, 1 };
+    int weights[2] = { 0x10000, 0x10000 };
+    crush_bucket *b = crush_make_bucket(m, CRUSH_BUCKET_STRAW2, hash, 1,
+                                        1, items, weights);
+    int bno = 0;
+    ASSERT_EQ(0, crush_add_bucket(m, 0, b, &bno));
+    crush_bucket *pair = crush_make_bucket(m, CRUSH_BUCKET_STRAW2, hash, 1,
+                                           2, items, weights);
+    int pairno = 0;
+    ASSERT_EQ(0, crush_add_bucket(m, 0, pair, &pairno));
+    crush_finalize(m);
+    int ruleno = add_simple_rule(m, bno, CRUSH_RULE_CHOOSE_FIRSTN, 0);
+    int pair_ruleno = add_simple_rule(m, pairno, CRUSH_RULE_CHOOSE_FIRSTN, 0);
+
+    // the only device, half out, is out for the values the hash of the
+    // bucket rejects
+    __u32 device_weights[2] = { 0x8000, 0x10000 };
+    int cwin_size = crush_work_size(m, result_max);
+    char cwin[cwin_size];
+    crush_init_workspace(m, cwin);
+    for (int x = 0; x < 1000; x++) {
+      int result[result_max];
+      int expected = (crush_hash32_2(hash, x, 0) & 0xffff) < device_weights[0];
+      ASSERT_EQ(expected, crush_do_rule(m, ruleno, x, result, result_max,
+                                        device_weights, 2, cwin, NULL)) << x;
+
+      __u32 in[2] = { 0x10000, 0x10000 };
+      ASSERT_EQ(1, crush_do_rule(m, pair_ruleno, x, result, result_max,
+                                 in, 2, cwin, NULL));
+      mapped[hash == CRUSH_HASH_XXHASH32].push_back(result[0]);
+    }
+    crush_destroy(m);
+  }
+  // both hashes spread the values evenly, but not in the same way
+  int ones[2] = { 0, 0 }, differ = 0;
+  for (int x = 0; x < 1000; x++) {
+    ones[0] += mapped[0][x];
+    ones[1] += mapped[1][x];
+    differ += mapped[0][x] != mapped[1][x];
+  }
+  ASSERT_NEAR(500, ones[0], 60);
+  ASSERT_NEAR(500, ones[1], 60);
+  ASSERT_NEAR(500, differ, 60);
+}
+
+TEST(mapper, straw2_recips) {
+  const int host_type = 1;
+  const int host_count = 6;
+  const int b_size = 20;
+  int rootno = 0;
+  crush_map *m = build_mapper_hosts(CRUSH_BUCKET_STRAW2, host_count, b_size,
+                                    host_type, &rootno);
+  int ruleno = add_simple_rule(m, rootno, CRUSH_RULE_CHOOSELEAF_FIRSTN, host_type);
+  const int device_count = host_count * b_size;
+  std::vector<__u32> device_weights(device_count, 0x10000);
+  const int result_max = 3;
+  int cwin_size = crush_work_size(m, result_max);
+  char cwin[cwin_size];
+  crush_init_workspace(m, cwin);
+
+  struct crush_choose_arg *choose_args = crush_make_choose_args(m, result_max);
+  for (int b = 0; b < m->max_buckets; b++)
+    for (__u32 position = 0; position < choose_args[b].weight_set_size; position++) {
+      crush_weight_set *ws = &choose_args[b].weight_set[position];
+      for (__u32 i = 0; i < ws->size; i++)
+        ws->weights[i] = ws->weights[i] / (position + 1) + i * 0x1357;
+      // the reciprocals of the first position are left stale
+      if (position > 0)
+        crush_update_straw2_recips(ws->recips, ws->weights, ws->size);
+    }
+
+  unsigned int fast_paths = crush_get_fast_paths();
+  for (auto mask : { 0u, fast_paths }) {
+    crush_set_fast_paths(mask);
+    for (auto args : { (struct crush_choose_arg *)NULL, choose_args }) {
+      for (int x = 0; x < 2000; x++) {
+        int result[result_max];
+        int result_len = crush_do_rule(m, ruleno, x, result, result_max,
+                                       device_weights.data(), device_count,
+                                       cwin, args);
+        // the same mapping without the reciprocals
+        std::vector<crush_straw2_recip *> saved;
+        for (int b = 0; b < host_count + 1; b++) {
+          crush_bucket_straw2 *bucket = (crush_bucket_straw2 *)m->buckets[b];
+          saved.push_back(bucket->item_recips);
+          bucket->item_recips = NULL;
+          for (__u32 position = 0; position < choose_args[b].weight_set_size; position++) {
+            saved.push_back(choose_args[b].weight_set[position].recips);
+            choose_args[b].weight_set[position].recips = NULL;
+          }
+        }
+        int expected[result_max];
+        ASSERT_EQ(result_len, crush_do_rule(m, ruleno, x, expected, result_max,
+                                            device_weights.data(), device_count,
+                                            cwin, args));
+        for (int j = 0; j < result_len; j++)
+          ASSERT_EQ(expected[j], result[j]) << "x " << x;
+        auto i = saved.begin();
+        for (int b = 0; b < host_count + 1; b++) {
+          ((crush_bucket_straw2 *)m->buckets[b])->item_recips = *i++;
+          for (__u32 position = 0; position < choose_args[b].weight_set_size; position++)
+            choose_args[b].weight_set[position].recips = *i++;
+        }
+      }
+    }
+  }
+  crush_set_fast_paths(fast_paths);
+
+  crush_destroy_choose_args(choose_args);
+  crush_destroy(m);
+}
+
+TEST(mapper, optimal_tunables) {
+  const int host_type = 1;
+  const int host_count = 6;
+  const int b_size = 5;
+  const int device_count = host_count * b_size;
+  // out, partially out and in devices to retry descents
+  std::vector<__u32> weights(device_count);
+  for (int i = 0; i < device_count; i++)
+    weights[i] = (i % 3) == 0 ? 0 : (i % 3) == 1 ? 0x8000 : 0x10000;
+  const int result_max = 4;
+  unsigned int fast_paths = crush_get_fast_paths();
+
+  for (int alg : { CRUSH_BUCKET_UNIFORM, CRUSH_BUCKET_LIST, CRUSH_BUCKET_TREE,
+                   CRUSH_BUCKET_STRAW, CRUSH_BUCKET_STRAW2 }) {
+    int rootno = 0;
+    crush_map *m = build_mapper_hosts(alg, host_count, b_size, host_type, &rootno);
+    std::vector<int> rules;
+    for (int op : { CRUSH_RULE_CHOOSE_FIRSTN, CRUSH_RULE_CHOOSELEAF_FIRSTN,
+                    CRUSH_RULE_CHOOSE_INDEP, CRUSH_RULE_CHOOSELEAF_INDEP })
+      rules.push_back(add_simple_rule(m, rootno, op, host_type));
+    rules.push_back(add_simple_rule(m, rootno, CRUSH_RULE_CHOOSE_FIRSTN, 0));
+    int cwin_size = crush_work_size(m, result_max);
+    char cwin[cwin_size];
+    crush_init_workspace(m, cwin);
+    const int size = m->choose_total_tries + 1;
+
+    // the tunables of set_optimal_crush_map() and others
+    for (int vary_r : { 1, 0 }) {
+      m->chooseleaf_vary_r = vary_r;
+      for (int ruleno : rules) {
+        std::vector<__u32> tries[2];
+        std::vector<int> results[2];
+        for (int optimal = 0; optimal < 2; optimal++) {
+          crush_set_fast_paths(optimal ? fast_paths :
+                               fast_paths & ~CRUSH_FAST_PATH_OPTIMAL_TUNABLES);
+          crush_clear_choose_tries(cwin);
+          for (int x = 0; x < 1000; x++) {
+            int result[result_max];
+            int result_len = crush_do_rule(m, ruleno, x, result, result_max,
+                                           weights.data(), device_count, cwin, NULL);
+            results[optimal].push_back(result_len);
+            results[optimal].insert(results[optimal].end(), result, result + result_len);
+          }
+          tries[optimal].resize(size);
+          crush_merge_choose_tries(cwin, tries[optimal].data(), size);
+        }
+        ASSERT_EQ(results[0], results[1]) << "alg " << alg << " rule " << ruleno;
+        ASSERT_EQ(tries[0], tries[1]) << "alg " << alg << " rule " << ruleno;
+      }
+    }
+    crush_destroy(m);
+  }
+  ASSERT_TRUE(fast_paths & CRUSH_FAST_PATH_OPTIMAL_TUNABLES);
+  crush_set_fast_paths(fast_paths);
+}
+
+TEST(mapper, crush_merge_choose_tries) {
+  const int host_type = 1;
+  const int host_count = 5;
+  const int b_size = 4;
+  int rootno = 0;
+  crush_map *m = build_mapper_hosts(CRUSH_BUCKET_STRAW2, host_count, b_size,
+                                    host_type, &rootno);
+  int ruleno = add_simple_rule(m, rootno, CRUSH_RULE_CHOOSELEAF_FIRSTN, host_type);
+  const int device_count = host_count * b_size;
+  // half of the devices are out and need retries
+  std::vector<__u32> weights(device_count);
+  for (int i = 0; i < device_count; i++)
+    weights[i] = (i % 2) ? 0 : 0x10000;
+
+  const int result_max = 3;
+  const int threads = 2;
+  int cwin_size = crush_work_size(m, result_max);
+  std::vector<std::vector<char>> cwin(threads, std::vector<char>(cwin_size));
+  char all[cwin_size];
+  crush_init_workspace(m, all);
+  for (int t = 0; t < threads; t++)
+    crush_init_workspace(m, cwin[t].data());
+
+  const int size = m->choose_total_tries + 1;
+  std::vector<__u32> choose_tries(size, 0);
+  ASSERT_EQ(size, crush_merge_choose_tries(all, choose_tries.data(), size));
+  for (int i = 0; i < size; i++)
+    ASSERT_EQ(0u, choose_tries[i]);
+
+  int found = 0;
+  for (int x = 0; x < 1000; x++) {
+    int result[result_max];
+    found += crush_do_rule(m, ruleno, x, result, result_max,
+                           weights.data(), device_count, all, NULL);
+    crush_do_rule(m, ruleno, x, result, result_max,
+                  weights.data(), device_count, cwin[x % threads].data(), NULL);
+  }
+  ASSERT_EQ(NULL, m->choose_tries);
+
+  std::vector<__u32> expected(size, 0);
+  crush_merge_choose_tries(all, expected.data(), size);
+  __u32 total = 0, retried = 0;
+  for (int i = 0; i < size; i++) {
+    total += expected[i];
+    if (i > 0)
+      retried += expected[i];
+  }
+  // a host and a device in it for each item found
+  ASSERT_EQ(2 * (__u32)found, total);
+  ASSERT_LT(0u, retried);
+
+  for (int t = 0; t < threads; t++)
+    crush_merge_choose_tries(cwin[t].data(), choose_tries.data(), size);
+  for (int i = 0; i < size; i++)
+    ASSERT_EQ(expected[i], choose_tries[i]);
+
+  crush_clear_choose_tries(all);
+  std::vector<__u32> cleared(size, 0);
+  crush_merge_choose_tries(all, cleared.data(), size);
+  for (int i = 0; i < size; i++)
+    ASSERT_EQ(0u, cleared[i]);
+
+  crush_destroy(m);
+}
+
+static void expect_same_as_do_rule(crush_map *m, int ruleno,
+                                   const std::vector<__u32> &weights,
+                                   crush_choose_arg *choose_args)
+{
+  const int result_max = 4;
+  const int size = m->choose_total_tries + 1;
+  int cwin_size = crush_work_size(m, result_max);
+  std::vector<char> expected_cwin(cwin_size), cwin(cwin_size);
+  crush_init_workspace(m, expected_cwin.data());
+  crush_init_workspace(m, cwin.data());
+  crush_track_visited(expected_cwin.data(), 1);
+  crush_track_visited(cwin.data(), 1);
+  crush_rule_executor e;
+  ASSERT_LE(0, crush_make_rule_executor(m, ruleno, &e));
+  for (int x = 0; x < 200; x++) {
+    int expected[result_max];
+    int expected_len = crush_do_rule(m, ruleno, x, expected, result_max,
+                                     weights.data(), weights.size(),
+                                     expected_cwin.data(), choose_args);
+    int result[result_max];
+    int result_len = crush_execute_rule(&e, x, result, result_max,
+                                        weights.data(), weights.size(),
+                                        cwin.data(), choose_args);
+    ASSERT_EQ(expected_len, result_len) << "rule " << ruleno << " x " << x;
+    for (int i = 0; i < result_len; i++)
+      ASSERT_EQ(expected[i], result[i]) << "rule " << ruleno << " x " << x;
+    ASSERT_EQ(crush_get_visited(expected_cwin.data()), crush_get_visited(cwin.data()));
+  }
+  std::vector<__u32> expected_tries(size, 0), tries(size, 0);
+  crush_merge_choose_tries(expected_cwin.data(), expected_tries.data(), size);
+  crush_merge_choose_tries(cwin.data(), tries.data(), size);
+  for (int i = 0; i < size; i++)
+    ASSERT_EQ(expected_tries[i], tries[i]);
+}
+
+TEST(mapper, crush_make_rule_executor) {
+  const int host_type = 1;
+  const int host_count = 8;
+  const int b_size = 4;
+  int rootno = 0;
+  crush_map *m = build_mapper_hosts(CRUSH_BUCKET_STRAW2, host_count, b_size,
+                                    host_type, &rootno);
+  const int device_count = host_count * b_size;
+  std::vector<__u32> weights(device_count, 0x10000);
+  for (int i = 0; i < device_count; i++)
+    if (i % 7 == 0)
+      weights[i] = 0;
+    else if (i % 5 == 1)
+      weights[i] = 0x8000;
+  crush_choose_arg *choose_args = crush_make_choose_args(m, 4);
+  ASSERT_TRUE(choose_args != NULL);
+
+  crush_rule_executor e;
+  ASSERT_EQ(-EINVAL, crush_make_rule_executor(m, 0, &e));
+
+  for (int op : { CRUSH_RULE_CHOOSELEAF_FIRSTN, CRUSH_RULE_CHOOSE_FIRSTN,
+                  CRUSH_RULE_CHOOSELEAF_INDEP, CRUSH_RULE_CHOOSE_INDEP })
+    for (int numrep : { 0, 2, -1 })
+      for (int vary_r : { 0, 1 })
+        for (int stable : { 0, 1 })
+          for (int local_tries : { 0, 2 }) {
+            struct crush_rule *rule = crush_make_rule(6, 0, 0, 0, 0);
+            crush_rule_set_step(rule, 0, CRUSH_RULE_SET_CHOOSELEAF_VARY_R, vary_r, 0);
+            crush_rule_set_step(rule, 1, CRUSH_RULE_SET_CHOOSELEAF_STABLE, stable, 0);
+            crush_rule_set_step(rule, 2, CRUSH_RULE_SET_CHOOSE_LOCAL_TRIES, local_tries, 0);
+            crush_rule_set_step(rule, 3, CRUSH_RULE_TAKE, rootno, 0);
+            crush_rule_set_step(rule, 4, op, numrep,
+                                (op == CRUSH_RULE_CHOOSE_FIRSTN && stable) ? 0 : host_type);
+            crush_rule_set_step(rule, 5, CRUSH_RULE_EMIT, 0, 0);
+            int ruleno = crush_add_rule(m, rule, -1);
+            ASSERT_EQ(1, crush_make_rule_executor(m, ruleno, &e));
+            expect_same_as_do_rule(m, ruleno, weights, NULL);
+            expect_same_as_do_rule(m, ruleno, weights, choose_args);
+          }
+
+  {
+    // not specialized
+    struct crush_rule *rule = crush_make_rule(4, 0, 0, 0, 0);
+    crush_rule_set_step(rule, 0, CRUSH_RULE_SET_CHOOSELEAF_VARY_R, 2, 0);
+    crush_rule_set_step(rule, 1, CRUSH_RULE_TAKE, rootno, 0);
+    crush_rule_set_step(rule, 2, CRUSH_RULE_CHOOSELEAF_FIRSTN, 0, host_type);
+    crush_rule_set_step(rule, 3, CRUSH_RULE_EMIT, 0, 0);
+    int ruleno = crush_add_rule(m, rule, -1);
+    ASSERT_EQ(0, crush_make_rule_executor(m, ruleno, &e));
+    expect_same_as_do_rule(m, ruleno, weights, NULL);
+
+    rule = crush_make_rule(5, 0, 0, 0, 0);
+    crush_rule_set_step(rule, 0, CRUSH_RULE_TAKE, rootno, 0);
+    crush_rule_set_step(rule, 1, CRUSH_RULE_CHOOSE_FIRSTN, 2, host_type);
+    crush_rule_set_step(rule, 2, CRUSH_RULE_CHOOSELEAF_FIRSTN, 1, 0);
+    crush_rule_set_step(rule, 3, CRUSH_RULE_EMIT, 0, 0);
+    crush_rule_set_step(rule, 4, CRUSH_RULE_NOOP, 0, 0);
+    ruleno = crush_add_rule(m, rule, -1);
+    ASSERT_EQ(0, crush_make_rule_executor(m, ruleno, &e));
+    expect_same_as_do_rule(m, ruleno, weights, NULL);
+  }
+  crush_destroy_choose_args(choose_args);
+  crush_destroy(m);
+
+  m = build_mapper_hosts(CRUSH_BUCKET_LIST, host_count, b_size, host_type, &rootno);
+  int ruleno = add_simple_rule(m, rootno, CRUSH_RULE_CHOOSELEAF_FIRSTN, host_type);
+  ASSERT_EQ(0, crush_make_rule_executor(m, ruleno, &e));
+  expect_same_as_do_rule(m, ruleno, weights, NULL);
+  crush_destroy(m);
+}
+
+#ifdef CRUSH_TRACE
+static void record_trace_event(const struct crush_trace_event *event, void *arg)
+{
+  static_cast<std::vector<crush_trace_event> *>(arg)->push_back(*event);
+}
+
+TEST(mapper, crush_set_trace) {
+  const int host_type = 1;
+  const int host_count = 5;
+  const int b_size = 4;
+  int rootno = 0;
+  crush_map *m = build_mapper_hosts(CRUSH_BUCKET_STRAW2, host_count, b_size,
+                                    host_type, &rootno);
+  const int device_count = host_count * b_size;
+  // a third of the devices are out and another third partially out
+  std::vector<__u32> weights(device_count);
+  for (int i = 0; i < device_count; i++)
+    weights[i] = (i % 3 == 0) ? 0 : (i % 3 == 1) ? 0x8000 : 0x10000;
+
+  const int result_max = 3;
+  char cwin[crush_work_size(m, result_max)];
+  crush_init_workspace(m, cwin);
+
+  // take, choose and emit
+  const int steps = 3;
+  std::vector<crush_trace_event> events;
+  crush_trace_stats stats[steps];
+  crush_trace trace;
+  trace.steps = stats;
+  trace.max_steps = steps;
+  trace.fn = record_trace_event;
+  trace.arg = &events;
+  ASSERT_EQ(0, crush_set_trace(cwin, &trace));
+
+  for (int op : { CRUSH_RULE_CHOOSELEAF_FIRSTN, CRUSH_RULE_CHOOSELEAF_INDEP }) {
+    int ruleno = add_simple_rule(m, rootno, op, host_type);
+    __u32 hashes = 0, draws = 0;
+    for (int x = 0; x < 100; x++) {
+      memset(stats, 0, sizeof(stats));
+      events.clear();
+      int result[result_max];
+      int len = crush_do_rule(m, ruleno, x, result, result_max,
+                              weights.data(), device_count, cwin, NULL);
+
+      crush_trace_stats counted;
+      memset(&counted, 0, sizeof(counted));
+      int found = 0;
+      for (const crush_trace_event &event : events) {
+        ASSERT_EQ(1, event.step);
+        switch (event.type) {
+        case CRUSH_TRACE_CHOOSE:
+          counted.buckets++;
+          draws += m->buckets[-1-event.bucket]->size;
+          break;
+        case CRUSH_TRACE_COLLIDE: counted.collisions++; break;
+        case CRUSH_TRACE_REJECT: counted.rejections++; break;
+        case CRUSH_TRACE_RETRY_BUCKET: counted.local_retries++; break;
+        case CRUSH_TRACE_RETRY_DESCENT: counted.descent_retries++; break;
+        case CRUSH_TRACE_SKIP: counted.skipped++; break;
+        case CRUSH_TRACE_PLACE:
+          counted.placed++;
+          if (event.bucket == rootno) {
+            ASSERT_GT(0, event.item);
+            found++;
+          } else {
+            ASSERT_LE(0, event.item);
+            ASSERT_LT(0u, weights[event.item]);
+          }
+          break;
+        default:
+          FAIL() << "unknown event " << event.type;
+        }
+      }
+      hashes += stats[1].hashes;
+      // no item is chosen by the take and emit steps
+      ASSERT_EQ(0u, stats[0].buckets);
+      ASSERT_EQ(0u, stats[2].buckets);
+      ASSERT_EQ(counted.buckets, stats[1].buckets);
+      ASSERT_EQ(counted.collisions, stats[1].collisions);
+      ASSERT_EQ(counted.rejections, stats[1].rejections);
+      ASSERT_EQ(counted.local_retries, stats[1].local_retries);
+      ASSERT_EQ(counted.descent_retries, stats[1].descent_retries);
+      ASSERT_EQ(counted.skipped, stats[1].skipped);
+      ASSERT_EQ(counted.placed, stats[1].placed);
+      // a host and a device in it for each item found
+      ASSERT_EQ(2 * (__u32)found, stats[1].placed);
+      int expected = 0;
+      for (int i = 0; i < len; i++)
+        if (result[i] != CRUSH_ITEM_NONE)
+          expected++;
+      ASSERT_EQ(expected, found);
+    }
+    // the partially out devices need a hash to tell if they are out
+    ASSERT_LT(draws, hashes);
+  }
+
+  ASSERT_EQ(0, crush_set_trace(cwin, NULL));
+  events.clear();
+  int result[result_max];
+  crush_do_rule(m, 0, 1, result, result_max,
+                weights.data(), device_count, cwin, NULL);
+  ASSERT_TRUE(events.empty());
+
+  crush_destroy(m);
+}
+#else
+TEST(mapper, crush_set_trace) {
+  char cwin[sizeof(struct crush_work)];
+  ASSERT_EQ(-EOPNOTSUPP, crush_set_trace(cwin, NULL));
+}
+#endif
+
 // Local Variables:
 // compile-command: "cd ../build ; make unittest_mapper && valgrind --tool=memcheck test/unittest_mapper"
 // End:
@@ -0,0 +1,192 @@
+#include <gtest/gtest.h>
+#include <errno.h>
+#include <algorithm>
+#include <vector>
+
+extern "C" {
+#include "crush/builder.h"
+#include "crush/hash.h"
+#include "crush/mapper.h"
+#include "crush/optimize.h"
+}
+#include "hosts.h"
+
+static const int host_type = 1;
+static const int host_count = 6;
+static const int b_size = 4;
+static const int device_count = host_count * b_size;
+
+static int optimize_weight(int host, int i)
+{
+  return 0x10000 * (1 + (host + i) % 4);
+}
+
+static crush_map *build_map(int alg, int *ruleno, std::vector<__u32> &targets)
+{
+  int rootno = 0;
+  crush_map *m = build_hosts_map(alg, host_count, b_size, host_type, &rootno,
+                                 optimize_weight);
+  targets.assign(device_count, 0);
+  for (int host = 0; host < host_count; host++)
+    for (int i = 0; i < b_size; i++)
+      targets[host * b_size + i] = optimize_weight(host, i);
+  *ruleno = add_simple_rule(m, rootno, CRUSH_RULE_CHOOSELEAF_FIRSTN, host_type);
+  return m;
+}
+
+TEST(optimize, crush_optimize_choose_args) {
+  int ruleno;
+  std::vector<__u32> targets;
+  crush_map *m = build_map(CRUSH_BUCKET_STRAW2, &ruleno, targets);
+  std::vector<__u32> weights(device_count, 0x10000);
+  const int result_max = 3;
+  const int positions = result_max;
+  const int n = 10000;
+  const int max_iterations = 40;
+  std::vector<int> xs(n);
+  for (int i = 0; i < n; i++)
+    xs[i] = i;
+
+  crush_choose_arg *single = crush_make_choose_args(m, positions);
+  crush_optimize_stats stats;
+  int accepted = crush_optimize_choose_args(m, ruleno, xs.data(), n, result_max,
+                                            weights.data(), weights.size(),
+                                            targets.data(), single,
+                                            max_iterations, 1, &stats);
+  ASSERT_LT(0, accepted);
+  EXPECT_EQ(accepted, stats.accepted);
+  EXPECT_GE(max_iterations, stats.iterations);
+  EXPECT_LT(stats.deviation_after, stats.deviation_before);
+  EXPECT_LE(n, stats.mapped);
+
+  // the weight sets are those that lead to deviation_after
+  crush_choose_arg *check = crush_make_choose_args(m, positions);
+  ASSERT_EQ(0, crush_copy_choose_args(m, check, single));
+  crush_optimize_stats again;
+  ASSERT_LE(0, crush_optimize_choose_args(m, ruleno, xs.data(), n, result_max,
+                                          weights.data(), weights.size(),
+                                          targets.data(), check,
+                                          0, 1, &again));
+  EXPECT_EQ(stats.deviation_after, again.deviation_before);
+  EXPECT_EQ(0, again.iterations);
+  crush_destroy_choose_args(check);
+
+  // the outcome does not depend on the number of threads
+  crush_choose_arg *parallel = crush_make_choose_args(m, positions);
+  ASSERT_EQ(accepted,
+            crush_optimize_choose_args(m, ruleno, xs.data(), n, result_max,
+                                       weights.data(), weights.size(),
+                                       targets.data(), parallel,
+                                       max_iterations, 4, NULL));
+  int ids[1];
+  EXPECT_EQ(0, crush_diff_choose_args(m, single, parallel, ids, 1));
+  crush_destroy_choose_args(parallel);
+  crush_destroy_choose_args(single);
+
+  // only the rules that exist
+  crush_choose_arg *args = crush_make_choose_args(m, positions);
+  EXPECT_EQ(-EINVAL, crush_optimize_choose_args(m, ruleno + 1, xs.data(), n, result_max,
+                                                weights.data(), weights.size(),
+                                                targets.data(), args,
+                                                max_iterations, 1, NULL));
+  EXPECT_EQ(-EINVAL, crush_optimize_choose_args(m, ruleno, xs.data(), n, 0,
+                                                weights.data(), weights.size(),
+                                                targets.data(), args,
+                                                max_iterations, 1, NULL));
+  crush_destroy_choose_args(args);
+  crush_destroy(m);
+
+  // only straw2 buckets
+  m = build_map(CRUSH_BUCKET_LIST, &ruleno, targets);
+  args = crush_make_choose_args(m, positions);
+  EXPECT_EQ(-EINVAL, crush_optimize_choose_args(m, ruleno, xs.data(), n, result_max,
+                                                weights.data(), weights.size(),
+                                                targets.data(), args,
+                                                max_iterations, 1, NULL));
+  crush_destroy_choose_args(args);
+  crush_destroy(m);
+}
+
+// the weight sets of bucket b at the positions p >= first are unchanged
+static void expect_unused(crush_map *m, const crush_choose_arg *args,
+                          const crush_choose_arg *initial, int b, int first)
+{
+  for (__u32 p = first; p < args[b].weight_set_size; p++)
+    ASSERT_TRUE(std::equal(args[b].weight_set[p].weights,
+                           args[b].weight_set[p].weights + args[b].weight_set[p].size,
+                           initial[b].weight_set[p].weights))
+      << "bucket " << m->buckets[b]->id << " position " << p;
+}
+
+TEST(optimize, indep) {
+  int ruleno;
+  std::vector<__u32> targets;
+  crush_map *m = build_map(CRUSH_BUCKET_STRAW2, &ruleno, targets);
+  struct crush_rule *rule = crush_make_rule(3, 0, 0, 0, 0);
+  crush_rule_set_step(rule, 0, CRUSH_RULE_TAKE, -1, 0);
+  crush_rule_set_step(rule, 1, CRUSH_RULE_CHOOSELEAF_INDEP, 0, host_type);
+  crush_rule_set_step(rule, 2, CRUSH_RULE_EMIT, 0, 0);
+  int leaf_ruleno = crush_add_rule(m, rule, -1);
+  rule = crush_make_rule(3, 0, 0, 0, 0);
+  crush_rule_set_step(rule, 0, CRUSH_RULE_TAKE, -1, 0);
+  crush_rule_set_step(rule, 1, CRUSH_RULE_CHOOSE_INDEP, 0, 0);
+  crush_rule_set_step(rule, 2, CRUSH_RULE_EMIT, 0, 0);
+  int choose_ruleno = crush_add_rule(m, rule, -1);
+  rule = crush_make_rule(4, 0, 0, 0, 0);
+  crush_rule_set_step(rule, 0, CRUSH_RULE_TAKE, -1, 0);
+  crush_rule_set_step(rule, 1, CRUSH_RULE_CHOOSE_INDEP, 0, host_type);
+  crush_rule_set_step(rule, 2, CRUSH_RULE_CHOOSE_INDEP, 1, 0);
+  crush_rule_set_step(rule, 3, CRUSH_RULE_EMIT, 0, 0);
+  int steps_ruleno = crush_add_rule(m, rule, -1);
+
+  std::vector<__u32> weights(device_count, 0x10000);
+  const int result_max = 3;
+  const int positions = result_max;
+  const int n = 10000;
+  const int max_iterations = 40;
+  std::vector<int> xs(n);
+  for (int i = 0; i < n; i++)
+    xs[i] = i;
+  crush_choose_arg *initial = crush_make_choose_args(m, positions);
+
+  for (int r : { leaf_ruleno, choose_ruleno }) {
+    crush_choose_arg *args = crush_make_choose_args(m, positions);
+    crush_optimize_stats stats;
+    ASSERT_LT(0, crush_optimize_choose_args(m, r, xs.data(), n, result_max,
+                                            weights.data(), weights.size(),
+                                            targets.data(), args,
+                                            max_iterations, 1, &stats));
+    EXPECT_LT(stats.deviation_after, stats.deviation_before);
+    // the weight sets crush_do_rule() does not use are left alone: all
+    // but the first for the root, and for the hosts of a choose step
+    for (int b = 0; b < m->max_buckets; b++) {
+      if (m->buckets[b] == NULL)
+        continue;
+      if (m->buckets[b]->type != host_type || r == choose_ruleno)
+        expect_unused(m, args, initial, b, 1);
+    }
+    // the hosts of a chooseleaf step choose at each position
+    bool tuned = false;
+    for (int b = 0; b < m->max_buckets; b++)
+      for (__u32 p = 1; m->buckets[b] && p < args[b].weight_set_size; p++)
+        tuned |= !std::equal(args[b].weight_set[p].weights,
+                             args[b].weight_set[p].weights + args[b].weight_set[p].size,
+                             initial[b].weight_set[p].weights);
+    EXPECT_EQ(r == leaf_ruleno, tuned);
+    crush_destroy_choose_args(args);
+  }
+
+  // an indep step must be the only choose step
+  crush_choose_arg *args = crush_make_choose_args(m, positions);
+  EXPECT_EQ(-EINVAL, crush_optimize_choose_args(m, steps_ruleno, xs.data(), n, result_max,
+                                                weights.data(), weights.size(),
+                                                targets.data(), args,
+                                                max_iterations, 1, NULL));
+  crush_destroy_choose_args(args);
+  crush_destroy_choose_args(initial);
+  crush_destroy(m);
+}
+
+// Local Variables:
+// compile-command: "cd ../build ; make unittest_optimize && valgrind --tool=memcheck test/unittest_optimize"
+// End:
@@ -0,0 +1,230 @@
+#include <gtest/gtest.h>
+#include <atomic>
+#include <math.h>
+#include <vector>
+
+extern "C" {
+#include "crush/builder.h"
+#include "crush/hash.h"
+#include "crush/mapper.h"
+#include "crush/parallel.h"
+}
+#include "hosts.h"
+
+struct visits {
+  int begin;
+  int chunk;
+  std::vector<int> count;
+  std::vector<int> worker;
+  // the chunks that are empty or larger than chunk
+  std::atomic<int> bad_chunks{0};
+};
+
+static void visit(void *arg, int worker, int begin, int end)
+{
+  visits *v = (visits *)arg;
+  if (begin >= end || end - begin > v->chunk)
+    v->bad_chunks++;
+  for (int x = begin; x < end; x++) {
+    v->count[x - v->begin]++;
+    v->worker[x - v->begin] = worker;
+    // uneven costs
+    if (x % 1000 == 0)
+      for (volatile int i = 0; i < 100000; i++)
+        ;
+  }
+}
+
+TEST(parallel, crush_parallel_run) {
+  for (int nthreads : { 1, 2, 7, 16 }) {
+    visits v;
+    v.begin = -1234;
+    v.chunk = 100;
+    const int n = 100000;
+    v.count.resize(n, 0);
+    v.worker.resize(n, -1);
+    ASSERT_EQ(nthreads, crush_parallel_run(v.begin, v.begin + n, v.chunk,
+                                           nthreads, visit, &v));
+    ASSERT_EQ(0, v.bad_chunks);
+    for (int i = 0; i < n; i++) {
+      ASSERT_EQ(1, v.count[i]);
+      ASSERT_LE(0, v.worker[i]);
+      ASSERT_GT(nthreads, v.worker[i]);
+    }
+  }
+
+  visits v;
+  v.begin = 0;
+  v.chunk = 1;
+  ASSERT_LT(0, crush_parallel_run(0, 0, 1, 0, visit, &v));
+  // an empty range calls fn for no chunk
+  ASSERT_EQ(0, v.bad_chunks);
+  ASSERT_EQ(-EINVAL, crush_parallel_run(1, 0, 1, 1, visit, &v));
+  ASSERT_EQ(-EINVAL, crush_parallel_run(0, 1, 0, 1, visit, &v));
+}
+
+TEST(parallel, crush_map_range) {
+  const int host_count = 10;
+  const int b_size = 10;
+  int ruleno;
+  crush_map *m = build_chooseleaf_map(host_count, b_size, &ruleno, hosts_mixed_weight);
+
+  const int device_count = host_count * b_size;
+  std::vector<__u32> weights(device_count, 0x10000);
+  for (int i = 0; i < device_count; i += 9)
+    weights[i] = 0;
+
+  const int result_max = 3;
+  const int x_begin = -5000;
+  const int n = 20000;
+  std::vector<int> expected(n * result_max);
+  std::vector<int> expected_lens(n);
+  int cwin_size = crush_work_size(m, result_max);
+  char cwin[cwin_size];
+  crush_init_workspace(m, cwin);
+  for (int i = 0; i < n; i++)
+    expected_lens[i] = crush_do_rule(m, ruleno, x_begin + i,
+                                     &expected[i * result_max], result_max,
+                                     weights.data(), device_count, cwin, NULL);
+
+  for (int nthreads : { 1, 4, 0 }) {
+    std::vector<int> results(n * result_max);
+    std::vector<int> result_lens(n, -1);
+    ASSERT_EQ(n, crush_map_range(m, ruleno, x_begin, x_begin + n,
+                                 results.data(), result_max, result_lens.data(),
+                                 weights.data(), device_count, NULL, nthreads));
+    for (int i = 0; i < n; i++) {
+      ASSERT_EQ(expected_lens[i], result_lens[i]);
+      for (int j = 0; j < result_lens[i]; j++)
+        ASSERT_EQ(expected[i * result_max + j], results[i * result_max + j]);
+    }
+  }
+
+  int result[result_max], result_len;
+  ASSERT_EQ(-EINVAL, crush_map_range(m, ruleno + 1, 0, 1, result, result_max,
+                                     &result_len, weights.data(), device_count,
+                                     NULL, 1));
+  ASSERT_EQ(-EINVAL, crush_map_range(m, ruleno, 1, 0, result, result_max,
+                                     &result_len, weights.data(), device_count,
+                                     NULL, 1));
+  ASSERT_EQ(0, crush_map_range(m, ruleno, 1, 1, result, result_max,
+                               &result_len, weights.data(), device_count,
+                               NULL, 2));
+  crush_destroy(m);
+}
+
+TEST(parallel, crush_simulate) {
+  const int host_count = 4;
+  const int b_size = 5;
+  const int device_count = host_count * b_size;
+  auto weight = [](int, int i) { return 0x10000 * (1 + i % 3); };
+  int ruleno;
+  crush_map *m = build_chooseleaf_map(host_count, b_size, &ruleno, weight);
+  std::vector<__u32> targets(device_count);
+  for (int d = 0; d < device_count; d++)
+    targets[d] = weight(d / b_size, d % b_size);
+
+  // a host is out and a device has no target: values are short
+  std::vector<__u32> weights(device_count, 0x10000);
+  for (int i = 0; i < b_size; i++) {
+    weights[i] = 0;
+    targets[i] = 0;
+  }
+  targets[7] = 0;
+
+  // more items than the hosts in some values
+  const int result_max = 4;
+  const int x_begin = -3000;
+  const int n = 30000;
+  std::vector<__u64> expected(device_count, 0);
+  __u64 expected_short = 0;
+  int cwin_size = crush_work_size(m, result_max);
+  char cwin[cwin_size];
+  crush_init_workspace(m, cwin);
+  for (int x = x_begin; x < x_begin + n; x++) {
+    int result[result_max];
+    int result_len = crush_do_rule(m, ruleno, x, result, result_max,
+                                   weights.data(), device_count, cwin, NULL);
+    for (int j = 0; j < result_len; j++)
+      expected[result[j]]++;
+    if (result_len < result_max)
+      expected_short++;
+  }
+  const int size = m->choose_total_tries + 1;
+  std::vector<__u32> expected_tries(size, 0);
+  crush_merge_choose_tries(cwin, expected_tries.data(), size);
+  __u64 items = 0;
+  double sum_targets = 0;
+  for (int i = 0; i < device_count; i++) {
+    items += expected[i];
+    sum_targets += targets[i];
+  }
+  double variance = 0;
+  int considered = 0;
+  for (int i = 0; i < device_count; i++) {
+    if (targets[i] == 0 && expected[i] == 0)
+      continue;
+    double e = items * (targets[i] / sum_targets);
+    variance += (expected[i] - e) * (expected[i] - e);
+    considered++;
+  }
+
+  for (int nthreads : { 1, 3 }) {
+    const int max_worst = 3;
+    std::vector<__u64> counts(device_count);
+    std::vector<__u32> choose_tries(size, 42);
+    crush_simulation_device overfull[max_worst], underfull[max_worst];
+    crush_simulation simulation = {
+      counts.data(), choose_tries.data(), size, overfull, underfull, max_worst
+    };
+    ASSERT_EQ(n, crush_simulate(m, ruleno, x_begin, x_begin + n, result_max,
+                                weights.data(), device_count, NULL,
+                                targets.data(), nthreads, &simulation));
+    ASSERT_EQ(expected, counts);
+    ASSERT_EQ(expected_tries, choose_tries);
+    ASSERT_EQ((__u64)n, simulation.values);
+    ASSERT_EQ(expected_short, simulation.short_values);
+    ASSERT_LT(0u, simulation.short_values);
+    ASSERT_EQ(items, simulation.items);
+    ASSERT_NEAR(sqrt(variance / considered), simulation.stddev, 1e-9);
+    ASSERT_EQ(max_worst, simulation.worst);
+    // the device without a target is the most overfull
+    ASSERT_EQ(7, overfull[0].device);
+    ASSERT_EQ(0, overfull[0].expected);
+    ASSERT_EQ(HUGE_VAL, simulation.max_ratio);
+    for (int i = 0; i < max_worst; i++) {
+      ASSERT_LT(b_size - 1, underfull[i].device);
+      ASSERT_EQ(expected[underfull[i].device], underfull[i].count);
+      ASSERT_EQ(expected[overfull[i].device], overfull[i].count);
+    }
+    double min_ratio = underfull[0].count / underfull[0].expected;
+    ASSERT_EQ(min_ratio, simulation.min_ratio);
+    ASSERT_LT(0.8, min_ratio);
+    ASSERT_GE(underfull[1].count / underfull[1].expected, min_ratio);
+    ASSERT_GE(overfull[1].count / overfull[1].expected,
+              overfull[2].count / overfull[2].expected);
+  }
+
+  // the statistics only
+  crush_simulation simulation = {};
+  ASSERT_EQ(1000, crush_simulate(m, ruleno, 0, 1000, result_max,
+                                 weights.data(), device_count, NULL,
+                                 targets.data(), 0, &simulation));
+  ASSERT_EQ(0, simulation.worst);
+  ASSERT_LT(0u, simulation.items);
+  ASSERT_EQ(-EINVAL, crush_simulate(m, ruleno + 1, 0, 1000, result_max,
+                                    weights.data(), device_count, NULL,
+                                    targets.data(), 1, &simulation));
+  ASSERT_EQ(-EINVAL, crush_simulate(m, ruleno, 1, 0, result_max,
+                                    weights.data(), device_count, NULL,
+                                    targets.data(), 1, &simulation));
+  ASSERT_EQ(-EINVAL, crush_simulate(m, ruleno, 0, 1, 0,
+                                    weights.data(), device_count, NULL,
+                                    targets.data(), 1, &simulation));
+
+  crush_destroy(m);
+}
+
+// Local Variables:
+// compile-command: "cd ../build ; make unittest_parallel && valgrind --tool=memcheck test/unittest_parallel"
+// End:
@@ -0,0 +1,143 @@
+#include <gtest/gtest.h>
+#include <errno.h>
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+extern "C" {
+#include "crush/builder.h"
+#include "crush/delta.h"
+#include "crush/hash.h"
+#include "crush/mapper.h"
+#include "crush/reverse.h"
+}
+#include "hosts.h"
+
+static const int host_type = 1;
+static const int host_count = 10;
+static const int b_size = 10;
+static const int device_count = host_count * b_size;
+
+static crush_map *build_map(int *ruleno)
+{
+  return build_chooseleaf_map(host_count, b_size, ruleno, hosts_mixed_weight);
+}
+
+// the entries of each device, computed from the results
+static void expect_index(const crush_reverse *reverse, const std::vector<int> &xs,
+                         const std::vector<int> &results, int result_max,
+                         const std::vector<int> &result_lens)
+{
+  std::vector<std::vector<std::pair<unsigned, int>>> expected(device_count);
+  for (size_t i = 0; i < xs.size(); i++)
+    for (int j = 0; j < result_lens[i]; j++)
+      expected[results[i * result_max + j]].push_back(std::make_pair((unsigned)xs[i], j));
+  for (int d = 0; d < device_count; d++) {
+    std::sort(expected[d].begin(), expected[d].end());
+    int count = crush_reverse_get(reverse, d, NULL, NULL, 0);
+    ASSERT_EQ((int)expected[d].size(), count) << "device " << d;
+    std::vector<int> d_xs(count), positions(count);
+    ASSERT_EQ(count, crush_reverse_get(reverse, d, d_xs.data(), positions.data(), count));
+    for (int i = 0; i < count; i++) {
+      ASSERT_EQ((int)expected[d][i].first, d_xs[i]);
+      ASSERT_EQ(expected[d][i].second, positions[i]);
+    }
+  }
+}
+
+TEST(reverse, crush_reverse_create) {
+  int ruleno;
+  crush_map *m = build_map(&ruleno);
+  std::vector<__u32> weights(device_count, 0x10000);
+  for (int i = 0; i < device_count; i += 9)
+    weights[i] = 0;
+  const int result_max = 3;
+  const int n = 20000;
+  std::vector<int> xs(n);
+  for (int i = 0; i < n; i++)
+    xs[i] = i * 7 - 3000;
+  std::vector<int> results(n * result_max);
+  std::vector<int> result_lens(n);
+  std::vector<__u64> visited(n);
+  ASSERT_EQ(n, crush_map_visited(m, ruleno, xs.data(), n,
+                                 results.data(), result_max, result_lens.data(),
+                                 visited.data(), weights.data(), device_count, NULL));
+
+  for (int nthreads : { 1, 4 }) {
+    crush_reverse *reverse = crush_reverse_create(device_count, xs.data(), n,
+                                                  results.data(), result_max,
+                                                  result_lens.data(), nthreads);
+    ASSERT_TRUE(reverse != NULL);
+    expect_index(reverse, xs, results, result_max, result_lens);
+    // a device holds one value in about 35, 105 apart in keys
+    ASSERT_GT((size_t)n * result_max * 2, crush_reverse_size(reverse));
+    crush_reverse_destroy(reverse);
+  }
+
+  // the first entries only, not a device
+  crush_reverse *reverse = crush_reverse_create(device_count, xs.data(), n,
+                                                results.data(), result_max,
+                                                result_lens.data(), 1);
+  int device = results[0];
+  int first[2];
+  ASSERT_LT(2, crush_reverse_get(reverse, device, first, NULL, 2));
+  ASSERT_EQ(0, crush_reverse_get(reverse, device_count, first, NULL, 2));
+  ASSERT_EQ(0, crush_reverse_get(reverse, CRUSH_ITEM_NONE, first, NULL, 2));
+
+  // lower the weight of a device and raise it again
+  std::vector<int> moved(n);
+  for (int edit = 0; edit < 2; edit++) {
+    crush_map *former = crush_flatten(m);
+    ASSERT_EQ(0, crush_set_device_weight(m, 23, edit ? 0x50000 : 0x8000));
+    crush_finalize(m);
+    __u64 changed = crush_changed_buckets(former, m, ruleno);
+    crush_destroy(former);
+    std::vector<int> former_results = results;
+    int moved_count = crush_reverse_delta(reverse, m, ruleno, changed, xs.data(), n,
+                                          results.data(), result_max,
+                                          result_lens.data(), visited.data(),
+                                          weights.data(), device_count, NULL,
+                                          moved.data());
+    ASSERT_LT(0, moved_count);
+    ASSERT_NE(former_results, results);
+    expect_index(reverse, xs, results, result_max, result_lens);
+  }
+  ASSERT_EQ(-EINVAL, crush_reverse_delta(reverse, m, ruleno, 0, xs.data(), n,
+                                         results.data(), result_max + 1,
+                                         result_lens.data(), visited.data(),
+                                         weights.data(), device_count, NULL,
+                                         moved.data()));
+
+  // the results of a value are replaced, the others are kept
+  int x = 42;
+  int former_items[result_max] = { 1, 2, 3 };
+  int former_len = 3;
+  int items[result_max] = { 1, 5, CRUSH_ITEM_NONE };
+  int len = 3;
+  crush_reverse *small = crush_reverse_create(device_count, &x, 1, former_items,
+                                              result_max, &former_len, 1);
+  ASSERT_EQ(3, crush_reverse_update(small, &x, 1, former_items, &former_len,
+                                    items, &len));
+  int found[1], positions[1];
+  ASSERT_EQ(1, crush_reverse_get(small, 1, found, positions, 1));
+  ASSERT_EQ(0, positions[0]);
+  ASSERT_EQ(0, crush_reverse_get(small, 2, found, positions, 1));
+  ASSERT_EQ(0, crush_reverse_get(small, 3, found, positions, 1));
+  ASSERT_EQ(1, crush_reverse_get(small, 5, found, positions, 1));
+  ASSERT_EQ(x, found[0]);
+  ASSERT_EQ(1, positions[0]);
+  ASSERT_EQ(0, crush_reverse_update(small, &x, 1, items, &len, items, &len));
+  crush_reverse_destroy(small);
+
+  errno = 0;
+  ASSERT_EQ(NULL, crush_reverse_create(device_count, xs.data(), n, results.data(),
+                                       0, result_lens.data(), 1));
+  ASSERT_EQ(EINVAL, errno);
+
+  crush_reverse_destroy(reverse);
+  crush_destroy(m);
+}
+
+// Local Variables:
+// compile-command: "cd ../build ; make unittest_reverse && valgrind --tool=memcheck test/unittest_reverse"
+// End: